@@ -45,6 +45,21 @@ atomic_add_u64(volatile uint64_t *ptr, uint64_t incr)
 #endif
 }
 
+static inline uint64_t
+atomic_exchange_u64(volatile uint64_t *ptr, uint64_t new)
+{
+#if ENABLE_ATOMIC64
+  return __sync_lock_test_and_set(ptr, new);
+#else
+  uint64_t ret;
+  pthread_mutex_lock(&atomic_lock);
+  ret  = *ptr;
+  *ptr = new;
+  pthread_mutex_unlock(&atomic_lock);
+  return ret;
+#endif
+}
+
 static inline uint64_t
 atomic_pre_add_u64(volatile uint64_t *ptr, uint64_t incr)
 {
@@ -0,0 +1,171 @@
+/*
+ *  tvheadend, congestion control for streaming clients
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "tvheadend.h"
+#include "congestion.h"
+
+/*
+ * Initialise
+ */
+void
+congestion_init ( congestion_t *cc, size_t maxsize, int64_t latency )
+{
+  memset(cc, 0, sizeof(*cc));
+  cc->cc_maxsize = maxsize;
+  cc->cc_latency = latency;
+}
+
+/*
+ * Sync on I-frames only when there is video to sync
+ */
+void
+congestion_start ( congestion_t *cc, const streaming_start_t *ss )
+{
+  int i;
+
+  cc->cc_video = 0;
+  for (i = 0; i < ss->ss_num_components; i++)
+    if (SCT_ISVIDEO(ss->ss_components[i].ssc_type))
+      cc->cc_video = 1;
+}
+
+/*
+ * Sync on I-frames only while video reaches the queue, the owner then
+ * passes every queued packet to congestion_count()
+ */
+void
+congestion_video ( congestion_t *cc, int video )
+{
+  cc->cc_video = video;
+  cc->cc_syncs = 0;
+  if (!video)
+    cc->cc_resync = 0;
+}
+
+/*
+ * Account a new packet, 0 if it must be dropped (waiting for a sync point)
+ */
+int
+congestion_admit ( congestion_t *cc, int frametype, size_t len )
+{
+  int sync = congestion_sync(cc, frametype);
+
+  if (cc->cc_resync) {
+    if (!sync) {
+      cc->cc_drops[frametype]++;
+      return 0;
+    }
+    cc->cc_resync = 0;
+  }
+  cc->cc_bytes += len;
+  cc->cc_syncs += sync;
+  return 1;
+}
+
+/*
+ * A packet left the queue towards the client
+ *
+ * Only samples taken while the queue stayed backlogged tell what the
+ * client can take, when it ran empty the client was merely fed slower
+ * than it could drain and the sample can only raise the estimate.
+ */
+void
+congestion_drain ( congestion_t *cc, int frametype, size_t len )
+{
+  int64_t now = getmonoclock(), d, r;
+
+  cc->cc_bytes -= len;
+  cc->cc_syncs -= congestion_sync(cc, frametype);
+
+  if (!cc->cc_sample) {
+    cc->cc_sample  = now;
+    cc->cc_drained = 0;
+    cc->cc_limited = 0;
+  }
+  cc->cc_drained += len;
+  if (!cc->cc_bytes)
+    cc->cc_limited = 1;
+
+  d = now - cc->cc_sample;
+  if (d < CONGESTION_SAMPLE)
+    return;
+  r = (int64_t)cc->cc_drained * 1000000 / d;
+  if (!cc->cc_rate)
+    cc->cc_rate = r;
+  else if (!cc->cc_limited || r > cc->cc_rate)
+    cc->cc_rate += (r - cc->cc_rate) / 4;
+  cc->cc_sample = 0;
+}
+
+/*
+ * A packet was trimmed from the queue, once no sync point is left the
+ * rest of the queue and the input up to the next one are useless
+ */
+void
+congestion_drop ( congestion_t *cc, int frametype, size_t len )
+{
+  cc->cc_bytes -= len;
+  cc->cc_syncs -= congestion_sync(cc, frametype);
+  cc->cc_drops[frametype]++;
+  if (!cc->cc_syncs)
+    cc->cc_resync = 1;
+}
+
+void
+congestion_flush ( congestion_t *cc )
+{
+  cc->cc_bytes  = 0;
+  cc->cc_syncs  = 0;
+  cc->cc_resync = 1;
+  cc->cc_sample = 0;
+}
+
+/*
+ * Time needed to catch up
+ */
+int64_t
+congestion_backlog ( congestion_t *cc )
+{
+  if (!cc->cc_rate)
+    return -1;
+  return (int64_t)cc->cc_bytes * 1000000 / cc->cc_rate;
+}
+
+/*
+ * Check the limits, 1 if the head GOP has to go
+ */
+int
+congestion_trim ( congestion_t *cc )
+{
+  if (!cc->cc_bytes)
+    return 0;
+  if ((cc->cc_maxsize && cc->cc_bytes > cc->cc_maxsize) ||
+      (cc->cc_latency && congestion_backlog(cc) > cc->cc_latency)) {
+    cc->cc_gops++;
+    return 1;
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ *****************************************************************************/
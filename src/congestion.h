@@ -0,0 +1,104 @@
+/*
+ *  tvheadend, congestion control for streaming clients
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TVH_CONGESTION_H__
+#define __TVH_CONGESTION_H__
+
+#include "tvheadend.h"
+#include "streaming.h"
+
+/*
+ * A client that cannot keep up has its queue trimmed from the head a
+ * whole GOP at a time, so it always resumes on an I-frame rather than
+ * decoding around holes. When no sync point is left in the queue the
+ * input is dropped until the next one arrives (resync).
+ *
+ * The drain rate is measured while the queue is backlogged, turning
+ * the queued bytes into the time the client needs to catch up; that
+ * is kept below the latency limit, the byte limit bounds memory.
+ *
+ * The owner of the queue does the actual removal and serialises all
+ * calls with the lock protecting the queue:
+ *
+ *   if(!congestion_admit(cc, type, len))  -> drop the packet
+ *   ...enqueue...
+ *   while(congestion_trim(cc))
+ *     remove packets from the head (congestion_drop) until the next
+ *     one after the first where congestion_sync() is true
+ *
+ *   ...dequeue...                         -> congestion_drain()
+ *
+ * An owner filtering streams out of the queue decides itself whether
+ * video gets through (congestion_video) and counts the queued packets
+ * again (congestion_count), as no I-frame would ever end a resync.
+ */
+
+#define CONGESTION_SAMPLE  250000   // drain rate sample period (us)
+
+typedef struct congestion {
+  size_t   cc_maxsize;    /* Byte limit (0 = none) */
+  int64_t  cc_latency;    /* Catch up time limit in us (0 = none) */
+  int      cc_video;      /* Sync on video I-frames (else on anything) */
+
+  size_t   cc_bytes;      /* Packet bytes queued */
+  int      cc_syncs;      /* Sync points queued */
+  int      cc_resync;     /* Input dropped until a sync point */
+
+  int64_t  cc_rate;       /* Drain rate in bytes/s (0 = unknown) */
+  int64_t  cc_sample;     /* Start of the current sample */
+  size_t   cc_drained;    /* Bytes drained in the current sample */
+  int      cc_limited;    /* The queue ran empty during the sample */
+
+  int      cc_drops[PKT_NTYPES];
+  int      cc_gops;       /* Trims */
+} congestion_t;
+
+void congestion_init ( congestion_t *cc, size_t maxsize, int64_t latency );
+
+void congestion_start ( congestion_t *cc, const streaming_start_t *ss );
+
+void congestion_video ( congestion_t *cc, int video );
+
+static inline int
+congestion_sync ( congestion_t *cc, int frametype )
+{
+  return !cc->cc_video || frametype == PKT_I_FRAME;
+}
+
+/* a packet still queued after congestion_video() */
+static inline void
+congestion_count ( congestion_t *cc, int frametype )
+{
+  cc->cc_syncs += congestion_sync(cc, frametype);
+}
+
+int  congestion_admit ( congestion_t *cc, int frametype, size_t len );
+
+void congestion_drain ( congestion_t *cc, int frametype, size_t len );
+
+void congestion_drop  ( congestion_t *cc, int frametype, size_t len );
+
+/* the owner dropped the whole queue */
+void congestion_flush ( congestion_t *cc );
+
+int  congestion_trim  ( congestion_t *cc );
+
+/* time the client needs to catch up (us), -1 if the rate is unknown */
+int64_t congestion_backlog ( congestion_t *cc );
+
+#endif /* __TVH_CONGESTION_H__ */
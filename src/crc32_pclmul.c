@@ -0,0 +1,101 @@
+/*
+ *  tvheadend, MPEG-2 CRC32 - PCLMULQDQ folding
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tvheadend.h"
+
+#include <smmintrin.h>
+#include <wmmintrin.h>
+
+uint32_t tvh_crc32_sb8    ( const uint8_t *data, size_t datalen, uint32_t crc );
+uint32_t tvh_crc32_pclmul ( const uint8_t *data, size_t datalen, uint32_t crc );
+
+/*
+ * The message is handled as one big polynomial, loaded big endian so
+ * that bit 127 of a block is the first bit on the wire. A block X at
+ * distance D bits ahead of block Y folds into it as
+ *
+ *   Xhi * (x^(D+64) mod P) + Xlo * (x^D mod P) + Y
+ *
+ * which keeps the value congruent modulo P. The last 128 bits are
+ * reduced by the table code, which also takes care of the tail.
+ */
+#define CRC32_X128 0xe8a45605   // x^128 mod P
+#define CRC32_X192 0xc5b9cd4c   // x^192 mod P
+#define CRC32_X512 0xe6228b11   // x^512 mod P
+#define CRC32_X576 0x8833794c   // x^576 mod P
+
+static inline __m128i
+crc32_fold ( __m128i x, __m128i k, __m128i y )
+{
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+                                     _mm_clmulepi64_si128(x, k, 0x00)), y);
+}
+
+uint32_t
+tvh_crc32_pclmul ( const uint8_t *data, size_t datalen, uint32_t crc )
+{
+  const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                     8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i k512  = _mm_set_epi64x(CRC32_X576, CRC32_X512);
+  const __m128i k128  = _mm_set_epi64x(CRC32_X192, CRC32_X128);
+  const __m128i *p    = (const __m128i *)data;
+  __m128i x0, x1, x2, x3;
+  uint8_t tmp[16];
+
+  if (datalen < 64)
+    return tvh_crc32_sb8(data, datalen, crc);
+
+#define LOAD(i) _mm_shuffle_epi8(_mm_loadu_si128(p + (i)), bswap)
+  x0 = _mm_xor_si128(LOAD(0), _mm_set_epi32(crc, 0, 0, 0));
+  x1 = LOAD(1);
+  x2 = LOAD(2);
+  x3 = LOAD(3);
+  p += 4;
+  datalen -= 64;
+
+  /* four independent streams, 64 bytes per round */
+  while (datalen >= 64) {
+    x0 = crc32_fold(x0, k512, LOAD(0));
+    x1 = crc32_fold(x1, k512, LOAD(1));
+    x2 = crc32_fold(x2, k512, LOAD(2));
+    x3 = crc32_fold(x3, k512, LOAD(3));
+    p += 4;
+    datalen -= 64;
+  }
+
+  x1 = crc32_fold(x0, k128, x1);
+  x2 = crc32_fold(x1, k128, x2);
+  x3 = crc32_fold(x2, k128, x3);
+
+  while (datalen >= 16) {
+    x3 = crc32_fold(x3, k128, LOAD(0));
+    p++;
+    datalen -= 16;
+  }
+#undef LOAD
+
+  _mm_storeu_si128((__m128i *)tmp, _mm_shuffle_epi8(x3, bswap));
+  crc = tvh_crc32_sb8(tmp, 16, 0);
+  return tvh_crc32_sb8((const uint8_t *)p, datalen, crc);
+}
+
+/******************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ *****************************************************************************/
@@ -76,7 +76,7 @@ typedef enum {
 
 LIST_HEAD(caid_list, caid);
 
-void descrambler_init          ( void );
+void descrambler_init          ( int csa_threads );
 void descrambler_done          ( void );
 void descrambler_service_start ( struct service *t );
 const char *descrambler_caid2name(uint16_t caid);
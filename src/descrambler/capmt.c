@@ -44,6 +44,7 @@
 #include "subscriptions.h"
 #include "dtable.h"
 #include "tvhcsa.h"
+#include "ecmcache.h"
 #include "input/mpegts/linuxdvb/linuxdvb_private.h"
 
 #if defined(PLATFORM_LINUX)
@@ -744,6 +745,7 @@ capmt_table_input(struct th_descrambler *td, struct service *s,
   mpegts_service_t *t = (mpegts_service_t*)s;
   linuxdvb_frontend_t *lfe;
   int total_caids = 0, current_caid = 0;
+  uint8_t cw[16], invalid[8];
 
   /* Validate */
   if (!idnode_is_instance(&s->s_id, &mpegts_service_class))
@@ -812,6 +814,22 @@ capmt_table_input(struct th_descrambler *td, struct service *s,
           memcpy(cce->cce_ecm, data, len);
           cce->cce_ecmsize = len;
 
+          /* answered for a cwc client already? the camd is not asked,
+           * its answers can't be tied to an ECM so they are not cached */
+          if (ecm_cache_lookup(caid, cce->cce_providerid, data, len,
+                               cw, 0) == ECM_CACHE_HIT) {
+            memset(invalid, 0, 8);
+            if (memcmp(cw, invalid, 8))
+              tvhcsa_set_key_even(&ct->ct_csa, cw);
+            if (memcmp(cw + 8, invalid, 8))
+              tvhcsa_set_key_odd(&ct->ct_csa, cw + 8);
+            if (ct->ct_keystate != CT_RESOLVED)
+              tvhlog(LOG_DEBUG, "capmt",
+                     "Obtained cached key for service \"%s\"", t->s_dvb_svcname);
+            ct->ct_keystate = CT_RESOLVED;
+            break;
+          }
+
           if (capmt->capmt_oscam == 2)
             capmt_enumerate_services(capmt, st->es_pid, 0);
           else
@@ -19,6 +19,7 @@
 #include <pthread.h>
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -43,6 +44,7 @@
 #include "input.h"
 #include "input/mpegts/tsdemux.h"
 #include "tvhcsa.h"
+#include "ecmcache.h"
 
 /**
  *
@@ -90,6 +92,45 @@ static pthread_cond_t cwc_config_changed;
 static pthread_mutex_t cwc_mutex;
 static char *crypt_md5(const char *pw, const char *salt);
 
+/**
+ * EMM duplicate cache for provider addressed EMMs, one table shared
+ * by all connections (cwc_mutex)
+ *
+ * Open addressing (linear probing) set of session + CAID + provider
+ * + CRC, the oldest entry is evicted through the ring once it is full.
+ * A session number is taken on each login, so a reconnected server
+ * gets everything again. Entries expire so that the server sees an
+ * EMM again now and then, even if the broadcaster repeats it.
+ */
+#define EMM_CACHE_SIZE   (1<<11)
+#define EMM_CACHE_HSIZE  (EMM_CACHE_SIZE<<1)
+#define EMM_CACHE_HMASK  (EMM_CACHE_HSIZE-1)
+#define EMM_CACHE_EXPIRE 600    // seconds
+
+typedef struct emm_cache_key {
+  uint32_t session;
+  uint32_t provid;
+  uint32_t crc;
+  uint16_t caid;
+} emm_cache_key_t;
+
+typedef struct emm_cache_entry {
+  emm_cache_key_t key;
+  uint16_t used;
+  time_t   sent;
+} emm_cache_entry_t;
+
+static struct {
+  emm_cache_entry_t hash[EMM_CACHE_HSIZE];
+  emm_cache_key_t ring[EMM_CACHE_SIZE];
+  uint32_t w;
+  uint32_t n;
+  uint32_t sessions;
+} cwc_emm_cache;
+
+/* CAIDs some connection forwards EMMs for, read without cwc_mutex */
+static volatile int cwc_emm_caids[0x10000 / 32];
+
 /**
  *
  */
@@ -100,6 +141,9 @@ typedef struct ecm_section {
   uint16_t es_seq;
   char es_nok;
   char es_pending;
+  char es_coalesced; // waiting on another request for the same ECM
+  uint16_t es_caid;
+  uint32_t es_provid;
   int64_t es_time;  // time request was sent
   size_t es_ecmsize;
   uint8_t es_ecm[4070];
@@ -236,14 +280,12 @@ typedef struct cwc {
   /* Emm forwarding */
   int cwc_forward_emm;
 
-  /* Emm duplicate cache */
-  struct {
-#define EMM_CACHE_SIZE (1<<5)
-#define EMM_CACHE_MASK (EMM_CACHE_SIZE-1)
-    uint32_t cache[EMM_CACHE_SIZE];
-    uint32_t w;
-    uint32_t n;
-  } cwc_emm_cache;
+  /* ECM answers taken from the shared cache vs. sent to the server */
+  int cwc_ecm_hits;
+  int cwc_ecm_requests;
+
+  /* Emm duplicate cache session, 0 if not logged in */
+  uint32_t cwc_emm_session;
 
   /* Viaccess EMM assemble state */
   struct {
@@ -515,6 +557,139 @@ cwc_send_msg(cwc_t *cwc, const uint8_t *msg, size_t len, int sid, int enq, uint1
 }
 
 
+/**
+ * EMM duplicate cache
+ */
+static inline uint32_t
+cwc_emm_cache_home(const emm_cache_key_t *k)
+{
+  return (k->crc ^ (k->caid * 0x9e3779b1) ^ (k->provid * 0x85ebca6b) ^
+          (k->session * 0xc2b2ae35)) & EMM_CACHE_HMASK;
+}
+
+static inline int
+cwc_emm_cache_match(const emm_cache_key_t *a, const emm_cache_key_t *b)
+{
+  return a->crc == b->crc && a->caid == b->caid &&
+         a->provid == b->provid && a->session == b->session;
+}
+
+static emm_cache_entry_t *
+cwc_emm_cache_find(const emm_cache_key_t *k)
+{
+  uint32_t i = cwc_emm_cache_home(k);
+  emm_cache_entry_t *e;
+
+  for ( ; (e = &cwc_emm_cache.hash[i])->used; i = (i + 1) & EMM_CACHE_HMASK)
+    if (cwc_emm_cache_match(&e->key, k))
+      return e;
+  return NULL;
+}
+
+static void
+cwc_emm_cache_remove(emm_cache_entry_t *e)
+{
+  uint32_t i = e - cwc_emm_cache.hash, j = i, k;
+
+  /* backward shift, keeps the probe sequences intact without tombstones */
+  cwc_emm_cache.hash[i].used = 0;
+  while (1) {
+    j = (j + 1) & EMM_CACHE_HMASK;
+    if (!cwc_emm_cache.hash[j].used)
+      return;
+    k = cwc_emm_cache_home(&cwc_emm_cache.hash[j].key);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    cwc_emm_cache.hash[i] = cwc_emm_cache.hash[j];
+    cwc_emm_cache.hash[j].used = 0;
+    i = j;
+  }
+}
+
+/*
+ * Returns 1 if this session has forwarded the EMM for the provider
+ * recently, otherwise records it as forwarded
+ */
+static int
+cwc_emm_cache_insert(cwc_t *cwc, uint16_t caid, uint32_t provid, uint32_t crc)
+{
+  emm_cache_key_t k = {
+    .session = cwc->cwc_emm_session,
+    .provid  = provid,
+    .crc     = crc,
+    .caid    = caid,
+  };
+  emm_cache_entry_t *e;
+  uint32_t i;
+
+  if (!k.session)
+    return 0;
+
+  if ((e = cwc_emm_cache_find(&k)) != NULL) {
+    if (dispatch_clock - e->sent < EMM_CACHE_EXPIRE)
+      return 1;
+    e->sent = dispatch_clock;
+    return 0;
+  }
+
+  /* evict the oldest entry */
+  if (cwc_emm_cache.n == EMM_CACHE_SIZE) {
+    if ((e = cwc_emm_cache_find(&cwc_emm_cache.ring[cwc_emm_cache.w])))
+      cwc_emm_cache_remove(e);
+  } else {
+    cwc_emm_cache.n++;
+  }
+  cwc_emm_cache.ring[cwc_emm_cache.w] = k;
+  cwc_emm_cache.w = (cwc_emm_cache.w + 1) & (EMM_CACHE_SIZE - 1);
+
+  for (i = cwc_emm_cache_home(&k); cwc_emm_cache.hash[i].used;
+       i = (i + 1) & EMM_CACHE_HMASK);
+  e = &cwc_emm_cache.hash[i];
+  e->key  = k;
+  e->used = 1;
+  e->sent = dispatch_clock;
+  return 0;
+}
+
+/**
+ * Forward an EMM addressed to one of the card's providers, unless
+ * this session sent it already
+ */
+static void
+cwc_emm_send(cwc_t *cwc, struct cs_card_data *pcard, uint32_t provid,
+             uint8_t *data, int len)
+{
+  uint32_t crc = tvh_crc32(data, len, 0xffffffff);
+
+  if (!cwc_emm_cache_insert(cwc, pcard->cwc_caid, provid, crc))
+    cwc_send_msg(cwc, data, len, 0, 1, 0, 0);
+}
+
+/**
+ * Precompute the CAIDs anyone wants EMMs for, so that the rest is
+ * dropped before taking cwc_mutex
+ */
+static void
+cwc_emm_filter_update(void)
+{
+  cwc_t *cwc;
+  struct cs_card_data *pcard;
+  int caids[ARRAY_SIZE(cwc_emm_caids)], i;
+
+  memset(caids, 0, sizeof(caids));
+  TAILQ_FOREACH(cwc, &cwcs, cwc_link) {
+    if (!cwc->cwc_forward_emm || !cwc->cwc_writer_running)
+      continue;
+    LIST_FOREACH(pcard, &cwc->cwc_cards, cs_card)
+      if (pcard->cwc_card_type != CARD_UNKNOWN)
+        caids[pcard->cwc_caid >> 5] |= 1U << (pcard->cwc_caid & 31);
+  }
+  for (i = 0; i < ARRAY_SIZE(caids); i++)
+    if (atomic_add(&cwc_emm_caids[i], 0) != caids[i])
+      atomic_exchange(&cwc_emm_caids[i], caids[i]);
+}
+
+
 
 /**
  * Card data command
@@ -558,6 +733,8 @@ cwc_comet_status_update(cwc_t *cwc)
 
   htsmsg_add_str(m, "id", cwc->cwc_id);
   htsmsg_add_u32(m, "connected", !!cwc->cwc_connected);
+  htsmsg_add_u32(m, "ecmhits", cwc->cwc_ecm_hits);
+  htsmsg_add_u32(m, "ecmrequests", cwc->cwc_ecm_requests);
   notify_by_msg("cwcStatus", m);
 }
 
@@ -668,6 +845,7 @@ cwc_decode_card_data_reply(cwc_t *cwc, uint8_t *msg, int len)
 	     cwc->cwc_hostname, cwc->cwc_port);
     }
   }
+  cwc_emm_filter_update();
 
   return 0;
 }
@@ -694,8 +872,8 @@ cwc_send_login(cwc_t *cwc)
 
 
 static void
-handle_ecm_reply(cwc_service_t *ct, ecm_section_t *es, uint8_t *msg,
-		 int len, int seq)
+handle_ecm_reply(cwc_service_t *ct, ecm_section_t *es, const uint8_t *cw,
+		 int seq)
 {
   mpegts_service_t *t = ct->cs_service;
   ecm_pid_t *ep, *epn;
@@ -708,7 +886,7 @@ handle_ecm_reply(cwc_service_t *ct, ecm_section_t *es, uint8_t *msg,
 
   snprintf(chaninfo, sizeof(chaninfo), " (PID %d)", es->es_channel);
 
-  if(len < 19) {
+  if(cw == NULL) {
     
     /* ERROR */
 
@@ -784,10 +962,9 @@ forbid:
 	   "Req delay: %"PRId64" ms)",
 	   chaninfo,
 	   t->s_dvb_svcname,
-	   msg[3 + 0], msg[3 + 1], msg[3 + 2], msg[3 + 3], msg[3 + 4],
-	   msg[3 + 5], msg[3 + 6], msg[3 + 7], msg[3 + 8], msg[3 + 9],
-	   msg[3 + 10],msg[3 + 11],msg[3 + 12],msg[3 + 13],msg[3 + 14],
-	   msg[3 + 15], seq, delay);
+	   cw[0], cw[1], cw[2], cw[3], cw[4], cw[5], cw[6], cw[7],
+	   cw[8], cw[9], cw[10], cw[11], cw[12], cw[13], cw[14], cw[15],
+	   seq, delay);
 
     TAILQ_FOREACH(cwc2, &cwcs, cwc_link) {
       LIST_FOREACH(ct2, &cwc2->cwc_services, cs_link) {
@@ -809,7 +986,7 @@ forbid:
 	     ct->cs_cwc->cwc_port);
 
     ct->cs_keystate = CS_RESOLVED;
-    memcpy(ct->cs_cw, msg + 3, 16);
+    memcpy(ct->cs_cw, cw, 16);
     ct->cs_pending_cw_update = 1;
 
     ep = LIST_FIRST(&ct->cs_pids);
@@ -830,6 +1007,51 @@ forbid:
   }
 }
 
+/**
+ * Hand the answer to the sections (of other services) that were
+ * waiting on the same ECM instead of asking for it themselves
+ * cwc_mutex is held
+ */
+static void
+cwc_ecm_coalesced(cwc_service_t *owner, ecm_section_t *es,
+                  const uint8_t *cw, int seq)
+{
+  cwc_t *cwc;
+  cwc_service_t *ct;
+  ecm_pid_t *ep;
+  ecm_section_t *es2;
+  int i;
+
+  TAILQ_FOREACH(cwc, &cwcs, cwc_link) {
+    LIST_FOREACH(ct, &cwc->cwc_services, cs_link) {
+      if (ct == owner)
+        continue;
+      LIST_FOREACH(ep, &ct->cs_pids, ep_link) {
+        for(i = 0; i <= ep->ep_last_section; i++) {
+          es2 = ep->ep_sections[i];
+          if(es2 == NULL || !es2->es_coalesced || !es2->es_pending ||
+             es2->es_caid != es->es_caid || es2->es_provid != es->es_provid ||
+             es2->es_ecmsize != es->es_ecmsize ||
+             memcmp(es2->es_ecm, es->es_ecm, es->es_ecmsize))
+            continue;
+          es2->es_coalesced = 0;
+          if(cw == NULL) {
+            /* failed, ask ourselves when the ECM repeats */
+            es2->es_pending = 0;
+            es2->es_ecmsize = 0;
+            continue;
+          }
+          atomic_add(&cwc->cwc_ecm_hits, 1);
+          handle_ecm_reply(ct, es2, cw, seq);
+          goto next; /* the pid list may have been pruned */
+        }
+      }
+next:
+      ;
+    }
+  }
+}
+
 
 /**
  * Handle running reply
@@ -841,6 +1063,7 @@ cwc_running_reply(cwc_t *cwc, uint8_t msgtype, uint8_t *msg, int len)
   cwc_service_t *ct;
   ecm_pid_t *ep;
   ecm_section_t *es;
+  const uint8_t *cw;
   uint16_t seq = (msg[2] << 8) | msg[3];
   int plen,i;
   short caid;
@@ -857,8 +1080,12 @@ cwc_running_reply(cwc_t *cwc, uint8_t msgtype, uint8_t *msg, int len)
           for(i = 0; i <= ep->ep_last_section; i++) {
             es = ep->ep_sections[i];
             if(es != NULL) {
-              if(es->es_seq == seq && es->es_pending) {
-                handle_ecm_reply(ct, es, msg, len, seq);
+              if(es->es_seq == seq && es->es_pending && !es->es_coalesced) {
+                cw = len < 19 ? NULL : msg + 3;
+                ecm_cache_store(es->es_caid, es->es_provid,
+                                es->es_ecm, es->es_ecmsize, cw);
+                handle_ecm_reply(ct, es, cw, seq);
+                cwc_ecm_coalesced(ct, es, cw, seq);
                 return 0;
               }
             }
@@ -929,6 +1156,7 @@ cwc_running_reply(cwc_t *cwc, uint8_t msgtype, uint8_t *msg, int len)
                pcard->cwc_providers[0].sa[7]);
         
         LIST_INSERT_HEAD(&cwc->cwc_cards, pcard, cs_card);
+        cwc_emm_filter_update();
       }
   }
   return 0;
@@ -1105,6 +1333,14 @@ cwc_session(cwc_t *cwc)
    */
   cwc->cwc_retry_delay = 0;
 
+  /**
+   * New session for the EMM duplicate cache, the server may have
+   * forgotten what it got on the previous connection
+   */
+  if (!++cwc_emm_cache.sessions)
+    ++cwc_emm_cache.sessions;
+  cwc->cwc_emm_session = cwc_emm_cache.sessions;
+
   /**
    * We do all requests from now on in a separate thread
    */
@@ -1113,6 +1349,7 @@ cwc_session(cwc_t *cwc)
   pthread_mutex_init(&cwc->cwc_writer_mutex, NULL);
   TAILQ_INIT(&cwc->cwc_writeq);
   tvhthread_create(&writer_thread_id, NULL, cwc_writer_thread, cwc, 0);
+  cwc_emm_filter_update();
 
   /**
    * Mainloop
@@ -1131,6 +1368,8 @@ cwc_session(cwc_t *cwc)
    */
   shutdown(cwc->cwc_fd, SHUT_RDWR);
   cwc->cwc_writer_running = 0;
+  cwc->cwc_emm_session = 0;
+  cwc_emm_filter_update();
   pthread_cond_signal(&cwc->cwc_writer_cond);
   pthread_join(writer_thread_id, NULL);
   tvhlog(LOG_DEBUG, "cwc", "Write thread joined");
@@ -1236,6 +1475,7 @@ cwc_thread(void *aux)
   free((void *)cwc->cwc_hostname);
   free((void *)cwc->cwc_id);
   free((void *)cwc->cwc_viaccess_emm.shared_emm);
+  cwc_emm_filter_update();
   free(cwc);
 
   pthread_mutex_unlock(&cwc_mutex);
@@ -1260,29 +1500,6 @@ verify_provider(struct cs_card_data *pcard, uint32_t providerid)
   return 0;
 }
 
-/**
- *
- */
-static void
-cwc_emm_cache_insert(cwc_t *cwc, uint32_t crc)
-{
-  /* evict the oldest entry */
-  cwc->cwc_emm_cache.cache[cwc->cwc_emm_cache.w] = crc;
-  cwc->cwc_emm_cache.w = (cwc->cwc_emm_cache.w+1)&EMM_CACHE_MASK;
-  if (cwc->cwc_emm_cache.n < EMM_CACHE_SIZE)
-    cwc->cwc_emm_cache.n++;
-}
-
-static int
-cwc_emm_cache_lookup(cwc_t *cwc, uint32_t crc)
-{
-  int i;
-  for (i=0; i<cwc->cwc_emm_cache.n; i++)
-    if (cwc->cwc_emm_cache.cache[i] == crc)
-      return 1;
-  return 0;
-}
-
 
 /**
  *
@@ -1293,6 +1510,11 @@ cwc_emm(uint8_t *data, int len, uint16_t caid, void *ca_update_id)
   cwc_t *cwc;
 
   struct cs_card_data *pcard;
+
+  if (!(((unsigned)atomic_add(&cwc_emm_caids[caid >> 5], 0) >>
+         (caid & 31)) & 1))
+    return;
+
   pthread_mutex_lock(&cwc_mutex);
 
   TAILQ_FOREACH(cwc, &cwcs, cwc_link) {
@@ -1356,7 +1578,7 @@ cwc_emm_conax(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int len)
     int i;
     for (i=0; i < pcard->cwc_num_providers; i++) {
       if (memcmp(&data[3], &pcard->cwc_providers[i].sa[1], 7) == 0) {
-        cwc_send_msg(cwc, data, len, 0, 1, 0, 0);
+        cwc_emm_send(cwc, pcard, pcard->cwc_providers[i].id, data, len);
         break;
       }
     }
@@ -1374,6 +1596,7 @@ cwc_emm_irdeto(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int len)
   int emm_mode = data[3] >> 3;
   int emm_len = data[3] & 0x07;
   int match = 0;
+  int i = -1;
   
   if (emm_mode & 0x10){
     // try to match card
@@ -1382,7 +1605,6 @@ cwc_emm_irdeto(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int len)
               !memcmp(&data[4], &pcard->cwc_ua[5], emm_len))); // exact match
   } else {
     // try to match provider
-    int i;
     for(i=0; i < pcard->cwc_num_providers; i++) {
       match = (emm_mode == pcard->cwc_providers[i].sa[4] &&
                (!emm_len || // zero length
@@ -1392,7 +1614,9 @@ cwc_emm_irdeto(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int len)
     }
   }
   
-  if (match)
+  if (match && i >= 0)
+    cwc_emm_send(cwc, pcard, pcard->cwc_providers[i].id, data, len);
+  else if (match)
     cwc_send_msg(cwc, data, len, 0, 1, 0, 0);
 }
 
@@ -1404,26 +1628,20 @@ cwc_emm_irdeto(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int len)
 void
 cwc_emm_seca(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int len)
 {
-  int match = 0;
-
   if (data[0] == 0x82) {
-    if (memcmp(&data[3], &pcard->cwc_ua[2], 6) == 0) {
-      match = 1;
-    }
+    if (memcmp(&data[3], &pcard->cwc_ua[2], 6) == 0)
+      cwc_send_msg(cwc, data, len, 0, 1, 0, 0);
   } 
   else if (data[0] == 0x84) {
     /* XXX this part is untested but should do no harm */
     int i;
     for (i=0; i < pcard->cwc_num_providers; i++) {
       if (memcmp(&data[5], &pcard->cwc_providers[i].sa[5], 3) == 0) {
-        match = 1;
+        cwc_emm_send(cwc, pcard, pcard->cwc_providers[i].id, data, len);
         break;
       }
     }
   }
-
-  if (match)
-    cwc_send_msg(cwc, data, len, 0, 1, 0, 0);
 }
 
 /**
@@ -1571,7 +1789,7 @@ cwc_emm_viaccess(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int mlen
 
 	ass = (uint8_t*) alloca(len+7);
 	if(ass) {
-	  uint32_t crc;
+	  uint32_t crc, provid = pcard->cwc_providers[i].id;
 
 	  memcpy(ass, data, 7);
 	  if (sort_nanos(ass + 7, tmp, len)) {
@@ -1585,7 +1803,7 @@ cwc_emm_viaccess(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int mlen
 	  len += 3;
 
 	  crc = tvh_crc32(ass, len, 0xffffffff);
-	  if (!cwc_emm_cache_lookup(cwc, crc)) {
+	  if (!cwc_emm_cache_insert(cwc, pcard->cwc_caid, provid, crc)) {
 	    tvhlog(LOG_DEBUG, "cwc",
 		   "Send EMM "
 		   "%02x.%02x.%02x.%02x.%02x.%02x.%02x.%02x"
@@ -1594,7 +1812,6 @@ cwc_emm_viaccess(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int mlen
 		   ass[4], ass[5], ass[6], ass[7],
 		   ass[len-4], ass[len-3], ass[len-2], ass[len-1]);
 	    cwc_send_msg(cwc, ass, len, 0, 1, 0, 0);
-	    cwc_emm_cache_insert(cwc, crc);
 	  }
 	}
       }
@@ -1619,6 +1836,7 @@ cwc_table_input(struct th_descrambler *td, service_t *s,
   ecm_section_t *es;
   char chaninfo[32];
   caid_t *c;
+  uint8_t cw[16];
 
   if (ct->cs_keystate == CS_IDLE)
     return;
@@ -1708,7 +1926,8 @@ cwc_table_input(struct th_descrambler *td, service_t *s,
       
       es = ep->ep_sections[section];
       
-      if(es->es_ecmsize == len && !memcmp(es->es_ecm, data, len))
+      if(es->es_ecmsize == len && !memcmp(es->es_ecm, data, len) &&
+         !es->es_coalesced)
         break; /* key already sent */
       
       if(cwc->cwc_fd == -1) {
@@ -1730,7 +1949,36 @@ cwc_table_input(struct th_descrambler *td, service_t *s,
         return;
       }
       
+      es->es_caid = c->caid;
+      es->es_provid = c->providerid;
+
+      switch(ecm_cache_lookup(c->caid, c->providerid, data, len, cw, 1)) {
+        case ECM_CACHE_HIT:
+          if(!es->es_coalesced)
+            es->es_time = getmonoclock();
+          es->es_coalesced = 0;
+          atomic_add(&cwc->cwc_ecm_hits, 1);
+          tvhlog(LOG_DEBUG, "cwc",
+                 "Cached ECM%s section=%d/%d, for service \"%s\"",
+                 chaninfo, section, ep->ep_last_section, t->s_dvb_svcname);
+          handle_ecm_reply(ct, es, cw, 0);
+          return;
+        case ECM_CACHE_PENDING:
+          if(!es->es_coalesced) {
+            es->es_coalesced = 1;
+            es->es_time = getmonoclock();
+            tvhlog(LOG_DEBUG, "cwc",
+                   "Waiting for shared ECM%s section=%d/%d, for service \"%s\"",
+                   chaninfo, section, ep->ep_last_section, t->s_dvb_svcname);
+          }
+          return;
+        case ECM_CACHE_MISS:
+          break;
+      }
+
+      es->es_coalesced = 0;
       es->es_seq = cwc_send_msg(cwc, data, len, sid, 1, c->caid, c->providerid);
+      atomic_add(&cwc->cwc_ecm_requests, 1);
       
       tvhlog(LOG_DEBUG, "cwc",
              "Sending ECM%s section=%d/%d, for service \"%s\" (seqno: %d)",
@@ -1752,26 +2000,20 @@ cwc_table_input(struct th_descrambler *td, service_t *s,
 void
 cwc_emm_dre(cwc_t *cwc, struct cs_card_data *pcard, uint8_t *data, int len)
 {
-  int match = 0;
-
   if (data[0] == 0x87) {
-    if (memcmp(&data[3], &pcard->cwc_ua[4], 4) == 0) {
-      match = 1;
-    }
+    if (memcmp(&data[3], &pcard->cwc_ua[4], 4) == 0)
+      cwc_send_msg(cwc, data, len, 0, 1, 0, 0);
   } 
   else if (data[0] == 0x86) {
     int i;
     for (i=0; i < pcard->cwc_num_providers; i++) {
       if (memcmp(&data[40], &pcard->cwc_providers[i].sa[4], 4) == 0) {
         /*      if (memcmp(&data[3], &cwc->cwc_providers[i].sa[4], 1) == 0) { */
-        match = 1;
+        cwc_emm_send(cwc, pcard, pcard->cwc_providers[i].id, data, len);
         break;
       }
     }
   }
-
-  if (match)
-    cwc_send_msg(cwc, data, len, 0, 1, 0, 0);
 }
 
 void
@@ -2061,6 +2303,7 @@ static void
 cwc_destroy(cwc_t *cwc)
 {
   TAILQ_REMOVE(&cwcs, cwc, cwc_link);  
+  cwc_emm_filter_update();
   cwc->cwc_running = 0;
   pthread_cond_signal(&cwc->cwc_cond);
 }
@@ -2145,6 +2388,8 @@ cwc_record_build(cwc_t *cwc)
   htsmsg_add_u32(e, "emm", cwc->cwc_emm);
   htsmsg_add_u32(e, "emmex", cwc->cwc_emmex);
   htsmsg_add_str(e, "comment", cwc->cwc_comment ?: "");
+  htsmsg_add_u32(e, "ecmhits", cwc->cwc_ecm_hits);
+  htsmsg_add_u32(e, "ecmrequests", cwc->cwc_ecm_requests);
 
   return e;
 }
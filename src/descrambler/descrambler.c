@@ -20,6 +20,8 @@
 #include "cwc.h"
 #include "capmt.h"
 #include "ffdecsa/FFdecsa.h"
+#include "tvhcsa.h"
+#include "ecmcache.h"
 #include "service.h"
 
 static struct strtab caidnametab[] = {
@@ -104,14 +106,16 @@ static struct strtab caidnametab[] = {
 };
 
 void
-descrambler_init ( void )
+descrambler_init ( int csa_threads )
 {
 #if ENABLE_CWC
-  cwc_init();
-  capmt_init();
 #if !ENABLE_DVBCSA
   ffdecsa_init();
 #endif
+  tvhcsa_workers_init(csa_threads);
+  ecm_cache_init();
+  cwc_init();
+  capmt_init();
 #endif
 }
 
@@ -121,6 +125,8 @@ descrambler_done ( void )
 #if ENABLE_CWC
   capmt_done();
   cwc_done();
+  ecm_cache_done();
+  tvhcsa_workers_done();
 #endif
 }
 
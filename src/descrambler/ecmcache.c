@@ -0,0 +1,215 @@
+/*
+ *  tvheadend - shared ECM answer cache
+ *  Copyright (C) 2014 Tvheadend Foundation CIC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "tvheadend.h"
+#include "ecmcache.h"
+
+#define ECM_CACHE_HASH_SIZE (1<<8)
+#define ECM_CACHE_HASH_MASK (ECM_CACHE_HASH_SIZE-1)
+
+typedef struct ecm_cache_entry {
+  LIST_ENTRY(ecm_cache_entry)  ece_hash_link;
+  TAILQ_ENTRY(ecm_cache_entry) ece_age_link;
+
+  uint32_t ece_crc;
+  uint16_t ece_caid;
+  uint32_t ece_provid;
+
+  int      ece_pending;
+  int64_t  ece_expire;
+  uint8_t  ece_cw[16];
+
+  int      ece_len;
+  uint8_t  ece_ecm[0];
+} ecm_cache_entry_t;
+
+LIST_HEAD(ecm_cache_bucket, ecm_cache_entry);
+TAILQ_HEAD(ecm_cache_age_queue, ecm_cache_entry);
+
+static pthread_mutex_t               ecm_cache_lock;
+static struct ecm_cache_bucket       ecm_cache_hash[ECM_CACHE_HASH_SIZE];
+static struct ecm_cache_age_queue    ecm_cache_age;
+static int                           ecm_cache_count;
+
+/*
+ * Entry handling (ecm_cache_lock is held)
+ */
+static void
+ecm_cache_remove ( ecm_cache_entry_t *ece )
+{
+  LIST_REMOVE(ece, ece_hash_link);
+  TAILQ_REMOVE(&ecm_cache_age, ece, ece_age_link);
+  ecm_cache_count--;
+  free(ece);
+}
+
+static void
+ecm_cache_touch ( ecm_cache_entry_t *ece, int64_t now )
+{
+  ece->ece_expire = now + 1000000LL *
+    (ece->ece_pending ? ECM_CACHE_PENDING_TTL : ECM_CACHE_TTL);
+  TAILQ_REMOVE(&ecm_cache_age, ece, ece_age_link);
+  TAILQ_INSERT_TAIL(&ecm_cache_age, ece, ece_age_link);
+}
+
+static void
+ecm_cache_expire ( int64_t now )
+{
+  ecm_cache_entry_t *ece;
+
+  /* the queue is only roughly ordered (pending entries expire sooner),
+   * stragglers are caught by the lookup below */
+  while ((ece = TAILQ_FIRST(&ecm_cache_age)) != NULL &&
+         (ece->ece_expire <= now || ecm_cache_count > ECM_CACHE_MAX))
+    ecm_cache_remove(ece);
+}
+
+static ecm_cache_entry_t *
+ecm_cache_find
+  ( uint16_t caid, uint32_t provid, const uint8_t *ecm, int len,
+    uint32_t crc, int64_t now )
+{
+  ecm_cache_entry_t *ece;
+
+  LIST_FOREACH(ece, &ecm_cache_hash[crc & ECM_CACHE_HASH_MASK], ece_hash_link)
+    if (ece->ece_crc == crc && ece->ece_len == len &&
+        ece->ece_caid == caid && ece->ece_provid == provid &&
+        !memcmp(ece->ece_ecm, ecm, len))
+      break;
+  if (ece && ece->ece_expire <= now) {
+    ecm_cache_remove(ece);
+    ece = NULL;
+  }
+  return ece;
+}
+
+static ecm_cache_entry_t *
+ecm_cache_add
+  ( uint16_t caid, uint32_t provid, const uint8_t *ecm, int len,
+    uint32_t crc )
+{
+  ecm_cache_entry_t *ece = malloc(sizeof(*ece) + len);
+
+  ece->ece_crc    = crc;
+  ece->ece_caid   = caid;
+  ece->ece_provid = provid;
+  ece->ece_len    = len;
+  memcpy(ece->ece_ecm, ecm, len);
+  LIST_INSERT_HEAD(&ecm_cache_hash[crc & ECM_CACHE_HASH_MASK], ece,
+                   ece_hash_link);
+  TAILQ_INSERT_TAIL(&ecm_cache_age, ece, ece_age_link);
+  ecm_cache_count++;
+  return ece;
+}
+
+/*
+ * Lookup an ECM, if claim is set a miss records the caller's request
+ * as pending so that duplicates are coalesced on it
+ */
+ecm_cache_result_t
+ecm_cache_lookup
+  ( uint16_t caid, uint32_t provid, const uint8_t *ecm, int len,
+    uint8_t *cw, int claim )
+{
+  ecm_cache_entry_t *ece;
+  ecm_cache_result_t r = ECM_CACHE_MISS;
+  uint32_t crc = tvh_crc32(ecm, len, 0xffffffff);
+  int64_t now = getmonoclock();
+
+  pthread_mutex_lock(&ecm_cache_lock);
+  ecm_cache_expire(now);
+  ece = ecm_cache_find(caid, provid, ecm, len, crc, now);
+  if (ece) {
+    if (ece->ece_pending) {
+      r = ECM_CACHE_PENDING;
+    } else {
+      memcpy(cw, ece->ece_cw, 16);
+      r = ECM_CACHE_HIT;
+    }
+  } else if (claim) {
+    ece = ecm_cache_add(caid, provid, ecm, len, crc);
+    ece->ece_pending = 1;
+    ecm_cache_touch(ece, now);
+  }
+  pthread_mutex_unlock(&ecm_cache_lock);
+
+  tvhtrace("ecmcache", "lookup caid %04X prov %06X crc %08X len %d: %s",
+           caid, provid, crc, len,
+           r == ECM_CACHE_HIT ? "hit" :
+           r == ECM_CACHE_PENDING ? "pending" : "miss");
+  return r;
+}
+
+/*
+ * Record the answer to an ECM request
+ */
+void
+ecm_cache_store
+  ( uint16_t caid, uint32_t provid, const uint8_t *ecm, int len,
+    const uint8_t *cw )
+{
+  ecm_cache_entry_t *ece;
+  uint32_t crc = tvh_crc32(ecm, len, 0xffffffff);
+  int64_t now = getmonoclock();
+
+  pthread_mutex_lock(&ecm_cache_lock);
+  ece = ecm_cache_find(caid, provid, ecm, len, crc, now);
+  if (cw == NULL) {
+    if (ece && ece->ece_pending)
+      ecm_cache_remove(ece);
+  } else {
+    if (ece == NULL)
+      ece = ecm_cache_add(caid, provid, ecm, len, crc);
+    ece->ece_pending = 0;
+    memcpy(ece->ece_cw, cw, 16);
+    ecm_cache_touch(ece, now);
+    ecm_cache_expire(now);
+  }
+  pthread_mutex_unlock(&ecm_cache_lock);
+}
+
+/*
+ * Initialise
+ */
+void
+ecm_cache_init ( void )
+{
+  pthread_mutex_init(&ecm_cache_lock, NULL);
+  TAILQ_INIT(&ecm_cache_age);
+}
+
+void
+ecm_cache_done ( void )
+{
+  ecm_cache_entry_t *ece;
+
+  pthread_mutex_lock(&ecm_cache_lock);
+  while ((ece = TAILQ_FIRST(&ecm_cache_age)) != NULL)
+    ecm_cache_remove(ece);
+  pthread_mutex_unlock(&ecm_cache_lock);
+}
+
+/* **************************************************************************
+ * Editor
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * *************************************************************************/
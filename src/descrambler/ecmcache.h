@@ -0,0 +1,55 @@
+/*
+ *  tvheadend - shared ECM answer cache
+ *  Copyright (C) 2014 Tvheadend Foundation CIC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TVH_ECMCACHE_H__
+#define __TVH_ECMCACHE_H__
+
+#include <stdint.h>
+
+/*
+ * Identical ECM sections always decrypt to the same control words, so
+ * answers are shared between every service (and every card client)
+ * that sees them. A request in flight is recorded as a pending entry,
+ * letting duplicates wait for it instead of asking the server again.
+ */
+
+#define ECM_CACHE_TTL          20  // seconds an answer is kept
+#define ECM_CACHE_PENDING_TTL  5   // seconds before a pending request is retried
+#define ECM_CACHE_MAX          1024
+
+typedef enum {
+  ECM_CACHE_MISS,     // not known, the caller owns the request (if claimed)
+  ECM_CACHE_PENDING,  // another request for this ECM is in flight
+  ECM_CACHE_HIT       // cw has been filled in
+} ecm_cache_result_t;
+
+void ecm_cache_init ( void );
+void ecm_cache_done ( void );
+
+ecm_cache_result_t
+ecm_cache_lookup
+  ( uint16_t caid, uint32_t provid, const uint8_t *ecm, int len,
+    uint8_t *cw, int claim );
+
+/* cw == NULL reports a failed request and drops the pending entry */
+void
+ecm_cache_store
+  ( uint16_t caid, uint32_t provid, const uint8_t *ecm, int len,
+    const uint8_t *cw );
+
+#endif /* __TVH_ECMCACHE_H__ */
@@ -67,6 +67,14 @@ MAKEFUNCS(64mmx);
 MAKEFUNCS(128sse2);
 #endif
 
+#ifdef CONFIG_AVX2
+MAKEFUNCS(256avx2);
+#endif
+
+#ifdef CONFIG_AVX512F
+MAKEFUNCS(512avx512);
+#endif
+
 static csafuncs_t current;
 
 
@@ -138,6 +146,26 @@ ffdecsa_init(void)
 
   int eax, ebx, ecx, edx;
   int max_std_level, std_caps=0;
+
+  /* AVX state must also be enabled by the OS (XCR0), let the compiler
+   * runtime deal with that rather than doing cpuid/xgetbv by hand */
+#if defined(CONFIG_AVX512F) || defined(CONFIG_AVX2)
+  __builtin_cpu_init();
+#endif
+#ifdef CONFIG_AVX512F
+  if (__builtin_cpu_supports("avx512f")) {
+    current = funcs_512avx512;
+    tvhlog(LOG_INFO, "CSA", "Using AVX-512 512bit parallel descrambling");
+    return;
+  }
+#endif
+#ifdef CONFIG_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    current = funcs_256avx2;
+    tvhlog(LOG_INFO, "CSA", "Using AVX2 256bit parallel descrambling");
+    return;
+  }
+#endif
   
 #if defined(__i386__)
 
@@ -432,6 +432,160 @@ static inline void trasp64_128_88cw(unsigned char *data){
   }
 #undef halfrow
 }
+
+//64-256/512------------------------------------------------------
+// Same as the 128 bit version, rows are split in GROUP_PARALLELISM/64
+// lanes of 64 bits and each lane is transposed independently
+#if GROUP_PARALLELISM>=256
+#define LANES (GROUP_PARALLELISM/64)
+
+static inline void trasp64_wide_88ccw(unsigned char *data){
+/* 64 rows of 256/512 bits transposition (bytes transp. - 8x8 rotate counterclockwise)*/
+#define lane ((unsigned long long int *)data)
+  int i,j,l;
+  for(j=0;j<64;j+=64){
+    unsigned long long int t,b;
+    for(i=0;i<32;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+32+i)+l];
+        lane[LANES*(j+i)+l]   = (t&0x00000000ffffffffULL)      | ((b                      )<<32);
+        lane[LANES*(j+32+i)+l]=((t                      )>>32) |  (b&0xffffffff00000000ULL) ;
+      }
+    }
+  }
+  for(j=0;j<64;j+=32){
+    unsigned long long int t,b;
+    for(i=0;i<16;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+16+i)+l];
+        lane[LANES*(j+i)+l]   = (t&0x0000ffff0000ffffULL)      | ((b&0x0000ffff0000ffffULL)<<16);
+        lane[LANES*(j+16+i)+l]=((t&0xffff0000ffff0000ULL)>>16) |  (b&0xffff0000ffff0000ULL) ;
+      }
+    }
+  }
+  for(j=0;j<64;j+=16){
+    unsigned long long int t,b;
+    for(i=0;i<8;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+8+i)+l];
+        lane[LANES*(j+i)+l]   = (t&0x00ff00ff00ff00ffULL)     | ((b&0x00ff00ff00ff00ffULL)<<8);
+        lane[LANES*(j+8+i)+l] =((t&0xff00ff00ff00ff00ULL)>>8) |  (b&0xff00ff00ff00ff00ULL);
+      }
+    }
+  }
+  for(j=0;j<64;j+=8){
+    unsigned long long int t,b;
+    for(i=0;i<4;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+4+i)+l];
+        lane[LANES*(j+i)+l]   =((t&0x0f0f0f0f0f0f0f0fULL)<<4) |  (b&0x0f0f0f0f0f0f0f0fULL);
+        lane[LANES*(j+4+i)+l] = (t&0xf0f0f0f0f0f0f0f0ULL)     | ((b&0xf0f0f0f0f0f0f0f0ULL)>>4);
+      }
+    }
+  }
+  for(j=0;j<64;j+=4){
+    unsigned long long int t,b;
+    for(i=0;i<2;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+2+i)+l];
+        lane[LANES*(j+i)+l]   =((t&0x3333333333333333ULL)<<2) |  (b&0x3333333333333333ULL);
+        lane[LANES*(j+2+i)+l] = (t&0xccccccccccccccccULL)     | ((b&0xccccccccccccccccULL)>>2);
+      }
+    }
+  }
+  for(j=0;j<64;j+=2){
+    unsigned long long int t,b;
+    for(i=0;i<1;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+1+i)+l];
+        lane[LANES*(j+i)+l]   =((t&0x5555555555555555ULL)<<1) |  (b&0x5555555555555555ULL);
+        lane[LANES*(j+1+i)+l] = (t&0xaaaaaaaaaaaaaaaaULL)     | ((b&0xaaaaaaaaaaaaaaaaULL)>>1);
+      }
+    }
+  }
+#undef lane
+}
+
+static inline void trasp64_wide_88cw(unsigned char *data){
+/* 64 rows of 256/512 bits transposition (bytes transp. - 8x8 rotate clockwise)*/
+#define lane ((unsigned long long int *)data)
+  int i,j,l;
+  for(j=0;j<64;j+=64){
+    unsigned long long int t,b;
+    for(i=0;i<32;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+32+i)+l];
+        lane[LANES*(j+i)+l]   = (t&0x00000000ffffffffULL)      | ((b                      )<<32);
+        lane[LANES*(j+32+i)+l]=((t                      )>>32) |  (b&0xffffffff00000000ULL) ;
+      }
+    }
+  }
+  for(j=0;j<64;j+=32){
+    unsigned long long int t,b;
+    for(i=0;i<16;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+16+i)+l];
+        lane[LANES*(j+i)+l]   = (t&0x0000ffff0000ffffULL)      | ((b&0x0000ffff0000ffffULL)<<16);
+        lane[LANES*(j+16+i)+l]=((t&0xffff0000ffff0000ULL)>>16) |  (b&0xffff0000ffff0000ULL) ;
+      }
+    }
+  }
+  for(j=0;j<64;j+=16){
+    unsigned long long int t,b;
+    for(i=0;i<8;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+8+i)+l];
+        lane[LANES*(j+i)+l]   = (t&0x00ff00ff00ff00ffULL)     | ((b&0x00ff00ff00ff00ffULL)<<8);
+        lane[LANES*(j+8+i)+l] =((t&0xff00ff00ff00ff00ULL)>>8) |  (b&0xff00ff00ff00ff00ULL);
+      }
+    }
+  }
+  for(j=0;j<64;j+=8){
+    unsigned long long int t,b;
+    for(i=0;i<4;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+4+i)+l];
+        lane[LANES*(j+i)+l]   =((t&0xf0f0f0f0f0f0f0f0ULL)>>4) |   (b&0xf0f0f0f0f0f0f0f0ULL);
+        lane[LANES*(j+4+i)+l] = (t&0x0f0f0f0f0f0f0f0fULL)     |  ((b&0x0f0f0f0f0f0f0f0fULL)<<4);
+      }
+    }
+  }
+  for(j=0;j<64;j+=4){
+    unsigned long long int t,b;
+    for(i=0;i<2;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+2+i)+l];
+        lane[LANES*(j+i)+l]   =((t&0xccccccccccccccccULL)>>2) |  (b&0xccccccccccccccccULL);
+        lane[LANES*(j+2+i)+l] = (t&0x3333333333333333ULL)     | ((b&0x3333333333333333ULL)<<2);
+      }
+    }
+  }
+  for(j=0;j<64;j+=2){
+    unsigned long long int t,b;
+    for(i=0;i<1;i++){
+      for(l=0;l<LANES;l++){
+        t=lane[LANES*(j+i)+l];
+        b=lane[LANES*(j+1+i)+l];
+        lane[LANES*(j+i)+l]   =((t&0xaaaaaaaaaaaaaaaaULL)>>1) |  (b&0xaaaaaaaaaaaaaaaaULL);
+        lane[LANES*(j+1+i)+l] = (t&0x5555555555555555ULL)     | ((b&0x5555555555555555ULL)<<1);
+      }
+    }
+  }
+#undef lane
+}
+#undef LANES
+#endif
 #endif
 
 
@@ -489,6 +643,9 @@ trasp64_64_88ccw(sb);
 #if GROUP_PARALLELISM==128
 trasp64_128_88ccw(sb);
 #endif
+#if GROUP_PARALLELISM>=256
+trasp64_wide_88ccw(sb);
+#endif
 DBG(dump_mem("stream_postrot",sb,GROUP_PARALLELISM*8,BYPG));
 
 for(j=0;j<64;j++){
@@ -888,6 +1045,9 @@ trasp64_64_88cw(cb);
 #if GROUP_PARALLELISM==128
 trasp64_128_88cw(cb);
 #endif
+#if GROUP_PARALLELISM>=256
+trasp64_wide_88cw(cb);
+#endif
 
 for(j=0;j<64;j++){
   DBG(fprintf(stderr,"postcall postrot cb[%2i]=",j));
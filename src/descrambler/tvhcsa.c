@@ -24,6 +24,334 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include "atomic.h"
+
+/*
+ * A cluster handed off to the worker pool
+ */
+struct tvhcsa_job
+{
+  TAILQ_ENTRY(tvhcsa_job)  cj_link;      ///< csa_jobs / csa_jobs_free
+  TAILQ_ENTRY(tvhcsa_job)  cj_work_link; ///< tvhcsa_work_queue
+  tvhcsa_t                *cj_csa;
+  int                      cj_queued;    ///< On work queue (tvhcsa_lock)
+  volatile int             cj_done;      ///< Decrypted
+
+  int                      cj_key_gen;   ///< csa_key_gen when filled
+  int                      cj_key_valid;
+  uint8_t                  cj_key_cw[16];
+
+  uint8_t                 *cj_tsbcluster;
+  int                      cj_fill;
+#if ENABLE_DVBCSA
+  struct dvbcsa_bs_batch_s *cj_tsbbatch_even;
+  struct dvbcsa_bs_batch_s *cj_tsbbatch_odd;
+  int                      cj_fill_even;
+  int                      cj_fill_odd;
+#endif
+};
+
+static pthread_mutex_t tvhcsa_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  tvhcsa_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  tvhcsa_done_cond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(,tvhcsa_job) tvhcsa_work_queue =
+  TAILQ_HEAD_INITIALIZER(tvhcsa_work_queue);
+static pthread_t      *tvhcsa_workers;
+static int             tvhcsa_workers_count;
+static int             tvhcsa_workers_running;
+
+/*
+ * Key setting (applied by the worker when offloading)
+ */
+static void
+tvhcsa_apply_keys
+  ( tvhcsa_t *csa, int upd, const uint8_t *even, const uint8_t *odd )
+{
+#if ENABLE_DVBCSA
+  if (upd & TVHCSA_KEY_EVEN)
+    dvbcsa_bs_key_set(even, csa->csa_key_even);
+  if (upd & TVHCSA_KEY_ODD)
+    dvbcsa_bs_key_set(odd, csa->csa_key_odd);
+#else
+  if (upd & TVHCSA_KEY_EVEN)
+    set_even_control_word(csa->csa_keys, even);
+  if (upd & TVHCSA_KEY_ODD)
+    set_odd_control_word(csa->csa_keys, odd);
+#endif
+}
+
+void
+tvhcsa_set_key_even ( tvhcsa_t *csa, const uint8_t *even )
+{
+  if (csa->csa_offload) {
+    pthread_mutex_lock(&tvhcsa_lock);
+    memcpy(csa->csa_key_next, even, 8);
+    csa->csa_key_pending |= TVHCSA_KEY_EVEN;
+    pthread_mutex_unlock(&tvhcsa_lock);
+  } else {
+    tvhcsa_apply_keys(csa, TVHCSA_KEY_EVEN, even, NULL);
+  }
+}
+
+void
+tvhcsa_set_key_odd ( tvhcsa_t *csa, const uint8_t *odd )
+{
+  if (csa->csa_offload) {
+    pthread_mutex_lock(&tvhcsa_lock);
+    memcpy(csa->csa_key_next + 8, odd, 8);
+    csa->csa_key_pending |= TVHCSA_KEY_ODD;
+    pthread_mutex_unlock(&tvhcsa_lock);
+  } else {
+    tvhcsa_apply_keys(csa, TVHCSA_KEY_ODD, NULL, odd);
+  }
+}
+
+/*
+ * Worker pool
+ */
+static void
+tvhcsa_job_decrypt ( tvhcsa_t *csa, tvhcsa_job_t *cj )
+{
+  if (cj->cj_key_gen != csa->csa_key_applied) {
+    tvhcsa_apply_keys(csa, cj->cj_key_valid,
+                      cj->cj_key_cw, cj->cj_key_cw + 8);
+    csa->csa_key_applied = cj->cj_key_gen;
+  }
+
+#if ENABLE_DVBCSA
+  if(cj->cj_fill_even) {
+    cj->cj_tsbbatch_even[cj->cj_fill_even].data = NULL;
+    dvbcsa_bs_decrypt(csa->csa_key_even, cj->cj_tsbbatch_even, 184);
+  }
+  if(cj->cj_fill_odd) {
+    cj->cj_tsbbatch_odd[cj->cj_fill_odd].data = NULL;
+    dvbcsa_bs_decrypt(csa->csa_key_odd, cj->cj_tsbbatch_odd, 184);
+  }
+#else
+  unsigned char *vec[3];
+
+  // Note: unlike the inline path the whole cluster is done here, the
+  //       packets left over at a parity change just form a short group
+  vec[0] = cj->cj_tsbcluster;
+  vec[1] = cj->cj_tsbcluster + cj->cj_fill * 188;
+  vec[2] = NULL;
+  while (vec[0])
+    decrypt_packets(csa->csa_keys, vec);
+#endif
+}
+
+static void *
+tvhcsa_worker ( void *aux )
+{
+  tvhcsa_job_t *cj;
+  tvhcsa_t *csa;
+
+  pthread_mutex_lock(&tvhcsa_lock);
+  while (tvhcsa_workers_running || !TAILQ_EMPTY(&tvhcsa_work_queue)) {
+
+    /* Oldest job for a service no other worker is busy with */
+    TAILQ_FOREACH(cj, &tvhcsa_work_queue, cj_work_link)
+      if (!cj->cj_csa->csa_busy)
+        break;
+    if (!cj) {
+      pthread_cond_wait(&tvhcsa_work_cond, &tvhcsa_lock);
+      continue;
+    }
+    TAILQ_REMOVE(&tvhcsa_work_queue, cj, cj_work_link);
+    cj->cj_queued = 0;
+    csa = cj->cj_csa;
+    csa->csa_busy = 1;
+    pthread_mutex_unlock(&tvhcsa_lock);
+
+    tvhcsa_job_decrypt(csa, cj);
+
+    pthread_mutex_lock(&tvhcsa_lock);
+    csa->csa_busy = 0;
+    atomic_add(&cj->cj_done, 1);
+    pthread_cond_broadcast(&tvhcsa_done_cond);
+    if (!TAILQ_EMPTY(&tvhcsa_work_queue))
+      pthread_cond_signal(&tvhcsa_work_cond);
+  }
+  pthread_mutex_unlock(&tvhcsa_lock);
+
+  return NULL;
+}
+
+static void
+tvhcsa_job_free ( tvhcsa_job_t *cj )
+{
+  free(cj->cj_tsbcluster);
+#if ENABLE_DVBCSA
+  free(cj->cj_tsbbatch_even);
+  free(cj->cj_tsbbatch_odd);
+#endif
+  free(cj);
+}
+
+/*
+ * Hand the current cluster off, the job's spare buffers take its place
+ */
+static void
+tvhcsa_submit ( tvhcsa_t *csa )
+{
+  tvhcsa_job_t *cj;
+  uint8_t *tsb;
+
+  if ((cj = TAILQ_FIRST(&csa->csa_jobs_free))) {
+    TAILQ_REMOVE(&csa->csa_jobs_free, cj, cj_link);
+  } else {
+    cj = calloc(1, sizeof(tvhcsa_job_t));
+    cj->cj_csa        = csa;
+    cj->cj_tsbcluster = malloc(csa->csa_cluster_size * 188);
+#if ENABLE_DVBCSA
+    cj->cj_tsbbatch_even = malloc((csa->csa_cluster_size + 1) *
+                                  sizeof(struct dvbcsa_bs_batch_s));
+    cj->cj_tsbbatch_odd  = malloc((csa->csa_cluster_size + 1) *
+                                  sizeof(struct dvbcsa_bs_batch_s));
+#endif
+  }
+
+  tsb                 = cj->cj_tsbcluster;
+  cj->cj_tsbcluster   = csa->csa_tsbcluster;
+  csa->csa_tsbcluster = tsb;
+  cj->cj_fill         = csa->csa_fill;
+  csa->csa_fill       = 0;
+#if ENABLE_DVBCSA
+  {
+    struct dvbcsa_bs_batch_s *b;
+    b = cj->cj_tsbbatch_even;
+    cj->cj_tsbbatch_even  = csa->csa_tsbbatch_even;
+    csa->csa_tsbbatch_even = b;
+    b = cj->cj_tsbbatch_odd;
+    cj->cj_tsbbatch_odd   = csa->csa_tsbbatch_odd;
+    csa->csa_tsbbatch_odd  = b;
+    cj->cj_fill_even      = csa->csa_fill_even;
+    cj->cj_fill_odd       = csa->csa_fill_odd;
+    csa->csa_fill_even    = 0;
+    csa->csa_fill_odd     = 0;
+  }
+#endif
+  cj->cj_key_gen      = csa->csa_key_gen;
+  cj->cj_key_valid    = csa->csa_key_valid;
+  memcpy(cj->cj_key_cw, csa->csa_key_cw, sizeof(cj->cj_key_cw));
+  cj->cj_done         = 0;
+
+  TAILQ_INSERT_TAIL(&csa->csa_jobs, cj, cj_link);
+  csa->csa_jobs_count++;
+
+  pthread_mutex_lock(&tvhcsa_lock);
+  cj->cj_queued = 1;
+  TAILQ_INSERT_TAIL(&tvhcsa_work_queue, cj, cj_work_link);
+  pthread_cond_signal(&tvhcsa_work_cond);
+  pthread_mutex_unlock(&tvhcsa_lock);
+}
+
+/*
+ * Take the held keys at the first packet scrambled with a parity whose
+ * key changed. At a parity change the packets before it are handed off
+ * with the old keys first (same boundary as the inline cw_update_pending
+ * handling), they may include the previous period of that parity.
+ */
+static void
+tvhcsa_key_check ( tvhcsa_t *csa, const uint8_t *tsb )
+{
+  uint8_t cw[8];
+  int xc0 = tsb[3] & 0xc0, parity, off;
+
+  if (xc0 != 0x80 && xc0 != 0xc0)
+    return;
+  parity = xc0 == 0x80 ? TVHCSA_KEY_EVEN : TVHCSA_KEY_ODD;
+  off = xc0 == 0x80 ? 0 : 8;
+
+  if (atomic_add(&csa->csa_key_pending, 0) & parity) {
+    pthread_mutex_lock(&tvhcsa_lock);
+    memcpy(cw, csa->csa_key_next + off, 8);
+    csa->csa_key_pending &= ~parity;
+    pthread_mutex_unlock(&tvhcsa_lock);
+
+    if (csa->csa_fill && csa->csa_key_parity != parity)
+      tvhcsa_submit(csa);
+
+    memcpy(csa->csa_key_cw + off, cw, 8);
+    csa->csa_key_valid |= parity;
+    csa->csa_key_gen++;
+  }
+  csa->csa_key_parity = parity;
+}
+
+/*
+ * Re-inject decrypted clusters (in order), optionally waiting for the
+ * oldest one when too many are outstanding
+ */
+static void
+tvhcsa_complete ( tvhcsa_t *csa, struct mpegts_service *s, int wait )
+{
+  tvhcsa_job_t *cj;
+  const uint8_t *t0;
+  int i;
+
+  while ((cj = TAILQ_FIRST(&csa->csa_jobs)) != NULL) {
+    if (!atomic_add(&cj->cj_done, 0)) {
+      if (!wait)
+        break;
+      pthread_mutex_lock(&tvhcsa_lock);
+      while (!cj->cj_done)
+        pthread_cond_wait(&tvhcsa_done_cond, &tvhcsa_lock);
+      pthread_mutex_unlock(&tvhcsa_lock);
+    }
+    wait = 0;
+
+    t0 = cj->cj_tsbcluster;
+    for(i = 0; i < cj->cj_fill; i++) {
+      ts_recv_packet2(s, t0);
+      t0 += 188;
+    }
+
+    TAILQ_REMOVE(&csa->csa_jobs, cj, cj_link);
+    csa->csa_jobs_count--;
+    TAILQ_INSERT_HEAD(&csa->csa_jobs_free, cj, cj_link);
+  }
+}
+
+void
+tvhcsa_workers_init ( int threads )
+{
+  int i;
+
+  /* Auto: one per CPU, inline (no hand off) on single CPU systems */
+  if (threads < 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 2)
+      threads = 0;
+  }
+  tvhcsa_workers_count   = MIN(threads, TVHCSA_WORKERS_MAX);
+  if (!tvhcsa_workers_count) {
+    tvhdebug("csa", "descrambling inline");
+    return;
+  }
+  tvhcsa_workers_running = 1;
+  tvhcsa_workers = calloc(tvhcsa_workers_count, sizeof(pthread_t));
+  for (i = 0; i < tvhcsa_workers_count; i++)
+    tvhthread_create(&tvhcsa_workers[i], NULL, tvhcsa_worker, NULL, 0);
+  tvhdebug("csa", "using %d descrambler thread(s)", tvhcsa_workers_count);
+}
+
+void
+tvhcsa_workers_done ( void )
+{
+  int i;
+
+  pthread_mutex_lock(&tvhcsa_lock);
+  tvhcsa_workers_running = 0;
+  pthread_cond_broadcast(&tvhcsa_work_cond);
+  pthread_mutex_unlock(&tvhcsa_lock);
+  for (i = 0; i < tvhcsa_workers_count; i++)
+    pthread_join(tvhcsa_workers[i], NULL);
+  free(tvhcsa_workers);
+  tvhcsa_workers = NULL;
+  tvhcsa_workers_count = 0;
+}
+
 void
 tvhcsa_descramble
   ( tvhcsa_t *csa, struct mpegts_service *s, struct elementary_stream *st,
@@ -39,6 +367,11 @@ tvhcsa_descramble
   int i;
   const uint8_t *t0;
 
+  if (csa->csa_offload) {
+    tvhcsa_complete(csa, s, 0);
+    tvhcsa_key_check(csa, tsb);
+  }
+
   pkt = csa->csa_tsbcluster + csa->csa_fill * 188;
   memcpy(pkt, tsb, 188);
   csa->csa_fill++;
@@ -83,6 +416,12 @@ tvhcsa_descramble
   if(csa->csa_fill != csa->csa_cluster_size)
     return;
 
+  if(csa->csa_offload) {
+    tvhcsa_submit(csa);
+    tvhcsa_complete(csa, s, csa->csa_jobs_count >= TVHCSA_JOBS_MAX);
+    return;
+  }
+
   if(csa->csa_fill_even) {
     csa->csa_tsbbatch_even[csa->csa_fill_even].data = NULL;
     dvbcsa_bs_decrypt(csa->csa_key_even, csa->csa_tsbbatch_even, 184);
@@ -106,12 +445,23 @@ tvhcsa_descramble
   int r;
   unsigned char *vec[3];
 
+  if (csa->csa_offload) {
+    tvhcsa_complete(csa, s, 0);
+    tvhcsa_key_check(csa, tsb);
+  }
+
   memcpy(csa->csa_tsbcluster + csa->csa_fill * 188, tsb, 188);
   csa->csa_fill++;
 
   if(csa->csa_fill != csa->csa_cluster_size)
     return;
 
+  if(csa->csa_offload) {
+    tvhcsa_submit(csa);
+    tvhcsa_complete(csa, s, csa->csa_jobs_count >= TVHCSA_JOBS_MAX);
+    return;
+  }
+
   while(1) {
 
     vec[0] = csa->csa_tsbcluster;
@@ -164,11 +514,37 @@ tvhcsa_init ( tvhcsa_t *csa )
 #else
   csa->csa_keys          = get_key_struct();
 #endif
+  csa->csa_offload       = tvhcsa_workers_count > 0;
+  TAILQ_INIT(&csa->csa_jobs);
+  TAILQ_INIT(&csa->csa_jobs_free);
 }
 
 void
 tvhcsa_destroy ( tvhcsa_t *csa )
 {
+  tvhcsa_job_t *cj;
+
+  /* Withdraw queued clusters and wait for any being decrypted */
+  if (csa->csa_offload) {
+    pthread_mutex_lock(&tvhcsa_lock);
+    TAILQ_FOREACH(cj, &csa->csa_jobs, cj_link)
+      if (cj->cj_queued) {
+        TAILQ_REMOVE(&tvhcsa_work_queue, cj, cj_work_link);
+        cj->cj_queued = 0;
+      }
+    while (csa->csa_busy)
+      pthread_cond_wait(&tvhcsa_done_cond, &tvhcsa_lock);
+    pthread_mutex_unlock(&tvhcsa_lock);
+  }
+  while ((cj = TAILQ_FIRST(&csa->csa_jobs)) != NULL) {
+    TAILQ_REMOVE(&csa->csa_jobs, cj, cj_link);
+    tvhcsa_job_free(cj);
+  }
+  while ((cj = TAILQ_FIRST(&csa->csa_jobs_free)) != NULL) {
+    TAILQ_REMOVE(&csa->csa_jobs_free, cj, cj_link);
+    tvhcsa_job_free(cj);
+  }
+
 #if ENABLE_DVBCSA
   dvbcsa_bs_key_free(csa->csa_key_odd);
   dvbcsa_bs_key_free(csa->csa_key_even);
@@ -31,6 +31,14 @@ struct elementary_stream;
 #include "ffdecsa/FFdecsa.h"
 #endif
 
+typedef struct tvhcsa_job tvhcsa_job_t;
+
+#define TVHCSA_WORKERS_MAX  16
+#define TVHCSA_JOBS_MAX     8  // per service, before the demux thread waits
+
+#define TVHCSA_KEY_EVEN     0x1
+#define TVHCSA_KEY_ODD      0x2
+
 typedef struct tvhcsa
 {
 
@@ -52,26 +60,37 @@ typedef struct tvhcsa
 #else
   void *csa_keys;
 #endif
+
+  /**
+   * Worker offload
+   *
+   * Full clusters are handed to the worker pool and re-injected, in
+   * order, by the demux thread once decrypted. A new key is held until
+   * the first packet scrambled with its parity; at a parity change the
+   * cluster filled so far is handed off with the old keys first. A key
+   * arriving late, with its parity already in use, is taken at once.
+   * Each cluster carries the
+   * key generation it was filled under and the worker re-keys only when
+   * that changes. Only the worker touches the key state once offload
+   * is enabled.
+   */
+  int      csa_offload;
+  TAILQ_HEAD(,tvhcsa_job) csa_jobs;      ///< Handed off, oldest first
+  TAILQ_HEAD(,tvhcsa_job) csa_jobs_free; ///< Spare cluster buffers
+  int      csa_jobs_count;
+  int      csa_busy;                     ///< Worker running (tvhcsa_lock)
+  int      csa_key_pending;              ///< TVHCSA_KEY_* held (tvhcsa_lock)
+  uint8_t  csa_key_next[16];             ///< Held keys (tvhcsa_lock)
+  int      csa_key_valid;                ///< TVHCSA_KEY_* in csa_key_cw
+  uint8_t  csa_key_cw[16];               ///< Keys for the cluster filling
+  int      csa_key_gen;                  ///< Bumped when csa_key_cw changes
+  int      csa_key_applied;              ///< Generation the worker keyed
+  int      csa_key_parity;               ///< TVHCSA_KEY_* of last packet
   
 } tvhcsa_t;
 
-#if ENABLE_DVBCSA
-
-#define tvhcsa_set_key_even(csa, cw)\
-  dvbcsa_bs_key_set(cw, (csa)->csa_key_even)
-
-#define tvhcsa_set_key_odd(csa, cw)\
-  dvbcsa_bs_key_set(cw, (csa)->csa_key_odd)
-
-#else
-
-#define tvhcsa_set_key_even(csa, cw)\
-  set_even_control_word((csa)->csa_keys, cw)
-
-#define tvhcsa_set_key_odd(csa, cw)\
-  set_odd_control_word((csa)->csa_keys, cw)
-
-#endif
+void tvhcsa_set_key_even ( tvhcsa_t *csa, const uint8_t *even );
+void tvhcsa_set_key_odd  ( tvhcsa_t *csa, const uint8_t *odd );
 
 void
 tvhcsa_descramble
@@ -81,4 +100,7 @@ tvhcsa_descramble
 void tvhcsa_init    ( tvhcsa_t *csa );
 void tvhcsa_destroy ( tvhcsa_t *csa );
 
+void tvhcsa_workers_init ( int threads );
+void tvhcsa_workers_done ( void );
+
 #endif /* __TVH_CSA_H__ */
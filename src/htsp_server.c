@@ -31,6 +31,7 @@
 #include "imagecache.h"
 #include "descrambler.h"
 #include "notify.h"
+#include "congestion.h"
 #if ENABLE_TIMESHIFT
 #include "timeshift.h"
 #endif
@@ -55,7 +56,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 #include "settings.h"
+#include "tvhpoll.h"
 #include <sys/time.h>
 
 /* **************************************************************************
@@ -84,7 +87,22 @@ TAILQ_HEAD(htsp_msg_q_queue, htsp_msg_q);
 static struct htsp_connection_list htsp_async_connections;
 static struct htsp_connection_list htsp_connections;
 
+/*
+ * Connections are served by a few I/O workers (non-blocking sockets on
+ * an event loop) and requests are run by a small pool of threads, one
+ * request per connection at a time so that they are handled in order
+ * (see HTSP_IO_THREADS and HTSP_POOL_THREADS for the default sizes)
+ */
+#define HTSP_WRITE_IOV      64           // messages per writev()
+#define HTSP_WRITE_BATCH    (256*1024)   // bytes serialized per writev()
+#define HTSP_WRITE_BUDGET   (1024*1024)  // bytes written before yielding
+#define HTSP_READ_SIZE      (16*1024)
+#define HTSP_READ_QUEUE     32           // requests queued before reading stops
+#define HTSP_MAX_MESSAGE    (1024*1024)
+#define HTSP_MUXPKT_HDR     160          // largest muxpkt header (w/o payload)
+
 static void htsp_streaming_input(void *opaque, streaming_message_t *sm);
+static void htsp_io_flush(struct htsp_connection *htsp);
 
 /**
  *
@@ -100,9 +118,39 @@ typedef struct htsp_msg {
 			   hm_msg can contain messages that points
 			   to packet payload so to avoid copy we
 			   keep a reference here */
+
+  /* muxpkt (hm_msg is NULL), encoded by the writer with hm_pb as the
+     payload */
+  uint32_t hm_sid;
+  uint32_t hm_frametype;      /* PKT_x_FRAME */
+  uint32_t hm_stream;
+  uint32_t hm_com;
+  uint32_t hm_duration;
+  int64_t  hm_pts;
+  int64_t  hm_dts;
+  uint32_t hm_seq;            /* Queue sequence (muxpkt with a dts) */
 } htsp_msg_t;
 
 
+/**
+ * Extreme (min or max) DTS of the queued packets: a monotonic deque,
+ * packets that can never be the extreme again are dropped as new ones
+ * come in, so the front is always the answer
+ */
+typedef struct htsp_dts_deque {
+  uint32_t *hdd_seq;
+  int64_t  *hdd_dts;
+  int       hdd_head;
+  int       hdd_len;
+  int       hdd_size;         /* Power of 2 */
+} htsp_dts_deque_t;
+
+typedef struct htsp_delay {
+  htsp_dts_deque_t hd_min;
+  htsp_dts_deque_t hd_max;
+  int              hd_packets;
+} htsp_delay_t;
+
 /**
  *
  */
@@ -113,6 +161,13 @@ typedef struct htsp_msg_q {
   int hmq_strict_prio;      /* Serve this queue 'til it's empty */
   int hmq_length;
   int hmq_payload;          /* Bytes of streaming payload that's enqueued */
+
+  uint32_t hmq_seq;         /* Last sequence given to a packet */
+  htsp_delay_t hmq_delay;   /* All packets */
+  htsp_delay_t *hmq_sdelay; /* Per stream (component index) */
+  int hmq_nsdelay;
+
+  congestion_t *hmq_cc;     /* Trimmed when the client lags (muxpkts) */
 } htsp_msg_q_t;
 
 /**
@@ -122,7 +177,7 @@ typedef struct htsp_connection {
   LIST_ENTRY(htsp_connection) htsp_link;
 
   int htsp_fd;
-  struct sockaddr_storage *htsp_peer;
+  struct sockaddr_storage htsp_peer;
 
   uint32_t htsp_version;
 
@@ -139,16 +194,51 @@ typedef struct htsp_connection {
   LIST_ENTRY(htsp_connection) htsp_async_link;
 
   /**
-   * Writer thread
+   * I/O worker, reads requests and writes the output queues
+   */
+  struct htsp_io *htsp_io;
+  TAILQ_ENTRY(htsp_connection) htsp_flush_link;
+  TAILQ_ENTRY(htsp_connection) htsp_release_link;
+  TAILQ_ENTRY(htsp_connection) htsp_resume_link;
+  int htsp_flush_queued;  /* On the worker's flush list (hio_mutex) */
+  int htsp_resume_queued; /* On the worker's resume list (hio_mutex) */
+  int htsp_rd_paused;     /* Not reading, the pool is behind */
+  int htsp_io_events;     /* Polled for */
+  int htsp_wr_pending;    /* Output is, or waits to be, written (htsp_out_mutex) */
+  int htsp_wr_pollout;    /* Waiting for the socket to drain */
+  int htsp_io_dead;       /* Socket failed, no more I/O */
+
+  struct iovec htsp_wr_iov[HTSP_WRITE_IOV];
+  void *htsp_wr_data[HTSP_WRITE_IOV];     /* Serialized message (freed) */
+  pktbuf_t *htsp_wr_pb[HTSP_WRITE_IOV];   /* Payload (reference held) */
+  int htsp_wr_cnt;
+  int htsp_wr_idx;
+  uint8_t htsp_wr_scratch[HTSP_WRITE_IOV / 2][HTSP_MUXPKT_HDR];
+
+  uint8_t *htsp_rbuf;
+  size_t htsp_rbuf_len;
+  size_t htsp_rbuf_size;
+
+  /**
+   * Requests waiting for the pool (htsp_pool_mutex)
    */
-  pthread_t htsp_writer_thread;
+  struct htsp_msg_queue htsp_in_q;
+  int htsp_in_count;
+  int htsp_in_full;       /* Reading stopped, resume once drained */
+  TAILQ_ENTRY(htsp_connection) htsp_pool_link;
+  int htsp_pool_queued;
+  int htsp_pool_busy;
+  int htsp_closing;
 
-  int htsp_writer_run;
+  /**
+   * Access denied reply, delayed (global_lock)
+   */
+  gtimer_t htsp_noaccess_timer;
+  htsmsg_t *htsp_noaccess_reply;
 
   struct htsp_msg_q_queue htsp_active_output_queues;
 
   pthread_mutex_t htsp_out_mutex;
-  pthread_cond_t htsp_out_cond;
 
   htsp_msg_q_t htsp_hmq_ctrl;
   htsp_msg_q_t htsp_hmq_epg;
@@ -186,21 +276,21 @@ typedef struct htsp_subscription {
 
 #if ENABLE_LIBAV
 streaming_target_t *hs_transcoder;
+transcoder_viewer_t *hs_tsession;
 #endif
 
   htsp_msg_q_t hs_q;
 
   time_t hs_last_report; /* Last queue status report sent */
 
-  int hs_dropstats[PKT_NTYPES];
+  congestion_t hs_cc;       /* Protected by htsp_out_mutex */
 
   int hs_90khz;
 
-  int hs_queue_depth;
-
 #define NUM_FILTERED_STREAMS (32*16)
 
   uint32_t hs_filtered_streams[16]; // one bit per stream
+  uint32_t hs_video_streams[16];    // same, protected by htsp_out_mutex
 
   int hs_first;
 
@@ -218,6 +308,7 @@ typedef struct htsp_file {
 } htsp_file_t;
 
 #define HTSP_DEFAULT_QUEUE_DEPTH 500000
+#define HTSP_QUEUE_DEPTH_LIMIT   3   // queue depths before GOPs are dropped
 
 /* **************************************************************************
  * Support routines
@@ -248,6 +339,29 @@ htsp_is_stream_enabled(htsp_subscription_t *hs, unsigned int id)
 }
 
 
+/**
+ * Sync the queue on I-frames only while a video stream is enabled, an
+ * audio only client would otherwise wait for one forever after a trim
+ * (htsp_out_mutex is held)
+ */
+static void
+htsp_congestion_video(htsp_subscription_t *hs)
+{
+  congestion_t *cc = &hs->hs_cc;
+  htsp_msg_t *hm;
+  int i, video = 0;
+
+  for(i = 0; i < NUM_FILTERED_STREAMS / 32; i++)
+    if(hs->hs_video_streams[i] & ~hs->hs_filtered_streams[i])
+      video = 1;
+
+  congestion_video(cc, video);
+  TAILQ_FOREACH(hm, &hs->hs_q.hmq_q, hm_link)
+    if(hm->hm_msg == NULL)
+      congestion_count(cc, hm->hm_frametype);
+}
+
+
 /**
  *
  */
@@ -273,12 +387,141 @@ htsp_update_logname(htsp_connection_t *htsp)
 static void
 htsp_msg_destroy(htsp_msg_t *hm)
 {
-  htsmsg_destroy(hm->hm_msg);
+  if(hm->hm_msg != NULL)
+    htsmsg_destroy(hm->hm_msg);
   if(hm->hm_pb != NULL)
     pktbuf_ref_dec(hm->hm_pb);
   free(hm);
 }
 
+/**
+ * Queue delay tracking (htsp_out_mutex held)
+ */
+static void
+htsp_dts_deque_push(htsp_dts_deque_t *d, uint32_t seq, int64_t dts, int max)
+{
+  int i, n;
+
+  while(d->hdd_len) {
+    i = (d->hdd_head + d->hdd_len - 1) & (d->hdd_size - 1);
+    if(max ? d->hdd_dts[i] > dts : d->hdd_dts[i] < dts)
+      break;
+    d->hdd_len--;
+  }
+
+  if(d->hdd_len == d->hdd_size) {
+    n = MAX(64, d->hdd_size * 2);
+    d->hdd_seq = realloc(d->hdd_seq, n * sizeof(*d->hdd_seq));
+    d->hdd_dts = realloc(d->hdd_dts, n * sizeof(*d->hdd_dts));
+    /* Unwrap into the new space */
+    for(i = 0; i < d->hdd_head + d->hdd_len - d->hdd_size; i++) {
+      d->hdd_seq[d->hdd_size + i] = d->hdd_seq[i];
+      d->hdd_dts[d->hdd_size + i] = d->hdd_dts[i];
+    }
+    d->hdd_size = n;
+  }
+
+  i = (d->hdd_head + d->hdd_len++) & (d->hdd_size - 1);
+  d->hdd_seq[i] = seq;
+  d->hdd_dts[i] = dts;
+}
+
+static void
+htsp_dts_deque_pop(htsp_dts_deque_t *d, uint32_t seq)
+{
+  if(d->hdd_len && d->hdd_seq[d->hdd_head] == seq) {
+    d->hdd_head = (d->hdd_head + 1) & (d->hdd_size - 1);
+    d->hdd_len--;
+  }
+}
+
+static void
+htsp_delay_push(htsp_delay_t *hd, uint32_t seq, int64_t dts)
+{
+  htsp_dts_deque_push(&hd->hd_min, seq, dts, 0);
+  htsp_dts_deque_push(&hd->hd_max, seq, dts, 1);
+  hd->hd_packets++;
+}
+
+static void
+htsp_delay_pop(htsp_delay_t *hd, uint32_t seq)
+{
+  htsp_dts_deque_pop(&hd->hd_min, seq);
+  htsp_dts_deque_pop(&hd->hd_max, seq);
+  hd->hd_packets--;
+}
+
+static int64_t
+htsp_delay_get(htsp_delay_t *hd)
+{
+  if(!hd->hd_min.hdd_len)
+    return 0;
+  return hd->hd_max.hdd_dts[hd->hd_max.hdd_head] -
+         hd->hd_min.hdd_dts[hd->hd_min.hdd_head];
+}
+
+static void
+htsp_delay_clear(htsp_delay_t *hd, int release)
+{
+  if(release) {
+    free(hd->hd_min.hdd_seq);
+    free(hd->hd_min.hdd_dts);
+    free(hd->hd_max.hdd_seq);
+    free(hd->hd_max.hdd_dts);
+    memset(hd, 0, sizeof(*hd));
+  } else {
+    hd->hd_min.hdd_head = hd->hd_min.hdd_len = 0;
+    hd->hd_max.hdd_head = hd->hd_max.hdd_len = 0;
+    hd->hd_packets = 0;
+  }
+}
+
+static void
+htsp_queue_delay_add(htsp_msg_q_t *hmq, htsp_msg_t *hm)
+{
+  int n;
+
+  if(hm->hm_msg != NULL || hm->hm_dts == PTS_UNSET)
+    return;
+  hm->hm_seq = ++hmq->hmq_seq;
+  htsp_delay_push(&hmq->hmq_delay, hm->hm_seq, hm->hm_dts);
+  if(hm->hm_stream >= NUM_FILTERED_STREAMS)
+    return;
+  if(hm->hm_stream >= hmq->hmq_nsdelay) {
+    n = hm->hm_stream + 1;
+    hmq->hmq_sdelay = realloc(hmq->hmq_sdelay, n * sizeof(htsp_delay_t));
+    memset(hmq->hmq_sdelay + hmq->hmq_nsdelay, 0,
+           (n - hmq->hmq_nsdelay) * sizeof(htsp_delay_t));
+    hmq->hmq_nsdelay = n;
+  }
+  htsp_delay_push(&hmq->hmq_sdelay[hm->hm_stream], hm->hm_seq, hm->hm_dts);
+}
+
+static void
+htsp_queue_delay_remove(htsp_msg_q_t *hmq, htsp_msg_t *hm)
+{
+  if(hm->hm_msg != NULL || hm->hm_dts == PTS_UNSET)
+    return;
+  htsp_delay_pop(&hmq->hmq_delay, hm->hm_seq);
+  if(hm->hm_stream < hmq->hmq_nsdelay)
+    htsp_delay_pop(&hmq->hmq_sdelay[hm->hm_stream], hm->hm_seq);
+}
+
+static void
+htsp_queue_delay_clear(htsp_msg_q_t *hmq, int release)
+{
+  int i;
+
+  htsp_delay_clear(&hmq->hmq_delay, release);
+  for(i = 0; i < hmq->hmq_nsdelay; i++)
+    htsp_delay_clear(&hmq->hmq_sdelay[i], release);
+  if(release) {
+    free(hmq->hmq_sdelay);
+    hmq->hmq_sdelay = NULL;
+    hmq->hmq_nsdelay = 0;
+  }
+}
+
 /**
  *
  */
@@ -311,6 +554,9 @@ htsp_flush_queue(htsp_connection_t *htsp, htsp_msg_q_t *hmq)
   // reset
   hmq->hmq_length = 0;
   hmq->hmq_payload = 0;
+  htsp_queue_delay_clear(hmq, 0);
+  if(hmq->hmq_cc)
+    congestion_flush(hmq->hmq_cc);
   pthread_mutex_unlock(&htsp->htsp_out_mutex);
 }
 
@@ -321,6 +567,11 @@ static void
 htsp_subscription_destroy(htsp_connection_t *htsp, htsp_subscription_t *hs)
 {
   LIST_REMOVE(hs, hs_link);
+#if ENABLE_LIBAV
+  if(hs->hs_tsession)
+    transcoder_session_leave(hs->hs_tsession);
+  else
+#endif
   subscription_unsubscribe(hs->hs_s);
 
   if(hs->hs_tsfix != NULL)
@@ -332,6 +583,7 @@ htsp_subscription_destroy(htsp_connection_t *htsp, htsp_subscription_t *hs)
 #endif
 
   htsp_flush_queue(htsp, &hs->hs_q);
+  htsp_queue_delay_clear(&hs->hs_q, 1);
 
 #if ENABLE_TIMESHIFT
   if(hs->hs_tshift)
@@ -342,24 +594,65 @@ htsp_subscription_destroy(htsp_connection_t *htsp, htsp_subscription_t *hs)
   free(hs);
 }
 
+/**
+ * Drop GOPs from the head while the client lags behind, the other
+ * messages stay queued (htsp_out_mutex is held, the queue is active)
+ */
+static void
+htsp_queue_trim(htsp_connection_t *htsp, htsp_msg_q_t *hmq)
+{
+  congestion_t *cc = hmq->hmq_cc;
+  htsp_msg_t *hm, *next;
+  int n;
+
+  while(congestion_trim(cc)) {
+    n = 0;
+    for(hm = TAILQ_FIRST(&hmq->hmq_q); hm != NULL; hm = next) {
+      next = TAILQ_NEXT(hm, hm_link);
+      if(hm->hm_msg != NULL)
+        continue;
+      if(n && congestion_sync(cc, hm->hm_frametype))
+        break;
+      TAILQ_REMOVE(&hmq->hmq_q, hm, hm_link);
+      hmq->hmq_length--;
+      hmq->hmq_payload -= hm->hm_payloadsize;
+      htsp_queue_delay_remove(hmq, hm);
+      congestion_drop(cc, hm->hm_frametype, hm->hm_payloadsize);
+      htsp_msg_destroy(hm);
+      n++;
+    }
+    if(n == 0) {
+      congestion_flush(cc);
+      break;
+    }
+    tvhtrace("htsp", "%s - lagging, dropped %d packets, %zu bytes left",
+             htsp->htsp_logname, n, cc->cc_bytes);
+  }
+
+  if(hmq->hmq_length == 0)
+    TAILQ_REMOVE(&htsp->htsp_active_output_queues, hmq, hmq_link);
+}
+
 /**
  *
  */
 static void
-htsp_send(htsp_connection_t *htsp, htsmsg_t *m, pktbuf_t *pb,
-	  htsp_msg_q_t *hmq, int payloadsize)
+htsp_enqueue(htsp_connection_t *htsp, htsp_msg_t *hm, htsp_msg_q_t *hmq)
 {
-  htsp_msg_t *hm = malloc(sizeof(htsp_msg_t));
+  int trim = hm->hm_msg == NULL && hmq->hmq_cc != NULL;
 
-  hm->hm_msg = m;
-  hm->hm_pb = pb;
-  if(pb != NULL)
-    pktbuf_ref_inc(pb);
-  hm->hm_payloadsize = payloadsize;
-  
   pthread_mutex_lock(&htsp->htsp_out_mutex);
 
+  if(trim &&
+     !congestion_admit(hmq->hmq_cc, hm->hm_frametype, hm->hm_payloadsize)) {
+    /* Waiting for a sync point */
+    pthread_mutex_unlock(&htsp->htsp_out_mutex);
+    htsp_msg_destroy(hm);
+    return;
+  }
+
   TAILQ_INSERT_TAIL(&hmq->hmq_q, hm, hm_link);
+  htsp_queue_delay_add(hmq, hm);
 
   if(hmq->hmq_length == 0) {
     /* Activate queue */
@@ -372,11 +665,107 @@ htsp_send(htsp_connection_t *htsp, htsmsg_t *m, pktbuf_t *pb,
   }
 
   hmq->hmq_length++;
-  hmq->hmq_payload += payloadsize;
-  pthread_cond_signal(&htsp->htsp_out_cond);
+  hmq->hmq_payload += hm->hm_payloadsize;
+  if(trim)
+    htsp_queue_trim(htsp, hmq);
+  if(!htsp->htsp_wr_pending) {
+    htsp->htsp_wr_pending = 1;
+    htsp_io_flush(htsp);
+  }
   pthread_mutex_unlock(&htsp->htsp_out_mutex);
 }
 
+/**
+ *
+ */
+static void
+htsp_send(htsp_connection_t *htsp, htsmsg_t *m, pktbuf_t *pb,
+	  htsp_msg_q_t *hmq, int payloadsize)
+{
+  htsp_msg_t *hm = malloc(sizeof(htsp_msg_t));
+
+  hm->hm_msg = m;
+  hm->hm_pb = pb;
+  if(pb != NULL)
+    pktbuf_ref_inc(pb);
+  hm->hm_payloadsize = payloadsize;
+  hm->hm_dts = PTS_UNSET;
+  htsp_enqueue(htsp, hm, hmq);
+}
+
+/**
+ * muxpkt encoding, byte for byte what htsmsg_binary_serialize() makes
+ * of the equivalent message
+ */
+const static char frametypearray[PKT_NTYPES] = {
+  [PKT_I_FRAME] = 'I',
+  [PKT_P_FRAME] = 'P',
+  [PKT_B_FRAME] = 'B',
+};
+
+static uint8_t *
+htsp_muxpkt_field(uint8_t *p, int type, const char *name, uint32_t len)
+{
+  int namelen = strlen(name);
+
+  *p++ = type;
+  *p++ = namelen;
+  *p++ = len >> 24;
+  *p++ = len >> 16;
+  *p++ = len >> 8;
+  *p++ = len;
+  memcpy(p, name, namelen);
+  return p + namelen;
+}
+
+static uint8_t *
+htsp_muxpkt_s64(uint8_t *p, const char *name, int64_t s64)
+{
+  uint64_t u64 = s64;
+  int l = 0;
+
+  while(u64 != 0) {
+    l++;
+    u64 >>= 8;
+  }
+  p = htsp_muxpkt_field(p, HMF_S64, name, l);
+  for(u64 = s64; l > 0; l--, u64 >>= 8)
+    *p++ = u64;
+  return p;
+}
+
+/**
+ * Write the message up to the payload data into buf (at least
+ * HTSP_MUXPKT_HDR bytes), returns the length
+ */
+static size_t
+htsp_muxpkt_header(htsp_msg_t *hm, uint8_t *buf)
+{
+  uint8_t *p = buf + 4;
+  size_t len;
+
+  p = htsp_muxpkt_field(p, HMF_STR, "method", 6);
+  memcpy(p, "muxpkt", 6);
+  p += 6;
+  p = htsp_muxpkt_s64(p, "subscriptionId", hm->hm_sid);
+  p = htsp_muxpkt_s64(p, "frametype", frametypearray[hm->hm_frametype]);
+  p = htsp_muxpkt_s64(p, "stream", hm->hm_stream);
+  p = htsp_muxpkt_s64(p, "com", hm->hm_com);
+  if(hm->hm_pts != PTS_UNSET)
+    p = htsp_muxpkt_s64(p, "pts", hm->hm_pts);
+  if(hm->hm_dts != PTS_UNSET)
+    p = htsp_muxpkt_s64(p, "dts", hm->hm_dts);
+  p = htsp_muxpkt_s64(p, "duration", hm->hm_duration);
+  p = htsp_muxpkt_field(p, HMF_BIN, "payload", pktbuf_len(hm->hm_pb));
+
+  len = p - buf - 4 + pktbuf_len(hm->hm_pb);
+  buf[0] = len >> 24;
+  buf[1] = len >> 16;
+  buf[2] = len >> 8;
+  buf[3] = len;
+  return p - buf;
+}
+
 /**
  *
  */
@@ -1486,9 +1875,15 @@ htsp_method_subscribe(htsp_connection_t *htsp, htsmsg_t *in)
 
   hs->hs_htsp = htsp;
   hs->hs_90khz = req90khz;
-  hs->hs_queue_depth = htsmsg_get_u32_or_default(in, "queueDepth",
-						 HTSP_DEFAULT_QUEUE_DEPTH);
+  /* Bounded by the queue depth (bytes) and optionally by the time the
+     client needs to catch up (queueLatency, ms) */
+  congestion_init(&hs->hs_cc,
+                  (size_t)htsmsg_get_u32_or_default(in, "queueDepth",
+                                                    HTSP_DEFAULT_QUEUE_DEPTH) *
+                  HTSP_QUEUE_DEPTH_LIMIT,
+                  htsmsg_get_u32_or_default(in, "queueLatency", 0) * 1000LL);
   htsp_init_queue(&hs->hs_q, 0);
+  hs->hs_q.hmq_cc = &hs->hs_cc;
 
   hs->hs_sid = sid;
   LIST_INSERT_HEAD(&htsp->htsp_subscriptions, hs, hs_link);
@@ -1498,11 +1893,20 @@ htsp_method_subscribe(htsp_connection_t *htsp, htsmsg_t *in)
 
 #if ENABLE_TIMESHIFT
   if (timeshiftPeriod != 0) {
+    channel_t *tsch = ch;
     if (timeshiftPeriod == ~0)
       tvhlog(LOG_DEBUG, "htsp", "using timeshift buffer (unlimited)");
     else
       tvhlog(LOG_DEBUG, "htsp", "using timeshift buffer (%u mins)", timeshiftPeriod / 60);
-    st = hs->hs_tshift = timeshift_create(st, timeshiftPeriod);
+#if ENABLE_LIBAV
+    /* Transcoded streams are per client, keep their buffer private */
+    if (transcoding_enabled &&
+        (htsmsg_get_str(in, "videoCodec") ||
+         htsmsg_get_str(in, "audioCodec") ||
+         htsmsg_get_str(in, "subtitleCodec")))
+      tsch = NULL;
+#endif
+    st = hs->hs_tshift = timeshift_create(st, timeshiftPeriod, tsch);
     normts = 1;
   }
 #endif
@@ -1511,6 +1915,7 @@ htsp_method_subscribe(htsp_connection_t *htsp, htsmsg_t *in)
   if (transcoding_enabled) {
     transcoder_props_t props;
 
+    memset(&props, 0, sizeof(props));
     props.tp_vcodec = streaming_component_txt2type(htsmsg_get_str(in, "videoCodec"));
     props.tp_acodec = streaming_component_txt2type(htsmsg_get_str(in, "audioCodec"));
     props.tp_scodec = streaming_component_txt2type(htsmsg_get_str(in, "subtitleCodec"));
@@ -1525,6 +1930,18 @@ htsp_method_subscribe(htsp_connection_t *htsp, htsmsg_t *in)
     if(props.tp_vcodec != SCT_UNKNOWN ||
        props.tp_acodec != SCT_UNKNOWN ||
        props.tp_scodec != SCT_UNKNOWN) {
+      if(st == &hs->hs_input) {
+        /* Live only, share the pipeline with the other viewers */
+        tvhdebug("htsp", "%s - subscribe to %s (shared transcoding)\n",
+                 htsp->htsp_logname, ch->ch_name ?: "");
+        transcoder_session_join(ch, &props, weight, st,
+                                &hs->hs_tsession, &hs->hs_s,
+                                htsp->htsp_logname,
+                                htsp->htsp_peername,
+                                htsp->htsp_username,
+                                htsp->htsp_clientname);
+        return NULL;
+      }
       st = hs->hs_transcoder = transcoder_create(st);
       transcoder_set_properties(st, &props);
       normts = 1;
@@ -1597,6 +2014,12 @@ htsp_method_change_weight(htsp_connection_t *htsp, htsmsg_t *in)
 
   htsp_reply(htsp, in, htsmsg_create_map());
 
+#if ENABLE_LIBAV
+  if(hs->hs_tsession) {
+    transcoder_session_weight(hs->hs_tsession, weight);
+    return NULL;
+  }
+#endif
   subscription_change_weight(hs->hs_s, weight);
   return NULL;
 }
@@ -1729,6 +2152,10 @@ htsp_method_filter_stream(htsp_connection_t *htsp, htsmsg_t *in)
         htsp_disable_stream(hs, f->hmf_s64);
     }
   }
+
+  pthread_mutex_lock(&htsp->htsp_out_mutex);
+  htsp_congestion_video(hs);
+  pthread_mutex_unlock(&htsp->htsp_out_mutex);
   return htsmsg_create_map();
 }
 
@@ -1983,7 +2410,7 @@ htsp_authenticate(htsp_connection_t *htsp, htsmsg_t *m)
     return;
 
   access = access_get_hashed(username, digest, htsp->htsp_challenge,
-			     (struct sockaddr *)htsp->htsp_peer, &match);
+			     (struct sockaddr *)&htsp->htsp_peer, &match);
 
   privgain = (access | htsp->htsp_granted_access) != htsp->htsp_granted_access;
     
@@ -1993,287 +2420,783 @@ htsp_authenticate(htsp_connection_t *htsp, htsmsg_t *m)
   htsp->htsp_granted_access |= access;
 }
 
+/* **************************************************************************
+ * Request pool
+ * *************************************************************************/
+
+static pthread_mutex_t htsp_pool_mutex;
+static pthread_cond_t  htsp_pool_cond;
+static TAILQ_HEAD(, htsp_connection) htsp_pool_queue;
+static pthread_t      *htsp_pool_threads;
+static int             htsp_pool_count;
+static int             htsp_pool_run;
+
+static void htsp_io_release(htsp_connection_t *htsp);
+static void htsp_io_resume(htsp_connection_t *htsp);
+
+static void htsp_pool_resume(htsp_connection_t *htsp);
+
 /**
- * timeout is in ms, 0 means infinite timeout
+ * Send the delayed access denied reply, then let the connection's next
+ * request run
  */
-static int
-htsp_read_message(htsp_connection_t *htsp, htsmsg_t **mp, int timeout)
+static void
+htsp_noaccess_send(void *aux)
 {
-  int v;
-  size_t len;
-  uint8_t data[4];
-  void *buf;
+  htsp_connection_t *htsp = aux;
 
-  v = timeout ? tcp_read_timeout(htsp->htsp_fd, data, 4, timeout) : 
-    tcp_read(htsp->htsp_fd, data, 4);
+  htsp_send_message(htsp, htsp->htsp_noaccess_reply, NULL);
+  htsp->htsp_noaccess_reply = NULL;
+  pthread_mutex_lock(&htsp_pool_mutex);
+  htsp_pool_resume(htsp);
+  pthread_mutex_unlock(&htsp_pool_mutex);
+}
 
-  if(v != 0)
-    return v;
+/**
+ * Process a request, returns 1 if the reply is delayed (the connection
+ * stays busy until it is sent)
+ */
+static int
+htsp_process_message(htsp_connection_t *htsp, htsmsg_t *m)
+{
+  htsmsg_t *reply;
+  const char *method;
+  uint32_t seq;
+  int i;
 
-  len = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
-  if(len > 1024 * 1024)
-    return EMSGSIZE;
-  if((buf = malloc(len)) == NULL)
-    return ENOMEM;
+  pthread_mutex_lock(&global_lock);
+  htsp_authenticate(htsp, m);
+
+  if((method = htsmsg_get_str(m, "method")) != NULL) {
+    tvhtrace("htsp", "%s - method %s", htsp->htsp_logname, method);
+    for(i = 0; i < NUM_METHODS; i++) {
+      if(!strcmp(method, htsp_methods[i].name)) {
+
+        if((htsp->htsp_granted_access & htsp_methods[i].privmask) != 
+           htsp_methods[i].privmask) {
+
+          /* Classic authentication failed delay, on a timer so that
+             the pool thread is not held */
+          reply = htsmsg_create_map();
+          htsmsg_add_u32(reply, "noaccess", 1);
+          if(!htsmsg_get_u32(m, "seq", &seq))
+            htsmsg_add_u32(reply, "seq", seq);
+          htsp->htsp_noaccess_reply = reply;
+          gtimer_arm_ms(&htsp->htsp_noaccess_timer, htsp_noaccess_send,
+                        htsp, 250);
+          pthread_mutex_unlock(&global_lock);
+          return 1;
+
+        } else {
+          reply = htsp_methods[i].fn(htsp, m);
+        }
+        break;
+      }
+    }
 
-  v = timeout ? tcp_read_timeout(htsp->htsp_fd, buf, len, timeout) : 
-    tcp_read(htsp->htsp_fd, buf, len);
-  
-  if(v != 0) {
-    free(buf);
-    return v;
+    if(i == NUM_METHODS) {
+      reply = htsp_error("Method not found");
+    }
+
+  } else {
+    reply = htsp_error("No 'method' argument");
   }
 
-  /* buf will be tied to the message.
-   * NB: If the message can not be deserialized buf will be free'd by the
-   * function.
-   */
-  *mp = htsmsg_binary_deserialize(buf, len, buf);
-  if(*mp == NULL)
-    return EBADMSG;
+  pthread_mutex_unlock(&global_lock);
 
+  if(reply != NULL) /* Methods can do all the replying inline */
+    htsp_reply(htsp, m, reply);
   return 0;
 }
 
 /**
- *
+ * Other end disconnected, clean up (the connection is freed by its
+ * I/O worker)
  */
-static int
-htsp_read_loop(htsp_connection_t *htsp)
+static void
+htsp_connection_close(htsp_connection_t *htsp)
 {
-  htsmsg_t *m = NULL, *reply;
-  int r, i;
-  const char *method;
+  htsp_subscription_t *s;
+  htsp_file_t *hf;
 
-  if(htsp_generate_challenge(htsp)) {
-    tvhlog(LOG_ERR, "htsp", "%s: Unable to generate challenge",
-	   htsp->htsp_logname);
-    return 1;
-  }
+  tvhlog(LOG_INFO, "htsp", "%s: Disconnected", htsp->htsp_logname);
 
   pthread_mutex_lock(&global_lock);
-  htsp->htsp_granted_access = 
-    access_get_by_addr((struct sockaddr *)htsp->htsp_peer);
-  pthread_mutex_unlock(&global_lock);
 
-  tvhlog(LOG_INFO, "htsp", "Got connection from %s", htsp->htsp_logname);
+  gtimer_disarm(&htsp->htsp_noaccess_timer);
+  if(htsp->htsp_noaccess_reply) {
+    htsmsg_destroy(htsp->htsp_noaccess_reply);
+    htsp->htsp_noaccess_reply = NULL;
+  }
 
-  /* Session main loop */
+  /* Beware! Closing subscriptions will invoke a lot of callbacks
+     down in the streaming code. So we do this as early as possible
+     to avoid any weird lockups */
+  while((s = LIST_FIRST(&htsp->htsp_subscriptions)) != NULL) {
+    htsp_subscription_destroy(htsp, s);
+  }
 
-  while(tvheadend_running) {
-readmsg:
-    if((r = htsp_read_message(htsp, &m, 0)) != 0)
-      return r;
+  if(htsp->htsp_async_mode)
+    LIST_REMOVE(htsp, htsp_async_link);
 
-    pthread_mutex_lock(&global_lock);
-    htsp_authenticate(htsp, m);
+  LIST_REMOVE(htsp, htsp_link);
+
+  while((hf = LIST_FIRST(&htsp->htsp_files)) != NULL)
+    htsp_file_destroy(hf);
+
+  tcp_server_release(htsp);
+
+  pthread_mutex_unlock(&global_lock);
+}
+
+/**
+ * Queue the connection for a pool thread (htsp_pool_mutex held)
+ */
+static void
+htsp_pool_schedule(htsp_connection_t *htsp)
+{
+  if(htsp->htsp_pool_queued || htsp->htsp_pool_busy)
+    return;
+  TAILQ_INSERT_TAIL(&htsp_pool_queue, htsp, htsp_pool_link);
+  htsp->htsp_pool_queued = 1;
+  pthread_cond_signal(&htsp_pool_cond);
+}
 
-    if((method = htsmsg_get_str(m, "method")) != NULL) {
-      tvhtrace("htsp", "%s - method %s", htsp->htsp_logname, method);
-      for(i = 0; i < NUM_METHODS; i++) {
-	      if(!strcmp(method, htsp_methods[i].name)) {
+/**
+ * Queue a request, returns 1 if the connection should stop reading
+ */
+static int
+htsp_pool_input(htsp_connection_t *htsp, htsmsg_t *m)
+{
+  htsp_msg_t *hm = calloc(1, sizeof(htsp_msg_t));
+  int full;
 
-	        if((htsp->htsp_granted_access & htsp_methods[i].privmask) != 
-	           htsp_methods[i].privmask) {
+  hm->hm_msg = m;
+  pthread_mutex_lock(&htsp_pool_mutex);
+  TAILQ_INSERT_TAIL(&htsp->htsp_in_q, hm, hm_link);
+  full = ++htsp->htsp_in_count >= HTSP_READ_QUEUE;
+  if(full)
+    htsp->htsp_in_full = 1;
+  htsp_pool_schedule(htsp);
+  pthread_mutex_unlock(&htsp_pool_mutex);
+  return full;
+}
 
-      	    pthread_mutex_unlock(&global_lock);
+static void
+htsp_pool_close(htsp_connection_t *htsp)
+{
+  pthread_mutex_lock(&htsp_pool_mutex);
+  htsp->htsp_closing = 1;
+  htsp_pool_schedule(htsp);
+  pthread_mutex_unlock(&htsp_pool_mutex);
+}
 
-	          /* Classic authentication failed delay */
-	          usleep(250000);
-	    
-	          reply = htsmsg_create_map();
-	          htsmsg_add_u32(reply, "noaccess", 1);
-	          htsp_reply(htsp, m, reply);
+/**
+ * Discard requests not yet run (htsp_pool_mutex held, or the pool
+ * stopped)
+ */
+static void
+htsp_pool_discard(htsp_connection_t *htsp)
+{
+  htsp_msg_t *hm;
 
-	          htsmsg_destroy(m);
-	          goto readmsg;
+  while((hm = TAILQ_FIRST(&htsp->htsp_in_q)) != NULL) {
+    TAILQ_REMOVE(&htsp->htsp_in_q, hm, hm_link);
+    htsp_msg_destroy(hm);
+  }
+  htsp->htsp_in_count = 0;
+}
 
-	        } else {
-	          reply = htsp_methods[i].fn(htsp, m);
-	        }
-	        break;
-	      }
-      }
+/**
+ * Request done, queue the connection again if there is more to do
+ * (htsp_pool_mutex held)
+ */
+static void
+htsp_pool_resume(htsp_connection_t *htsp)
+{
+  htsp->htsp_pool_busy = 0;
+  if(TAILQ_FIRST(&htsp->htsp_in_q) || htsp->htsp_closing)
+    htsp_pool_schedule(htsp);
+}
 
-      if(i == NUM_METHODS) {
-	      reply = htsp_error("Method not found");
-      }
+static void *
+htsp_pool_thread(void *aux)
+{
+  htsp_connection_t *htsp;
+  htsp_msg_t *hm;
+  int delayed;
 
-    } else {
-      reply = htsp_error("No 'method' argument");
+  pthread_mutex_lock(&htsp_pool_mutex);
+  while(htsp_pool_run) {
+
+    if((htsp = TAILQ_FIRST(&htsp_pool_queue)) == NULL) {
+      pthread_cond_wait(&htsp_pool_cond, &htsp_pool_mutex);
+      continue;
+    }
+    TAILQ_REMOVE(&htsp_pool_queue, htsp, htsp_pool_link);
+    htsp->htsp_pool_queued = 0;
+
+    /* Gone, nothing else will queue it again */
+    if(htsp->htsp_closing) {
+      htsp_pool_discard(htsp);
+      pthread_mutex_unlock(&htsp_pool_mutex);
+      htsp_connection_close(htsp);
+      htsp_io_release(htsp);
+      pthread_mutex_lock(&htsp_pool_mutex);
+      continue;
     }
 
-    pthread_mutex_unlock(&global_lock);
+    /* One request at a time, then back of the queue */
+    hm = TAILQ_FIRST(&htsp->htsp_in_q);
+    TAILQ_REMOVE(&htsp->htsp_in_q, hm, hm_link);
+    htsp->htsp_in_count--;
+    if(htsp->htsp_in_full && htsp->htsp_in_count <= HTSP_READ_QUEUE / 2) {
+      htsp->htsp_in_full = 0;
+      htsp_io_resume(htsp);
+    }
+    htsp->htsp_pool_busy = 1;
+    pthread_mutex_unlock(&htsp_pool_mutex);
 
-    if(reply != NULL) /* Methods can do all the replying inline */
-      htsp_reply(htsp, m, reply);
+    delayed = htsp_process_message(htsp, hm->hm_msg);
+    htsp_msg_destroy(hm);
 
-    htsmsg_destroy(m);
+    pthread_mutex_lock(&htsp_pool_mutex);
+    if(!delayed)
+      htsp_pool_resume(htsp);
   }
-  return 0;
+  pthread_mutex_unlock(&htsp_pool_mutex);
+  return NULL;
+}
+
+/* **************************************************************************
+ * I/O workers
+ * *************************************************************************/
+
+typedef struct htsp_io {
+  pthread_t        hio_thread;
+  tvhpoll_t       *hio_poll;
+  th_pipe_t        hio_pipe;
+  int              hio_run;
+
+  pthread_mutex_t  hio_mutex;
+  TAILQ_HEAD(, htsp_connection) hio_flush;    /* Output queued */
+  int              hio_flush_count;
+  TAILQ_HEAD(, htsp_connection) hio_release;  /* Closed, to be freed */
+  TAILQ_HEAD(, htsp_connection) hio_resume;   /* To read again */
+} htsp_io_t;
+
+static htsp_io_t *htsp_io;
+static int        htsp_io_count;
+static int        htsp_io_next;
+
+static void
+htsp_io_wakeup(htsp_io_t *hio)
+{
+  char c = 'W';
+  if (write(hio->hio_pipe.wr, &c, 1) < 0 && errno != EAGAIN)
+    tvhlog(LOG_ERR, "htsp", "failed to wake I/O worker [e=%s]",
+           strerror(errno));
+}
+
+static void
+htsp_io_poll(htsp_connection_t *htsp, int out)
+{
+  tvhpoll_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.fd       = htsp->htsp_fd;
+  ev.events   = (htsp->htsp_rd_paused ? 0 : TVHPOLL_IN) |
+                (out ? TVHPOLL_OUT : 0);
+  ev.data.ptr = htsp;
+  /* Removed first, so that dropping IN or OUT also works with kqueue */
+  if (htsp->htsp_io_events & ~ev.events)
+    tvhpoll_rem(htsp->htsp_io->hio_poll, &ev, 1);
+  tvhpoll_add(htsp->htsp_io->hio_poll, &ev, 1);
+  htsp->htsp_io_events  = ev.events;
+  htsp->htsp_wr_pollout = out;
 }
 
 /**
- *
+ * Output has been queued for a connection (htsp_out_mutex held)
  */
-static void *
-htsp_write_scheduler(void *aux)
+static void
+htsp_io_flush(htsp_connection_t *htsp)
 {
-  htsp_connection_t *htsp = aux;
+  htsp_io_t *hio = htsp->htsp_io;
+  int wake;
+
+  pthread_mutex_lock(&hio->hio_mutex);
+  wake = TAILQ_EMPTY(&hio->hio_flush);
+  if (!htsp->htsp_flush_queued) {
+    TAILQ_INSERT_TAIL(&hio->hio_flush, htsp, htsp_flush_link);
+    htsp->htsp_flush_queued = 1;
+    hio->hio_flush_count++;
+  }
+  pthread_mutex_unlock(&hio->hio_mutex);
+  if (wake)
+    htsp_io_wakeup(hio);
+}
+
+/**
+ * Connection is torn down, hand it back to its worker to be freed
+ */
+static void
+htsp_io_release(htsp_connection_t *htsp)
+{
+  htsp_io_t *hio = htsp->htsp_io;
+
+  pthread_mutex_lock(&hio->hio_mutex);
+  TAILQ_INSERT_TAIL(&hio->hio_release, htsp, htsp_release_link);
+  pthread_mutex_unlock(&hio->hio_mutex);
+  htsp_io_wakeup(hio);
+}
+
+/**
+ * The pool has caught up with a connection that stopped reading
+ * (htsp_pool_mutex held)
+ */
+static void
+htsp_io_resume(htsp_connection_t *htsp)
+{
+  htsp_io_t *hio = htsp->htsp_io;
+
+  pthread_mutex_lock(&hio->hio_mutex);
+  if (!htsp->htsp_resume_queued) {
+    TAILQ_INSERT_TAIL(&hio->hio_resume, htsp, htsp_resume_link);
+    htsp->htsp_resume_queued = 1;
+  }
+  pthread_mutex_unlock(&hio->hio_mutex);
+  htsp_io_wakeup(hio);
+}
+
+/**
+ * Stop all I/O on a connection and have the pool clean it up
+ */
+static void
+htsp_io_error(htsp_connection_t *htsp)
+{
+  tvhpoll_event_t ev;
+
+  if (htsp->htsp_io_dead)
+    return;
+  htsp->htsp_io_dead = 1;
+  memset(&ev, 0, sizeof(ev));
+  ev.fd = htsp->htsp_fd;
+  tvhpoll_rem(htsp->htsp_io->hio_poll, &ev, 1);
+  htsp_pool_close(htsp);
+}
+
+/**
+ * Take the next batch of messages off the output queues and serialize
+ * them, returns 0 when there was nothing left
+ */
+static int
+htsp_io_collect(htsp_connection_t *htsp)
+{
+  htsp_msg_t *hms[HTSP_WRITE_IOV];
   htsp_msg_q_t *hmq;
   htsp_msg_t *hm;
+  struct iovec *iov;
+  size_t dlen, batch = 0;
   void *dptr;
-  size_t dlen;
+  int i, n = 0, niov = 0, nscratch = 0;
 
   pthread_mutex_lock(&htsp->htsp_out_mutex);
-
-  while(tvheadend_running) {
-
-    if((hmq = TAILQ_FIRST(&htsp->htsp_active_output_queues)) == NULL) {
-      /* No active queues at all */
-      if(!htsp->htsp_writer_run)
-	      break; /* Should not run anymore, bail out */
-      
-      /* Nothing to be done, go to sleep */
-      pthread_cond_wait(&htsp->htsp_out_cond, &htsp->htsp_out_mutex);
-      continue;
-    }
+  while(niov + 2 <= HTSP_WRITE_IOV && batch < HTSP_WRITE_BATCH &&
+        (hmq = TAILQ_FIRST(&htsp->htsp_active_output_queues)) != NULL) {
 
     hm = TAILQ_FIRST(&hmq->hmq_q);
     TAILQ_REMOVE(&hmq->hmq_q, hm, hm_link);
     hmq->hmq_length--;
     hmq->hmq_payload -= hm->hm_payloadsize;
+    htsp_queue_delay_remove(hmq, hm);
+    if(hm->hm_msg == NULL && hmq->hmq_cc != NULL)
+      congestion_drain(hmq->hmq_cc, hm->hm_frametype, hm->hm_payloadsize);
 
     TAILQ_REMOVE(&htsp->htsp_active_output_queues, hmq, hmq_link);
     if(hmq->hmq_length) {
       /* Still messages to be sent, put back in active queues */
       if(hmq->hmq_strict_prio) {
-	      TAILQ_INSERT_HEAD(&htsp->htsp_active_output_queues, hmq, hmq_link);
+        TAILQ_INSERT_HEAD(&htsp->htsp_active_output_queues, hmq, hmq_link);
       } else {
         TAILQ_INSERT_TAIL(&htsp->htsp_active_output_queues, hmq, hmq_link);
       }
     }
+    batch += hm->hm_payloadsize + 64;
+    niov  += hm->hm_msg ? 1 : 2;
+    hms[n++] = hm;
+  }
+  if(n == 0)
+    htsp->htsp_wr_pending = 0;
+  pthread_mutex_unlock(&htsp->htsp_out_mutex);
 
-    pthread_mutex_unlock(&htsp->htsp_out_mutex);
-
-    if (htsmsg_binary_serialize(hm->hm_msg, &dptr, &dlen, INT32_MAX) != 0) {
+  htsp->htsp_wr_cnt = htsp->htsp_wr_idx = 0;
+  for(i = 0; i < n; i++) {
+    hm  = hms[i];
+    iov = &htsp->htsp_wr_iov[htsp->htsp_wr_cnt];
+
+    /* Packet header, then the payload straight from its buffer */
+    if(hm->hm_msg == NULL) {
+      dptr = htsp->htsp_wr_scratch[nscratch++];
+      iov[0].iov_base = dptr;
+      iov[0].iov_len  = htsp_muxpkt_header(hm, dptr);
+      iov[1].iov_base = (void *)pktbuf_ptr(hm->hm_pb);
+      iov[1].iov_len  = pktbuf_len(hm->hm_pb);
+      htsp->htsp_wr_data[htsp->htsp_wr_cnt]   = NULL;
+      htsp->htsp_wr_pb[htsp->htsp_wr_cnt]     = NULL;
+      htsp->htsp_wr_data[htsp->htsp_wr_cnt+1] = NULL;
+      htsp->htsp_wr_pb[htsp->htsp_wr_cnt+1]   = hm->hm_pb;
+      htsp->htsp_wr_cnt += 2;
+      hm->hm_pb = NULL;
+
+    } else if (htsmsg_binary_serialize(hm->hm_msg, &dptr, &dlen, INT32_MAX) != 0) {
       tvhlog(LOG_WARNING, "htsp", "%s: failed to serialize data",
              htsp->htsp_logname);
+    } else {
+      iov[0].iov_base = dptr;
+      iov[0].iov_len  = dlen;
+      htsp->htsp_wr_data[htsp->htsp_wr_cnt] = dptr;
+      htsp->htsp_wr_pb[htsp->htsp_wr_cnt]   = NULL;
+      htsp->htsp_wr_cnt++;
     }
-
     htsp_msg_destroy(hm);
+  }
+  return n;
+}
 
-    if (tvh_write(htsp->htsp_fd, dptr, dlen)) {
+static void
+htsp_io_write_done(htsp_connection_t *htsp)
+{
+  int i;
+
+  for(i = 0; i < htsp->htsp_wr_cnt; i++) {
+    free(htsp->htsp_wr_data[i]);
+    if(htsp->htsp_wr_pb[i])
+      pktbuf_ref_dec(htsp->htsp_wr_pb[i]);
+  }
+  htsp->htsp_wr_cnt = htsp->htsp_wr_idx = 0;
+}
+
+/**
+ * Write out as much as the socket takes, returns 1 if the budget ran
+ * out with more to send
+ */
+static int
+htsp_io_write(htsp_connection_t *htsp)
+{
+  struct iovec *iov;
+  ssize_t r;
+  int budget = HTSP_WRITE_BUDGET;
+
+  if(htsp->htsp_io_dead)
+    return 0;
+
+  while(budget > 0) {
+
+    if(htsp->htsp_wr_idx == htsp->htsp_wr_cnt) {
+      htsp_io_write_done(htsp);
+      if(!htsp_io_collect(htsp)) {
+        if(htsp->htsp_wr_pollout)
+          htsp_io_poll(htsp, 0);
+        return 0;
+      }
+      continue;
+    }
+
+    r = writev(htsp->htsp_fd, htsp->htsp_wr_iov + htsp->htsp_wr_idx,
+               MIN(htsp->htsp_wr_cnt - htsp->htsp_wr_idx, IOV_MAX));
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        if(!htsp->htsp_wr_pollout)
+          htsp_io_poll(htsp, 1);
+        return 0;
+      }
       tvhlog(LOG_INFO, "htsp", "%s: Write error -- %s",
              htsp->htsp_logname, strerror(errno));
+      htsp_io_error(htsp);
+      return 0;
+    }
+
+    budget -= r;
+    while(r > 0) {
+      iov = &htsp->htsp_wr_iov[htsp->htsp_wr_idx];
+      if(r < iov->iov_len) {
+        iov->iov_base  = (uint8_t *)iov->iov_base + r;
+        iov->iov_len  -= r;
+        break;
+      }
+      r -= iov->iov_len;
+      htsp->htsp_wr_idx++;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Pass the complete requests read so far to the pool, until it has too
+ * many queued
+ */
+static void
+htsp_io_parse(htsp_connection_t *htsp)
+{
+  uint8_t *p;
+  size_t len, need;
+  void *buf;
+  htsmsg_t *m;
+
+  p = htsp->htsp_rbuf;
+  while(!htsp->htsp_rd_paused &&
+        htsp->htsp_rbuf_len - (p - htsp->htsp_rbuf) >= 4) {
+    len = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    if(len > HTSP_MAX_MESSAGE) {
+      tvhlog(LOG_INFO, "htsp", "%s: Read error -- %s",
+             htsp->htsp_logname, strerror(EMSGSIZE));
+      htsp_io_error(htsp);
+      return;
+    }
+    need = 4 + len;
+    if(htsp->htsp_rbuf_len - (p - htsp->htsp_rbuf) < need) {
+      /* Make room for the rest of a large message */
+      if(need > htsp->htsp_rbuf_size - (p - htsp->htsp_rbuf)) {
+        htsp->htsp_rbuf_len -= p - htsp->htsp_rbuf;
+        memmove(htsp->htsp_rbuf, p, htsp->htsp_rbuf_len);
+        p = htsp->htsp_rbuf;
+        htsp->htsp_rbuf_size = need;
+        htsp->htsp_rbuf = realloc(htsp->htsp_rbuf, need);
+        return;
+      }
       break;
     }
 
-    free(dptr);
-    pthread_mutex_lock(&htsp->htsp_out_mutex);
+    /* buf will be tied to the message.
+     * NB: If the message can not be deserialized buf will be free'd by the
+     * function.
+     */
+    buf = malloc(MAX(len, 1));
+    memcpy(buf, p + 4, len);
+    p += need;
+    if((m = htsmsg_binary_deserialize(buf, len, buf)) == NULL) {
+      tvhlog(LOG_INFO, "htsp", "%s: Read error -- %s",
+             htsp->htsp_logname, strerror(EBADMSG));
+      htsp_io_error(htsp);
+      return;
+    }
+    if(htsp_pool_input(htsp, m)) {
+      tvhtrace("htsp", "%s - pool behind, stop reading", htsp->htsp_logname);
+      htsp->htsp_rd_paused = 1;
+      htsp_io_poll(htsp, htsp->htsp_wr_pollout);
+    }
   }
-  // Shutdown socket to make receive thread terminate entire HTSP connection
 
-  shutdown(htsp->htsp_fd, SHUT_RDWR);
-  pthread_mutex_unlock(&htsp->htsp_out_mutex);
-  return NULL;
+  htsp->htsp_rbuf_len -= p - htsp->htsp_rbuf;
+  if(htsp->htsp_rbuf_len) {
+    memmove(htsp->htsp_rbuf, p, htsp->htsp_rbuf_len);
+  } else if(htsp->htsp_rbuf_size > 4 * HTSP_READ_SIZE) {
+    /* Don't keep the room for a large request */
+    free(htsp->htsp_rbuf);
+    htsp->htsp_rbuf = NULL;
+    htsp->htsp_rbuf_size = 0;
+  }
 }
 
 /**
- *
+ * Read what is available and pass complete requests to the pool
  */
 static void
-htsp_serve(int fd, void **opaque, struct sockaddr_storage *source,
-	   struct sockaddr_storage *self)
+htsp_io_read(htsp_connection_t *htsp)
 {
-  htsp_connection_t htsp;
-  char buf[50];
-  htsp_subscription_t *s;
-  
-  // Note: global_lock held on entry
+  ssize_t r;
 
-  tcp_get_ip_str((struct sockaddr*)source, buf, 50);
+  if(htsp->htsp_rbuf_size - htsp->htsp_rbuf_len < HTSP_READ_SIZE) {
+    htsp->htsp_rbuf_size = htsp->htsp_rbuf_len + HTSP_READ_SIZE;
+    htsp->htsp_rbuf = realloc(htsp->htsp_rbuf, htsp->htsp_rbuf_size);
+  }
 
-  memset(&htsp, 0, sizeof(htsp_connection_t));
-  *opaque = &htsp;
+  r = read(htsp->htsp_fd, htsp->htsp_rbuf + htsp->htsp_rbuf_len,
+           htsp->htsp_rbuf_size - htsp->htsp_rbuf_len);
+  if(r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if(r <= 0) {
+    htsp_io_error(htsp);
+    return;
+  }
+  htsp->htsp_rbuf_len += r;
+  htsp_io_parse(htsp);
+}
 
-  TAILQ_INIT(&htsp.htsp_active_output_queues);
+/**
+ * Free a connection, its socket is gone from the poll set so no events
+ * can be pending for it (I/O worker only)
+ */
+static void
+htsp_io_free(htsp_connection_t *htsp)
+{
+  htsp_msg_q_t *hmq;
+  htsp_msg_t *hm;
 
-  htsp_init_queue(&htsp.htsp_hmq_ctrl, 0);
-  htsp_init_queue(&htsp.htsp_hmq_qstatus, 1);
-  htsp_init_queue(&htsp.htsp_hmq_epg, 0);
+  htsp_io_write_done(htsp);
+  while((hmq = TAILQ_FIRST(&htsp->htsp_active_output_queues)) != NULL) {
+    TAILQ_REMOVE(&htsp->htsp_active_output_queues, hmq, hmq_link);
+    while((hm = TAILQ_FIRST(&hmq->hmq_q)) != NULL) {
+      TAILQ_REMOVE(&hmq->hmq_q, hm, hm_link);
+      htsp_msg_destroy(hm);
+    }
+  }
 
-  htsp.htsp_peername = strdup(buf);
-  htsp_update_logname(&htsp);
+  close(htsp->htsp_fd);
+  pthread_mutex_destroy(&htsp->htsp_out_mutex);
+  free(htsp->htsp_rbuf);
+  free(htsp->htsp_logname);
+  free(htsp->htsp_peername);
+  free(htsp->htsp_username);
+  free(htsp->htsp_clientname);
+  free(htsp->htsp_language);
+  free(htsp);
+}
 
-  htsp.htsp_fd = fd;
-  htsp.htsp_peer = source;
-  htsp.htsp_writer_run = 1;
+static void *
+htsp_io_thread(void *aux)
+{
+  htsp_io_t *hio = aux;
+  htsp_connection_t *htsp;
+  tvhpoll_event_t ev[64];
+  int i, n, again = 0;
+  char c[64];
 
-  LIST_INSERT_HEAD(&htsp_connections, &htsp, htsp_link);
-  pthread_mutex_unlock(&global_lock);
+  while(hio->hio_run) {
 
-  tvhthread_create(&htsp.htsp_writer_thread, NULL,
-                   htsp_write_scheduler, &htsp, 0);
+    n = tvhpoll_wait(hio->hio_poll, ev, 64, again ? 0 : -1);
+    if(n < 0) {
+      if(errno != EINTR)
+        tvhlog(LOG_ERR, "htsp", "poll failed [e=%s]", strerror(errno));
+      n = 0;
+    }
 
-  /**
-   * Reader loop
-   */
+    for(i = 0; i < n; i++) {
+      if(ev[i].data.ptr == &hio->hio_pipe) {
+        while(read(hio->hio_pipe.rd, c, sizeof(c)) > 0);
+        continue;
+      }
+      htsp = ev[i].data.ptr;
+      if(htsp->htsp_io_dead)
+        continue;
+      if(htsp->htsp_rd_paused && (ev[i].events & (TVHPOLL_ERR | TVHPOLL_HUP))) {
+        htsp_io_error(htsp);
+        continue;
+      }
+      if(ev[i].events & (TVHPOLL_IN | TVHPOLL_ERR | TVHPOLL_HUP))
+        htsp_io_read(htsp);
+      if((ev[i].events & TVHPOLL_OUT) && htsp_io_write(htsp)) {
+        pthread_mutex_lock(&hio->hio_mutex);
+        if(!htsp->htsp_flush_queued) {
+          TAILQ_INSERT_TAIL(&hio->hio_flush, htsp, htsp_flush_link);
+          htsp->htsp_flush_queued = 1;
+          hio->hio_flush_count++;
+        }
+        pthread_mutex_unlock(&hio->hio_mutex);
+      }
+    }
 
-  htsp_read_loop(&htsp);
+    /* Output, each connection queued so far gets one turn */
+    pthread_mutex_lock(&hio->hio_mutex);
+    for(n = hio->hio_flush_count; n > 0; n--) {
+      htsp = TAILQ_FIRST(&hio->hio_flush);
+      TAILQ_REMOVE(&hio->hio_flush, htsp, htsp_flush_link);
+      htsp->htsp_flush_queued = 0;
+      hio->hio_flush_count--;
+      pthread_mutex_unlock(&hio->hio_mutex);
+      i = htsp_io_write(htsp);
+      pthread_mutex_lock(&hio->hio_mutex);
+      if(i && !htsp->htsp_flush_queued) {
+        TAILQ_INSERT_TAIL(&hio->hio_flush, htsp, htsp_flush_link);
+        htsp->htsp_flush_queued = 1;
+        hio->hio_flush_count++;
+      }
+    }
+    again = hio->hio_flush_count > 0;
+
+    /* Input, the pool has caught up (requests may be buffered already) */
+    while((htsp = TAILQ_FIRST(&hio->hio_resume)) != NULL) {
+      TAILQ_REMOVE(&hio->hio_resume, htsp, htsp_resume_link);
+      htsp->htsp_resume_queued = 0;
+      pthread_mutex_unlock(&hio->hio_mutex);
+      if(!htsp->htsp_io_dead && htsp->htsp_rd_paused) {
+        htsp->htsp_rd_paused = 0;
+        htsp_io_poll(htsp, htsp->htsp_wr_pollout);
+        htsp_io_parse(htsp);
+      }
+      pthread_mutex_lock(&hio->hio_mutex);
+    }
 
-  tvhlog(LOG_INFO, "htsp", "%s: Disconnected", htsp.htsp_logname);
+    /* Release, after the events above so none refer to these */
+    while((htsp = TAILQ_FIRST(&hio->hio_release)) != NULL) {
+      TAILQ_REMOVE(&hio->hio_release, htsp, htsp_release_link);
+      if(htsp->htsp_flush_queued) {
+        TAILQ_REMOVE(&hio->hio_flush, htsp, htsp_flush_link);
+        hio->hio_flush_count--;
+      }
+      if(htsp->htsp_resume_queued)
+        TAILQ_REMOVE(&hio->hio_resume, htsp, htsp_resume_link);
+      pthread_mutex_unlock(&hio->hio_mutex);
+      htsp_io_free(htsp);
+      pthread_mutex_lock(&hio->hio_mutex);
+    }
+    pthread_mutex_unlock(&hio->hio_mutex);
+  }
+  return NULL;
+}
 
-  /**
-   * Ok, we're back, other end disconnected. Clean up stuff.
-   */
+/**
+ *
+ */
+static void
+htsp_serve(int fd, void **opaque, struct sockaddr_storage *source,
+	   struct sockaddr_storage *self)
+{
+  htsp_connection_t *htsp;
+  char buf[50];
 
-  pthread_mutex_lock(&global_lock);
+  // Note: global_lock held, called from the accept thread
 
-  /* Beware! Closing subscriptions will invoke a lot of callbacks
-     down in the streaming code. So we do this as early as possible
-     to avoid any weird lockups */
-  while((s = LIST_FIRST(&htsp.htsp_subscriptions)) != NULL) {
-    htsp_subscription_destroy(&htsp, s);
-  }
+  tcp_get_ip_str((struct sockaddr*)source, buf, 50);
 
-  if(htsp.htsp_async_mode)
-    LIST_REMOVE(&htsp, htsp_async_link);
+  htsp = calloc(1, sizeof(htsp_connection_t));
+  *opaque = htsp;
 
-  LIST_REMOVE(&htsp, htsp_link);
+  TAILQ_INIT(&htsp->htsp_active_output_queues);
+  TAILQ_INIT(&htsp->htsp_in_q);
+  pthread_mutex_init(&htsp->htsp_out_mutex, NULL);
 
-  pthread_mutex_unlock(&global_lock);
+  htsp_init_queue(&htsp->htsp_hmq_ctrl, 0);
+  htsp_init_queue(&htsp->htsp_hmq_qstatus, 1);
+  htsp_init_queue(&htsp->htsp_hmq_epg, 0);
 
-  pthread_mutex_lock(&htsp.htsp_out_mutex);
-  htsp.htsp_writer_run = 0;
-  pthread_cond_signal(&htsp.htsp_out_cond);
-  pthread_mutex_unlock(&htsp.htsp_out_mutex);
+  htsp->htsp_peername = strdup(buf);
+  htsp_update_logname(htsp);
 
-  pthread_join(htsp.htsp_writer_thread, NULL);
+  htsp->htsp_fd = fd;
+  htsp->htsp_peer = *source;
+  htsp->htsp_io = &htsp_io[htsp_io_next++ % htsp_io_count];
 
-  htsp_msg_q_t *hmq;
+  LIST_INSERT_HEAD(&htsp_connections, htsp, htsp_link);
 
-  TAILQ_FOREACH(hmq, &htsp.htsp_active_output_queues, hmq_link) {
-    htsp_msg_t *hm;
-    while((hm = TAILQ_FIRST(&hmq->hmq_q)) != NULL) {
-      TAILQ_REMOVE(&hmq->hmq_q, hm, hm_link);
-      htsp_msg_destroy(hm);
-    }
+  if(htsp_generate_challenge(htsp)) {
+    tvhlog(LOG_ERR, "htsp", "%s: Unable to generate challenge",
+	   htsp->htsp_logname);
+    htsp->htsp_io_dead = 1;
+    htsp_pool_close(htsp);
+    return;
   }
 
-  htsp_file_t *hf;
-  while((hf = LIST_FIRST(&htsp.htsp_files)) != NULL)
-    htsp_file_destroy(hf);
+  htsp->htsp_granted_access = 
+    access_get_by_addr((struct sockaddr *)&htsp->htsp_peer);
 
-  close(fd);
-  
-  /* Free memory (leave lock in place, for parent method) */
-  pthread_mutex_lock(&global_lock);
-  free(htsp.htsp_logname);
-  free(htsp.htsp_peername);
-  free(htsp.htsp_username);
-  free(htsp.htsp_clientname);
-  *opaque = NULL;
+  tvhlog(LOG_INFO, "htsp", "Got connection from %s", htsp->htsp_logname);
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  htsp_io_poll(htsp, 0);
 }
 
 /*
@@ -2300,15 +3223,50 @@ htsp_server_cancel ( void *opaque )
  *  Fire up HTSP server
  */
 void
-htsp_init(const char *bindaddr)
+htsp_init(const char *bindaddr, int io_threads, int pool_threads)
 {
   extern int tvheadend_htsp_port_extra;
   static tcp_server_ops_t ops = {
     .start  = htsp_serve,
     .stop   = NULL,
     .status = htsp_server_status,
-    .cancel = htsp_server_cancel
+    .cancel = htsp_server_cancel,
+    .detach = 1
   };
+  tvhpoll_event_t ev;
+  htsp_io_t *hio;
+  int i;
+
+  pthread_mutex_init(&htsp_pool_mutex, NULL);
+  pthread_cond_init(&htsp_pool_cond, NULL);
+  TAILQ_INIT(&htsp_pool_queue);
+  htsp_pool_run = 1;
+  htsp_pool_count   = MIN(MAX(pool_threads, 1), HTSP_THREADS_MAX);
+  htsp_pool_threads = calloc(htsp_pool_count, sizeof(pthread_t));
+  for (i = 0; i < htsp_pool_count; i++)
+    tvhthread_create(&htsp_pool_threads[i], NULL, htsp_pool_thread, NULL, 0);
+
+  htsp_io_count = MIN(MAX(io_threads, 1), HTSP_THREADS_MAX);
+  htsp_io       = calloc(htsp_io_count, sizeof(htsp_io_t));
+  for (i = 0; i < htsp_io_count; i++) {
+    hio = &htsp_io[i];
+    pthread_mutex_init(&hio->hio_mutex, NULL);
+    TAILQ_INIT(&hio->hio_flush);
+    TAILQ_INIT(&hio->hio_release);
+    TAILQ_INIT(&hio->hio_resume);
+    tvh_pipe(O_NONBLOCK, &hio->hio_pipe);
+    hio->hio_poll = tvhpoll_create(256);
+    memset(&ev, 0, sizeof(ev));
+    ev.fd       = hio->hio_pipe.rd;
+    ev.events   = TVHPOLL_IN;
+    ev.data.ptr = &hio->hio_pipe;
+    tvhpoll_add(hio->hio_poll, &ev, 1);
+    hio->hio_run = 1;
+    tvhthread_create(&hio->hio_thread, NULL, htsp_io_thread, hio, 0);
+  }
+  tvhdebug("htsp", "using %d I/O and %d request thread(s)",
+           htsp_io_count, htsp_pool_count);
+
   htsp_server = tcp_server_create(bindaddr, tvheadend_htsp_port, &ops, NULL);
   if(tvheadend_htsp_port_extra)
     htsp_server_2 = tcp_server_create(bindaddr, tvheadend_htsp_port_extra, &ops, NULL);
@@ -2320,10 +3278,56 @@ htsp_init(const char *bindaddr)
 void
 htsp_done(void)
 {
+  htsp_connection_t *htsp;
+  htsp_io_t *hio;
+  int i;
+
   if (htsp_server_2)
     tcp_server_delete(htsp_server_2);
   if (htsp_server)
     tcp_server_delete(htsp_server);
+
+  /* Stop the workers */
+  pthread_mutex_lock(&htsp_pool_mutex);
+  htsp_pool_run = 0;
+  pthread_cond_broadcast(&htsp_pool_cond);
+  pthread_mutex_unlock(&htsp_pool_mutex);
+  for (i = 0; i < htsp_pool_count; i++)
+    pthread_join(htsp_pool_threads[i], NULL);
+  free(htsp_pool_threads);
+
+  for (i = 0; i < htsp_io_count; i++) {
+    hio = &htsp_io[i];
+    hio->hio_run = 0;
+    htsp_io_wakeup(hio);
+    pthread_join(hio->hio_thread, NULL);
+  }
+
+  /* Close what is left */
+  for (i = 0; i < htsp_io_count; i++) {
+    hio = &htsp_io[i];
+    while((htsp = TAILQ_FIRST(&hio->hio_release)) != NULL) {
+      TAILQ_REMOVE(&hio->hio_release, htsp, htsp_release_link);
+      htsp_io_free(htsp);
+    }
+  }
+  while (1) {
+    pthread_mutex_lock(&global_lock);
+    htsp = LIST_FIRST(&htsp_connections);
+    pthread_mutex_unlock(&global_lock);
+    if (htsp == NULL)
+      break;
+    htsp_pool_discard(htsp);
+    htsp_connection_close(htsp);
+    htsp_io_free(htsp);
+  }
+
+  for (i = 0; i < htsp_io_count; i++) {
+    hio = &htsp_io[i];
+    tvhpoll_destroy(hio->hio_poll);
+    tvh_pipe_close(&hio->hio_pipe);
+  }
+  free(htsp_io);
 }
 
 /* **************************************************************************
@@ -2544,71 +3548,51 @@ htsp_event_delete(epg_broadcast_t *ebc)
   _htsp_event_update(ebc, NULL, m);
 }
 
-const static char frametypearray[PKT_NTYPES] = {
-  [PKT_I_FRAME] = 'I',
-  [PKT_P_FRAME] = 'P',
-  [PKT_B_FRAME] = 'B',
-};
-
 /**
  * Build a htsmsg from a th_pkt and enqueue it on our HTSP service
  */
 static void
 htsp_stream_deliver(htsp_subscription_t *hs, th_pkt_t *pkt)
 {
-  htsmsg_t *m;
+  htsmsg_t *m, *l, *e;
   htsp_msg_t *hm;
   htsp_connection_t *htsp = hs->hs_htsp;
-  int64_t ts;
-  int qlen = hs->hs_q.hmq_payload;
+  int i;
 
   if(!htsp_is_stream_enabled(hs, pkt->pkt_componentindex)) {
     pkt_ref_dec(pkt);
     return;
   }
 
-  if((qlen > hs->hs_queue_depth     && pkt->pkt_frametype == PKT_B_FRAME) ||
-     (qlen > hs->hs_queue_depth * 2 && pkt->pkt_frametype == PKT_P_FRAME) || 
-     (qlen > hs->hs_queue_depth * 3)) {
-
-    hs->hs_dropstats[pkt->pkt_frametype]++;
-
-    /* Queue size protection */
-    pkt_ref_dec(pkt);
-    return;
-  }
-
-  m = htsmsg_create_map();
- 
-  htsmsg_add_str(m, "method", "muxpkt");
-  htsmsg_add_u32(m, "subscriptionId", hs->hs_sid);
-  htsmsg_add_u32(m, "frametype", frametypearray[pkt->pkt_frametype]);
+  /**
+   * No message is built, the writer encodes the header and sends the
+   * payload from the packet buffer (see htsp_muxpkt_header)
+   */
+  hm = malloc(sizeof(htsp_msg_t));
+  hm->hm_msg       = NULL;
+  hm->hm_sid       = hs->hs_sid;
+  hm->hm_frametype = pkt->pkt_frametype;
+  hm->hm_stream    = pkt->pkt_componentindex;
+  hm->hm_com       = pkt->pkt_commercial;
+  hm->hm_pts       = PTS_UNSET;
+  hm->hm_dts       = PTS_UNSET;
 
-  htsmsg_add_u32(m, "stream", pkt->pkt_componentindex);
-  htsmsg_add_u32(m, "com", pkt->pkt_commercial);
+  if(pkt->pkt_pts != PTS_UNSET)
+    hm->hm_pts = hs->hs_90khz ? pkt->pkt_pts : ts_rescale(pkt->pkt_pts, 1000000);
 
-  if(pkt->pkt_pts != PTS_UNSET) {
-    int64_t pts = hs->hs_90khz ? pkt->pkt_pts : ts_rescale(pkt->pkt_pts, 1000000);
-    htsmsg_add_s64(m, "pts", pts);
-  }
+  if(pkt->pkt_dts != PTS_UNSET)
+    hm->hm_dts = hs->hs_90khz ? pkt->pkt_dts : ts_rescale(pkt->pkt_dts, 1000000);
 
-  if(pkt->pkt_dts != PTS_UNSET) {
-    int64_t dts = hs->hs_90khz ? pkt->pkt_dts : ts_rescale(pkt->pkt_dts, 1000000);
-    htsmsg_add_s64(m, "dts", dts);
-  }
+  hm->hm_duration = hs->hs_90khz ? pkt->pkt_duration : ts_rescale(pkt->pkt_duration, 1000000);
 
-  uint32_t dur = hs->hs_90khz ? pkt->pkt_duration : ts_rescale(pkt->pkt_duration, 1000000);
-  htsmsg_add_u32(m, "duration", dur);
-  
   pkt = pkt_merge_header(pkt);
 
-  /**
-   * Since we will serialize directly we use 'binptr' which is a binary
-   * object that just points to data, thus avoiding a copy.
-   */
-  htsmsg_add_binptr(m, "payload", pktbuf_ptr(pkt->pkt_payload),
-		    pktbuf_len(pkt->pkt_payload));
-  htsp_send(htsp, m, pkt->pkt_payload, &hs->hs_q, pktbuf_len(pkt->pkt_payload));
+  hm->hm_pb = pkt->pkt_payload;
+  pktbuf_ref_inc(hm->hm_pb);
+  hm->hm_payloadsize = pktbuf_len(pkt->pkt_payload);
+
+  /* Queue size protection, may drop this packet or older ones */
+  htsp_enqueue(htsp, hm, &hs->hs_q);
   atomic_add(&hs->hs_s->ths_bytes_out, pktbuf_len(pkt->pkt_payload));
 
   if(hs->hs_last_report != dispatch_clock) {
@@ -2624,39 +3608,44 @@ htsp_stream_deliver(htsp_subscription_t *hs, th_pkt_t *pkt)
     htsmsg_add_u32(m, "bytes", hs->hs_q.hmq_payload);
 
     /**
-     * Figure out real time queue delay 
+     * Real time queue delay, overall and per stream
      */
     
     pthread_mutex_lock(&htsp->htsp_out_mutex);
 
-    int64_t min_dts = PTS_UNSET;
-    int64_t max_dts = PTS_UNSET;
-    TAILQ_FOREACH(hm, &hs->hs_q.hmq_q, hm_link) {
-      if(!hm->hm_msg)
-	continue;
-      if(htsmsg_get_s64(hm->hm_msg, "dts", &ts))
-	continue;
-      if(ts == PTS_UNSET)
-	continue;
-  
-      if(min_dts == PTS_UNSET)
-	min_dts = ts;
-      else
-	min_dts = MIN(ts, min_dts);
-
-      if(max_dts == PTS_UNSET)
-	max_dts = ts;
-      else
-	max_dts = MAX(ts, max_dts);
+    htsmsg_add_s64(m, "delay", htsp_delay_get(&hs->hs_q.hmq_delay));
+
+    l = htsmsg_create_list();
+    for(i = 0; i < hs->hs_q.hmq_nsdelay; i++) {
+      if(!hs->hs_q.hmq_sdelay[i].hd_packets)
+        continue;
+      e = htsmsg_create_map();
+      htsmsg_add_u32(e, "index", i);
+      htsmsg_add_u32(e, "packets", hs->hs_q.hmq_sdelay[i].hd_packets);
+      htsmsg_add_s64(e, "delay", htsp_delay_get(&hs->hs_q.hmq_sdelay[i]));
+      htsmsg_add_msg(l, NULL, e);
     }
 
-    htsmsg_add_s64(m, "delay", max_dts - min_dts);
+    htsmsg_add_u32(m, "Bdrops", hs->hs_cc.cc_drops[PKT_B_FRAME]);
+    htsmsg_add_u32(m, "Pdrops", hs->hs_cc.cc_drops[PKT_P_FRAME]);
+    htsmsg_add_u32(m, "Idrops", hs->hs_cc.cc_drops[PKT_I_FRAME]);
 
     pthread_mutex_unlock(&htsp->htsp_out_mutex);
 
-    htsmsg_add_u32(m, "Bdrops", hs->hs_dropstats[PKT_B_FRAME]);
-    htsmsg_add_u32(m, "Pdrops", hs->hs_dropstats[PKT_P_FRAME]);
-    htsmsg_add_u32(m, "Idrops", hs->hs_dropstats[PKT_I_FRAME]);
+#if ENABLE_LIBAV
+    streaming_target_t *tr = hs->hs_tsession ?
+      transcoder_session_transcoder(hs->hs_tsession) : hs->hs_transcoder;
+    if(tr) {
+      transcoder_stats_t ts;
+      transcoder_get_stats(tr, &ts);
+      htsmsg_add_u32(m, "transcodeFps", ts.tst_fps);
+      htsmsg_add_u32(m, "transcodeBytes", ts.tst_queue);
+      htsmsg_add_s64(m, "transcodeLatency", ts.tst_latency);
+      htsmsg_add_u32(m, "transcodeDrops", ts.tst_drops);
+    }
+#endif
+
+    htsmsg_add_msg(m, "streams", l);
 
     /* We use a special queue for queue status message so they're not
        blocked by anything else */
@@ -2680,6 +3669,16 @@ htsp_subscription_start(htsp_subscription_t *hs, const streaming_start_t *ss)
   const source_info_t *si = &ss->ss_si;
   tvhdebug("htsp", "%s - subscription start", hs->hs_htsp->htsp_logname);
 
+  pthread_mutex_lock(&hs->hs_htsp->htsp_out_mutex);
+  memset(hs->hs_video_streams, 0, sizeof(hs->hs_video_streams));
+  for(i = 0; i < ss->ss_num_components; i++) {
+    unsigned int id = ss->ss_components[i].ssc_index;
+    if(SCT_ISVIDEO(ss->ss_components[i].ssc_type) && id < NUM_FILTERED_STREAMS)
+      hs->hs_video_streams[id / 32] |= 1 << (id & 31);
+  }
+  htsp_congestion_video(hs);
+  pthread_mutex_unlock(&hs->hs_htsp->htsp_out_mutex);
+
   for(i = 0; i < ss->ss_num_components; i++) {
     const streaming_start_component_t *ssc = &ss->ss_components[i];
 
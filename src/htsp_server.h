@@ -22,7 +22,11 @@
 #include "epg.h"
 #include "dvr/dvr.h"
 
-void htsp_init(const char *bindaddr);
+#define HTSP_IO_THREADS     2   // default event loop workers
+#define HTSP_POOL_THREADS   4   // default request workers
+#define HTSP_THREADS_MAX    64
+
+void htsp_init(const char *bindaddr, int io_threads, int pool_threads);
 void htsp_done(void);
 
 void htsp_channel_update_nownext(channel_t *ch);
@@ -86,6 +86,16 @@ tvh_input_stream_create_msg
   htsmsg_add_u32(m, "bps", st->stats.bps);
   htsmsg_add_u32(m, "te", st->stats.te);
   htsmsg_add_u32(m, "cc", st->stats.cc);
+  htsmsg_add_u32(m, "fill", st->stats.fill);
+  htsmsg_add_u32(m, "overrun", st->stats.overrun);
+  htsmsg_add_u32(m, "backlog", st->stats.backlog);
+  htsmsg_add_u32(m, "drop", st->stats.drop);
+  htsmsg_add_u32(m, "loss", st->stats.loss);
+  htsmsg_add_u32(m, "dup", st->stats.dup);
+  htsmsg_add_u32(m, "reorder", st->stats.reorder);
+  htsmsg_add_u32(m, "fec_rec", st->stats.fec_rec);
+  htsmsg_add_u32(m, "fec_unrec", st->stats.fec_unrec);
+  htsmsg_add_u32(m, "fec_pkts", st->stats.fec_pkts);
   return m;
 }
 
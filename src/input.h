@@ -46,6 +46,16 @@ struct tvh_input_stream_stats
   int bps;    ///< Bandwidth (bps)
   int cc;     ///< Continuity errors
   int te;     ///< Transport errors
+  int fill;   ///< Input queue fill level (%)
+  int overrun;///< Input queue overruns
+  int backlog;///< Table queue backlog (TS packets)
+  int drop;   ///< Input drops (e.g. socket receive queue overflow)
+  int loss;   ///< Lost packets (sequence gaps, e.g. RTP)
+  int dup;    ///< Duplicate packets
+  int reorder;///< Packets received out of order
+  int fec_rec;  ///< Packets recovered by FEC
+  int fec_unrec;///< Packets lost despite FEC
+  int fec_pkts; ///< FEC packets received (overhead)
 };
 
 struct tvh_input_stream {
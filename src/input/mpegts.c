@@ -17,15 +17,20 @@
  */
 
 #include "input.h"
+#include "mpegts/tsdemux.h"
 
 void
-mpegts_init ( int linuxdvb_mask, str_list_t *tsfiles, int tstuners )
+mpegts_init ( int linuxdvb_mask, str_list_t *tsfiles, int tstuners,
+              int iptv_threads )
 {
   /* Register classes (avoid API 400 errors due to not yet defined) */
   idclass_register(&mpegts_network_class);
   idclass_register(&mpegts_mux_class);
   idclass_register(&mpegts_service_class);
 
+  /* TS sync search */
+  ts_sync_init();
+
   /* Setup DVB networks */
 #if ENABLE_MPEGTS_DVB
   dvb_network_init();
@@ -43,7 +48,7 @@ mpegts_init ( int linuxdvb_mask, str_list_t *tsfiles, int tstuners )
 
   /* IPTV */
 #if ENABLE_IPTV
-  iptv_init();
+  iptv_init(iptv_threads);
 #endif
 
   /* Linux DVB */
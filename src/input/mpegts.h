@@ -25,6 +25,7 @@
 #endif
 
 #include "input.h"
+#include "packet.h"
 #include "service.h"
 #include "mpegts/dvb.h"
 #include "subscriptions.h"
@@ -34,6 +35,8 @@
 #define MPEGTS_PSI_SECTION_SIZE 5000
 #define MPEGTS_FULLMUX_PID      0x2000
 #define MPEGTS_PID_NONE         0xFFFF
+#define MPEGTS_TABLE_HASH       64 // must be a power of 2
+#define MPEGTS_TABLE_FEED_PKTS  64
 
 /* Types */
 typedef struct mpegts_table         mpegts_table_t;
@@ -46,7 +49,7 @@ typedef struct mpegts_mux_sub       mpegts_mux_sub_t;
 typedef struct mpegts_input         mpegts_input_t;
 typedef struct mpegts_table_feed    mpegts_table_feed_t;
 typedef struct mpegts_network_link  mpegts_network_link_t;
-typedef struct mpegts_packet        mpegts_packet_t;
+typedef struct mpegts_ring          mpegts_ring_t;
 typedef struct mpegts_buffer        mpegts_buffer_t;
 
 /* Lists */
@@ -68,19 +71,45 @@ extern const idclass_t mpegts_input_class;
  * Setup / Tear down
  * *************************************************************************/
 
-void mpegts_init ( int linuxdvb_mask, str_list_t *tsfiles, int tstuners );
+void mpegts_init ( int linuxdvb_mask, str_list_t *tsfiles, int tstuners,
+                   int iptv_threads );
 void mpegts_done ( void );
 
 /* **************************************************************************
  * Data / SI processing
  * *************************************************************************/
 
-struct mpegts_packet
+/*
+ * Input ring
+ *
+ * Producer (the input's receive thread(s)) / single consumer
+ * (mpegts_input_thread) ring of 188 byte TS slots. Head and tail are
+ * free running counters, only the producer writes mr_head and only
+ * the consumer writes mr_tail. Producers serialise on mr_put_lock,
+ * which is only ever contended for inputs with several receive
+ * threads (IPTV), the consumer side is lock free.
+ *
+ * The slots are split into refcounted segments so that raw mux output
+ * can be delivered as slices of the ring (no copy). A segment that is
+ * still referenced downstream when the producer comes back round to it
+ * is replaced rather than overwritten. One segment of space is always
+ * kept free, so the producer never enters a segment the consumer has
+ * not completely finished with.
+ */
+#define MPEGTS_RING_SLOTS     (1 << 14) // must be a power of 2
+#define MPEGTS_RING_SEG_SLOTS (1 << 8)  // must be a power of 2
+#define MPEGTS_RING_SEGS      (MPEGTS_RING_SLOTS / MPEGTS_RING_SEG_SLOTS)
+
+struct mpegts_ring
 {
-  TAILQ_ENTRY(mpegts_packet)  mp_link;
-  size_t                      mp_len;
-  mpegts_mux_t               *mp_mux;
-  uint8_t                     mp_data[0];
+  pktbuf_t         **mr_seg;     ///< MPEGTS_RING_SEGS segments of data
+  mpegts_mux_t     **mr_mux;     ///< Owning mux per slot
+  volatile uint32_t  mr_head;    ///< Next slot to write
+  volatile uint32_t  mr_tail;    ///< Next slot to read
+  volatile int       mr_waiting; ///< Consumer is asleep
+  volatile int       mr_overrun; ///< Number of batches truncated (full)
+  volatile int       mr_dropped; ///< Number of TS packets dropped
+  pthread_mutex_t    mr_put_lock;///< Serialises producers
 };
 
 typedef int (*mpegts_table_callback_t)
@@ -130,6 +159,11 @@ typedef struct mpegts_pid
   int8_t                   mp_cc;
   RB_HEAD(,mpegts_pid_sub) mp_subs; // subscribers to pid
   RB_ENTRY(mpegts_pid)     mp_link;
+
+  /* Precomputed delivery info (see mpegts_input_update_pid) */
+  int                      mp_type;        // union of MPS_* subs
+  mpegts_service_t       **mp_svcs;        // services to feed
+  int                      mp_svcs_count;
 } mpegts_pid_t;
 
 struct mpegts_table
@@ -158,6 +192,7 @@ struct mpegts_table
    */
 
   LIST_ENTRY(mpegts_table) mt_link;
+  LIST_ENTRY(mpegts_table) mt_pid_link; // mm_table_hash linkage
   mpegts_mux_t *mt_mux;
 
   char *mt_name;
@@ -197,12 +232,16 @@ struct mpegts_table
  * When in raw mode we need to enqueue raw TS packet
  * to a different thread because we need to hold
  * global_lock when doing delivery of the tables
+ *
+ * Packets are aggregated into (pooled) chunks of up to
+ * MPEGTS_TABLE_FEED_PKTS packets for the same mux
  */
 
 struct mpegts_table_feed {
   TAILQ_ENTRY(mpegts_table_feed) mtf_link;
-  uint8_t mtf_tsb[188];
   mpegts_mux_t *mtf_mux;
+  int           mtf_len;
+  uint8_t       mtf_tsb[MPEGTS_TABLE_FEED_PKTS * 188];
 };
 
 /*
@@ -322,11 +361,11 @@ struct mpegts_mux
    */
 
   RB_HEAD(, mpegts_pid)       mm_pids;
-  int                         mm_last_pid;
-  mpegts_pid_t               *mm_last_mp;
+  mpegts_pid_t              **mm_pid_table; // direct index (by PID)
 
   int                         mm_num_tables;
   LIST_HEAD(, mpegts_table)   mm_tables;
+  LIST_HEAD(, mpegts_table)   mm_table_hash[MPEGTS_TABLE_HASH]; // by PID
   TAILQ_HEAD(, mpegts_table)  mm_table_queue;
 
   /*
@@ -393,7 +432,8 @@ struct mpegts_service
    * When a subscription request SMT_MPEGTS, chunk them togeather 
    * in order to recude load.
    */
-  sbuf_t s_tsbuf;
+  pktbuf_t *s_tsbuf;
+  int       s_tsbuf_len;
 
   /**
    * Average continuity errors
@@ -437,6 +477,8 @@ struct mpegts_mux_instance
 
   int             mmi_tune_failed;
 
+  int             mmi_ts_stride; // detected packet size (188/192/204)
+
   void (*mmi_delete) (mpegts_mux_instance_t *mmi);
 };
 
@@ -481,11 +523,12 @@ struct mpegts_input
   int mi_running;
 
   /* Data input */
-  // Note: this section is protected by mi_input_lock
+  // Note: mi_input_lock/cond are only used to put the input thread
+  //       to sleep when the ring is empty
   pthread_t                       mi_input_tid;
   pthread_mutex_t                 mi_input_lock;
   pthread_cond_t                  mi_input_cond;
-  TAILQ_HEAD(,mpegts_packet)      mi_input_queue;
+  mpegts_ring_t                   mi_input_ring;
 
   /* Data processing/output */
   // Note: this lock (mi_output_lock) protects all the remaining
@@ -500,6 +543,9 @@ struct mpegts_input
   pthread_t                       mi_table_tid;
   pthread_cond_t                  mi_table_cond;
   mpegts_table_feed_queue_t       mi_table_queue;
+  mpegts_table_feed_queue_t       mi_table_feed_pool;
+  int                             mi_table_feed_pool_count;
+  int                             mi_table_backlog; // TS packets queued
 
   /*
    * Functions
@@ -670,12 +716,15 @@ mpegts_pid_t *mpegts_mux_find_pid_(mpegts_mux_t *mm, int pid, int create);
 static inline mpegts_pid_t *
 mpegts_mux_find_pid(mpegts_mux_t *mm, int pid, int create)
 {
-  if (mm->mm_last_pid != pid)
+  if (create)
     return mpegts_mux_find_pid_(mm, pid, create);
-  else
-    return mm->mm_last_mp;
+  if (mm->mm_pid_table && pid >= 0 && pid <= MPEGTS_FULLMUX_PID)
+    return mm->mm_pid_table[pid];
+  return NULL;
 }
 
+void mpegts_mux_free_pids ( mpegts_mux_t *mm );
+
 void mpegts_input_recv_packets
   (mpegts_input_t *mi, mpegts_mux_instance_t *mmi, sbuf_t *sb, size_t off,
    int64_t *pcr, uint16_t *pcr_pid);
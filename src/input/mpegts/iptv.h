@@ -20,7 +20,7 @@
 #ifndef __IPTV_H__
 #define __IPTV_H__
 
-void iptv_init ( void );
+void iptv_init ( int threads );
 void iptv_done ( void );
 
 #endif /* __IPTV_H__ */
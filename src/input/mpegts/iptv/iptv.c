@@ -21,6 +21,7 @@
 #include "tvhpoll.h"
 #include "tcp.h"
 #include "settings.h"
+#include "atomic.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -40,9 +41,9 @@
  * *************************************************************************/
 
 iptv_input_t   *iptv_input;
-tvhpoll_t      *iptv_poll;
-pthread_t       iptv_thread;
-pthread_mutex_t iptv_lock;
+
+static iptv_thread_t *iptv_threads;
+static int            iptv_threads_count;
 
 /* **************************************************************************
  * IPTV handlers
@@ -208,7 +209,7 @@ iptv_input_start_mux ( mpegts_input_t *mi, mpegts_mux_instance_t *mmi )
   }
 
   /* Start */
-  pthread_mutex_lock(&iptv_lock);
+  pthread_mutex_lock(&im->mm_iptv_lock);
   im->mm_active = mmi; // Note: must set here else mux_started call
                        // will not realise we're ready to accept pid open calls
   ret            = ih->start(im, &url);
@@ -216,7 +217,7 @@ iptv_input_start_mux ( mpegts_input_t *mi, mpegts_mux_instance_t *mmi )
     im->im_handler = ih;
   else
     im->mm_active  = NULL;
-  pthread_mutex_unlock(&iptv_lock);
+  pthread_mutex_unlock(&im->mm_iptv_lock);
 
   return ret;
 }
@@ -226,6 +227,7 @@ iptv_input_stop_mux ( mpegts_input_t *mi, mpegts_mux_instance_t *mmi )
 {
   iptv_mux_t *im = (iptv_mux_t*)mmi->mmi_mux;
   mpegts_network_link_t *mnl;
+  int i;
 
   // Not active??
   if (!im->mm_active)
@@ -235,16 +237,30 @@ iptv_input_stop_mux ( mpegts_input_t *mi, mpegts_mux_instance_t *mmi )
   if (im->im_handler->stop)
     im->im_handler->stop(im);
 
-  pthread_mutex_lock(&iptv_lock);
+  pthread_mutex_lock(&im->mm_iptv_lock);
 
   /* Close file */
   if (im->mm_iptv_fd > 0) {
     close(im->mm_iptv_fd); // removes from poll
     im->mm_iptv_fd = -1;
   }
+  for (i = 0; i < ARRAY_SIZE(im->mm_iptv_fec_fd); i++)
+    if (im->mm_iptv_fec_fd[i] >= 0) {
+      close(im->mm_iptv_fec_fd[i]);
+      im->mm_iptv_fec_fd[i] = -1;
+    }
+  if (im->mm_iptv_thread) {
+    atomic_add(&im->mm_iptv_thread->it_muxes, -1);
+    im->mm_iptv_thread = NULL;
+  }
 
   /* Free memory */
   sbuf_free(&im->mm_iptv_buffer);
+  if (im->mm_iptv_rx)
+    iptv_udp_rx_destroy(im->mm_iptv_rx);
+  im->mm_iptv_rx  = NULL;
+  im->mm_iptv_mtu = 0;
+  iptv_rtp_destroy(im);
 
   /* Clear bw limit */
   LIST_FOREACH(mnl, &mi->mi_networks, mnl_mi_link) {
@@ -252,7 +268,7 @@ iptv_input_stop_mux ( mpegts_input_t *mi, mpegts_mux_instance_t *mmi )
     in->in_bw_limited = 0;
   }
 
-  pthread_mutex_unlock(&iptv_lock);
+  pthread_mutex_unlock(&im->mm_iptv_lock);
 }
 
 static void
@@ -264,14 +280,15 @@ iptv_input_display_name ( mpegts_input_t *mi, char *buf, size_t len )
 static void *
 iptv_input_thread ( void *aux )
 {
-  int nfds;
+  int i, nfds;
   ssize_t n;
   size_t off;
   iptv_mux_t *im;
-  tvhpoll_event_t ev;
+  iptv_thread_t *it = aux;
+  tvhpoll_event_t ev[IPTV_POLL_EVENTS];
 
   while ( tvheadend_running ) {
-    nfds = tvhpoll_wait(iptv_poll, &ev, 1, -1);
+    nfds = tvhpoll_wait(it->it_poll, ev, IPTV_POLL_EVENTS, -1);
     if ( nfds < 0 ) {
       if (tvheadend_running) {
         tvhlog(LOG_ERR, "iptv", "poll() error %s, sleeping 1 second",
@@ -282,47 +299,58 @@ iptv_input_thread ( void *aux )
     } else if ( nfds == 0 ) {
       continue;
     }
-    im = ev.data.ptr;
 
-    pthread_mutex_lock(&iptv_lock);
+    for (i = 0; i < nfds; i++) {
+      im = ev[i].data.ptr;
 
-    /* No longer active */
-    if (!im->mm_active)
-      goto done;
+      pthread_mutex_lock(&im->mm_iptv_lock);
 
-    /* Get data */
-    off = 0;
-    if ((n = im->im_handler->read(im, &off)) < 0) {
-      tvhlog(LOG_ERR, "iptv", "read() error %s", strerror(errno));
-      im->im_handler->stop(im);
-      goto done;
-    }
-    iptv_input_recv_packets(im, n, off);
+      /* No longer active */
+      if (!im->mm_active)
+        goto done;
+
+      /* Get data */
+      off = 0;
+      if ((n = im->im_handler->read(im, &off)) < 0) {
+        tvhlog(LOG_ERR, "iptv", "read() error %s", strerror(errno));
+        if (im->im_handler->stop)
+          im->im_handler->stop(im);
+        goto done;
+      }
+      iptv_input_recv_packets(im, n, off);
 
 done:
-    pthread_mutex_unlock(&iptv_lock);
+      pthread_mutex_unlock(&im->mm_iptv_lock);
+    }
   }
   return NULL;
 }
 
+/*
+ * Note: called with im->mm_iptv_lock held, muxes on the same network
+ *       may be received concurrently by other threads, so the network
+ *       counters are only ever updated atomically
+ */
 void
 iptv_input_recv_packets ( iptv_mux_t *im, ssize_t len, size_t off )
 {
-  static time_t t1 = 0, t2;
   iptv_network_t *in = (iptv_network_t*)im->mm_network;
-  in->in_bps += len * 8;
-  time(&t2);
-  if (t2 != t1) {
+  time_t t1 = in->in_bps_period, t2 = dispatch_clock;
+  uint64_t bps;
+
+  atomic_add_u64(&in->in_bps, len * 8);
+
+  /* New period (only one thread will win the swap) */
+  if (t2 != t1 && __sync_bool_compare_and_swap(&in->in_bps_period, t1, t2)) {
+    bps = atomic_exchange_u64(&in->in_bps, 0);
     if (in->in_max_bandwidth &&
-        in->in_bps > in->in_max_bandwidth * 1024) {
+        bps > (uint64_t)in->in_max_bandwidth * 1024) {
       if (!in->in_bw_limited) {
         tvhinfo("iptv", "%s bandwidth limited exceeded",
                 idnode_get_title(&in->mn_id));
         in->in_bw_limited = 1;
       }
     }
-    in->in_bps = 0;
-    t1 = t2;
   }
 
   /* Pass on */
@@ -330,11 +358,27 @@ iptv_input_recv_packets ( iptv_mux_t *im, ssize_t len, size_t off )
                             &im->mm_iptv_buffer, off, NULL, NULL);
 }
 
+/*
+ * Pick the least loaded receive thread
+ */
+static iptv_thread_t *
+iptv_thread_pick ( void )
+{
+  int i;
+  iptv_thread_t *it = iptv_threads;
+  for (i = 1; i < iptv_threads_count; i++)
+    if (iptv_threads[i].it_muxes < it->it_muxes)
+      it = &iptv_threads[i];
+  return it;
+}
+
 void
 iptv_input_mux_started ( iptv_mux_t *im )
 {
   tvhpoll_event_t ev = { 0 };
+  iptv_thread_t *it;
   char buf[256];
+  int i;
   im->mm_display_name((mpegts_mux_t*)im, buf, sizeof(buf));
 
   /* Allocate input buffer */
@@ -345,14 +389,31 @@ iptv_input_mux_started ( iptv_mux_t *im )
     ev.fd       = im->mm_iptv_fd;
     ev.events   = TVHPOLL_IN;
     ev.data.ptr = im;
+    it          = iptv_thread_pick();
 
     /* Error? */
-    if (tvhpoll_add(iptv_poll, &ev, 1) == -1) {
+    if (tvhpoll_add(it->it_poll, &ev, 1) == -1) {
       tvherror("iptv", "%s - failed to add to poll q", buf);
       close(im->mm_iptv_fd);
       im->mm_iptv_fd = -1;
       return;
     }
+    atomic_add(&it->it_muxes, 1);
+    im->mm_iptv_thread = it;
+
+    /* FEC streams, read by the same thread along with the media */
+    for (i = 0; i < ARRAY_SIZE(im->mm_iptv_fec_fd); i++) {
+      if (im->mm_iptv_fec_fd[i] < 0)
+        continue;
+      ev.fd = im->mm_iptv_fec_fd[i];
+      if (tvhpoll_add(it->it_poll, &ev, 1) == -1) {
+        tvhwarn("iptv", "%s - failed to add FEC to poll q", buf);
+        close(im->mm_iptv_fec_fd[i]);
+        im->mm_iptv_fec_fd[i] = -1;
+      }
+    }
+    tvhtrace("iptv", "%s - receive thread %d",
+             buf, (int)(it - iptv_threads));
   }
 
   /* Install table handlers */
@@ -511,8 +572,10 @@ iptv_network_init ( void )
   htsmsg_destroy(c);
 }
 
-void iptv_init ( void )
+void iptv_init ( int threads )
 {
+  int i;
+
   /* Register handlers */
   iptv_http_init();
   iptv_udp_init();
@@ -532,17 +595,29 @@ void iptv_init ( void )
   /* Init Network */
   iptv_network_init();
 
-  /* Setup TS thread */
-  iptv_poll = tvhpoll_create(10);
-  pthread_mutex_init(&iptv_lock, NULL);
-  tvhthread_create(&iptv_thread, NULL, iptv_input_thread, NULL, 0);
+  /* Setup TS threads */
+  iptv_threads_count = MIN(MAX(threads, 1), IPTV_THREADS_MAX);
+  iptv_threads       = calloc(iptv_threads_count, sizeof(iptv_thread_t));
+  for (i = 0; i < iptv_threads_count; i++) {
+    iptv_threads[i].it_poll = tvhpoll_create(IPTV_POLL_EVENTS);
+    tvhthread_create(&iptv_threads[i].it_tid, NULL,
+                     iptv_input_thread, &iptv_threads[i], 0);
+  }
+  tvhdebug("iptv", "using %d receive thread(s)", iptv_threads_count);
 }
 
 void iptv_done ( void )
 {
-  pthread_kill(iptv_thread, SIGTERM);
-  pthread_join(iptv_thread, NULL);
-  tvhpoll_destroy(iptv_poll);
+  int i;
+
+  for (i = 0; i < iptv_threads_count; i++)
+    pthread_kill(iptv_threads[i].it_tid, SIGTERM);
+  for (i = 0; i < iptv_threads_count; i++) {
+    pthread_join(iptv_threads[i].it_tid, NULL);
+    tvhpoll_destroy(iptv_threads[i].it_poll);
+  }
+  free(iptv_threads);
+  iptv_threads = NULL;
   pthread_mutex_lock(&global_lock);
   mpegts_network_unregister_builder(&iptv_network_class);
   mpegts_input_stop_all((mpegts_input_t*)iptv_input);
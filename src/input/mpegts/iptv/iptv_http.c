@@ -43,14 +43,14 @@ iptv_http_data
 {
   iptv_mux_t *im = p;
 
-  pthread_mutex_lock(&iptv_lock);
+  pthread_mutex_lock(&im->mm_iptv_lock);
 
   sbuf_append(&im->mm_iptv_buffer, buf, len);
 
   if (len > 0)
     iptv_input_recv_packets(im, len, 0);
 
-  pthread_mutex_unlock(&iptv_lock);
+  pthread_mutex_unlock(&im->mm_iptv_lock);
 
   return len;
 }
@@ -44,6 +44,26 @@ const idclass_t iptv_mux_class =
       .name     = "Interface",
       .off      = offsetof(iptv_mux_t, mm_iptv_interface),
     },
+    {
+      .type     = PT_U32,
+      .id       = "iptv_rcvbuf",
+      .name     = "Receive Buffer (KB)",
+      .off      = offsetof(iptv_mux_t, mm_iptv_rcvbuf),
+      .def.i    = IPTV_UDP_RCVBUF,
+    },
+    {
+      .type     = PT_U32,
+      .id       = "iptv_rtp_reorder",
+      .name     = "RTP Reorder Depth (ms)",
+      .off      = offsetof(iptv_mux_t, mm_iptv_rtp_reorder),
+      .def.i    = IPTV_RTP_REORDER,
+    },
+    {
+      .type     = PT_BOOL,
+      .id       = "iptv_fec",
+      .name     = "RTP FEC (SMPTE 2022-1)",
+      .off      = offsetof(iptv_mux_t, mm_iptv_fec),
+    },
     {
       .type     = PT_BOOL,
       .id       = "iptv_atsc",
@@ -105,6 +125,9 @@ iptv_mux_create0 ( iptv_network_t *in, const char *uuid, htsmsg_t *conf )
     mpegts_mux_create(iptv_mux, uuid, (mpegts_network_t*)in,
                       MPEGTS_ONID_NONE, MPEGTS_TSID_NONE, conf);
 
+  pthread_mutex_init(&im->mm_iptv_lock, NULL);
+  im->mm_iptv_fec_fd[0] = im->mm_iptv_fec_fd[1] = -1;
+
   /* Callbacks */
   im->mm_display_name     = iptv_mux_display_name;
   im->mm_config_save      = iptv_mux_config_save;
@@ -23,16 +23,27 @@
 #include "input.h"
 #include "htsbuf.h"
 #include "url.h"
+#include "tvhpoll.h"
 
 #define IPTV_PKT_SIZE (300*188)
 
-extern pthread_mutex_t iptv_lock;
+/* UDP batched receive */
+#define IPTV_UDP_BATCH      32        ///< Datagrams per recvmmsg() call
+#define IPTV_UDP_DGRAM_SIZE 2048      ///< Min datagram slot (7*188 + RTP)
+#define IPTV_UDP_DGRAM_MAX  65536     ///< Slots grow up to this on truncation
+#define IPTV_UDP_RCVBUF     1024      ///< Default SO_RCVBUF (KB)
+#define IPTV_POLL_EVENTS    16        ///< Events per tvhpoll_wait()
+#define IPTV_RTP_REORDER    40        ///< Default RTP reorder depth (ms)
+#define IPTV_THREADS_MAX    64
 
 typedef struct iptv_input   iptv_input_t;
 typedef struct iptv_network iptv_network_t;
 typedef struct iptv_mux     iptv_mux_t;
 typedef struct iptv_service iptv_service_t;
 typedef struct iptv_handler iptv_handler_t;
+typedef struct iptv_udp_rx  iptv_udp_rx_t;
+typedef struct iptv_thread  iptv_thread_t;
+typedef struct iptv_rtp     iptv_rtp_t;
 
 struct iptv_handler
 {
@@ -46,20 +57,32 @@ struct iptv_handler
 
 void iptv_handler_register ( iptv_handler_t *ih, int num );
 
+/*
+ * Receive thread, muxes are sharded across these on start
+ */
+struct iptv_thread
+{
+  pthread_t     it_tid;
+  tvhpoll_t    *it_poll;
+  volatile int  it_muxes;   ///< Number of muxes polled by this thread
+};
+
 struct iptv_input
 {
   mpegts_input_t;
 };
 
 void iptv_input_mux_started ( iptv_mux_t *im );
+void iptv_udp_rx_destroy ( iptv_udp_rx_t *rx );
 void iptv_input_recv_packets ( iptv_mux_t *im, ssize_t len, size_t off );
 
 struct iptv_network
 {
   mpegts_network_t;
 
-  int in_bps;
-  int in_bw_limited;
+  volatile uint64_t in_bps;
+  volatile time_t   in_bps_period;
+  int               in_bw_limited;
 
   uint32_t in_max_streams;
   uint32_t in_max_bandwidth;
@@ -71,15 +94,26 @@ struct iptv_mux
 {
   mpegts_mux_t;
 
+  pthread_mutex_t       mm_iptv_lock;    ///< Protects receive state
+  iptv_thread_t        *mm_iptv_thread;
+
   int                   mm_iptv_fd;
   char                 *mm_iptv_url;
   char                 *mm_iptv_interface;
+  uint32_t              mm_iptv_rcvbuf;
 
   int                   mm_iptv_atsc;
 
   char                 *mm_iptv_svcname;
 
   sbuf_t                mm_iptv_buffer;
+  iptv_udp_rx_t        *mm_iptv_rx;
+  int                   mm_iptv_mtu;     ///< Receive interface MTU (0 unknown)
+  uint32_t              mm_iptv_rxq_ovfl;
+  uint32_t              mm_iptv_rtp_reorder;
+  iptv_rtp_t           *mm_iptv_rtp;
+  int                   mm_iptv_fec;
+  int                   mm_iptv_fec_fd[2]; ///< Column, row
 
   iptv_handler_t       *im_handler;
 
@@ -104,6 +138,13 @@ extern iptv_network_t *iptv_network;
 
 void iptv_mux_load_all ( void );
 
+void iptv_rtp_input
+  ( iptv_mux_t *im, uint16_t seq, const uint8_t *data, int len );
+void iptv_rtp_fec_input
+  ( iptv_mux_t *im, const uint8_t *data, int len );
+void iptv_rtp_flush   ( iptv_mux_t *im );
+void iptv_rtp_destroy ( iptv_mux_t *im );
+
 void iptv_http_init    ( void );
 void iptv_udp_init     ( void );
 
@@ -0,0 +1,440 @@
+/*
+ *  IPTV - RTP reorder buffer
+ *
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tvheadend.h"
+#include "iptv_private.h"
+
+/*
+ * Packets are keyed on the RTP sequence number. In order packets are
+ * passed straight on, packets from the future are copied aside until
+ * either the gap is filled or the oldest has waited longer than the
+ * configured depth, at which point the gap is declared lost.
+ *
+ * With SMPTE 2022-1 FEC enabled the payload of every packet is kept in
+ * its slot so that a single missing packet in a row or column can be
+ * rebuilt (XOR of the FEC payload and the other members) before its
+ * gap times out.
+ */
+
+#define IPTV_RTP_SLOTS 256 // must be a power of 2
+#define IPTV_RTP_MASK  (IPTV_RTP_SLOTS - 1)
+
+#define RTP_SLOT_FREE  0
+#define RTP_SLOT_HELD  1   ///< Waiting for earlier packets
+#define RTP_SLOT_DONE  2   ///< Passed on (used to detect duplicates)
+
+#define IPTV_RTP_RESYNC 32 ///< Late packets in a row taken as a restart
+
+#define IPTV_FEC_SLOTS 32
+#define IPTV_FEC_HDR   16  ///< SMPTE 2022-1 FEC header
+
+#define IPTV_RTP_RATE  1000000 ///< Packet rate measurement period (us)
+
+typedef struct iptv_rtp_slot
+{
+  uint16_t  seq;
+  uint8_t   state;
+  uint16_t  len;
+  int64_t   time;
+  uint8_t   data[IPTV_UDP_DGRAM_SIZE];
+} iptv_rtp_slot_t;
+
+typedef struct iptv_fec
+{
+  int       valid;
+  uint16_t  snbase;
+  uint8_t   offset;   ///< 1 for row FEC, L for column FEC
+  uint8_t   na;       ///< Number of protected packets
+  uint16_t  lenrec;   ///< Length recovery
+  uint16_t  len;
+  uint8_t   data[IPTV_UDP_DGRAM_SIZE];
+} iptv_fec_t;
+
+struct iptv_rtp
+{
+  int              started;
+  uint16_t         expected;  ///< Next sequence number to pass on
+  uint16_t         highest;   ///< Highest sequence number received
+  int              held;      ///< Number of HELD slots
+  int              late;      ///< Consecutive late packets
+  int              fec;       ///< Keep passed on payloads for FEC
+  int              fec_next;
+  int              fec_recovering;
+  int              fec_span;  ///< Packets in the signalled L x D matrix
+  int64_t          rate_time;
+  int              rate_pkts;
+  int64_t          pkt_us;    ///< Measured packet interval
+  iptv_rtp_slot_t  slots[IPTV_RTP_SLOTS];
+  iptv_fec_t       fecs[IPTV_FEC_SLOTS];
+  uint8_t          fec_buf[IPTV_UDP_DGRAM_SIZE];
+};
+
+#define RTP_STAT(im, f, v)\
+  do { if ((im)->mm_active) (im)->mm_active->mmi_stats.f += (v); } while (0)
+
+static inline void
+iptv_rtp_emit
+  ( iptv_mux_t *im, iptv_rtp_t *rtp, uint16_t seq,
+    const uint8_t *data, int len )
+{
+  iptv_rtp_slot_t *s = &rtp->slots[seq & IPTV_RTP_MASK];
+  sbuf_append(&im->mm_iptv_buffer, data, len);
+  if (rtp->fec && data != s->data) {
+    /* Too large to keep, can't take part in recovery */
+    s->len = len <= sizeof(s->data) ? len : 0;
+    memcpy(s->data, data, s->len);
+  }
+  s->seq   = seq;
+  s->state = RTP_SLOT_DONE;
+  rtp->expected = seq + 1;
+}
+
+/*
+ * With FEC a gap is held for two matrices worth of packets, the column
+ * FEC of a matrix is spread over the one sent after it
+ */
+static inline int64_t
+iptv_rtp_depth ( iptv_mux_t *im, iptv_rtp_t *rtp )
+{
+  int64_t us = (int64_t)im->mm_iptv_rtp_reorder * 1000, fec;
+  if (rtp->fec) {
+    if (rtp->fec_span && rtp->pkt_us)
+      fec = 2 * rtp->fec_span * rtp->pkt_us;
+    else
+      fec = IPTV_RTP_REORDER * 1000; // FEC is pointless without holding gaps
+    us = MAX(us, fec);
+  }
+  return us;
+}
+
+/*
+ * Pass on held packets that are now in sequence
+ */
+static void
+iptv_rtp_drain ( iptv_mux_t *im, iptv_rtp_t *rtp )
+{
+  iptv_rtp_slot_t *s;
+  while (rtp->held) {
+    s = &rtp->slots[rtp->expected & IPTV_RTP_MASK];
+    if (s->state != RTP_SLOT_HELD || s->seq != rtp->expected)
+      break;
+    rtp->held--;
+    iptv_rtp_emit(im, rtp, s->seq, s->data, s->len);
+  }
+}
+
+/*
+ * Find the oldest (lowest sequence) held packet
+ */
+static iptv_rtp_slot_t *
+iptv_rtp_oldest ( iptv_rtp_t *rtp )
+{
+  int i;
+  uint16_t seq;
+  iptv_rtp_slot_t *s;
+  for (i = 1; i < IPTV_RTP_SLOTS; i++) {
+    seq = rtp->expected + i;
+    s   = &rtp->slots[seq & IPTV_RTP_MASK];
+    if (s->state == RTP_SLOT_HELD && s->seq == seq)
+      return s;
+  }
+  return NULL;
+}
+
+/*
+ * Skip forward to the oldest held packet, counting the gap as lost
+ */
+static void
+iptv_rtp_skip ( iptv_mux_t *im, iptv_rtp_t *rtp )
+{
+  iptv_rtp_slot_t *s = iptv_rtp_oldest(rtp);
+  if (!s) {
+    rtp->held = 0; // Note: should not happen
+    return;
+  }
+  RTP_STAT(im, loss, (uint16_t)(s->seq - rtp->expected));
+  if (rtp->fec)
+    RTP_STAT(im, fec_unrec, (uint16_t)(s->seq - rtp->expected));
+  rtp->expected = s->seq;
+  iptv_rtp_drain(im, rtp);
+}
+
+/*
+ * Sender restarted (or jumped back), pass on what is held and follow
+ * the new sequence
+ */
+static void
+iptv_rtp_resync ( iptv_mux_t *im, iptv_rtp_t *rtp, uint16_t seq )
+{
+  int i;
+
+  tvhdebug("iptv", "rtp resync, sequence %u (expected %u)",
+           seq, rtp->expected);
+  while (rtp->held)
+    iptv_rtp_skip(im, rtp);
+  for (i = 0; i < IPTV_RTP_SLOTS; i++)
+    rtp->slots[i].state = RTP_SLOT_FREE;
+  for (i = 0; i < IPTV_FEC_SLOTS; i++)
+    rtp->fecs[i].valid = 0;
+  rtp->expected = rtp->highest = seq;
+  rtp->late     = 0;
+}
+
+void
+iptv_rtp_input
+  ( iptv_mux_t *im, uint16_t seq, const uint8_t *data, int len )
+{
+  int16_t d;
+  int64_t depth;
+  iptv_rtp_t *rtp = im->mm_iptv_rtp;
+  iptv_rtp_slot_t *s;
+
+  if (!rtp) {
+    rtp = im->mm_iptv_rtp = calloc(1, sizeof(iptv_rtp_t));
+    rtp->fec = im->mm_iptv_fec;
+  }
+  depth = iptv_rtp_depth(im, rtp);
+  if (!rtp->fec_recovering)
+    rtp->rate_pkts++;
+  if (!rtp->started) {
+    rtp->started  = 1;
+    rtp->expected = rtp->highest = seq;
+  }
+
+  /* Too far back to be late, or late (not duplicate) for too long */
+  s = &rtp->slots[seq & IPTV_RTP_MASK];
+  d = (int16_t)(seq - rtp->expected);
+  if (d >= 0)
+    rtp->late = 0;
+  else if (d <= -IPTV_RTP_SLOTS ||
+           (!(s->state == RTP_SLOT_DONE && s->seq == seq) &&
+            ++rtp->late >= IPTV_RTP_RESYNC))
+    iptv_rtp_resync(im, rtp, seq);
+
+  if ((int16_t)(seq - rtp->highest) > 0)
+    rtp->highest = seq;
+  s = &rtp->slots[seq & IPTV_RTP_MASK];
+  d = (int16_t)(seq - rtp->expected);
+
+  /* In order */
+  if (d == 0) {
+    if (rtp->held && !rtp->fec_recovering)
+      RTP_STAT(im, reorder, 1);
+    iptv_rtp_emit(im, rtp, seq, data, len);
+    iptv_rtp_drain(im, rtp);
+
+  /* Already passed on, or too late */
+  } else if (d < 0) {
+    if (d > -IPTV_RTP_SLOTS && s->state == RTP_SLOT_DONE && s->seq == seq)
+      RTP_STAT(im, dup, 1);
+    else
+      RTP_STAT(im, reorder, 1);
+
+  /* From the future, hold (if it fits) */
+  } else if (depth && d < IPTV_RTP_SLOTS && (size_t)len <= sizeof(s->data)) {
+    if (s->state == RTP_SLOT_HELD && s->seq == seq) {
+      RTP_STAT(im, dup, 1);
+      return;
+    }
+    s->seq   = seq;
+    s->state = RTP_SLOT_HELD;
+    s->len   = len;
+    s->time  = getmonoclock();
+    memcpy(s->data, data, len);
+    rtp->held++;
+
+  /* Gap (no reordering, too big a jump to wait for, or too large) */
+  } else {
+    while (rtp->held)
+      iptv_rtp_skip(im, rtp);
+    d = (int16_t)(seq - rtp->expected);
+    if (d > 0) {
+      RTP_STAT(im, loss, d);
+      if (rtp->fec)
+        RTP_STAT(im, fec_unrec, d);
+    }
+    iptv_rtp_emit(im, rtp, seq, data, len);
+  }
+}
+
+/*
+ * FEC recovery
+ */
+static inline iptv_rtp_slot_t *
+iptv_rtp_fec_member ( iptv_rtp_t *rtp, uint16_t seq )
+{
+  iptv_rtp_slot_t *s = &rtp->slots[seq & IPTV_RTP_MASK];
+  if (s->seq == seq && s->state != RTP_SLOT_FREE && s->len)
+    return s;
+  return NULL;
+}
+
+static int
+iptv_rtp_fec_recover ( iptv_mux_t *im, iptv_rtp_t *rtp, iptv_fec_t *f )
+{
+  int i, j, missing = -1;
+  uint16_t seq, len;
+  iptv_rtp_slot_t *s;
+
+  /* Find the missing member (only one can be rebuilt) */
+  for (i = 0; i < f->na; i++) {
+    seq = f->snbase + i * f->offset;
+    if (!iptv_rtp_fec_member(rtp, seq)) {
+      if (missing >= 0)
+        return 0;
+      missing = seq;
+    }
+  }
+
+  /* Not yet due (may still arrive) */
+  if (missing >= 0 && (int16_t)(missing - rtp->highest) >= 0)
+    return 0;
+
+  /* Nothing to do (complete, or the gap has already been given up) */
+  f->valid = 0;
+  if (missing < 0 || (int16_t)(missing - rtp->expected) < 0)
+    return 0;
+
+  /* Rebuild */
+  memcpy(rtp->fec_buf, f->data, f->len);
+  len = f->lenrec;
+  for (i = 0; i < f->na; i++) {
+    seq = f->snbase + i * f->offset;
+    if (seq == missing) continue;
+    s = iptv_rtp_fec_member(rtp, seq);
+    for (j = 0; j < MIN(s->len, f->len); j++)
+      rtp->fec_buf[j] ^= s->data[j];
+    len ^= s->len;
+  }
+  if (!len || len > f->len || (len % 188) != 0)
+    return 0;
+
+  RTP_STAT(im, fec_rec, 1);
+  rtp->fec_recovering = 1;
+  iptv_rtp_input(im, missing, rtp->fec_buf, len);
+  rtp->fec_recovering = 0;
+  return 1;
+}
+
+/*
+ * Try all outstanding FEC packets, returns number of recovered packets
+ */
+static int
+iptv_rtp_fec_scan ( iptv_mux_t *im, iptv_rtp_t *rtp )
+{
+  int i, r = 0;
+  for (i = 0; i < IPTV_FEC_SLOTS; i++)
+    if (rtp->fecs[i].valid)
+      r += iptv_rtp_fec_recover(im, rtp, &rtp->fecs[i]);
+  return r;
+}
+
+/*
+ * Receive FEC packet (RTP header already removed)
+ *
+ * Note: the length recovery is applied to the TS payload only, CSRC
+ *       lists and header extensions are not protected
+ */
+void
+iptv_rtp_fec_input ( iptv_mux_t *im, const uint8_t *data, int len )
+{
+  iptv_rtp_t *rtp = im->mm_iptv_rtp;
+  iptv_fec_t *f;
+  int offset, na;
+
+  if (!rtp || !rtp->fec)
+    return;
+  if (len <= IPTV_FEC_HDR)
+    return;
+  RTP_STAT(im, fec_pkts, 1);
+
+  /* Header (X D type index / offset / NA) */
+  offset = data[13];
+  na     = data[14];
+  if ((data[12] & 0x38) != 0 || !offset || !na) // XOR only
+    return;
+  if (offset * (na - 1) >= IPTV_RTP_SLOTS / 2)
+    return;
+  len -= IPTV_FEC_HDR;
+  if (len > IPTV_UDP_DGRAM_SIZE)
+    return;
+
+  f = &rtp->fecs[rtp->fec_next];
+  rtp->fec_next = (rtp->fec_next + 1) % IPTV_FEC_SLOTS;
+  f->valid  = 1;
+  f->snbase = (data[0] << 8) | data[1];
+  f->lenrec = (data[2] << 8) | data[3];
+  f->offset = offset;
+  f->na     = na;
+  f->len    = len;
+  memcpy(f->data, data + IPTV_FEC_HDR, len);
+  rtp->fec_span = MAX(rtp->fec_span, offset * na);
+
+  iptv_rtp_fec_recover(im, rtp, f);
+}
+
+/*
+ * Give up on gaps where the following packet has waited too long
+ */
+void
+iptv_rtp_flush ( iptv_mux_t *im )
+{
+  int64_t now, depth;
+  iptv_rtp_t *rtp = im->mm_iptv_rtp;
+  iptv_rtp_slot_t *s;
+
+  if (!rtp || (!rtp->held && !rtp->fec))
+    return;
+
+  now = getmonoclock();
+
+  /* Packet rate, turns the FEC matrix into a hold time */
+  if (rtp->fec && now - rtp->rate_time >= IPTV_RTP_RATE) {
+    if (rtp->rate_time && rtp->rate_pkts)
+      rtp->pkt_us = (now - rtp->rate_time) / rtp->rate_pkts;
+    rtp->rate_time = now;
+    rtp->rate_pkts = 0;
+  }
+
+  depth = iptv_rtp_depth(im, rtp);
+  while (rtp->held) {
+    if (!(s = iptv_rtp_oldest(rtp))) {
+      rtp->held = 0;
+      break;
+    }
+    if (now - s->time < depth)
+      break;
+    if (rtp->fec && iptv_rtp_fec_scan(im, rtp))
+      continue;
+    iptv_rtp_skip(im, rtp);
+  }
+}
+
+void
+iptv_rtp_destroy ( iptv_mux_t *im )
+{
+  free(im->mm_iptv_rtp);
+  im->mm_iptv_rtp = NULL;
+}
+
+/******************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ *****************************************************************************/
@@ -25,6 +25,7 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #if defined(PLATFORM_LINUX)
@@ -38,27 +39,201 @@
 #  endif
 #endif
 
+#if !ENABLE_RECVMMSG
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int  msg_len;
+};
+#endif
 
 /*
- * Connect UDP/RTP
+ * Preallocated receive ring, filled by a single recvmmsg() call. Slots
+ * are sized for the interface MTU and grow if a datagram gets truncated.
+ */
+struct iptv_udp_rx
+{
+  struct mmsghdr msg[IPTV_UDP_BATCH];
+  struct iovec   iov[IPTV_UDP_BATCH];
+#ifdef SO_RXQ_OVFL
+  uint8_t        ctl[IPTV_UDP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+#endif
+  size_t         size;              ///< Slot size
+  uint8_t       *data;              ///< IPTV_UDP_BATCH slots
+};
+
+/*
+ * Get (upto) IPTV_UDP_BATCH datagrams in one go
  */
 static int
-iptv_udp_start ( iptv_mux_t *im, const url_t *url )
+iptv_udp_recvmmsg ( int fd, iptv_udp_rx_t *rx )
+{
+  int i;
+
+  for (i = 0; i < IPTV_UDP_BATCH; i++) {
+    rx->msg[i].msg_hdr.msg_flags = 0;
+#ifdef SO_RXQ_OVFL
+    rx->msg[i].msg_hdr.msg_controllen = sizeof(rx->ctl[i]);
+#endif
+  }
+
+  /* MSG_TRUNC: report the real length of a truncated datagram (Linux) */
+#if ENABLE_RECVMMSG
+  return recvmmsg(fd, rx->msg, IPTV_UDP_BATCH, MSG_DONTWAIT | MSG_TRUNC, NULL);
+#else
+  for (i = 0; i < IPTV_UDP_BATCH; i++) {
+    ssize_t n = recvmsg(fd, &rx->msg[i].msg_hdr, MSG_DONTWAIT | MSG_TRUNC);
+    if (n < 0)
+      return i ?: -1;
+    rx->msg[i].msg_len = n;
+  }
+  return i;
+#endif
+}
+
+static void
+iptv_udp_rx_alloc ( iptv_udp_rx_t *rx, size_t size )
+{
+  int i;
+
+  free(rx->data);
+  rx->size = size;
+  rx->data = malloc(IPTV_UDP_BATCH * size);
+  for (i = 0; i < IPTV_UDP_BATCH; i++) {
+    rx->iov[i].iov_base = rx->data + i * size;
+    rx->iov[i].iov_len  = size;
+  }
+}
+
+static iptv_udp_rx_t *
+iptv_udp_rx_create ( size_t size )
+{
+  int i;
+  iptv_udp_rx_t *rx = calloc(1, sizeof(iptv_udp_rx_t));
+
+  iptv_udp_rx_alloc(rx, size);
+  for (i = 0; i < IPTV_UDP_BATCH; i++) {
+    rx->msg[i].msg_hdr.msg_iov      = &rx->iov[i];
+    rx->msg[i].msg_hdr.msg_iovlen   = 1;
+#ifdef SO_RXQ_OVFL
+    rx->msg[i].msg_hdr.msg_control  = rx->ctl[i];
+#endif
+  }
+  return rx;
+}
+
+void
+iptv_udp_rx_destroy ( iptv_udp_rx_t *rx )
+{
+  free(rx->data);
+  free(rx);
+}
+
+/*
+ * Update drop counter from kernel overflow count (cumulative)
+ */
+static void
+iptv_udp_rx_drops ( iptv_mux_t *im, struct msghdr *mh )
+{
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *cmsg;
+  uint32_t ovfl;
+
+  for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+      continue;
+    memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+    if (ovfl != im->mm_iptv_rxq_ovfl) {
+      if (im->mm_active)
+        im->mm_active->mmi_stats.drop += ovfl - im->mm_iptv_rxq_ovfl;
+      im->mm_iptv_rxq_ovfl = ovfl;
+    }
+  }
+#endif
+}
+
+/*
+ * Drain the socket into the mux buffer
+ *
+ * Datagrams are fetched IPTV_UDP_BATCH at a time until the socket is
+ * empty or a buffer's worth of data has been queued, each datagram is
+ * handed to the per-scheme callback which appends the payload so the
+ * whole lot can be passed on with a single call to
+ * iptv_input_recv_packets().
+ */
+static ssize_t
+iptv_udp_drain
+  ( iptv_mux_t *im, int fd,
+    void (*input)(iptv_mux_t *im, uint8_t *data, ssize_t len) )
+{
+  int i, n;
+  ssize_t len, total = 0;
+  size_t trunc = 0;
+  iptv_udp_rx_t *rx = im->mm_iptv_rx;
+
+  /* Room for a full frame less the IP and UDP headers */
+  if (!rx)
+    rx = im->mm_iptv_rx =
+      iptv_udp_rx_create(MAX(IPTV_UDP_DGRAM_SIZE, im->mm_iptv_mtu - 28));
+
+  while (total < IPTV_PKT_SIZE) {
+    if ((n = iptv_udp_recvmmsg(fd, rx)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      return total ?: -1;
+    }
+    for (i = 0; i < n; i++) {
+      struct msghdr *mh = &rx->msg[i].msg_hdr;
+      len    = rx->msg[i].msg_len;
+      total += len;
+      if (fd == im->mm_iptv_fd)
+        iptv_udp_rx_drops(im, mh);
+      if (mh->msg_flags & MSG_TRUNC) {
+        if (im->mm_active)
+          im->mm_active->mmi_stats.drop++;
+        trunc = MAX(trunc, (size_t)len);
+        continue;
+      }
+      input(im, rx->iov[i].iov_base, len);
+    }
+
+    /* Lost a datagram, make room for the next one (the length is only
+       known with MSG_TRUNC, else just double) */
+    if (trunc && rx->size < IPTV_UDP_DGRAM_MAX) {
+      char name[256];
+      trunc = MIN(IPTV_UDP_DGRAM_MAX, MAX(trunc, rx->size * 2));
+      im->mm_display_name((mpegts_mux_t*)im, name, sizeof(name));
+      tvhwarn("iptv", "%s - datagram truncated, receive slots now %zu bytes",
+              name, trunc);
+      iptv_udp_rx_alloc(rx, trunc);
+      trunc = 0;
+    }
+    if (n < IPTV_UDP_BATCH)
+      break;
+  }
+
+  return total;
+}
+
+/*
+ * Open, bind and join a UDP socket
+ */
+static int
+iptv_udp_bind
+  ( iptv_mux_t *im, const char *host, int port, const char *name )
 {
   int fd, solip, rxsize, reuse = 1, ipv6 = 0;
+  socklen_t len;
   struct ifreq ifr;
   struct in_addr saddr;
   struct in6_addr s6addr;
-  char name[256], buf[256];
-
-  im->mm_display_name((mpegts_mux_t*)im, name, sizeof(name));
+  char buf[256];
 
   /* Determine if this is IPv6 */
-  if (!inet_pton(AF_INET, url->host, &saddr)) {
+  if (!inet_pton(AF_INET, host, &saddr)) {
     ipv6 = 1;
-    if (!inet_pton(AF_INET6, url->host, &s6addr)) {
+    if (!inet_pton(AF_INET6, host, &s6addr)) {
       tvherror("iptv", "%s - failed to process host", name);
-      return SM_CODE_TUNING_FAILED;
+      return -1;
     }
   }
 
@@ -66,7 +241,7 @@ iptv_udp_start ( iptv_mux_t *im, const url_t *url )
   if ((fd = tvh_socket(ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, 0)) == -1) {
     tvherror("iptv", "%s - failed to create socket [%s]",
              name, strerror(errno));
-    return SM_CODE_TUNING_FAILED;
+    return -1;
   }
 
   /* Mark reuse address */
@@ -92,7 +267,7 @@ iptv_udp_start ( iptv_mux_t *im, const url_t *url )
 
     /* Bind */
     sin.sin_family = AF_INET;
-    sin.sin_port   = htons(url->port);
+    sin.sin_port   = htons(port);
     sin.sin_addr   = saddr;
     if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
       inet_ntop(AF_INET, &sin.sin_addr, buf, sizeof(buf));
@@ -134,7 +309,7 @@ iptv_udp_start ( iptv_mux_t *im, const url_t *url )
 
     /* Bind */
     sin.sin6_family = AF_INET6;
-    sin.sin6_port   = htons(url->port);
+    sin.sin6_port   = htons(port);
     sin.sin6_addr   = s6addr;
     if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
       inet_ntop(AF_INET6, &sin.sin6_addr, buf, sizeof(buf));
@@ -162,72 +337,148 @@ iptv_udp_start ( iptv_mux_t *im, const url_t *url )
 #endif
   }
     
+  /* Largest datagram expected */
+  if (ifr.ifr_name[0] && !ioctl(fd, SIOCGIFMTU, &ifr))
+    im->mm_iptv_mtu = MAX(im->mm_iptv_mtu, ifr.ifr_mtu);
+
   /* Increase RX buffer size */
-  rxsize = IPTV_PKT_SIZE;
+  rxsize = (im->mm_iptv_rcvbuf ?: IPTV_UDP_RCVBUF) * 1024;
   if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rxsize, sizeof(rxsize)) == -1)
     tvhwarn("iptv", "%s - cannot increase UDP rx buffer size [%s]",
             name, strerror(errno));
+  len = sizeof(rxsize);
+  if (!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rxsize, &len))
+    tvhdebug("iptv", "%s - UDP rx buffer size %d (port %d)",
+             name, rxsize, port);
 
-  /* Done */
-  im->mm_iptv_fd = fd;
-  iptv_input_mux_started(im);
-  return 0;
+  /* Report kernel receive queue drops */
+#ifdef SO_RXQ_OVFL
+  reuse = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &reuse, sizeof(reuse)) == -1)
+    tvhwarn("iptv", "%s - cannot enable UDP drop reporting [%s]",
+            name, strerror(errno));
+#endif
+
+  return fd;
 
 error:
   close(fd);
   return -1;
 }
 
+/*
+ * Connect UDP/RTP
+ */
+static int
+iptv_udp_start ( iptv_mux_t *im, const url_t *url )
+{
+  int fd;
+  char name[256];
+
+  im->mm_display_name((mpegts_mux_t*)im, name, sizeof(name));
+
+  if ((fd = iptv_udp_bind(im, url->host, url->port, name)) < 0)
+    return SM_CODE_TUNING_FAILED;
+  im->mm_iptv_fd       = fd;
+  im->mm_iptv_rxq_ovfl = 0;
+
+  /* SMPTE 2022-1 FEC (column stream on port+2, row stream on port+4) */
+  if (im->mm_iptv_fec && !strcmp(url->scheme, "rtp")) {
+    im->mm_iptv_fec_fd[0] = iptv_udp_bind(im, url->host, url->port + 2, name);
+    im->mm_iptv_fec_fd[1] = iptv_udp_bind(im, url->host, url->port + 4, name);
+  }
+
+  iptv_input_mux_started(im);
+  return 0;
+}
+
+static void
+iptv_udp_input ( iptv_mux_t *im, uint8_t *data, ssize_t len )
+{
+  sbuf_append(&im->mm_iptv_buffer, data, len);
+}
+
 static ssize_t
 iptv_udp_read ( iptv_mux_t *im, size_t *off )
 {
-  return sbuf_read(&im->mm_iptv_buffer, im->mm_iptv_fd);
+  return iptv_udp_drain(im, im->mm_iptv_fd, iptv_udp_input);
 }
 
+/*
+ * RTP header length (or -1 if invalid)
+ */
 static ssize_t
-iptv_rtp_read ( iptv_mux_t *im, size_t *off )
+iptv_rtp_header_len ( const uint8_t *rtp, ssize_t len )
 {
-  ssize_t len, hlen;
-  int      ptr = im->mm_iptv_buffer.sb_ptr;
-  uint8_t *rtp = im->mm_iptv_buffer.sb_data + ptr;
-
-  /* Raw packet */
-  len = iptv_udp_read(im, NULL);
-  if (len < 0)
-    return -1;
+  ssize_t hlen;
 
-  /* Strip RTP header */
   if (len < 12)
-    goto ignore;
+    return -1;
 
   /* Version 2 */
   if ((rtp[0] & 0xC0) != 0x80)
-    goto ignore;
-
-  /* MPEG-TS */
-  if ((rtp[1] & 0x7F) != 33)
-    goto ignore;
+    return -1;
 
   /* Header length (4bytes per CSRC) */
   hlen = ((rtp[0] & 0xf) * 4) + 12;
   if (rtp[0] & 0x10) {
     if (len < hlen+4)
-      goto ignore;
+      return -1;
     hlen += ((rtp[hlen+2] << 8) | rtp[hlen+3]) * 4;
     hlen += 4;
   }
-  if (len < hlen || ((len - hlen) % 188) != 0)
+  if (len < hlen)
+    return -1;
+
+  return hlen;
+}
+
+static void
+iptv_rtp_payload ( iptv_mux_t *im, uint8_t *rtp, ssize_t len )
+{
+  ssize_t hlen;
+
+  /* Strip RTP header */
+  if ((hlen = iptv_rtp_header_len(rtp, len)) < 0)
+    goto ignore;
+
+  /* MPEG-TS */
+  if ((rtp[1] & 0x7F) != 33)
     goto ignore;
 
-  /* Cut header */
-  memmove(rtp, rtp+hlen, len-hlen);
-  im->mm_iptv_buffer.sb_ptr -= hlen;
+  if (((len - hlen) % 188) != 0)
+    goto ignore;
 
-  return len;
+  /* Pass on (in sequence order) */
+  iptv_rtp_input(im, (rtp[2] << 8) | rtp[3], rtp + hlen, len - hlen);
+  return;
 
 ignore:
-  printf("ignore\n");
-  im->mm_iptv_buffer.sb_ptr = ptr; // reset
+  if (im->mm_active)
+    im->mm_active->mmi_stats.drop++;
+}
+
+static void
+iptv_rtp_fec_payload ( iptv_mux_t *im, uint8_t *rtp, ssize_t len )
+{
+  ssize_t hlen;
+
+  if ((hlen = iptv_rtp_header_len(rtp, len)) >= 0)
+    iptv_rtp_fec_input(im, rtp + hlen, len - hlen);
+}
+
+static ssize_t
+iptv_rtp_read ( iptv_mux_t *im, size_t *off )
+{
+  int i;
+  ssize_t len = iptv_udp_drain(im, im->mm_iptv_fd, iptv_rtp_payload);
+
+  /* FEC (polled along with the media, just drain all of them) */
+  for (i = 0; i < ARRAY_SIZE(im->mm_iptv_fec_fd); i++)
+    if (im->mm_iptv_fec_fd[i] >= 0)
+      iptv_udp_drain(im, im->mm_iptv_fec_fd[i], iptv_rtp_fec_payload);
+
+  iptv_rtp_flush(im);
   return len;
 }
 
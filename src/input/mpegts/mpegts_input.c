@@ -250,6 +250,58 @@ mps_cmp ( mpegts_pid_sub_t *a, mpegts_pid_sub_t *b )
   return 0;
 }
 
+/*
+ * Precompute the per PID delivery info used by mpegts_input_process(),
+ * must be called (with mi_output_lock held) whenever the subscriptions
+ * on the PID or the set of active services change
+ */
+static void
+mpegts_input_update_pid
+  ( mpegts_input_t *mi, mpegts_mux_t *mm, mpegts_pid_t *mp )
+{
+  mpegts_pid_sub_t *mps, skel;
+  service_t *s;
+  int type = MPS_NONE, n = 0;
+
+  if (mp->mp_pid == 0)
+    type = MPS_STREAM | MPS_TABLE;
+  else
+    RB_FOREACH(mps, &mp->mp_subs, mps_link)
+      type |= mps->mps_type;
+
+  free(mp->mp_svcs);
+  mp->mp_svcs = NULL;
+
+  /* Stream data goes to all services on the mux for table PIDs,
+   * otherwise only to the services that registered the PID */
+  if (type & MPS_STREAM) {
+    LIST_FOREACH(s, &mi->mi_transports, s_active_link)
+      n++;
+    if (n)
+      mp->mp_svcs = malloc(n * sizeof(mpegts_service_t*));
+    n = 0;
+    skel.mps_type = MPS_STREAM;
+    LIST_FOREACH(s, &mi->mi_transports, s_active_link) {
+      if (((mpegts_service_t*)s)->s_dvb_mux != mm) continue;
+      skel.mps_owner = s;
+      if ((type & MPS_TABLE) ||
+          RB_FIND(&mp->mp_subs, &skel, mps_link, mps_cmp))
+        mp->mp_svcs[n++] = (mpegts_service_t*)s;
+    }
+  }
+
+  mp->mp_type       = type;
+  mp->mp_svcs_count = n;
+}
+
+static void
+mpegts_input_update_pids ( mpegts_input_t *mi, mpegts_mux_t *mm )
+{
+  mpegts_pid_t *mp;
+  RB_FOREACH(mp, &mm->mm_pids, mp_link)
+    mpegts_input_update_pid(mi, mm, mp);
+}
+
 mpegts_pid_t *
 mpegts_input_open_pid
   ( mpegts_input_t *mi, mpegts_mux_t *mm, int pid, int type, void *owner )
@@ -266,6 +318,7 @@ mpegts_input_open_pid
       tvhdebug("mpegts", "%s - open PID %04X (%d) [%d/%p]",
                buf, mp->mp_pid, mp->mp_pid, type, owner);
       SKEL_USED(mpegts_pid_sub_skel);
+      mpegts_input_update_pid(mi, mm, mp);
     }
   }
   return mp;
@@ -284,23 +337,23 @@ mpegts_input_close_pid
   skel.mps_type  = type;
   skel.mps_owner = owner;
   mps = RB_FIND(&mp->mp_subs, &skel, mps_link, mps_cmp);
-  if (pid == mm->mm_last_pid) {
-    mm->mm_last_pid = -1;
-    mm->mm_last_mp = NULL;
-  }
   if (mps) {
     RB_REMOVE(&mp->mp_subs, mps, mps_link);
     free(mps);
 
     if (!RB_FIRST(&mp->mp_subs)) {
       RB_REMOVE(&mm->mm_pids, mp, mp_link);
+      mm->mm_pid_table[mp->mp_pid] = NULL;
       if (mp->mp_fd != -1) {
         mm->mm_display_name(mm, buf, sizeof(buf));
         tvhdebug("mpegts", "%s - close PID %04X (%d) [%d/%p]",
                buf, mp->mp_pid, mp->mp_pid, type, owner);
         close(mp->mp_fd);
       }
+      free(mp->mp_svcs);
       free(mp);
+    } else {
+      mpegts_input_update_pid(mi, mm, mp);
     }
   }
 }
@@ -323,6 +376,7 @@ mpegts_input_open_service ( mpegts_input_t *mi, mpegts_service_t *s, int init )
   mi->mi_open_pid(mi, s->s_dvb_mux, s->s_pcr_pid, MPS_STREAM, s);
   TAILQ_FOREACH(st, &s->s_components, es_link)
     mi->mi_open_pid(mi, s->s_dvb_mux, st->es_pid, MPS_STREAM, s);
+  mpegts_input_update_pids(mi, s->s_dvb_mux);
 
   pthread_mutex_unlock(&s->s_stream_mutex);
   pthread_mutex_unlock(&mi->mi_output_lock);
@@ -357,7 +411,7 @@ mpegts_input_close_service ( mpegts_input_t *mi, mpegts_service_t *s )
   mi->mi_close_pid(mi, s->s_dvb_mux, s->s_pcr_pid, MPS_STREAM, s);
   TAILQ_FOREACH(st, &s->s_components, es_link)
     mi->mi_close_pid(mi, s->s_dvb_mux, st->es_pid, MPS_STREAM, s);
-
+  mpegts_input_update_pids(mi, s->s_dvb_mux);
 
   pthread_mutex_unlock(&s->s_stream_mutex);
   pthread_mutex_unlock(&mi->mi_output_lock);
@@ -438,26 +492,105 @@ mpegts_input_has_subscription ( mpegts_input_t *mi, mpegts_mux_t *mm )
  * *************************************************************************/
 
 static int inline
-ts_sync_count ( const uint8_t *tsb, int len )
+ts_sync_count ( const uint8_t *tsb, int len, int stride )
 {
   int i = 0;
-  while (len >= 188 && *tsb == 0x47) {
+  while (len >= stride && *tsb == 0x47) {
     ++i;
-    len -= 188;
-    tsb += 188;
+    len -= stride;
+    tsb += stride;
   }
   return i;
 }
 
+/*
+ * Copy a batch of packets into the input ring (producer side)
+ */
+static void
+mpegts_input_ring_put
+  ( mpegts_input_t *mi, mpegts_mux_t *mm, const uint8_t *tsb, uint32_t p,
+    int stride )
+{
+  mpegts_ring_t *mr = &mi->mi_input_ring;
+  pktbuf_t *pb;
+  uint8_t *dst;
+  uint32_t head, space, idx, seg, n, i;
+
+  pthread_mutex_lock(&mr->mr_put_lock);
+
+  /* Allocate (lazily, idle inputs don't need the memory) */
+  if (!mr->mr_seg) {
+    mr->mr_seg  = calloc(MPEGTS_RING_SEGS, sizeof(pktbuf_t*));
+    for (i = 0; i < MPEGTS_RING_SEGS; i++)
+      mr->mr_seg[i] = pktbuf_alloc(NULL, MPEGTS_RING_SEG_SLOTS * 188);
+    mr->mr_mux  = calloc(MPEGTS_RING_SLOTS, sizeof(mpegts_mux_t*));
+    __sync_synchronize();
+  }
+
+  /* Check space (keeping one segment spare, see mpegts.h) */
+  head  = mr->mr_head;
+  space = MPEGTS_RING_SLOTS - MPEGTS_RING_SEG_SLOTS - (head - mr->mr_tail);
+  if (p > space) {
+    atomic_add(&mr->mr_overrun, 1);
+    atomic_add(&mr->mr_dropped, p - space);
+    p = space;
+  }
+  if (!p) {
+    pthread_mutex_unlock(&mr->mr_put_lock);
+    return;
+  }
+
+  /* Copy (by segment, M2TS/RS packets are stripped to 188 bytes) */
+  while (p) {
+    idx = head & (MPEGTS_RING_SLOTS - 1);
+    seg = idx / MPEGTS_RING_SEG_SLOTS;
+    n   = MIN(p, MPEGTS_RING_SEG_SLOTS - (idx & (MPEGTS_RING_SEG_SLOTS - 1)));
+
+    /* Entering a segment still referenced by slices, replace it */
+    pb  = mr->mr_seg[seg];
+    if (!(idx & (MPEGTS_RING_SEG_SLOTS - 1)) && pb->pb_refcount > 1) {
+      mr->mr_seg[seg] = pktbuf_alloc(NULL, MPEGTS_RING_SEG_SLOTS * 188);
+      pktbuf_ref_dec(pb);
+      pb = mr->mr_seg[seg];
+    }
+
+    dst = pb->pb_data + ((idx & (MPEGTS_RING_SEG_SLOTS - 1)) * 188);
+    if (stride == 188)
+      memcpy(dst, tsb, n * 188);
+    else
+      for (i = 0; i < n; i++)
+        memcpy(dst + (i * 188), tsb + (i * stride), 188);
+    for (i = 0; i < n; i++)
+      mr->mr_mux[idx + i] = mm;
+    tsb  += n * stride;
+    head += n;
+    p    -= n;
+  }
+
+  /* Publish */
+  __sync_synchronize();
+  mr->mr_head = head;
+  __sync_synchronize();
+
+  pthread_mutex_unlock(&mr->mr_put_lock);
+
+  /* Wakeup (only if consumer is asleep) */
+  if (mr->mr_waiting) {
+    pthread_mutex_lock(&mi->mi_input_lock);
+    pthread_cond_signal(&mi->mi_input_cond);
+    pthread_mutex_unlock(&mi->mi_input_lock);
+  }
+}
+
 void
 mpegts_input_recv_packets
   ( mpegts_input_t *mi, mpegts_mux_instance_t *mmi, sbuf_t *sb, size_t off,
     int64_t *pcr, uint16_t *pcr_pid )
 {
   int i, p = 0;
-  mpegts_packet_t *mp;
   uint8_t *tsb = sb->sb_data + off;
   int     len  = sb->sb_ptr  - off;
+  int  stride  = mmi->mmi_ts_stride ?: 188;
 #define MIN_TS_PKT 10
 #define MIN_TS_SYN 5
 
@@ -465,12 +598,20 @@ mpegts_input_recv_packets
     return;
 
   /* Check for sync */
-// could be a bit more efficient
-  while ( (len >= (MIN_TS_SYN * 188)) &&
-          ((p = ts_sync_count(tsb, len)) < MIN_TS_SYN) ) {
-    --len;
-    ++tsb;
-    ++off;
+  if ((p = ts_sync_count(tsb, len, stride)) < MIN_TS_SYN) {
+    if ((i = ts_sync_find(tsb, len, MIN_TS_SYN, &stride)) < 0) {
+      /* Keep the tail, it may hold the start of the next lattice */
+      i = MAX(0, len - (MIN_TS_SYN * 204));
+      p = 0;
+    } else {
+      if (stride != mmi->mmi_ts_stride && stride != 188)
+        tvhdebug("mpegts", "detected %d byte TS packets", stride);
+      mmi->mmi_ts_stride = stride;
+      p = ts_sync_count(tsb + i, len - i, stride);
+    }
+    len -= i;
+    tsb += i;
+    off += i;
   }
 
   // Note: we check for sync here so that the buffer can always be
@@ -487,27 +628,15 @@ mpegts_input_recv_packets
         ts_recv_packet1(NULL, tmp, pcr, 0);
         if (*pcr != PTS_UNSET) *pcr_pid = pid;
       }
-      tmp += 188;
+      tmp += stride;
     }
   }
 
   /* Pass */
   if (p >= MIN_TS_SYN) {
-    size_t sz = sizeof(mpegts_packet_t) + (p * 188);
-    
-    mp = calloc(1, sz);
-    mp->mp_mux  = mmi->mmi_mux;
-    mp->mp_len  = p * 188;
-    memcpy(mp->mp_data, tsb, mp->mp_len);
-
-    len -= mp->mp_len;
-    off += mp->mp_len;
-
-    pthread_mutex_lock(&mi->mi_input_lock);
-    if (TAILQ_FIRST(&mi->mi_input_queue) == NULL)
-      pthread_cond_signal(&mi->mi_input_cond);
-    TAILQ_INSERT_TAIL(&mi->mi_input_queue, mp, mp_link);
-    pthread_mutex_unlock(&mi->mi_input_lock);
+    mpegts_input_ring_put(mi, mmi->mmi_mux, tsb, p, stride);
+    len -= p * stride;
+    off += p * stride;
   }
 
   /* Adjust buffer */
@@ -517,27 +646,53 @@ mpegts_input_recv_packets
     sb->sb_ptr = 0;    // clear
 }
 
+/*
+ * Table feed chunk pool (protected by mi_output_lock)
+ */
+#define MPEGTS_TABLE_FEED_POOL 16
+
+static mpegts_table_feed_t *
+mpegts_input_table_feed_alloc ( mpegts_input_t *mi )
+{
+  mpegts_table_feed_t *mtf;
+  if ((mtf = TAILQ_FIRST(&mi->mi_table_feed_pool))) {
+    TAILQ_REMOVE(&mi->mi_table_feed_pool, mtf, mtf_link);
+    mi->mi_table_feed_pool_count--;
+  } else {
+    mtf = malloc(sizeof(mpegts_table_feed_t));
+  }
+  mtf->mtf_len = 0;
+  return mtf;
+}
+
+static void
+mpegts_input_table_feed_free ( mpegts_input_t *mi, mpegts_table_feed_t *mtf )
+{
+  if (mi->mi_table_feed_pool_count < MPEGTS_TABLE_FEED_POOL) {
+    TAILQ_INSERT_HEAD(&mi->mi_table_feed_pool, mtf, mtf_link);
+    mi->mi_table_feed_pool_count++;
+  } else {
+    free(mtf);
+  }
+}
+
 static void
 mpegts_input_process
-  ( mpegts_input_t *mi, mpegts_packet_t *mp )
+  ( mpegts_input_t *mi, mpegts_mux_t *mm, pktbuf_t *seg, int off, int len )
 {
-  int len = mp->mp_len;
-  int i = 0, table_wakeup = 0;
-  int table, stream;
-  uint8_t *tsb = mp->mp_data;
-  mpegts_mux_t          *mm  = mp->mp_mux;
+  int i = 0, k, table_wakeup = 0;
+  uint8_t *tsb = seg->pb_data + off;
   mpegts_mux_instance_t *mmi = mm->mm_active;
-  mpegts_pid_t *last_mp = NULL;
 
   /* Process */
   while ( len >= 188 ) {
     mpegts_pid_t *mp;
-    mpegts_pid_sub_t *mps;
-    service_t *s;
+    mpegts_service_t *s;
     int pid = ((tsb[i+1] & 0x1f) << 8) | tsb[i+2];
     int cc  = (tsb[i+3] & 0x0f);
     int pl  = (tsb[i+3] & 0x10) ? 1 : 0;
     int te  = (tsb[i+1] & 0x80);
+    int table;
 
     /* Ignore NUL packets */
     if (pid == 0x1FFF) goto done;
@@ -558,53 +713,31 @@ mpegts_input_process
         mp->mp_cc = (cc + 1) & 0xF;
       }
 
-      // Note: there is a minor danger this caching will get things
-      //       wrong for a brief period of time if the registrations on
-      //       the PID change
-      if (mp != last_mp) {
-        if (pid == 0)
-          stream = table = 1;
-        else {
-          stream = table = 0;
-
-          /* Determine PID type */
-          RB_FOREACH(mps, &mp->mp_subs, mps_link) {
-            if (mps->mps_type & MPS_STREAM)
-              stream = 1;
-            if (mps->mps_type & MPS_TABLE)
-              table  = 1;
-            if (table && stream) break;
-          }
-
-          /* Special case streams */
-          LIST_FOREACH(s, &mi->mi_transports, s_active_link) {
-            if (((mpegts_service_t*)s)->s_dvb_mux != mmi->mmi_mux) continue;
-                 if (pid == s->s_pmt_pid) stream = 1;
-            else if (pid == s->s_pcr_pid) stream = 1;
-          }
-        }
-      }
+      table = mp->mp_type & MPS_TABLE;
     
       /* Stream data */
-      if (stream) {
-        LIST_FOREACH(s, &mi->mi_transports, s_active_link) {
-          int f;
-          if (((mpegts_service_t*)s)->s_dvb_mux != mmi->mmi_mux) continue;
-          f = table || (pid == s->s_pmt_pid) || (pid == s->s_pcr_pid);
-          ts_recv_packet1((mpegts_service_t*)s, tsb+i, NULL, f);
-        }
+      for (k = 0; k < mp->mp_svcs_count; k++) {
+        s = mp->mp_svcs[k];
+        ts_recv_packet1(s, tsb+i, NULL,
+                        table || pid == s->s_pmt_pid || pid == s->s_pcr_pid);
       }
 
       /* Table data */
       if (table) {
         if (!(tsb[i+1] & 0x80)) {
-          // TODO: might be able to optimise this a bit by having slightly
-          //       larger buffering and trying to aggregate data (if we get
-          //       same PID multiple times in the loop)
-          mpegts_table_feed_t *mtf = malloc(sizeof(mpegts_table_feed_t));
-          memcpy(mtf->mtf_tsb, tsb+i, 188);
-          mtf->mtf_mux = mm;
-          TAILQ_INSERT_TAIL(&mi->mi_table_queue, mtf, mtf_link);
+          // Note: the last chunk can only still be queued if the table
+          //       thread has not picked it up yet (we hold mi_output_lock)
+          mpegts_table_feed_t *mtf =
+            TAILQ_LAST(&mi->mi_table_queue, mpegts_table_feed_queue);
+          if (!mtf || mtf->mtf_mux != mm ||
+              mtf->mtf_len >= sizeof(mtf->mtf_tsb)) {
+            mtf = mpegts_input_table_feed_alloc(mi);
+            mtf->mtf_mux = mm;
+            TAILQ_INSERT_TAIL(&mi->mi_table_queue, mtf, mtf_link);
+          }
+          memcpy(mtf->mtf_tsb + mtf->mtf_len, tsb+i, 188);
+          mtf->mtf_len += 188;
+          mi->mi_table_backlog++;
           table_wakeup = 1;
         } else {
           //tvhdebug("tsdemux", "%s - SI packet had errors", name);
@@ -617,10 +750,10 @@ done:
     len -= 188;
   }
 
-  /* Raw stream */
+  /* Raw stream (delivered straight out of the ring segment) */
   if (i > 0 && LIST_FIRST(&mmi->mmi_streaming_pad.sp_targets) != NULL) {
     streaming_message_t sm;
-    pktbuf_t *pb = pktbuf_alloc(tsb, i);
+    pktbuf_t *pb = pktbuf_slice(seg, off, i);
     memset(&sm, 0, sizeof(sm));
     sm.sm_type = SMT_MPEGTS;
     sm.sm_data = pb;
@@ -639,75 +772,113 @@ done:
 static void *
 mpegts_input_thread ( void * p )
 {
-  mpegts_packet_t *mp;
-  mpegts_input_t  *mi = p;
+  mpegts_input_t *mi = p;
+  mpegts_ring_t  *mr = &mi->mi_input_ring;
+  mpegts_mux_t   *mm;
+  uint32_t head, tail = mr->mr_tail, idx, off, n;
 
-  pthread_mutex_lock(&mi->mi_input_lock);
   while (mi->mi_running) {
 
-    /* Wait for a packet */
-    if (!(mp = TAILQ_FIRST(&mi->mi_input_queue))) {
-      pthread_cond_wait(&mi->mi_input_cond, &mi->mi_input_lock);
+    /* Wait for data */
+    head = mr->mr_head;
+    if (head == tail) {
+      pthread_mutex_lock(&mi->mi_input_lock);
+      mr->mr_waiting = 1;
+      __sync_synchronize();
+      if (mr->mr_head == tail && mi->mi_running)
+        pthread_cond_wait(&mi->mi_input_cond, &mi->mi_input_lock);
+      mr->mr_waiting = 0;
+      pthread_mutex_unlock(&mi->mi_input_lock);
       continue;
     }
-    TAILQ_REMOVE(&mi->mi_input_queue, mp, mp_link);
-    pthread_mutex_unlock(&mi->mi_input_lock);
-      
-    /* Process */
+    __sync_synchronize();
+
+    /* Process run of slots belonging to the same mux (within a segment) */
+    idx = tail & (MPEGTS_RING_SLOTS - 1);
+    off = idx & (MPEGTS_RING_SEG_SLOTS - 1);
+    n   = 1;
     pthread_mutex_lock(&mi->mi_output_lock);
-    if (mp->mp_mux && mp->mp_mux->mm_active)
-      mpegts_input_process(mi, mp);
+    mm  = mr->mr_mux[idx];
+    while (tail + n != head && off + n < MPEGTS_RING_SEG_SLOTS &&
+           mr->mr_mux[idx + n] == mm)
+      n++;
+    if (mm && mm->mm_active)
+      mpegts_input_process(mi, mm, mr->mr_seg[idx / MPEGTS_RING_SEG_SLOTS],
+                           off * 188, n * 188);
     pthread_mutex_unlock(&mi->mi_output_lock);
 
-    /* Cleanup */
-    free(mp);
-    pthread_mutex_lock(&mi->mi_input_lock);
-  }
-
-  /* Flush */
-  while ((mp = TAILQ_FIRST(&mi->mi_input_queue))) {
-    TAILQ_REMOVE(&mi->mi_input_queue, mp, mp_link);
-    free(mp);
+    /* Release */
+    tail += n;
+    __sync_synchronize();
+    mr->mr_tail = tail;
   }
-  pthread_mutex_unlock(&mi->mi_input_lock);
 
   return NULL;
 }
 
 static void
-mpegts_input_table_dispatch ( mpegts_mux_t *mm, mpegts_table_feed_t *mtf )
+mpegts_input_table_dispatch ( mpegts_mux_t *mm, const uint8_t *tsb, int len )
 {
-  int      i   = 0;
-  int      len = mm->mm_num_tables;
-  uint16_t pid = ((mtf->mtf_tsb[1] & 0x1f) << 8) | mtf->mtf_tsb[2];
-  uint8_t  cc  = (mtf->mtf_tsb[3] & 0x0f);
-  mpegts_table_t *mt, *vec[len];
-
-  /* Collate - tables may be removed during callbacks */
-  LIST_FOREACH(mt, &mm->mm_tables, mt_link) {
-    vec[i++] = mt;
-    mt->mt_refcount++;
-  }
-  assert(i == len);
-
-  /* Process */
-  for (i = 0; i < len; i++) {
-    mt = vec[i];
-    if (!mt->mt_destroyed && mt->mt_pid == pid) {
-      if (mtf->mtf_tsb[3] & 0x10) {
-        int ccerr = 0;
-        if (mt->mt_cc != -1 && mt->mt_cc != cc) {
-          ccerr = 1;
-          /* Ignore dupes (shouldn't have payload set, but some seem to) */
-          //if (((mt->mt_cc + 15) & 0xf) != cc)
-          tvhdebug("psi", "PID %04X CC error %d != %d", pid, cc, mt->mt_cc);
-         }
-        mt->mt_cc = (cc + 1) & 0xF;
-        mpegts_psi_section_reassemble(&mt->mt_sect, mtf->mtf_tsb, 0, ccerr,
-                                      mpegts_table_dispatch, mt);
+  int      i, n, r;
+  uint16_t pid;
+  uint8_t  cc;
+  mpegts_table_t *mt;
+
+  while (len >= 188) {
+    pid = ((tsb[1] & 0x1f) << 8) | tsb[2];
+
+    /* Run of packets on the same PID */
+    for (r = 188; r < len; r += 188)
+      if ((((tsb[r+1] & 0x1f) << 8) | tsb[r+2]) != pid)
+        break;
+
+    /* Count */
+    n = 0;
+    LIST_FOREACH(mt, &mm->mm_table_hash[pid & (MPEGTS_TABLE_HASH - 1)],
+                 mt_pid_link)
+      if (mt->mt_pid == pid)
+        n++;
+
+    if (n) {
+      mpegts_table_t *vec[n];
+
+      /* Collate - tables may be removed during callbacks */
+      i = 0;
+      LIST_FOREACH(mt, &mm->mm_table_hash[pid & (MPEGTS_TABLE_HASH - 1)],
+                   mt_pid_link) {
+        if (mt->mt_pid != pid) continue;
+        vec[i++] = mt;
+        mt->mt_refcount++;
+      }
+      assert(i == n);
+
+      /* Process */
+      for (r -= 188; r >= 0; r -= 188, tsb += 188, len -= 188) {
+        if (!(tsb[3] & 0x10)) continue;
+        cc = (tsb[3] & 0x0f);
+        for (i = 0; i < n; i++) {
+          int ccerr = 0;
+          mt = vec[i];
+          if (mt->mt_destroyed) continue;
+          if (mt->mt_cc != -1 && mt->mt_cc != cc) {
+            ccerr = 1;
+            /* Ignore dupes (shouldn't have payload set, but some seem to) */
+            //if (((mt->mt_cc + 15) & 0xf) != cc)
+            tvhdebug("psi", "PID %04X CC error %d != %d", pid, cc, mt->mt_cc);
+          }
+          mt->mt_cc = (cc + 1) & 0xF;
+          mpegts_psi_section_reassemble(&mt->mt_sect, tsb, 0, ccerr,
+                                        mpegts_table_dispatch, mt);
+        }
       }
+
+      for (i = 0; i < n; i++)
+        mpegts_table_release(vec[i]);
+
+    } else {
+      tsb += r;
+      len -= r;
     }
-    mpegts_table_release(mt);
   }
 }
 
@@ -731,13 +902,14 @@ mpegts_input_table_thread ( void *aux )
     /* Process */
     if (mtf->mtf_mux) {
       pthread_mutex_lock(&global_lock);
-      mpegts_input_table_dispatch(mtf->mtf_mux, mtf);
+      mpegts_input_table_dispatch(mtf->mtf_mux, mtf->mtf_tsb, mtf->mtf_len);
       pthread_mutex_unlock(&global_lock);
     }
 
     /* Cleanup */
-    free(mtf);
     pthread_mutex_lock(&mi->mi_output_lock);
+    mi->mi_table_backlog -= mtf->mtf_len / 188;
+    mpegts_input_table_feed_free(mi, mtf);
   }
 
   /* Flush */
@@ -745,6 +917,12 @@ mpegts_input_table_thread ( void *aux )
     TAILQ_REMOVE(&mi->mi_table_queue, mtf, mtf_link);
     free(mtf);
   }
+  while ((mtf = TAILQ_FIRST(&mi->mi_table_feed_pool)) != NULL) {
+    TAILQ_REMOVE(&mi->mi_table_feed_pool, mtf, mtf_link);
+    free(mtf);
+  }
+  mi->mi_table_feed_pool_count = 0;
+  mi->mi_table_backlog = 0;
   pthread_mutex_unlock(&mi->mi_output_lock);
 
   return NULL;
@@ -755,22 +933,22 @@ mpegts_input_flush_mux
   ( mpegts_input_t *mi, mpegts_mux_t *mm )
 {
   mpegts_table_feed_t *mtf;
-  mpegts_packet_t *mp;
+  mpegts_ring_t *mr = &mi->mi_input_ring;
+  uint32_t i, head;
 
   // Note: to avoid long delays in here, rather than actually
   //       remove things from the Q, we simply invalidate by clearing
   //       the mux pointer and allow the threads to deal with the deletion
 
-  /* Flush input Q */
-  pthread_mutex_lock(&mi->mi_input_lock);
-  TAILQ_FOREACH(mp, &mi->mi_input_queue, mp_link) {
-    if (mp->mp_mux == mm)
-      mp->mp_mux = NULL;
-  }
-  pthread_mutex_unlock(&mi->mi_input_lock);
+  /* Flush input ring (consumer reads mux pointers under mi_output_lock) */
+  pthread_mutex_lock(&mi->mi_output_lock);
+  head = mr->mr_head;
+  __sync_synchronize();
+  for (i = mr->mr_tail; i != head; i++)
+    if (mr->mr_mux[i & (MPEGTS_RING_SLOTS - 1)] == mm)
+      mr->mr_mux[i & (MPEGTS_RING_SLOTS - 1)] = NULL;
 
   /* Flush table Q */
-  pthread_mutex_lock(&mi->mi_output_lock);
   TAILQ_FOREACH(mtf, &mi->mi_table_queue, mtf_link) {
     if (mtf->mtf_mux == mm)
       mtf->mtf_mux = NULL;
@@ -816,6 +994,10 @@ mpegts_input_stream_status
   st->max_weight  = w;
   st->stats       = mmi->mmi_stats;
   st->stats.bps   = atomic_exchange(&mmi->mmi_stats.bps, 0) * 8;
+  st->stats.fill  = ((mi->mi_input_ring.mr_head - mi->mi_input_ring.mr_tail)
+                     * 100) / MPEGTS_RING_SLOTS;
+  st->stats.overrun = mi->mi_input_ring.mr_overrun;
+  st->stats.backlog = mi->mi_table_backlog;
 }
 
 static void
@@ -931,11 +1113,12 @@ mpegts_input_create0
   /* Init input/output structures */
   pthread_mutex_init(&mi->mi_input_lock, NULL);
   pthread_cond_init(&mi->mi_input_cond, NULL);
-  TAILQ_INIT(&mi->mi_input_queue);
+  pthread_mutex_init(&mi->mi_input_ring.mr_put_lock, NULL);
 
   pthread_mutex_init(&mi->mi_output_lock, NULL);
   pthread_cond_init(&mi->mi_table_cond, NULL);
   TAILQ_INIT(&mi->mi_table_queue);
+  TAILQ_INIT(&mi->mi_table_feed_pool);
 
   /* Add to global list */
   LIST_INSERT_HEAD(&mpegts_input_all, mi, mi_global_link);
@@ -962,6 +1145,7 @@ void
 mpegts_input_delete ( mpegts_input_t *mi, int delconf )
 {
   mpegts_network_link_t *mnl;
+  int i;
 
   /* Remove networks */
   while ((mnl = LIST_FIRST(&mi->mi_networks)))
@@ -977,6 +1161,13 @@ mpegts_input_delete ( mpegts_input_t *mi, int delconf )
 
   pthread_mutex_destroy(&mi->mi_output_lock);
   pthread_cond_destroy(&mi->mi_table_cond);
+  pthread_mutex_destroy(&mi->mi_input_ring.mr_put_lock);
+  if (mi->mi_input_ring.mr_seg) {
+    for (i = 0; i < MPEGTS_RING_SEGS; i++)
+      pktbuf_ref_dec(mi->mi_input_ring.mr_seg[i]);
+    free(mi->mi_input_ring.mr_seg);
+  }
+  free(mi->mi_input_ring.mr_mux);
   free(mi->mi_name);
   free(mi);
 }
@@ -520,8 +520,6 @@ mpegts_mux_stop ( mpegts_mux_t *mm, int force )
   mpegts_mux_instance_t *mmi = mm->mm_active;
   mpegts_input_t *mi = NULL;
   th_subscription_t *sub;
-  mpegts_pid_t *mp;
-  mpegts_pid_sub_t *mps;
 
   if (!force && mpegts_mux_has_subscribers(mm))
     return;
@@ -547,20 +545,9 @@ mpegts_mux_stop ( mpegts_mux_t *mm, int force )
     mpegts_input_flush_mux(mi, mm);
 
   /* Ensure PIDs are cleared */
-  mm->mm_last_pid = -1;
-  mm->mm_last_mp = NULL;
-  while ((mp = RB_FIRST(&mm->mm_pids))) {
-    while ((mps = RB_FIRST(&mp->mp_subs))) {
-      RB_REMOVE(&mp->mp_subs, mps, mps_link);
-      free(mps);
-    }
-    RB_REMOVE(&mm->mm_pids, mp, mp_link);
-    if (mp->mp_fd != -1) {
-      tvhdebug("mpegts", "%s - close PID %04X (%d)", buf, mp->mp_pid, mp->mp_pid);
-      close(mp->mp_fd);
-    }
-    free(mp);
-  }
+  if (mi) pthread_mutex_lock(&mi->mi_output_lock);
+  mpegts_mux_free_pids(mm);
+  if (mi) pthread_mutex_unlock(&mi->mi_output_lock);
 
   /* Scanning */
   if (mm->mm_initial_scan_status == MM_SCAN_CURRENT) {
@@ -787,7 +774,6 @@ mpegts_mux_create0
   mm->mm_close_table         = mpegts_mux_close_table;
   TAILQ_INIT(&mm->mm_table_queue);
 
-  mm->mm_last_pid            = -1;
 
   /* Configuration */
   if (conf)
@@ -917,28 +903,50 @@ mpegts_mux_find_pid_ ( mpegts_mux_t *mm, int pid, int create )
 {
   mpegts_pid_t *mp;
   
-  if (pid > 0x2000) return NULL;
+  if (pid < 0 || pid > MPEGTS_FULLMUX_PID) return NULL;
+
+  if (!create)
+    return mm->mm_pid_table ? mm->mm_pid_table[pid] : NULL;
+
+  if (!mm->mm_pid_table)
+    mm->mm_pid_table = calloc(MPEGTS_FULLMUX_PID + 1, sizeof(mpegts_pid_t*));
+
+  SKEL_ALLOC(mpegts_pid_skel);
+  mpegts_pid_skel->mp_pid = pid;
+  mp = RB_INSERT_SORTED(&mm->mm_pids, mpegts_pid_skel, mp_link, mp_cmp);
+  if (!mp) {
+    mp = mpegts_pid_skel;
+    SKEL_USED(mpegts_pid_skel);
+    mp->mp_fd = -1;
+    mp->mp_cc = -1;
+    mm->mm_pid_table[pid] = mp;
+  }
+  return mp;
+}
 
-  if (!create) {
-    mpegts_pid_t skel;
-    skel.mp_pid = pid;
-    mp = RB_FIND(&mm->mm_pids, &skel, mp_link, mp_cmp);
-  } else {
-    SKEL_ALLOC(mpegts_pid_skel);
-    mpegts_pid_skel->mp_pid = pid;
-    mp = RB_INSERT_SORTED(&mm->mm_pids, mpegts_pid_skel, mp_link, mp_cmp);
-    if (!mp) {
-      mp = mpegts_pid_skel;
-      SKEL_USED(mpegts_pid_skel);
-      mp->mp_fd = -1;
-      mp->mp_cc = -1;
+void
+mpegts_mux_free_pids ( mpegts_mux_t *mm )
+{
+  char buf[256];
+  mpegts_pid_t *mp;
+  mpegts_pid_sub_t *mps;
+
+  mm->mm_display_name(mm, buf, sizeof(buf));
+  while ((mp = RB_FIRST(&mm->mm_pids))) {
+    while ((mps = RB_FIRST(&mp->mp_subs))) {
+      RB_REMOVE(&mp->mp_subs, mps, mps_link);
+      free(mps);
     }
+    RB_REMOVE(&mm->mm_pids, mp, mp_link);
+    if (mp->mp_fd != -1) {
+      tvhdebug("mpegts", "%s - close PID %04X (%d)", buf, mp->mp_pid, mp->mp_pid);
+      close(mp->mp_fd);
+    }
+    free(mp->mp_svcs);
+    free(mp);
   }
-  if (mp) {
-    mm->mm_last_pid = pid;
-    mm->mm_last_mp = mp;
-  }
-  return mp;
+  free(mm->mm_pid_table);
+  mm->mm_pid_table = NULL;
 }
 
 /******************************************************************************
@@ -259,7 +259,10 @@ mpegts_service_stop(service_t *t)
     i->mi_close_service(i, s);
 
   /* Save some memory */
-  sbuf_free(&s->s_tsbuf);
+  if (s->s_tsbuf) {
+    pktbuf_ref_dec(s->s_tsbuf);
+    s->s_tsbuf = NULL;
+  }
 }
 
 /*
@@ -374,7 +377,8 @@ mpegts_service_delete ( service_t *t, int delconf )
   free(ms->s_dvb_provider);
   free(ms->s_dvb_charset);
   LIST_REMOVE(ms, s_dvb_mux_link);
-  sbuf_free(&ms->s_tsbuf);
+  if (ms->s_tsbuf)
+    pktbuf_ref_dec(ms->s_tsbuf);
 
   // Note: the ultimate deletion and removal from the idnode list
   //       is done in service_destroy
@@ -397,7 +401,7 @@ mpegts_service_create0
   service_create0((service_t*)s, class, uuid, S_MPEG_TS, conf);
 
   /* Create */
-  sbuf_init(&s->s_tsbuf);
+  s->s_tsbuf = NULL;
   if (!conf) {
     if (sid)     s->s_dvb_service_id = sid;
     if (pmt_pid) s->s_pmt_pid        = pmt_pid;
@@ -103,6 +103,7 @@ mpegts_table_destroy ( mpegts_table_t *mt )
 {
   struct mpegts_table_state *st;
   LIST_REMOVE(mt, mt_link);
+  LIST_REMOVE(mt, mt_pid_link);
   mt->mt_destroyed = 1;
   mt->mt_mux->mm_num_tables--;
   mt->mt_mux->mm_close_table(mt->mt_mux, mt);
@@ -128,7 +129,8 @@ mpegts_table_add
   mpegts_table_t *mt;
 
   /* Check for existing */
-  LIST_FOREACH(mt, &mm->mm_tables, mt_link) {
+  LIST_FOREACH(mt, &mm->mm_table_hash[pid & (MPEGTS_TABLE_HASH - 1)],
+               mt_pid_link) {
     if ( mt->mt_pid      == pid      &&
          mt->mt_callback == callback &&
          mt->mt_opaque   == opaque )
@@ -151,6 +153,8 @@ mpegts_table_add
   mt->mt_mux      = mm;
   mt->mt_cc       = -1;
   LIST_INSERT_HEAD(&mm->mm_tables, mt, mt_link);
+  LIST_INSERT_HEAD(&mm->mm_table_hash[pid & (MPEGTS_TABLE_HASH - 1)],
+                   mt, mt_pid_link);
   mm->mm_num_tables++;
 
   /* Open table */
@@ -295,18 +295,21 @@ static void
 ts_remux(mpegts_service_t *t, const uint8_t *src)
 {
   streaming_message_t sm;
-  pktbuf_t *pb;
-  sbuf_t *sb = &t->s_tsbuf;
+  pktbuf_t *pb = t->s_tsbuf;
 
-  if (sb->sb_data == NULL)
-    sbuf_init_fixed(sb, TS_REMUX_BUFSIZE);
+  /* Packets are gathered straight into the buffer that is delivered */
+  if (pb == NULL) {
+    pb = t->s_tsbuf = pktbuf_alloc(NULL, TS_REMUX_BUFSIZE);
+    t->s_tsbuf_len = 0;
+  }
 
-  sbuf_append(sb, src, 188);
+  memcpy(pb->pb_data + t->s_tsbuf_len, src, 188);
+  t->s_tsbuf_len += 188;
 
-  if(sb->sb_ptr < TS_REMUX_BUFSIZE) 
+  if(t->s_tsbuf_len < TS_REMUX_BUFSIZE) 
     return;
 
-  pb = pktbuf_alloc(sb->sb_data, sb->sb_ptr);
+  t->s_tsbuf = NULL;
 
   sm.sm_type = SMT_MPEGTS;
   sm.sm_data = pb;
@@ -315,8 +318,6 @@ ts_remux(mpegts_service_t *t, const uint8_t *src)
   pktbuf_ref_dec(pb);
 
   service_set_streaming_status_flags((service_t*)t, TSS_PACKETS);
-
-  sbuf_reset(sb, TS_REMUX_BUFSIZE);
 }
 
 /*
@@ -325,11 +326,15 @@ ts_remux(mpegts_service_t *t, const uint8_t *src)
 int
 ts_resync ( const uint8_t *tsb, int *len, int *idx )
 {
-  int err = 1;
-  while (err && (*len > 376)) {
-    (*idx)++; (*len)--;
-    err = (tsb[*idx] != 0x47) || (tsb[*idx+188] != 0x47) || 
-          (tsb[*idx+376] != 0x47);
+  int p = ts_sync_scan(tsb + *idx + 1, *len - 1, 188, 3);
+  if (p < 0) {
+    if (*len > 376) {
+      *idx += *len - 376;
+      *len  = 376;
+    }
+    return 1;
   }
-  return err;
+  *idx += p + 1;
+  *len -= p + 1;
+  return 0;
 }
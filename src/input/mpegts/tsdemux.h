@@ -21,6 +21,13 @@
 
 int ts_resync ( const uint8_t *tsb, int *len, int *idx );
 
+void ts_sync_init ( void );
+
+extern int (*ts_sync_scan)
+  ( const uint8_t *tsb, int len, int stride, int count );
+
+int ts_sync_find ( const uint8_t *tsb, int len, int count, int *stride );
+
 int ts_recv_packet1
   (struct mpegts_service *t, const uint8_t *tsb, int64_t *pcrp, int table);
 
@@ -0,0 +1,118 @@
+/*
+ *  tvheadend, MPEG transport stream sync search
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tvheadend.h"
+#include "input.h"
+#include "tsdemux.h"
+
+/*
+ * Kernels
+ *
+ * All return the first offset p for which tsb[p + k * stride] == 0x47
+ * for k = 0 .. count - 1 (entirely within len), or -1.
+ */
+
+int ts_sync_scan_c    ( const uint8_t *tsb, int len, int stride, int count );
+#if ENABLE_SSE2
+int ts_sync_scan_sse2 ( const uint8_t *tsb, int len, int stride, int count );
+#endif
+#if ENABLE_AVX2
+int ts_sync_scan_avx2 ( const uint8_t *tsb, int len, int stride, int count );
+#endif
+
+int
+ts_sync_scan_c ( const uint8_t *tsb, int len, int stride, int count )
+{
+  const uint8_t *p, *end;
+  int k;
+
+  if (count < 1 || len < (count - 1) * stride + 1)
+    return -1;
+  end = tsb + len - (count - 1) * stride;
+
+  for (p = tsb; p < end; p++) {
+    if (!(p = memchr(p, 0x47, end - p)))
+      break;
+    for (k = 1; k < count; k++)
+      if (p[k * stride] != 0x47)
+        break;
+    if (k == count)
+      return p - tsb;
+  }
+  return -1;
+}
+
+int (*ts_sync_scan) ( const uint8_t *tsb, int len, int stride, int count )
+  = ts_sync_scan_c;
+
+/*
+ * Find TS sync (try all supported packet sizes)
+ */
+int
+ts_sync_find ( const uint8_t *tsb, int len, int count, int *stride )
+{
+  static const int strides[] = { 188, 192, 204 };
+  int i, l, p, best = -1;
+
+  for (i = 0; i < ARRAY_SIZE(strides); i++) {
+    /* Only need to look before the best match so far */
+    l = len;
+    if (best >= 0)
+      l = MIN(len, best + (count - 1) * strides[i]);
+    p = ts_sync_scan(tsb, l, strides[i], count);
+    if (p >= 0 && (best < 0 || p < best)) {
+      best    = p;
+      *stride = strides[i];
+      if (!best) break;
+    }
+  }
+  return best;
+}
+
+/*
+ * Select best available kernel
+ */
+void
+ts_sync_init ( void )
+{
+  const char *name = "generic";
+
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_cpu_init();
+#if ENABLE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    ts_sync_scan = ts_sync_scan_avx2;
+    name = "AVX2";
+  } else
+#endif
+#if ENABLE_SSE2
+  if (__builtin_cpu_supports("sse2")) {
+    ts_sync_scan = ts_sync_scan_sse2;
+    name = "SSE2";
+  }
+#endif
+#endif
+
+  tvhdebug("tsdemux", "using %s TS sync search", name);
+}
+
+/******************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ *****************************************************************************/
@@ -0,0 +1,59 @@
+/*
+ *  tvheadend, MPEG transport stream sync search (AVX2)
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <immintrin.h>
+
+int ts_sync_scan_c    ( const uint8_t *tsb, int len, int stride, int count );
+int ts_sync_scan_avx2 ( const uint8_t *tsb, int len, int stride, int count );
+
+/*
+ * Test 32 candidate offsets at once: AND together the 0x47 compare
+ * masks of every lattice point, the lowest set bit is the answer
+ */
+int
+ts_sync_scan_avx2 ( const uint8_t *tsb, int len, int stride, int count )
+{
+  const __m256i sync = _mm256_set1_epi8(0x47);
+  __m256i m;
+  int p, k, r, last;
+
+  if (count < 1 || len < (count - 1) * stride + 1)
+    return -1;
+  last = len - (count - 1) * stride;
+
+  for (p = 0; p + 32 <= last; p += 32) {
+    m = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(tsb + p)), sync);
+    for (k = 1; k < count && _mm256_movemask_epi8(m); k++)
+      m = _mm256_and_si256(m, _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(tsb + p + k * stride)), sync));
+    if ((r = _mm256_movemask_epi8(m)))
+      return p + __builtin_ctz(r);
+  }
+
+  /* Tail */
+  if ((r = ts_sync_scan_c(tsb + p, len - p, stride, count)) >= 0)
+    return p + r;
+  return -1;
+}
+
+/******************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ *****************************************************************************/
@@ -454,6 +454,10 @@ main(int argc, char **argv)
               opt_threadid     = 0,
               opt_ipv6         = 0,
               opt_tsfile_tuner = 0,
+              opt_iptv_threads = 1,
+              opt_csa_threads  = -1,
+              opt_htsp_io_threads   = HTSP_IO_THREADS,
+              opt_htsp_pool_threads = HTSP_POOL_THREADS,
               opt_dump         = 0;
   const char *opt_config       = NULL,
              *opt_user         = NULL,
@@ -488,6 +492,15 @@ main(int argc, char **argv)
 #if ENABLE_LINUXDVB
     { 'a', "adapters",  "Only use specified DVB adapters (comma separated)",
       OPT_STR, &opt_dvb_adapters },
+#endif
+#if ENABLE_IPTV
+    {   0, "iptv_threads", "Number of IPTV receive threads",
+      OPT_INT, &opt_iptv_threads },
+#endif
+#if ENABLE_CWC
+    {   0, "csa_threads", "Number of CSA descrambler threads\n"
+                          "(0 = descramble inline, default one per CPU)",
+      OPT_INT, &opt_csa_threads },
 #endif
     {   0, NULL,         "Server Connectivity",    OPT_BOOL, NULL         },
     { '6', "ipv6",       "Listen on IPv6",         OPT_BOOL, &opt_ipv6    },
@@ -500,6 +513,10 @@ main(int argc, char **argv)
       OPT_INT, &tvheadend_htsp_port },
     {   0, "htsp_port2", "Specify extra htsp port",
       OPT_INT, &tvheadend_htsp_port_extra },
+    {   0, "htsp_io_threads", "Number of HTSP connection I/O threads",
+      OPT_INT, &opt_htsp_io_threads },
+    {   0, "htsp_threads", "Number of HTSP request threads",
+      OPT_INT, &opt_htsp_pool_threads },
 
     {   0, NULL,        "Debug Options",           OPT_BOOL, NULL         },
     { 'd', "stderr",    "Enable debug on stderr",  OPT_BOOL, &opt_stderr  },
@@ -728,6 +745,7 @@ main(int argc, char **argv)
   trap_init(argv[0]);
   
   /* Initialise configuration */
+  tvh_crc32_init();
   uuid_init();
   idnode_init();
   config_init(opt_config);
@@ -750,7 +768,7 @@ main(int argc, char **argv)
   service_init();
 
 #if ENABLE_MPEGTS
-  mpegts_init(adapter_mask, &opt_tsfile, opt_tsfile_tuner);
+  mpegts_init(adapter_mask, &opt_tsfile, opt_tsfile_tuner, opt_iptv_threads);
 #endif
 
   channel_init();
@@ -770,14 +788,14 @@ main(int argc, char **argv)
 
   service_mapper_init();
 
-  descrambler_init();
+  descrambler_init(opt_csa_threads);
 
   epggrab_init();
   epg_init();
 
   dvr_init();
 
-  htsp_init(opt_bindaddr);
+  htsp_init(opt_bindaddr, opt_htsp_io_threads, opt_htsp_pool_threads);
 
 
   if(opt_subscribe != NULL)
@@ -363,6 +363,19 @@ muxer_open_stream(muxer_t *m, int fd)
 }
 
 
+/**
+ * sanity wrapper arround m_open_sink(), not every muxer supports it
+ */
+int
+muxer_open_sink(muxer_t *m, muxer_sink_t *ms)
+{
+  if(!m || !ms || !m->m_open_sink)
+    return -1;
+
+  return m->m_open_sink(m, ms);
+}
+
+
 /**
  * sanity wrapper arround m_close()
  */
@@ -55,8 +55,15 @@ struct th_pkt;
 struct epg_broadcast;
 struct service;
 
+/* Receives the output of a muxer opened with muxer_open_sink() */
+typedef struct muxer_sink {
+  void (*ms_write)(struct muxer_sink *, const void *data, size_t size);
+} muxer_sink_t;
+
 typedef struct muxer {
   int         (*m_open_stream)(struct muxer *, int fd);                 // Open for socket streaming
+  int         (*m_open_sink)  (struct muxer *, muxer_sink_t *);         // Open for streaming to memory
+                                                                        // (optional)
   int         (*m_open_file)  (struct muxer *, const char *filename);   // Open for file storage
   const char* (*m_mime)       (struct muxer *,                          // Figure out the mimetype
 			       const struct streaming_start *);
@@ -96,6 +103,7 @@ muxer_t *muxer_create(muxer_container_type_t mc, const muxer_config_t *m_cfg);
 // Wrapper functions
 int         muxer_open_file   (muxer_t *m, const char *filename);
 int         muxer_open_stream (muxer_t *m, int fd);
+int         muxer_open_sink   (muxer_t *m, muxer_sink_t *ms);
 int         muxer_init        (muxer_t *m, const struct streaming_start *ss, const char *name);
 int         muxer_reconfigure (muxer_t *m, const struct streaming_start *ss);
 int         muxer_add_marker  (muxer_t *m);
@@ -35,6 +35,7 @@ typedef struct pass_muxer {
   /* File descriptor stuff */
   off_t pm_off;
   int   pm_fd;
+  muxer_sink_t *pm_sink;
   int   pm_seekable;
   int   pm_error;
 
@@ -369,6 +370,23 @@ pass_muxer_open_stream(muxer_t *m, int fd)
 }
 
 
+/**
+ * Open the muxer for streaming to memory
+ */
+static int
+pass_muxer_open_sink(muxer_t *m, muxer_sink_t *ms)
+{
+  pass_muxer_t *pm = (pass_muxer_t*)m;
+
+  pm->pm_off      = 0;
+  pm->pm_sink     = ms;
+  pm->pm_seekable = 0;
+  pm->pm_filename = strdup("Live output");
+
+  return 0;
+}
+
+
 /**
  * Open the file and set the file descriptor
  */
@@ -405,6 +423,9 @@ pass_muxer_write(muxer_t *m, const void *data, size_t size)
 
   if(pm->pm_error) {
     pm->m_errors++;
+  } else if(pm->pm_sink) {
+    pm->pm_sink->ms_write(pm->pm_sink, data, size);
+    pm->pm_off += size;
   } else if(tvh_write(pm->pm_fd, data, size)) {
     pm->pm_error = errno;
     tvhlog(LOG_ERR, "pass", "%s: Write failed -- %s", pm->pm_filename, 
@@ -421,41 +442,65 @@ pass_muxer_write(muxer_t *m, const void *data, size_t size)
 
 /**
  * Write TS packets to the file descriptor
+ *
+ * Note: the packet buffer may be shared with other subscribers (and
+ *       with the input ring, see pktbuf_slice()), so it is never
+ *       modified. Rewritten packets are built in a local copy and the
+ *       untouched runs either side of them are written directly.
  */
 static void
 pass_muxer_write_ts(muxer_t *m, pktbuf_t *pb)
 {
   pass_muxer_t *pm = (pass_muxer_t*)m;
-  unsigned char* tsb;
+  unsigned char *tsb, *run, *end;
+  unsigned char tmp[188];
   
   /* Rewrite PAT/PMT in operation */
   if (pm->m_config.m_flags & (MC_REWRITE_PAT | MC_REWRITE_PMT)) {
 
-    tsb = pb->pb_data;
-    while (tsb < pb->pb_data + pb->pb_size) {
+    tsb = run = pb->pb_data;
+    end = pb->pb_data + pb->pb_size;
+    while (tsb < end) {
       int pid = (tsb[1] & 0x1f) << 8 | tsb[2];
+      int rewrite = 0;
 
       /* PAT */
       if (pm->m_config.m_flags & MC_REWRITE_PAT && pid == 0) {
-        if (pass_muxer_rewrite_pat(pm, tsb)) {
+        memcpy(tmp, tsb, 188);
+        if (pass_muxer_rewrite_pat(pm, tmp)) {
           tvherror("pass", "PAT rewrite failed, disabling");
           pm->m_config.m_flags &= ~MC_REWRITE_PAT;
+        } else {
+          rewrite = 1;
         }
       /* PMT */
       } else if (pm->m_config.m_flags & MC_REWRITE_PMT && pid == pm->pm_pmt_pid) {
         if (tsb[1] & 0x40) { /* pusi - the first PMT packet */  
-          memcpy(tsb, pm->pm_pmt, 188);
-          tsb[3] = (pm->pm_pmt[3] & 0xf0) | pm->pm_pmt_cc;
+          memcpy(tmp, pm->pm_pmt, 188);
+          tmp[3] = (pm->pm_pmt[3] & 0xf0) | pm->pm_pmt_cc;
           pm->pm_pmt_cc = (pm->pm_pmt_cc + 1) & 0xf;
         } else {
           /* Nullify packet */
-          tsb[1] = 0x1f;
-          memset(tsb+2, 0xff, 186);
+          tmp[0] = tsb[0];
+          tmp[1] = 0x1f;
+          memset(tmp+2, 0xff, 186);
         }
+        rewrite = 1;
+      }
+
+      if (rewrite) {
+        if (tsb > run)
+          pass_muxer_write(m, run, tsb - run);
+        pass_muxer_write(m, tmp, 188);
+        run = tsb + 188;
       }
 
       tsb += 188;
     }
+
+    if (end > run)
+      pass_muxer_write(m, run, end - run);
+    return;
   }
 
   pass_muxer_write(m, pb->pb_data, pb->pb_size);
@@ -549,6 +594,7 @@ pass_muxer_create(muxer_container_type_t mc, const muxer_config_t *m_cfg)
 
   pm = calloc(1, sizeof(pass_muxer_t));
   pm->m_open_stream  = pass_muxer_open_stream;
+  pm->m_open_sink    = pass_muxer_open_sink;
   pm->m_open_file    = pass_muxer_open_file;
   pm->m_init         = pass_muxer_init;
   pm->m_reconfigure  = pass_muxer_reconfigure;
@@ -130,6 +130,23 @@ tvh_muxer_open_stream(muxer_t *m, int fd)
 }
 
 
+/**
+ * Open the muxer for streaming to memory
+ */
+static int
+tvh_muxer_open_sink(muxer_t *m, muxer_sink_t *ms)
+{
+  tvh_muxer_t *tm = (tvh_muxer_t*)m;
+
+  if(mk_mux_open_sink(tm->tm_ref, ms)) {
+    tm->m_errors++;
+    return -1;
+  }
+
+  return 0;
+}
+
+
 /**
  * Open a file
  */
@@ -229,6 +246,7 @@ tvh_muxer_create(muxer_container_type_t mc, const muxer_config_t *m_cfg)
 
   tm = calloc(1, sizeof(tvh_muxer_t));
   tm->m_open_stream  = tvh_muxer_open_stream;
+  tm->m_open_sink    = tvh_muxer_open_sink;
   tm->m_open_file    = tvh_muxer_open_file;
   tm->m_mime         = tvh_muxer_mime;
   tm->m_init         = tvh_muxer_init;
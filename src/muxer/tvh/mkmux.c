@@ -87,6 +87,7 @@ typedef struct mk_chapter {
 struct mk_mux {
   muxer_t *m;
   int fd;
+  muxer_sink_t *sink;
   char *filename;
   int error;
   off_t fdpos; // Current position in file
@@ -427,6 +428,15 @@ mk_write_to_fd(mk_mux_t *mkm, htsbuf_queue_t *hq)
   int i = 0;
   off_t oldpos = mkm->fdpos;
 
+  if(mkm->sink) {
+    TAILQ_FOREACH(hd, &hq->hq_q, hd_link) {
+      mkm->sink->ms_write(mkm->sink, hd->hd_data + hd->hd_data_off,
+                          hd->hd_data_len - hd->hd_data_off);
+      mkm->fdpos += hd->hd_data_len - hd->hd_data_off;
+    }
+    return 0;
+  }
+
   TAILQ_FOREACH(hd, &hq->hq_q, hd_link)
     i++;
 
@@ -1042,6 +1052,21 @@ mk_mux_open_stream(mk_mux_t *mkm, int fd)
 }
 
 
+/**
+ * Stream to memory, same layout as a socket stream
+ */
+int
+mk_mux_open_sink(mk_mux_t *mkm, muxer_sink_t *ms)
+{
+  mkm->filename = strdup("Live output");
+  mkm->fd = -1;
+  mkm->sink = ms;
+  mkm->cluster_maxsize = 0;
+
+  return 0;
+}
+
+
 /**
  *
  */
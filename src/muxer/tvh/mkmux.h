@@ -32,6 +32,7 @@ mk_mux_t *mk_mux_create(muxer_t *m, int webm);
 
 int mk_mux_open_file  (mk_mux_t *mkm, const char *filename);
 int mk_mux_open_stream(mk_mux_t *mkm, int fd);
+int mk_mux_open_sink  (mk_mux_t *mkm, muxer_sink_t *ms);
 
 int mk_mux_init(mk_mux_t *mkm, const char *title, 
 		const struct streaming_start *ss);
@@ -198,7 +198,10 @@ void
 pktbuf_ref_dec(pktbuf_t *pb)
 {
   if((atomic_add(&pb->pb_refcount, -1)) == 1) {
-    free(pb->pb_data);
+    if(pb->pb_parent)
+      pktbuf_ref_dec(pb->pb_parent);
+    else
+      free(pb->pb_data);
     free(pb);
   }
 }
@@ -215,6 +218,7 @@ pktbuf_alloc(const void *data, size_t size)
   pktbuf_t *pb = malloc(sizeof(pktbuf_t));
   pb->pb_refcount = 1;
   pb->pb_size = size;
+  pb->pb_parent = NULL;
 
   if(size > 0) {
     pb->pb_data = malloc(size);
@@ -231,5 +235,23 @@ pktbuf_make(void *data, size_t size)
   pb->pb_refcount = 1;
   pb->pb_size = size;
   pb->pb_data = data;
+  pb->pb_parent = NULL;
   return pb;
 }
+
+/**
+ * Reference a range of an existing buffer without copying it, the
+ * parent is kept alive until the slice is released. The data is
+ * shared so must be treated as read only.
+ */
+pktbuf_t *
+pktbuf_slice(pktbuf_t *pb, size_t off, size_t size)
+{
+  pktbuf_t *s = malloc(sizeof(pktbuf_t));
+  s->pb_refcount = 1;
+  s->pb_size = size;
+  s->pb_data = pb->pb_data + off;
+  s->pb_parent = pb;
+  pktbuf_ref_inc(pb);
+  return s;
+}
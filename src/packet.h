@@ -24,6 +24,7 @@ typedef struct pktbuf {
   int pb_refcount;
   uint8_t *pb_data;
   size_t pb_size;
+  struct pktbuf *pb_parent; // Owner of pb_data (slices only)
 } pktbuf_t;
 
 
@@ -110,6 +111,8 @@ pktbuf_t *pktbuf_alloc(const void *data, size_t size);
 
 pktbuf_t *pktbuf_make(void *data, size_t size);
 
+pktbuf_t *pktbuf_slice(pktbuf_t *pb, size_t off, size_t size);
+
 #define pktbuf_len(pb) ((pb)->pb_size)
 #define pktbuf_ptr(pb) ((pb)->pb_data)
 
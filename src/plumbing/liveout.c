@@ -0,0 +1,750 @@
+/**
+ *  Shared live output
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#include "tvheadend.h"
+#include "streaming.h"
+#include "channels.h"
+#include "subscriptions.h"
+#include "atomic.h"
+#include "liveout.h"
+#include "tsfix.h"
+#include "globalheaders.h"
+#include "congestion.h"
+
+#define LIVEOUT_WINDOW       (4 * 1024 * 1024) // bytes kept for the viewers
+#define LIVEOUT_RAI_TIMEOUT  2000000          // join on a PAT without RAI (us)
+#define LIVEOUT_MAX_VPIDS    8
+#define LIVEOUT_QUEUE_SIZE   (8 * 1024 * 1024) // input bytes
+#define LIVEOUT_QUEUE_LATENCY 2000000         // time to work off the queue (us)
+
+typedef enum {
+  LO_STARTING,
+  LO_RUNNING,
+  LO_STOPPED,
+} liveout_state_t;
+
+/**
+ * The output of one muxer call
+ */
+typedef struct liveout_chunk {
+  TAILQ_ENTRY(liveout_chunk) lc_link;
+  pktbuf_t *lc_pb;
+  int64_t   lc_seq;
+  int       lc_sync;     /* Offset a viewer may join at, -1 if none */
+  int       lc_refs;     /* The window and the viewers reading it */
+  int       lc_dead;     /* Trimmed from the window */
+} liveout_chunk_t;
+
+TAILQ_HEAD(liveout_chunk_queue, liveout_chunk);
+
+/**
+ *
+ */
+typedef struct liveout {
+  muxer_sink_t lo_sink;  /* Must be first */
+
+  LIST_ENTRY(liveout) lo_link;
+  int lo_refcount;       /* Viewers, protected by global_lock */
+  LIST_HEAD(, liveout_viewer) lo_viewers;  /* Protected by global_lock */
+
+  channel_t *lo_channel;
+  char *lo_name;
+  muxer_container_type_t lo_mc;
+  muxer_config_t lo_mcfg;
+
+  th_subscription_t *lo_s;
+  streaming_target_t *lo_gh;
+  streaming_target_t *lo_tsfix;
+  muxer_t *lo_mux;
+
+  /* The muxer runs in its own thread, away from the demuxer */
+  streaming_queue_t lo_sq;
+  congestion_t lo_cc;
+  pthread_t lo_thread;
+  int lo_running;
+
+  /* Producer side, only touched from the muxer thread */
+  uint8_t *lo_buf;
+  size_t lo_len;
+  size_t lo_size;
+  int lo_video;
+  int lo_keyframe;
+  int64_t lo_rai;
+  uint16_t lo_vpids[LIVEOUT_MAX_VPIDS];
+  int lo_nvpids;
+
+  /* Protected by lo_mutex */
+  pthread_mutex_t lo_mutex;
+  pthread_cond_t lo_cond;
+  liveout_state_t lo_state;
+  int lo_code;
+  char *lo_mime;
+  pktbuf_t *lo_header;
+  struct liveout_chunk_queue lo_chunks;
+  size_t lo_bytes;
+  int64_t lo_seq;
+  liveout_chunk_t *lo_sync;   /* Newest join point in the window */
+
+} liveout_t;
+
+typedef enum {
+  LV_NEW,
+  LV_HEADER,
+  LV_STREAMING,
+} liveout_viewer_state_t;
+
+/**
+ *
+ */
+struct liveout_viewer {
+  liveout_t *lv_lo;
+  LIST_ENTRY(liveout_viewer) lv_link;  /* Protected by global_lock */
+  int lv_weight;
+  liveout_viewer_state_t lv_state;
+  liveout_chunk_t *lv_chunk;  /* Being read, NULL when waiting for a join */
+  int lv_sent;                /* lv_chunk was handed out */
+  int lv_off;                 /* Where to start in lv_chunk */
+  int64_t lv_seq;             /* Join after this chunk */
+  pktbuf_t *lv_pb;            /* Held for the caller */
+  int lv_skips;
+};
+
+static LIST_HEAD(, liveout) liveouts;
+
+
+/**
+ *
+ */
+static void
+liveout_chunk_unref(liveout_chunk_t *lc)
+{
+  if(--lc->lc_refs)
+    return;
+  pktbuf_ref_dec(lc->lc_pb);
+  free(lc);
+}
+
+
+/**
+ * Muxer output, collected until the muxer call returns
+ */
+static void
+liveout_sink_write(muxer_sink_t *ms, const void *data, size_t size)
+{
+  liveout_t *lo = (liveout_t *)ms;
+
+  if(lo->lo_len + size > lo->lo_size) {
+    lo->lo_size = MAX(MAX(lo->lo_size * 2, lo->lo_len + size), 65536);
+    lo->lo_buf = realloc(lo->lo_buf, lo->lo_size);
+  }
+  memcpy(lo->lo_buf + lo->lo_len, data, size);
+  lo->lo_len += size;
+}
+
+
+/**
+ * Take over the collected output
+ */
+static pktbuf_t *
+liveout_take(liveout_t *lo)
+{
+  pktbuf_t *pb;
+
+  if(!lo->lo_len)
+    return NULL;
+  pb = pktbuf_make(lo->lo_buf, lo->lo_len);
+  lo->lo_buf = NULL;
+  lo->lo_len = lo->lo_size = 0;
+  return pb;
+}
+
+
+/**
+ *
+ */
+static int
+liveout_is_vpid(liveout_t *lo, int pid)
+{
+  int i;
+
+  for(i = 0; i < lo->lo_nvpids; i++)
+    if(lo->lo_vpids[i] == pid)
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Find a join point in the transport stream, a video packet starting a
+ * PES with the random access indicator set. Sources that never set it
+ * (and radio) fall back to the PAT.
+ */
+static int
+liveout_ts_sync(liveout_t *lo, const uint8_t *tsb, size_t len)
+{
+  int64_t now = getmonoclock();
+  size_t off;
+  int pid, pat = -1;
+
+  for(off = 0; off + 188 <= len; off += 188) {
+    const uint8_t *p = tsb + off;
+    if(p[0] != 0x47 || !(p[1] & 0x40))
+      continue;
+    pid = ((p[1] & 0x1f) << 8) | p[2];
+    if(pid == 0) {
+      if(pat < 0)
+        pat = off;
+    } else if((p[3] & 0x20) && p[4] && (p[5] & 0x40) &&
+              liveout_is_vpid(lo, pid)) {
+      lo->lo_rai = now;
+      return off;
+    }
+  }
+
+  if(pat >= 0 && now - lo->lo_rai > LIVEOUT_RAI_TIMEOUT)
+    return pat;
+  return -1;
+}
+
+
+/**
+ * Append the output of the last muxer call to the window
+ */
+static void
+liveout_publish(liveout_t *lo, int type)
+{
+  liveout_chunk_t *lc;
+  pktbuf_t *pb;
+
+  if((pb = liveout_take(lo)) == NULL)
+    return;
+
+  lc = calloc(1, sizeof(liveout_chunk_t));
+  lc->lc_pb   = pb;
+  lc->lc_refs = 1;
+  if(type == SMT_MPEGTS) {
+    lc->lc_sync = liveout_ts_sync(lo, pktbuf_ptr(pb), pktbuf_len(pb));
+  } else {
+    /* A cluster is written out when the next one is started */
+    lc->lc_sync = (lo->lo_keyframe || !lo->lo_video) ? 0 : -1;
+    lo->lo_keyframe = 0;
+  }
+
+  pthread_mutex_lock(&lo->lo_mutex);
+  lc->lc_seq = ++lo->lo_seq;
+  TAILQ_INSERT_TAIL(&lo->lo_chunks, lc, lc_link);
+  lo->lo_bytes += pktbuf_len(pb);
+  if(lc->lc_sync >= 0)
+    lo->lo_sync = lc;
+
+  while(lo->lo_bytes > LIVEOUT_WINDOW &&
+        (lc = TAILQ_FIRST(&lo->lo_chunks)) != TAILQ_LAST(&lo->lo_chunks, liveout_chunk_queue)) {
+    TAILQ_REMOVE(&lo->lo_chunks, lc, lc_link);
+    lo->lo_bytes -= pktbuf_len(lc->lc_pb);
+    if(lo->lo_sync == lc)
+      lo->lo_sync = NULL;
+    lc->lc_dead = 1;
+    liveout_chunk_unref(lc);
+  }
+  pthread_cond_broadcast(&lo->lo_cond);
+  pthread_mutex_unlock(&lo->lo_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+liveout_stop(liveout_t *lo, int code)
+{
+  pthread_mutex_lock(&lo->lo_mutex);
+  if(lo->lo_state != LO_STOPPED) {
+    tvhlog(LOG_DEBUG, "liveout", "%s: stopped, %s",
+           lo->lo_name, streaming_code2txt(code));
+    lo->lo_state = LO_STOPPED;
+    lo->lo_code  = code;
+  }
+  pthread_cond_broadcast(&lo->lo_cond);
+  pthread_mutex_unlock(&lo->lo_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+liveout_start(liveout_t *lo, const streaming_start_t *ss)
+{
+  const streaming_start_component_t *ssc;
+  char *mime;
+  int i;
+
+  lo->lo_video = 0;
+  lo->lo_nvpids = 0;
+  for(i = 0; i < ss->ss_num_components; i++) {
+    ssc = &ss->ss_components[i];
+    if(!SCT_ISVIDEO(ssc->ssc_type))
+      continue;
+    lo->lo_video = 1;
+    if(lo->lo_nvpids < LIVEOUT_MAX_VPIDS)
+      lo->lo_vpids[lo->lo_nvpids++] = ssc->ssc_pid;
+  }
+  lo->lo_rai = lo->lo_video ? getmonoclock() : 0;
+
+  mime = strdup(muxer_mime(lo->lo_mux, ss));
+  if(muxer_init(lo->lo_mux, ss, lo->lo_name) < 0) {
+    free(mime);
+    liveout_stop(lo, SM_CODE_UNDEFINED_ERROR);
+    return;
+  }
+
+  pthread_mutex_lock(&lo->lo_mutex);
+  lo->lo_mime   = mime;
+  lo->lo_header = liveout_take(lo);
+  lo->lo_state  = LO_RUNNING;
+  pthread_cond_broadcast(&lo->lo_cond);
+  pthread_mutex_unlock(&lo->lo_mutex);
+
+  tvhlog(LOG_DEBUG, "liveout", "%s: started, %s", lo->lo_name, mime);
+}
+
+
+/**
+ *
+ */
+static void
+liveout_process(liveout_t *lo, streaming_message_t *sm)
+{
+  int key;
+
+  switch(sm->sm_type) {
+  case SMT_MPEGTS:
+  case SMT_PACKET:
+    if(lo->lo_state != LO_RUNNING)
+      break;
+    key = sm->sm_type == SMT_PACKET &&
+          ((th_pkt_t*)sm->sm_data)->pkt_frametype == PKT_I_FRAME;
+    muxer_write_pkt(lo->lo_mux, sm->sm_type, sm->sm_data);
+    sm->sm_data = NULL;
+    liveout_publish(lo, sm->sm_type);
+    if(key)
+      lo->lo_keyframe = 1;
+    if(lo->lo_mux->m_errors)
+      liveout_stop(lo, SM_CODE_UNDEFINED_ERROR);
+    break;
+
+  case SMT_START:
+    if(lo->lo_state == LO_STARTING)
+      liveout_start(lo, sm->sm_data);
+    else if(lo->lo_state == LO_RUNNING &&
+            muxer_reconfigure(lo->lo_mux, sm->sm_data) < 0)
+      tvhlog(LOG_WARNING, "liveout", "%s: unable to reconfigure", lo->lo_name);
+    break;
+
+  case SMT_STOP:
+    if(sm->sm_code != SM_CODE_SOURCE_RECONFIGURED)
+      liveout_stop(lo, sm->sm_code);
+    break;
+
+  case SMT_NOSTART:
+  case SMT_EXIT:
+    liveout_stop(lo, sm->sm_code);
+    break;
+
+  default:
+    break;
+  }
+
+  streaming_msg_free(sm);
+}
+
+
+/**
+ * Muxer thread, a muxer falling behind has its input trimmed a GOP at
+ * a time
+ */
+static void *
+liveout_thread(void *aux)
+{
+  liveout_t *lo = aux;
+  streaming_queue_t *sq = &lo->lo_sq;
+  streaming_message_t *sm;
+
+  pthread_mutex_lock(&sq->sq_mutex);
+  while(lo->lo_running) {
+    sm = TAILQ_FIRST(&sq->sq_queue);
+    if(sm == NULL) {
+      pthread_cond_wait(&sq->sq_cond, &sq->sq_mutex);
+      continue;
+    }
+    streaming_queue_remove(sq, sm);
+    pthread_mutex_unlock(&sq->sq_mutex);
+
+    liveout_process(lo, sm);
+
+    pthread_mutex_lock(&sq->sq_mutex);
+  }
+  pthread_mutex_unlock(&sq->sq_mutex);
+
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+liveout_destroy(liveout_t *lo)
+{
+  liveout_chunk_t *lc;
+
+  LIST_REMOVE(lo, lo_link);
+
+  if(lo->lo_s)
+    subscription_unsubscribe(lo->lo_s);
+  if(lo->lo_gh)
+    globalheaders_destroy(lo->lo_gh);
+  if(lo->lo_tsfix)
+    tsfix_destroy(lo->lo_tsfix);
+
+  pthread_mutex_lock(&lo->lo_sq.sq_mutex);
+  lo->lo_running = 0;
+  pthread_cond_signal(&lo->lo_sq.sq_cond);
+  pthread_mutex_unlock(&lo->lo_sq.sq_mutex);
+  pthread_join(lo->lo_thread, NULL);
+
+  if(lo->lo_cc.cc_gops)
+    tvhlog(LOG_DEBUG, "liveout", "%s: fell behind, input trimmed %d times",
+           lo->lo_name, lo->lo_cc.cc_gops);
+  streaming_queue_deinit(&lo->lo_sq);
+
+  if(lo->lo_mime)
+    muxer_close(lo->lo_mux);
+  muxer_destroy(lo->lo_mux);
+
+  while((lc = TAILQ_FIRST(&lo->lo_chunks)) != NULL) {
+    TAILQ_REMOVE(&lo->lo_chunks, lc, lc_link);
+    liveout_chunk_unref(lc);
+  }
+  if(lo->lo_header)
+    pktbuf_ref_dec(lo->lo_header);
+
+  tvhlog(LOG_DEBUG, "liveout", "%s: destroyed", lo->lo_name);
+
+  pthread_cond_destroy(&lo->lo_cond);
+  pthread_mutex_destroy(&lo->lo_mutex);
+  free(lo->lo_buf);
+  free(lo->lo_mime);
+  free(lo->lo_name);
+  free(lo);
+}
+
+
+/**
+ *
+ */
+static liveout_t *
+liveout_create(channel_t *ch, muxer_container_type_t mc,
+               const muxer_config_t *mcfg, int weight,
+               const char *hostname, const char *username, const char *client)
+{
+  liveout_t *lo;
+  streaming_target_t *st;
+  muxer_t *mux;
+  int flags;
+
+  mux = muxer_create(mc, mcfg);
+  if(mux == NULL)
+    return NULL;
+
+  lo = calloc(1, sizeof(liveout_t));
+  lo->lo_sink.ms_write = liveout_sink_write;
+  if(muxer_open_sink(mux, &lo->lo_sink)) {
+    muxer_destroy(mux);
+    free(lo);
+    return NULL;
+  }
+
+  lo->lo_mux     = mux;
+  lo->lo_channel = ch;
+  lo->lo_name    = strdup(channel_get_name(ch));
+  lo->lo_mc      = mc;
+  lo->lo_mcfg    = *mcfg;
+  lo->lo_state   = LO_STARTING;
+  pthread_mutex_init(&lo->lo_mutex, NULL);
+  pthread_cond_init(&lo->lo_cond, NULL);
+  TAILQ_INIT(&lo->lo_chunks);
+  LIST_INIT(&lo->lo_viewers);
+  LIST_INSERT_HEAD(&liveouts, lo, lo_link);
+
+  streaming_queue_init(&lo->lo_sq, (mc == MC_PASS || mc == MC_RAW) ?
+                                   SMT_TO_MASK(SMT_PACKET) : 0);
+  congestion_init(&lo->lo_cc, LIVEOUT_QUEUE_SIZE, LIVEOUT_QUEUE_LATENCY);
+  streaming_queue_congestion(&lo->lo_sq, &lo->lo_cc);
+  lo->lo_running = 1;
+  tvhthread_create(&lo->lo_thread, NULL, liveout_thread, lo, 0);
+
+  if(mc == MC_PASS || mc == MC_RAW) {
+    st = &lo->lo_sq.sq_st;
+    flags = SUBSCRIPTION_RAW_MPEGTS;
+  } else {
+    lo->lo_gh = globalheaders_create(&lo->lo_sq.sq_st);
+    lo->lo_tsfix = tsfix_create(lo->lo_gh);
+    st = lo->lo_tsfix;
+    flags = 0;
+  }
+
+  lo->lo_s = subscription_create_from_channel(ch, weight, "HTTP", st, flags,
+                                              hostname, username, client);
+  if(lo->lo_s == NULL) {
+    liveout_destroy(lo);
+    return NULL;
+  }
+
+  tvhlog(LOG_DEBUG, "liveout", "%s: created, %s", lo->lo_name,
+         muxer_container_type2txt(mc));
+  return lo;
+}
+
+
+/**
+ * The subscription runs at the highest weight of the viewers
+ */
+static void
+liveout_reweight(liveout_t *lo)
+{
+  liveout_viewer_t *lv;
+  int weight = 0;
+
+  LIST_FOREACH(lv, &lo->lo_viewers, lv_link)
+    weight = MAX(weight, lv->lv_weight);
+
+  if(weight && lo->lo_s)
+    subscription_change_weight(lo->lo_s, weight);
+}
+
+
+/**
+ * Attach a viewer to the output, creating it on demand
+ */
+liveout_viewer_t *
+liveout_join(channel_t *ch, muxer_container_type_t mc,
+             const muxer_config_t *mcfg, int weight,
+             const char *hostname, const char *username, const char *client)
+{
+  liveout_t *lo;
+  liveout_viewer_t *lv;
+  int stopped;
+
+  lock_assert(&global_lock);
+
+  LIST_FOREACH(lo, &liveouts, lo_link) {
+    if(lo->lo_channel != ch || lo->lo_mc != mc ||
+       memcmp(&lo->lo_mcfg, mcfg, sizeof(muxer_config_t)))
+      continue;
+    pthread_mutex_lock(&lo->lo_mutex);
+    stopped = lo->lo_state == LO_STOPPED;
+    pthread_mutex_unlock(&lo->lo_mutex);
+    if(!stopped)
+      break;
+  }
+
+  if(lo == NULL) {
+    lo = liveout_create(ch, mc, mcfg, weight, hostname, username, client);
+    if(lo == NULL)
+      return NULL;
+  }
+
+  lo->lo_refcount++;
+  lv = calloc(1, sizeof(liveout_viewer_t));
+  lv->lv_lo = lo;
+  lv->lv_weight = weight;
+  LIST_INSERT_HEAD(&lo->lo_viewers, lv, lv_link);
+  if(lo->lo_refcount > 1)
+    liveout_reweight(lo);
+  return lv;
+}
+
+
+/**
+ *
+ */
+static void
+liveout_release(liveout_viewer_t *lv)
+{
+  if(lv->lv_pb) {
+    pktbuf_ref_dec(lv->lv_pb);
+    lv->lv_pb = NULL;
+  }
+}
+
+
+/**
+ * Detach a viewer, the last one stops the output
+ */
+void
+liveout_leave(liveout_viewer_t *lv)
+{
+  liveout_t *lo = lv->lv_lo;
+
+  lock_assert(&global_lock);
+
+  pthread_mutex_lock(&lo->lo_mutex);
+  liveout_release(lv);
+  if(lv->lv_chunk)
+    liveout_chunk_unref(lv->lv_chunk);
+  pthread_mutex_unlock(&lo->lo_mutex);
+  LIST_REMOVE(lv, lv_link);
+  free(lv);
+
+  if(--lo->lo_refcount == 0)
+    liveout_destroy(lo);
+  else
+    liveout_reweight(lo);
+}
+
+
+/**
+ * Next chunk for the viewer, lo_mutex held
+ */
+static liveout_chunk_t *
+liveout_advance(liveout_viewer_t *lv)
+{
+  liveout_t *lo = lv->lv_lo;
+  liveout_chunk_t *lc = lv->lv_chunk;
+
+  if(lc && lc->lc_dead) {
+    /* Fell out of the window, resume at a later join point */
+    lv->lv_seq = lc->lc_seq;
+    lv->lv_chunk = NULL;
+    lv->lv_skips++;
+    liveout_chunk_unref(lc);
+    lc = NULL;
+  }
+
+  if(lc == NULL) {
+    lc = lo->lo_sync;
+    if(lc == NULL || lc->lc_seq <= lv->lv_seq)
+      return NULL;
+    lv->lv_off = lc->lc_sync;
+  } else if(lv->lv_sent) {
+    lc = TAILQ_NEXT(lc, lc_link);
+    if(lc == NULL)
+      return NULL;
+    liveout_chunk_unref(lv->lv_chunk);
+    lv->lv_off = 0;
+  } else {
+    return lc;
+  }
+
+  lc->lc_refs++;
+  lv->lv_chunk = lc;
+  lv->lv_sent = 0;
+  return lc;
+}
+
+
+/**
+ * Wait for the next event for the viewer, up to timeout ms
+ */
+liveout_event_type_t
+liveout_next(liveout_viewer_t *lv, int timeout, liveout_event_t *le)
+{
+  liveout_t *lo = lv->lv_lo;
+  liveout_event_type_t r;
+  liveout_chunk_t *lc;
+  struct timespec ts;
+  struct timeval tp;
+
+  gettimeofday(&tp, NULL);
+  ts.tv_sec  = tp.tv_sec + timeout / 1000;
+  ts.tv_nsec = tp.tv_usec * 1000 + (timeout % 1000) * 1000000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  memset(le, 0, sizeof(*le));
+
+  pthread_mutex_lock(&lo->lo_mutex);
+  liveout_release(lv);
+
+  for(;;) {
+    if(lv->lv_state == LV_NEW) {
+      if(lo->lo_state == LO_RUNNING) {
+        lv->lv_state = LV_HEADER;
+        le->le_mime = lo->lo_mime;
+        r = LIVEOUT_START;
+        break;
+      }
+    } else if(lv->lv_state == LV_HEADER) {
+      /* Anything queued before now would start mid-GOP */
+      lv->lv_state = LV_STREAMING;
+      lv->lv_seq = lo->lo_seq;
+      if(lo->lo_header) {
+        lv->lv_pb = lo->lo_header;
+        pktbuf_ref_inc(lv->lv_pb);
+        le->le_data = pktbuf_ptr(lv->lv_pb);
+        le->le_len  = pktbuf_len(lv->lv_pb);
+        r = LIVEOUT_DATA;
+        break;
+      }
+      continue;
+    } else if((lc = liveout_advance(lv)) != NULL) {
+      lv->lv_sent = 1;
+      lv->lv_pb = lc->lc_pb;
+      pktbuf_ref_inc(lv->lv_pb);
+      le->le_data = pktbuf_ptr(lv->lv_pb) + lv->lv_off;
+      le->le_len  = pktbuf_len(lv->lv_pb) - lv->lv_off;
+      r = LIVEOUT_DATA;
+      break;
+    }
+
+    if(lo->lo_state == LO_STOPPED) {
+      le->le_code = lo->lo_code;
+      r = LIVEOUT_STOP;
+      break;
+    }
+
+    if(pthread_cond_timedwait(&lo->lo_cond, &lo->lo_mutex, &ts) == ETIMEDOUT) {
+      r = LIVEOUT_TIMEOUT;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&lo->lo_mutex);
+
+  if(r == LIVEOUT_DATA)
+    atomic_add(&lo->lo_s->ths_bytes_out, le->le_len);
+
+  return r;
+}
+
+
+/**
+ *
+ */
+int
+liveout_skips(liveout_viewer_t *lv)
+{
+  return lv->lv_skips;
+}
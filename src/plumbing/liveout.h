@@ -0,0 +1,64 @@
+/**
+ *  Shared live output
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIVEOUT_H__
+#define LIVEOUT_H__
+
+#include "tvheadend.h"
+#include "muxer.h"
+
+/*
+ * One subscription and one muxer per (channel, container, muxer config),
+ * the muxed bytes are kept in a window of refcounted chunks that all the
+ * viewers read from. A viewer joins at the next keyframe and a viewer
+ * falling out of the window resumes at the next one as well.
+ */
+
+struct channel;
+typedef struct liveout_viewer liveout_viewer_t;
+
+typedef enum {
+  LIVEOUT_TIMEOUT,      /* Nothing yet */
+  LIVEOUT_START,        /* le_mime, sent once before any data */
+  LIVEOUT_DATA,         /* le_data, le_len */
+  LIVEOUT_STOP,         /* le_code, the output ended */
+} liveout_event_type_t;
+
+typedef struct liveout_event {
+  const char    *le_mime;
+  const uint8_t *le_data;
+  size_t         le_len;
+  int            le_code;
+} liveout_event_t;
+
+/* global_lock must be held, NULL if the container can't be shared */
+liveout_viewer_t *liveout_join(struct channel *ch, muxer_container_type_t mc,
+                               const muxer_config_t *mcfg, int weight,
+                               const char *hostname, const char *username,
+                               const char *client);
+
+void liveout_leave(liveout_viewer_t *lv);
+
+/* The returned data stays valid until the next call */
+liveout_event_type_t liveout_next(liveout_viewer_t *lv, int timeout,
+                                  liveout_event_t *le);
+
+/* Times the viewer fell behind and skipped to a keyframe */
+int liveout_skips(liveout_viewer_t *lv);
+
+#endif // LIVEOUT_H__
@@ -27,9 +27,18 @@
 #include "settings.h"
 #include "streaming.h"
 #include "service.h"
+#include "channels.h"
+#include "subscriptions.h"
 #include "packet.h"
 #include "transcoding.h"
+#include "tsfix.h"
 #include "libav.h"
+#include "atomic.h"
+#include "congestion.h"
+
+#define TRANSCODER_QUEUE_SIZE     (8 * 1024 * 1024) // input bytes
+#define TRANSCODER_QUEUE_LATENCY  2000000           // time to work off the queue (us)
+#define TRANSCODER_STATS_PERIOD   1000000
 
 LIST_HEAD(transcoder_stream_list, transcoder_stream);
 
@@ -104,9 +113,54 @@ typedef struct transcoder {
 
   transcoder_props_t            t_props;
   struct transcoder_stream_list t_stream_list;
+
+  /* The codecs run in their own thread, away from the demuxer */
+  streaming_queue_t             t_sq;
+  congestion_t                  t_cc;
+  pthread_t                     t_thread;
+  int                           t_running;
+
+  /* Statistics, protected by t_sq.sq_mutex */
+  int                           t_frames;   // video frames in the current period
+  int64_t                       t_period;   // start of the current period
+  int                           t_fps;
+  int64_t                       t_latency;  // average time per video frame (us)
 } transcoder_t;
 
 
+LIST_HEAD(transcoder_viewer_list, transcoder_viewer);
+
+/*
+ * One pipeline per channel and properties, fanned out to the viewers
+ */
+typedef struct transcoder_session {
+  streaming_target_t             tss_input;
+  LIST_ENTRY(transcoder_session) tss_link;
+
+  struct channel                *tss_channel;
+  transcoder_props_t             tss_props;
+
+  th_subscription_t             *tss_s;
+  streaming_target_t            *tss_tsfix;
+  streaming_target_t            *tss_transcoder;
+
+  pthread_mutex_t                tss_mutex;    // viewers and tss_ss
+  struct transcoder_viewer_list  tss_viewers;
+  streaming_start_t             *tss_ss;       // replayed to late joiners
+} transcoder_session_t;
+
+
+struct transcoder_viewer {
+  LIST_ENTRY(transcoder_viewer)  tv_link;
+  transcoder_session_t          *tv_session;
+  streaming_target_t            *tv_output;
+  int                            tv_weight;
+  int                            tv_waiting;   // for the next video keyframe
+};
+
+static LIST_HEAD(, transcoder_session) transcoder_sessions;
+
+
 
 #define WORKING_ENCODER(x) (x == CODEC_ID_H264 || x == CODEC_ID_MPEG2VIDEO || \
 			    x == CODEC_ID_VP8  || x == CODEC_ID_AAC ||	\
@@ -744,6 +798,37 @@ transcoder_stream_video(transcoder_stream_t *ts, th_pkt_t *pkt)
 }
 
 
+/**
+ * Account the time a video frame took, fps are counted per period
+ */
+static void
+transcoder_stats_update(transcoder_t *t, int64_t d)
+{
+  streaming_queue_t *sq = &t->t_sq;
+  int64_t now = getmonoclock();
+
+  pthread_mutex_lock(&sq->sq_mutex);
+
+  if (t->t_latency)
+    t->t_latency += (d - t->t_latency) / 8;
+  else
+    t->t_latency = d;
+
+  t->t_frames++;
+  if (!t->t_period) {
+    t->t_period = now;
+  } else if (now - t->t_period >= TRANSCODER_STATS_PERIOD) {
+    t->t_fps = (int64_t)t->t_frames * 1000000 / (now - t->t_period);
+    t->t_frames = 0;
+    t->t_period = now;
+    tvhtrace("transcode", "%d fps, %zu bytes queued, %"PRId64" us per frame",
+             t->t_fps, sq->sq_size, t->t_latency);
+  }
+
+  pthread_mutex_unlock(&sq->sq_mutex);
+}
+
+
 /**
  * 
  */
@@ -751,12 +836,20 @@ static void
 transcoder_packet(transcoder_t *t, th_pkt_t *pkt)
 {
   transcoder_stream_t *ts;
+  int64_t start;
 
   LIST_FOREACH(ts, &t->t_stream_list, ts_link) {
     if (pkt->pkt_componentindex != ts->ts_index)
       continue;
 
+    if (!SCT_ISVIDEO(ts->ts_type)) {
+      ts->ts_handle_pkt(ts, pkt);
+      return;
+    }
+
+    start = getmonoclock();
     ts->ts_handle_pkt(ts, pkt);
+    transcoder_stats_update(t, getmonoclock() - start);
     return;
   }
 
@@ -1229,16 +1322,16 @@ transcoder_stop(transcoder_t *t)
  * 
  */
 static void
-transcoder_input(void *opaque, streaming_message_t *sm)
+transcoder_process(transcoder_t *t, streaming_message_t *sm)
 {
-  transcoder_t *t;
   streaming_start_t *ss;
 
-  t = opaque;
-
   switch (sm->sm_type) {
   case SMT_PACKET:
     transcoder_packet(t, sm->sm_data);
+    // reference is transfered
+    sm->sm_data = NULL;
+    streaming_msg_free(sm);
     break;
 
   case SMT_START:
@@ -1267,6 +1360,49 @@ transcoder_input(void *opaque, streaming_message_t *sm)
 }
 
 
+/**
+ * Worker, a transcoder falling behind has its input trimmed a GOP at a
+ * time so the decoders resume on a keyframe
+ */
+static void *
+transcoder_thread(void *aux)
+{
+  transcoder_t *t = aux;
+  streaming_queue_t *sq = &t->t_sq;
+  streaming_message_t *sm;
+
+  pthread_mutex_lock(&sq->sq_mutex);
+  while (t->t_running) {
+    sm = TAILQ_FIRST(&sq->sq_queue);
+    if (sm == NULL) {
+      pthread_cond_wait(&sq->sq_cond, &sq->sq_mutex);
+      continue;
+    }
+    streaming_queue_remove(sq, sm);
+    pthread_mutex_unlock(&sq->sq_mutex);
+
+    transcoder_process(t, sm);
+
+    pthread_mutex_lock(&sq->sq_mutex);
+  }
+  pthread_mutex_unlock(&sq->sq_mutex);
+
+  return NULL;
+}
+
+
+/**
+ * 
+ */
+static void
+transcoder_input(void *opaque, streaming_message_t *sm)
+{
+  transcoder_t *t = opaque;
+
+  streaming_target_deliver2(&t->t_sq.sq_st, sm);
+}
+
+
 /**
  *
  */
@@ -1279,6 +1415,13 @@ transcoder_create(streaming_target_t *output)
 
   streaming_target_init(&t->t_input, transcoder_input, t, 0);
 
+  streaming_queue_init(&t->t_sq, 0);
+  congestion_init(&t->t_cc, TRANSCODER_QUEUE_SIZE, TRANSCODER_QUEUE_LATENCY);
+  streaming_queue_congestion(&t->t_sq, &t->t_cc);
+
+  t->t_running = 1;
+  tvhthread_create(&t->t_thread, NULL, transcoder_thread, t, 0);
+
   return &t->t_input;
 }
 
@@ -1305,18 +1448,316 @@ transcoder_set_properties(streaming_target_t *st,
 
 
 /**
- * 
+ * The worker never takes global_lock, so this may join it with
+ * global_lock held
  */
 void
 transcoder_destroy(streaming_target_t *st)
 {
   transcoder_t *t = (transcoder_t *)st;
 
+  pthread_mutex_lock(&t->t_sq.sq_mutex);
+  t->t_running = 0;
+  pthread_cond_signal(&t->t_sq.sq_cond);
+  pthread_mutex_unlock(&t->t_sq.sq_mutex);
+
+  pthread_join(t->t_thread, NULL);
+
+  if (t->t_cc.cc_gops)
+    tvhlog(LOG_DEBUG, "transcode", "Fell behind, input trimmed %d times",
+	   t->t_cc.cc_gops);
+
   transcoder_stop(t);
+  streaming_queue_deinit(&t->t_sq);
   free(t);
 }
 
 
+/**
+ * 
+ */
+void
+transcoder_get_stats(streaming_target_t *st, transcoder_stats_t *stats)
+{
+  transcoder_t *t = (transcoder_t *)st;
+  int i;
+
+  pthread_mutex_lock(&t->t_sq.sq_mutex);
+  stats->tst_fps     = t->t_fps;
+  stats->tst_queue   = t->t_sq.sq_size;
+  stats->tst_latency = t->t_latency;
+  stats->tst_drops   = 0;
+  for (i = 0; i < PKT_NTYPES; i++)
+    stats->tst_drops += t->t_cc.cc_drops[i];
+  pthread_mutex_unlock(&t->t_sq.sq_mutex);
+}
+
+
+/**
+ * 
+ */
+static int
+transcoder_props_equal(const transcoder_props_t *a, const transcoder_props_t *b)
+{
+  return a->tp_vcodec     == b->tp_vcodec &&
+         a->tp_acodec     == b->tp_acodec &&
+         a->tp_scodec     == b->tp_scodec &&
+         a->tp_channels   == b->tp_channels &&
+         a->tp_bandwidth  == b->tp_bandwidth &&
+         a->tp_resolution == b->tp_resolution &&
+         !strncmp(a->tp_language, b->tp_language, sizeof(a->tp_language));
+}
+
+
+/**
+ * 
+ */
+static int
+transcoder_session_video(const streaming_start_t *ss, int index)
+{
+  int i;
+
+  for (i = 0; i < ss->ss_num_components; i++)
+    if (SCT_ISVIDEO(ss->ss_components[i].ssc_type) &&
+        (index < 0 || ss->ss_components[i].ssc_index == index))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Fan the transcoder output out to the viewers
+ */
+static void
+transcoder_session_input(void *opaque, streaming_message_t *sm)
+{
+  transcoder_session_t *tss = opaque;
+  transcoder_viewer_t *tv;
+  th_pkt_t *pkt;
+  int key = 0;
+
+  pthread_mutex_lock(&tss->tss_mutex);
+
+  switch (sm->sm_type) {
+  case SMT_START:
+    if (tss->tss_ss)
+      streaming_start_unref(tss->tss_ss);
+    tss->tss_ss = sm->sm_data;
+    atomic_add(&tss->tss_ss->ss_refcount, 1);
+    break;
+
+  case SMT_STOP:
+    if (tss->tss_ss)
+      streaming_start_unref(tss->tss_ss);
+    tss->tss_ss = NULL;
+    break;
+
+  case SMT_PACKET:
+    pkt = sm->sm_data;
+    key = pkt->pkt_frametype == PKT_I_FRAME && tss->tss_ss &&
+          transcoder_session_video(tss->tss_ss, pkt->pkt_componentindex);
+    break;
+
+  case SMT_SKIP:
+  case SMT_SPEED:
+  case SMT_TIMESHIFT_STATUS:
+    /* Shared sessions are live only */
+    goto out;
+
+  default:
+    break;
+  }
+
+  LIST_FOREACH(tv, &tss->tss_viewers, tv_link) {
+    if (sm->sm_type == SMT_PACKET && tv->tv_waiting) {
+      if (!key)
+        continue;
+      tv->tv_waiting = 0;
+    }
+    streaming_target_deliver2(tv->tv_output, streaming_msg_clone(sm));
+  }
+
+out:
+  pthread_mutex_unlock(&tss->tss_mutex);
+  streaming_msg_free(sm);
+}
+
+
+/**
+ * The session subscription runs at the highest weight of its viewers
+ */
+static void
+transcoder_session_reweight(transcoder_session_t *tss)
+{
+  transcoder_viewer_t *tv;
+  int weight = 0;
+
+  LIST_FOREACH(tv, &tss->tss_viewers, tv_link)
+    weight = MAX(weight, tv->tv_weight);
+
+  if (weight && tss->tss_s)
+    subscription_change_weight(tss->tss_s, weight);
+}
+
+
+/**
+ * 
+ */
+static void
+transcoder_session_destroy(transcoder_session_t *tss)
+{
+  LIST_REMOVE(tss, tss_link);
+
+  if (tss->tss_s)
+    subscription_unsubscribe(tss->tss_s);
+  if (tss->tss_tsfix)
+    tsfix_destroy(tss->tss_tsfix);
+  transcoder_destroy(tss->tss_transcoder);
+
+  if (tss->tss_ss)
+    streaming_start_unref(tss->tss_ss);
+
+  pthread_mutex_destroy(&tss->tss_mutex);
+  free(tss);
+}
+
+
+/**
+ * The subscription is made once the first viewer is attached
+ */
+static transcoder_session_t *
+transcoder_session_create(struct channel *ch, transcoder_props_t *props)
+{
+  transcoder_session_t *tss = calloc(1, sizeof(transcoder_session_t));
+
+  tss->tss_channel = ch;
+  tss->tss_props   = *props;
+  pthread_mutex_init(&tss->tss_mutex, NULL);
+  LIST_INIT(&tss->tss_viewers);
+  LIST_INSERT_HEAD(&transcoder_sessions, tss, tss_link);
+
+  streaming_target_init(&tss->tss_input, transcoder_session_input, tss, 0);
+  tss->tss_transcoder = transcoder_create(&tss->tss_input);
+  transcoder_set_properties(tss->tss_transcoder, props);
+  tss->tss_tsfix = tsfix_create(tss->tss_transcoder);
+
+  return tss;
+}
+
+
+/**
+ * Attach a viewer to the session for the channel and properties,
+ * starting one if needed. A late joiner gets the current start and
+ * packets from the next video keyframe on.
+ *
+ * The worker may deliver to the output as soon as the viewer is on the
+ * list, so *tvp and *sp are set under tss_mutex before that. Both are
+ * left NULL if the subscription can't be made. The fan-out holds
+ * tss_mutex while delivering, so the output's own locks must not be
+ * held here.
+ */
+void
+transcoder_session_join(struct channel *ch, transcoder_props_t *props,
+			int weight, streaming_target_t *output,
+			transcoder_viewer_t **tvp, th_subscription_t **sp,
+			const char *name, const char *hostname,
+			const char *username, const char *client)
+{
+  transcoder_session_t *tss;
+  transcoder_viewer_t *tv;
+  streaming_start_t *ss;
+  int first = 0;
+
+  lock_assert(&global_lock);
+
+  LIST_FOREACH(tss, &transcoder_sessions, tss_link)
+    if (tss->tss_channel == ch && transcoder_props_equal(&tss->tss_props, props))
+      break;
+
+  if (!tss) {
+    tss = transcoder_session_create(ch, props);
+    tss->tss_s = subscription_create_from_channel(ch, weight, name,
+						  tss->tss_tsfix, 0,
+						  hostname, username, client);
+    if (!tss->tss_s) {
+      transcoder_session_destroy(tss);
+      return;
+    }
+    tvhlog(LOG_DEBUG, "transcode", "Shared session for %s opened",
+	   channel_get_name(ch));
+    first = 1;
+  }
+
+  tv = calloc(1, sizeof(transcoder_viewer_t));
+  tv->tv_session = tss;
+  tv->tv_output  = output;
+  tv->tv_weight  = weight;
+
+  pthread_mutex_lock(&tss->tss_mutex);
+  *tvp = tv;
+  *sp  = tss->tss_s;
+  if ((ss = tss->tss_ss) != NULL) {
+    atomic_add(&ss->ss_refcount, 1);
+    streaming_target_deliver2(output, streaming_msg_create_data(SMT_START, ss));
+    tv->tv_waiting = transcoder_session_video(ss, -1);
+  }
+  LIST_INSERT_HEAD(&tss->tss_viewers, tv, tv_link);
+  pthread_mutex_unlock(&tss->tss_mutex);
+
+  if (!first)
+    transcoder_session_reweight(tss);
+}
+
+
+/**
+ * Detach a viewer, the last one closes the session
+ */
+void
+transcoder_session_leave(transcoder_viewer_t *tv)
+{
+  transcoder_session_t *tss = tv->tv_session;
+
+  lock_assert(&global_lock);
+
+  pthread_mutex_lock(&tss->tss_mutex);
+  LIST_REMOVE(tv, tv_link);
+  pthread_mutex_unlock(&tss->tss_mutex);
+  free(tv);
+
+  if (!LIST_EMPTY(&tss->tss_viewers)) {
+    transcoder_session_reweight(tss);
+    return;
+  }
+
+  tvhlog(LOG_DEBUG, "transcode", "Shared session for %s closed",
+	 channel_get_name(tss->tss_channel));
+  transcoder_session_destroy(tss);
+}
+
+
+/**
+ * 
+ */
+void
+transcoder_session_weight(transcoder_viewer_t *tv, int weight)
+{
+  lock_assert(&global_lock);
+
+  tv->tv_weight = weight;
+  transcoder_session_reweight(tv->tv_session);
+}
+
+
+/**
+ * 
+ */
+streaming_target_t *
+transcoder_session_transcoder(transcoder_viewer_t *tv)
+{
+  return tv->tv_session->tss_transcoder;
+}
+
+
 /**
  * 
  */ 
@@ -31,6 +31,17 @@ typedef struct transcoder_prop {
   int32_t  tp_resolution;
 } transcoder_props_t;
 
+typedef struct transcoder_stats {
+  int      tst_fps;       // video frames per second
+  size_t   tst_queue;     // input bytes waiting for the codecs
+  int64_t  tst_latency;   // average time per video frame (us)
+  int      tst_drops;     // input packets dropped when behind
+} transcoder_stats_t;
+
+typedef struct transcoder_viewer transcoder_viewer_t;
+
+struct channel;
+
 extern uint32_t transcoding_enabled;
 
 streaming_target_t *transcoder_create (streaming_target_t *output);
@@ -39,6 +50,25 @@ void                transcoder_destroy(streaming_target_t *tr);
 void transcoder_get_capabilities(htsmsg_t *array);
 void transcoder_set_properties  (streaming_target_t *tr, 
 				 transcoder_props_t *prop);
+void transcoder_get_stats       (streaming_target_t *tr,
+				 transcoder_stats_t *stats);
+
+/* Sessions shared by all the viewers of a channel with the same
+   properties, global_lock must be held and the output's locks not */
+void transcoder_session_join  (struct channel *ch,
+			       transcoder_props_t *props,
+			       int weight,
+			       streaming_target_t *output,
+			       transcoder_viewer_t **tvp,
+			       th_subscription_t **sp,
+			       const char *name,
+			       const char *hostname,
+			       const char *username,
+			       const char *client);
+void transcoder_session_leave (transcoder_viewer_t *tv);
+void transcoder_session_weight(transcoder_viewer_t *tv, int weight);
+
+streaming_target_t *transcoder_session_transcoder(transcoder_viewer_t *tv);
 
 
 void transcoding_init(void);
@@ -25,6 +25,7 @@
 #include "atomic.h"
 #include "service.h"
 #include "timeshift.h"
+#include "congestion.h"
 
 void
 streaming_pad_init(streaming_pad_t *sp)
@@ -47,6 +48,65 @@ streaming_target_init(streaming_target_t *st, st_callback_t *cb, void *opaque,
 }
 
 
+/**
+ * Payload size and frame type of the data messages
+ *
+ * A raw TS chunk carries no frame information, each one is taken as a
+ * point a demuxer can resync on.
+ */
+static int
+streaming_queue_data(streaming_message_t *sm, int *frametype, size_t *len)
+{
+  th_pkt_t *pkt;
+  pktbuf_t *pb;
+
+  if (sm->sm_type == SMT_PACKET) {
+    pkt = sm->sm_data;
+    *frametype = pkt ? pkt->pkt_frametype : 0;
+    *len = pkt && pkt->pkt_payload ? pkt->pkt_payload->pb_size : 0;
+    return 1;
+  }
+  if (sm->sm_type == SMT_MPEGTS) {
+    pb = sm->sm_data;
+    *frametype = PKT_I_FRAME;
+    *len = pb ? pb->pb_size : 0;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Drop GOPs from the head while the consumer lags (sq_mutex is held)
+ */
+static void
+streaming_queue_trim(streaming_queue_t *sq)
+{
+  congestion_t *cc = sq->sq_cc;
+  streaming_message_t *sm, *next;
+  size_t len;
+  int type, n;
+
+  while (congestion_trim(cc)) {
+    n = 0;
+    for (sm = TAILQ_FIRST(&sq->sq_queue); sm != NULL; sm = next) {
+      next = TAILQ_NEXT(sm, sm_link);
+      if (!streaming_queue_data(sm, &type, &len))
+        continue;
+      if (n && congestion_sync(cc, type))
+        break;
+      TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
+      sq->sq_size -= len;
+      congestion_drop(cc, type, len);
+      streaming_msg_free(sm);
+      n++;
+    }
+    if (n == 0) {
+      congestion_flush(cc);
+      break;
+    }
+  }
+}
+
 /**
  *
  */
@@ -54,22 +114,69 @@ static void
 streaming_queue_deliver(void *opauqe, streaming_message_t *sm)
 {
   streaming_queue_t *sq = opauqe;
+  congestion_t *cc = sq->sq_cc;
+  size_t len = 0;
+  int type, data;
 
   pthread_mutex_lock(&sq->sq_mutex);
 
+  data = streaming_queue_data(sm, &type, &len);
+
   /* queue size protection */
-  // TODO: would be better to update size as we go, but this would
-  //       require updates elsewhere to ensure all removals from the queue
-  //       are covered (new function)
-  if (sq->sq_maxsize && streaming_queue_size(&sq->sq_queue) >= sq->sq_maxsize)
+  if (cc) {
+    if (sm->sm_type == SMT_START)
+      congestion_start(cc, sm->sm_data);
+    if (data && !congestion_admit(cc, type, len)) {
+      streaming_msg_free(sm);
+      pthread_mutex_unlock(&sq->sq_mutex);
+      return;
+    }
+  } else if (sq->sq_maxsize && sq->sq_size >= sq->sq_maxsize) {
     streaming_msg_free(sm);
-  else
-    TAILQ_INSERT_TAIL(&sq->sq_queue, sm, sm_link);
+    pthread_cond_signal(&sq->sq_cond);
+    pthread_mutex_unlock(&sq->sq_mutex);
+    return;
+  }
+
+  TAILQ_INSERT_TAIL(&sq->sq_queue, sm, sm_link);
+  sq->sq_size += len;
+  if (cc && data)
+    streaming_queue_trim(sq);
 
   pthread_cond_signal(&sq->sq_cond);
   pthread_mutex_unlock(&sq->sq_mutex);
 }
 
+/**
+ * Take a message off the queue (sq_mutex is held), queues with a size
+ * limit or congestion control must be consumed through this
+ */
+void
+streaming_queue_remove(streaming_queue_t *sq, streaming_message_t *sm)
+{
+  size_t len;
+  int type;
+
+  TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
+  if (streaming_queue_data(sm, &type, &len)) {
+    sq->sq_size -= len;
+    if (sq->sq_cc)
+      congestion_drain(sq->sq_cc, type, len);
+  }
+}
+
+/**
+ * Trim the queue by the given congestion control, which replaces the
+ * plain size limit
+ */
+void
+streaming_queue_congestion(streaming_queue_t *sq, congestion_t *cc)
+{
+  pthread_mutex_lock(&sq->sq_mutex);
+  sq->sq_cc = cc;
+  pthread_mutex_unlock(&sq->sq_mutex);
+}
+
 
 /**
  *
@@ -84,6 +191,8 @@ streaming_queue_init2(streaming_queue_t *sq, int reject_filter, size_t maxsize)
   TAILQ_INIT(&sq->sq_queue);
 
   sq->sq_maxsize = maxsize;
+  sq->sq_size    = 0;
+  sq->sq_cc      = NULL;
 }
 
 /**
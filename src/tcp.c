@@ -412,13 +412,11 @@ static LIST_HEAD(, tcp_server_launch) tcp_server_join = { 0 };
 /**
  *
  */
-static void *
-tcp_server_start(void *aux)
+static void
+tcp_server_sockopts(tcp_server_launch_t *tsl)
 {
-  tcp_server_launch_t *tsl = aux;
   struct timeval to;
   int val;
-  char c = 'J';
 
   val = 1;
   setsockopt(tsl->fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
@@ -444,6 +442,18 @@ tcp_server_start(void *aux)
   to.tv_sec  = 30;
   to.tv_usec =  0;
   setsockopt(tsl->fd, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof(to));
+}
+
+/**
+ *
+ */
+static void *
+tcp_server_start(void *aux)
+{
+  tcp_server_launch_t *tsl = aux;
+  char c = 'J';
+
+  tcp_server_sockopts(tsl);
 
   /* Start */
   time(&tsl->started);
@@ -469,6 +479,46 @@ tcp_server_start(void *aux)
   return NULL;
 }
 
+/**
+ * Start a connection handled without its own thread (global_lock held)
+ */
+static void
+tcp_server_start_detached(tcp_server_launch_t *tsl)
+{
+  tcp_server_sockopts(tsl);
+  time(&tsl->started);
+  if (tsl->ops.status) {
+    LIST_INSERT_HEAD(&tcp_server_launches, tsl, link);
+    notify_reload("connections");
+  }
+  tsl->ops.start(tsl->fd, &tsl->opaque, &tsl->peer, &tsl->self);
+}
+
+/**
+ * Detached connection is finished, the caller closes the socket
+ */
+void
+tcp_server_release(void *opaque)
+{
+  tcp_server_launch_t *tsl;
+
+  lock_assert(&global_lock);
+
+  LIST_FOREACH(tsl, &tcp_server_active, alink)
+    if (tsl->opaque == opaque)
+      break;
+  if (tsl == NULL)
+    return;
+
+  if (tsl->ops.stop) tsl->ops.stop(tsl->opaque);
+  if (tsl->ops.status) {
+    LIST_REMOVE(tsl, link);
+    notify_reload("connections");
+  }
+  LIST_REMOVE(tsl, alink);
+  free(tsl);
+}
+
 
 /**
  *
@@ -539,6 +589,11 @@ tcp_server_loop(void *aux)
 
       pthread_mutex_lock(&global_lock);
       LIST_INSERT_HEAD(&tcp_server_active, tsl, alink);
+      if (tsl->ops.detach) {
+        tcp_server_start_detached(tsl);
+        pthread_mutex_unlock(&global_lock);
+        continue;
+      }
       pthread_mutex_unlock(&global_lock);
       tvhthread_create(&tsl->tid, NULL, tcp_server_start, tsl, 0);
     }
@@ -717,6 +772,11 @@ tcp_server_done(void)
   LIST_FOREACH(tsl, &tcp_server_active, alink) {
     if (tsl->ops.cancel)
       tsl->ops.cancel(tsl->opaque);
+    /* Detached, the protocol closes the socket on release */
+    if (tsl->ops.detach) {
+      shutdown(tsl->fd, SHUT_RDWR);
+      continue;
+    }
     close(tsl->fd);
     tsl->fd = -1;
     pthread_kill(tsl->tid, SIGTERM);
@@ -30,6 +30,8 @@ typedef struct tcp_server_ops
   void (*stop)   (void *opaque);
   void (*status) (void *opaque, htsmsg_t *m);
   void (*cancel) (void *opaque);
+  int    detach; /* start() returns at once (with global_lock held), the
+                    connection lasts until tcp_server_release() */
 } tcp_server_ops_t;
 
 extern int tcp_preferred_address_family;
@@ -49,6 +51,8 @@ void *tcp_server_create(const char *bindaddr, int port,
 
 void tcp_server_delete(void *server);
 
+void tcp_server_release(void *opaque);
+
 int tcp_read(int fd, void *buf, size_t len);
 
 char *tcp_read_line(int fd, htsbuf_queue_t *spill);
@@ -33,6 +33,7 @@
 #include <stdio.h>
 
 static int timeshift_index = 0;
+static int timeshift_buffer_index = 0;
 
 uint32_t  timeshift_enabled;
 int       timeshift_ondemand;
@@ -41,6 +42,7 @@ int       timeshift_unlimited_period;
 uint32_t  timeshift_max_period;
 int       timeshift_unlimited_size;
 uint64_t  timeshift_max_size;
+uint64_t  timeshift_ram_size;
 
 /*
  * Intialise global file manager
@@ -61,6 +63,7 @@ void timeshift_init ( void )
   timeshift_max_period       = 3600;                    // 1Hr
   timeshift_unlimited_size   = 0;
   timeshift_max_size         = 10000 * (size_t)1048576; // 10G
+  timeshift_ram_size         = 0;                       // Disk only
 
   /* Load settings */
   if ((m = hts_settings_load("timeshift/config"))) {
@@ -77,6 +80,8 @@ void timeshift_init ( void )
       timeshift_unlimited_size = u32 ? 1 : 0;
     if (!htsmsg_get_u32(m, "max_size", &u32))
       timeshift_max_size = 1048576LL * u32;
+    if (!htsmsg_get_u32(m, "ram_size", &u32))
+      timeshift_ram_size = 1048576LL * u32;
     htsmsg_destroy(m);
   }
 }
@@ -105,10 +110,277 @@ void timeshift_save ( void )
   htsmsg_add_u32(m, "max_period", timeshift_max_period);
   htsmsg_add_u32(m, "unlimited_size", timeshift_unlimited_size);
   htsmsg_add_u32(m, "max_size", timeshift_max_size / 1048576);
+  htsmsg_add_u32(m, "ram_size", timeshift_ram_size / 1048576);
 
   hts_settings_save(m, "timeshift/config");
 }
 
+/*
+ * Shared buffers
+ */
+static LIST_HEAD(,timeshift_buffer) timeshift_buffers;
+static pthread_mutex_t              timeshift_buffers_mutex =
+  PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Get (or create) buffer, shared by the viewers of a channel fed from
+ * the same source
+ */
+static timeshift_buffer_t *timeshift_buffer_get
+  ( struct channel *ch, const char *source, time_t max_time )
+{
+  timeshift_buffer_t *tsb = NULL;
+
+  pthread_mutex_lock(&timeshift_buffers_mutex);
+  if (ch && source)
+    LIST_FOREACH(tsb, &timeshift_buffers, link)
+      if (tsb->key == ch && !strcmp(tsb->source, source))
+        break;
+
+  if (tsb) {
+    pthread_mutex_lock(&tsb->rdwr_mutex);
+    if (tsb->max_time && (!max_time || max_time > tsb->max_time))
+      tsb->max_time = max_time;
+    pthread_mutex_unlock(&tsb->rdwr_mutex);
+    tvhdebug("timeshift", "ts %d shared buffer (%d viewers)",
+             tsb->id, tsb->refcount + 1);
+  } else {
+    tsb = calloc(1, sizeof(timeshift_buffer_t));
+    TAILQ_INIT(&tsb->files);
+    LIST_INIT(&tsb->viewers);
+    tsb->key      = source ? ch : NULL;
+    tsb->source   = source ? strdup(source) : NULL;
+    tsb->id       = timeshift_buffer_index++;
+    tsb->max_time = max_time;
+    tsb->vididx   = -1;
+    pthread_mutex_init(&tsb->rdwr_mutex, NULL);
+    pthread_mutex_init(&tsb->feed_mutex, NULL);
+    streaming_queue_init(&tsb->wr_queue, 0);
+    tvhthread_create(&tsb->wr_thread, NULL, timeshift_writer, tsb, 0);
+    if (tsb->key)
+      LIST_INSERT_HEAD(&timeshift_buffers, tsb, link);
+  }
+  tsb->refcount++;
+  pthread_mutex_unlock(&timeshift_buffers_mutex);
+  return tsb;
+}
+
+/*
+ * Release buffer
+ */
+static void timeshift_buffer_put ( timeshift_buffer_t *tsb )
+{
+  int i;
+
+  pthread_mutex_lock(&timeshift_buffers_mutex);
+  if (--tsb->refcount > 0) {
+    pthread_mutex_unlock(&timeshift_buffers_mutex);
+    return;
+  }
+  if (tsb->key)
+    LIST_REMOVE(tsb, link);
+  pthread_mutex_unlock(&timeshift_buffers_mutex);
+
+  /* Writer */
+  streaming_target_deliver2(&tsb->wr_queue.sq_st,
+                            streaming_msg_create(SMT_EXIT));
+  pthread_join(tsb->wr_thread, NULL);
+  streaming_queue_deinit(&tsb->wr_queue);
+
+  /* Flush files */
+  timeshift_filemgr_flush(tsb, NULL);
+
+  for (i = 0; i < TIMESHIFT_FEED_RECENT; i++)
+    if (tsb->recent[i].payload)
+      pktbuf_ref_dec(tsb->recent[i].payload);
+  if (tsb->path)
+    free(tsb->path);
+  free(tsb->source);
+  free(tsb->fidx);
+  free(tsb);
+}
+
+/*
+ * Attach / detach viewer, the first one feeds the buffer
+ */
+static void timeshift_buffer_attach ( timeshift_buffer_t *tsb, timeshift_t *ts )
+{
+  pthread_mutex_lock(&tsb->feed_mutex);
+  ts->buf          = tsb;
+  ts->pts_known    = 0;
+  ts->pts_offset   = 0;
+  ts->unmatched    = 0;
+  ts->last_payload = NULL;
+  LIST_INSERT_HEAD(&tsb->viewers, ts, buf_link);
+  if (!tsb->feeder) {
+    tsb->feeder    = ts;
+    ts->pts_known  = 1;
+    ts->pts_offset = -tsb->feed_offset;
+  }
+  pthread_mutex_unlock(&tsb->feed_mutex);
+}
+
+static void timeshift_buffer_detach ( timeshift_buffer_t *tsb, timeshift_t *ts )
+{
+  timeshift_t *v, *nxt = NULL;
+
+  pthread_mutex_lock(&tsb->feed_mutex);
+  LIST_REMOVE(ts, buf_link);
+  if (tsb->feeder == ts) {
+
+    /* Hand over, preferably to a viewer whose timebase is known */
+    LIST_FOREACH(v, &tsb->viewers, buf_link)
+      if (!nxt || (v->pts_known && !nxt->pts_known))
+        nxt = v;
+    tsb->feeder = nxt;
+    if (nxt) {
+      if (!nxt->pts_known) {
+        tvhlog(LOG_WARNING, "timeshift",
+               "ts %d feeder timebase unknown, buffer will be discontinuous",
+               tsb->id);
+        nxt->pts_offset = -tsb->feed_offset;
+        nxt->pts_known  = 1;
+      }
+      tsb->feed_offset = -nxt->pts_offset;
+      tvhdebug("timeshift", "ts %d now fed by ts %d (offset %"PRId64")",
+               tsb->id, nxt->id, tsb->feed_offset);
+    }
+  }
+  pthread_mutex_unlock(&tsb->feed_mutex);
+  if (ts->last_payload)
+    pktbuf_ref_dec(ts->last_payload);
+  ts->last_payload = NULL;
+  ts->buf          = NULL;
+}
+
+/*
+ * Move to the buffer wanted for the current source, called by the
+ * reader (state_mutex is held) once it let go of its position
+ */
+void timeshift_rebuffer ( timeshift_t *ts )
+{
+  timeshift_buffer_t *tsb;
+  streaming_message_t *sm;
+
+  ts->buf_change = 0;
+  if ((tsb = ts->buf)) {
+    timeshift_buffer_detach(tsb, ts);
+    timeshift_buffer_put(tsb);
+  }
+  tsb = timeshift_buffer_get(ts->buf_channel, ts->buf_source, ts->max_time);
+  timeshift_buffer_attach(tsb, ts);
+  tvhdebug("timeshift", "ts %d using %s buffer %d", ts->id,
+           tsb->key ? "shared" : "private", tsb->id);
+
+  /* A new feeder restates the stream makeup */
+  if (tsb->feeder == ts && ts->smt_start) {
+    atomic_add(&ts->smt_start->ss_refcount, 1);
+    sm = streaming_msg_create_data(SMT_START, ts->smt_start);
+    sm->sm_time = getmonoclock();
+    streaming_target_deliver2(&tsb->wr_queue.sq_st, sm);
+  }
+}
+
+/*
+ * Source of the input, viewers can only share a buffer when their
+ * packets come from the same service instance
+ */
+static void timeshift_source ( timeshift_t *ts, streaming_start_t *ss )
+{
+  char buf[512];
+
+  snprintf(buf, sizeof(buf), "%s|%s|%s|%d",
+           ss->ss_si.si_adapter ?: "", ss->ss_si.si_mux ?: "",
+           ss->ss_si.si_service ?: "", ss->ss_service_id);
+  if (ts->buf_source && !strcmp(ts->buf_source, buf))
+    return;
+  free(ts->buf_source);
+  ts->buf_source = strdup(buf);
+  ts->buf_change = 1;
+}
+
+/*
+ * Pass a message on to the buffer, only the feeder's input is stored.
+ * The other viewers use it to measure their timebase against it.
+ */
+static streaming_message_t *timeshift_feed
+  ( timeshift_t *ts, streaming_message_t *sm )
+{
+  timeshift_buffer_t *tsb = ts->buf;
+  timeshift_feed_rec_t *rec;
+  th_pkt_t *pkt = NULL;
+  int i;
+
+  switch (sm->sm_type) {
+    case SMT_PACKET:
+      pkt = sm->sm_data;
+      break;
+    case SMT_START:
+    case SMT_SIGNAL_STATUS:
+    case SMT_MPEGTS:
+      break;
+    default:
+      streaming_msg_free(sm);
+      return NULL;
+  }
+
+  pthread_mutex_lock(&tsb->feed_mutex);
+
+  /* Viewer, match the last packet against those stored */
+  if (tsb->feeder != ts) {
+    if (pkt && !ts->pts_known &&
+        ++ts->unmatched > TIMESHIFT_FEED_MATCH && !ts->buf_change) {
+      tvhlog(LOG_WARNING, "timeshift",
+             "ts %d no timebase match, using a private buffer", ts->id);
+      ts->buf_channel = NULL;
+      ts->buf_change  = 1;
+    }
+    if (pkt) {
+      if (ts->last_payload) {
+        for (i = 0; i < TIMESHIFT_FEED_RECENT; i++) {
+          rec = &tsb->recent[i];
+          if (rec->payload == ts->last_payload) {
+            ts->pts_offset = ts->last_dts - rec->dts;
+            ts->pts_known  = 1;
+            break;
+          }
+        }
+        pktbuf_ref_dec(ts->last_payload);
+      }
+      if ((ts->last_payload = pkt->pkt_payload))
+        pktbuf_ref_inc(ts->last_payload);
+      ts->last_dts = pkt->pkt_dts;
+    }
+    pthread_mutex_unlock(&tsb->feed_mutex);
+    streaming_msg_free(sm);
+    return NULL;
+  }
+
+  /* Feeder */
+  if (pkt) {
+    if (tsb->feed_offset) {
+      sm->sm_data = pkt_copy_shallow(pkt);
+      pkt_ref_dec(pkt);
+      pkt = sm->sm_data;
+      if (pkt->pkt_pts != PTS_UNSET)
+        pkt->pkt_pts += tsb->feed_offset;
+      if (pkt->pkt_dts != PTS_UNSET)
+        pkt->pkt_dts += tsb->feed_offset;
+    }
+    if (pkt->pkt_payload) {
+      rec = &tsb->recent[tsb->recent_idx];
+      tsb->recent_idx = (tsb->recent_idx + 1) % TIMESHIFT_FEED_RECENT;
+      if (rec->payload)
+        pktbuf_ref_dec(rec->payload);
+      rec->payload = pkt->pkt_payload;
+      rec->dts     = pkt->pkt_dts;
+      pktbuf_ref_inc(rec->payload);
+    }
+  }
+  pthread_mutex_unlock(&tsb->feed_mutex);
+  return sm;
+}
+
 /*
  * Receive data
  */
@@ -136,6 +408,8 @@ static void timeshift_input
     if (sm->sm_type == SMT_START && ts->state == TS_INIT) {
       ts->state  = TS_LIVE;
     }
+    if (sm->sm_type == SMT_START && ts->buf_channel)
+      timeshift_source(ts, sm->sm_data);
 
     if (sm->sm_type == SMT_PACKET) {
       tvhtrace("timeshift",
@@ -187,7 +461,10 @@ static void timeshift_input
                  pkt->pkt_duration,
                  pktbuf_len(pkt->pkt_payload));
       }
-      streaming_target_deliver2(&ts->wr_queue.sq_st, sm);
+      if (!ts->buf || ts->buf_change)
+        streaming_msg_free(sm);
+      else if ((sm = timeshift_feed(ts, sm)))
+        streaming_target_deliver2(&ts->buf->wr_queue.sq_st, sm);
     } else
       streaming_msg_free(sm);
 
@@ -208,39 +485,34 @@ void
 timeshift_destroy(streaming_target_t *pad)
 {
   timeshift_t *ts = (timeshift_t*)pad;
-  streaming_message_t *sm;
+  timeshift_buffer_t *tsb;
 
   /* Must hold global lock */
   lock_assert(&global_lock);
 
-  /* Ensure the threads exits */
-  // Note: this is a workaround for the fact the Q might have been flushed
-  //       in reader thread (VERY unlikely)
+  /* Ensure the reader exits */
   pthread_mutex_lock(&ts->state_mutex);
-  sm = streaming_msg_create(SMT_EXIT);
-  streaming_target_deliver2(&ts->wr_queue.sq_st, sm);
   timeshift_write_exit(ts->rd_pipe.wr);
   pthread_mutex_unlock(&ts->state_mutex);
 
-  /* Wait for all threads */
+  /* Wait for reader */
   pthread_join(ts->rd_thread, NULL);
-  pthread_join(ts->wr_thread, NULL);
-
-  /* Shut stuff down */
-  streaming_queue_deinit(&ts->wr_queue);
 
   close(ts->rd_pipe.rd);
   close(ts->rd_pipe.wr);
 
-  /* Flush files */
-  timeshift_filemgr_flush(ts, NULL);
+  /* Release buffer */
+  if (ts->buf) {
+    tsb = ts->buf;
+    timeshift_buffer_detach(tsb, ts);
+    timeshift_buffer_put(tsb);
+  }
+  free(ts->buf_source);
 
   /* Release SMT_START index */
   if (ts->smt_start)
     streaming_start_unref(ts->smt_start);
 
-  if (ts->path)
-    free(ts->path);
   free(ts);
 }
 
@@ -248,10 +520,11 @@ timeshift_destroy(streaming_target_t *pad)
  * Create timeshift buffer
  *
  * max_period of buffer in seconds (0 = unlimited)
- * max_size   of buffer in bytes   (0 = unlimited)
+ * ch         buffer is shared with other viewers of ch fed from the same
+ *            service, it is picked once that is known (NULL = private)
  */
 streaming_target_t *timeshift_create
-  (streaming_target_t *out, time_t max_time)
+  (streaming_target_t *out, time_t max_time, struct channel *ch)
 {
   timeshift_t *ts = calloc(1, sizeof(timeshift_t));
 
@@ -259,26 +532,25 @@ streaming_target_t *timeshift_create
   lock_assert(&global_lock);
 
   /* Setup structure */
-  TAILQ_INIT(&ts->files);
   ts->output     = out;
-  ts->path       = NULL;
-  ts->max_time   = max_time;
   ts->state      = TS_INIT;
-  ts->full       = 0;
-  ts->vididx     = -1;
   ts->id         = timeshift_index;
   ts->ondemand   = timeshift_ondemand;
   ts->pts_delta  = PTS_UNSET;
-  pthread_mutex_init(&ts->rdwr_mutex, NULL);
+  ts->max_time   = max_time;
   pthread_mutex_init(&ts->state_mutex, NULL);
 
+  /* Buffer (on-demand buffers start at the pause, so are never shared) */
+  if (ts->ondemand || !ch)
+    timeshift_buffer_attach(timeshift_buffer_get(NULL, NULL, max_time), ts);
+  else
+    ts->buf_channel = ch;
+
   /* Initialise output */
   tvh_pipe(O_NONBLOCK, &ts->rd_pipe);
 
   /* Initialise input */
-  streaming_queue_init(&ts->wr_queue, 0);
   streaming_target_init(&ts->input, timeshift_input, ts, 0);
-  tvhthread_create(&ts->wr_thread, NULL, timeshift_writer, ts, 0);
   tvhthread_create(&ts->rd_thread, NULL, timeshift_reader, ts, 0);
 
   /* Update index */
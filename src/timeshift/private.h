@@ -19,20 +19,124 @@
 #ifndef __TVH_TIMESHIFT_PRIVATE_H__
 #define __TVH_TIMESHIFT_PRIVATE_H__
 
+#include <sys/uio.h>
+
 #define TIMESHIFT_PLAY_BUF     200000 // us to buffer in TX
 #define TIMESHIFT_FILE_PERIOD      60 // number of secs in each buffer file
 
+#define TIMESHIFT_WR_IOV           64 // iovecs per writev()
+#define TIMESHIFT_WR_STAGE    (16*1024) // staging for headers and small bodies
+#define TIMESHIFT_WR_COPY         512 // bodies up to this size are staged
+#define TIMESHIFT_WR_BATCH   (256*1024) // flush threshold
+#define TIMESHIFT_RD_AHEAD   (128*1024) // reader read-ahead
+
+/**
+ * Buffer record format (also used on the reader control pipe)
+ *
+ * Each record is a fixed header followed by the message body, a header
+ * with a zero length marks the end of a file. Packets are stored as a
+ * timeshift_rec_pkt_t followed by the codec header and payload data.
+ */
+typedef struct timeshift_rec_hdr
+{
+  uint32_t                            len;    ///< Record length (incl. header)
+  uint16_t                            type;   ///< Message type
+  uint16_t                            flags;  ///< Reserved
+  int64_t                             time;   ///< Message time
+} __attribute__((packed)) timeshift_rec_hdr_t;
+
+#define TIMESHIFT_REC_HEADER  0x01    ///< Packet has a codec header
+#define TIMESHIFT_REC_PAYLOAD 0x02    ///< Packet has a payload
+
+typedef struct timeshift_rec_pkt
+{
+  int64_t                             dts;
+  int64_t                             pts;
+  int32_t                             duration;
+  uint32_t                            hdr_len;  ///< Codec header length
+  uint8_t                             flags;
+  uint8_t                             commercial;
+  uint8_t                             componentindex;
+  uint8_t                             frametype;
+  uint8_t                             field;
+  uint8_t                             channels;
+  uint8_t                             sri;
+  uint8_t                             err;
+  uint16_t                            aspect_num;
+  uint16_t                            aspect_den;
+} __attribute__((packed)) timeshift_rec_pkt_t;
+
+/**
+ * Pending writes, records are gathered here and written with a single
+ * writev() once the writer runs out of queued messages (or the batch
+ * fills up). Packet data is referenced rather than copied.
+ */
+typedef struct timeshift_wrbuf
+{
+  struct iovec                        iov[TIMESHIFT_WR_IOV];
+  pktbuf_t                           *ref[TIMESHIFT_WR_IOV]; ///< Held data
+  int                                 iovcnt;
+  size_t                              len;        ///< Bytes pending
+  size_t                              stage_len;
+  uint8_t                             stage[TIMESHIFT_WR_STAGE];
+} timeshift_wrbuf_t;
+
+/**
+ * In-memory segment (RAM mode), messages are held by reference. Each
+ * record keeps the offset it will have once written out, so indexes
+ * and reader positions survive the segment being spilled to disk.
+ */
+typedef struct timeshift_ram_rec
+{
+  off_t                               pos;    ///< Position in the file
+  size_t                              len;    ///< Record length on disk
+  streaming_message_t                *sm;     ///< NULL marks end of file
+} timeshift_ram_rec_t;
+
+typedef struct timeshift_ram
+{
+  timeshift_ram_rec_t                *recs;
+  int                                 count;
+  int                                 alloc;
+  uint8_t                             eof;    ///< Segment is closed
+} timeshift_ram_t;
+
+/**
+ * Reader read-ahead, file data is append only so anything buffered
+ * stays valid until the file is changed
+ */
+typedef struct timeshift_rdbuf
+{
+  int                                 fd;
+  off_t                               off;        ///< File offset of data[0]
+  size_t                              len;
+  size_t                              size;
+  uint8_t                            *data;
+} timeshift_rdbuf_t;
+
 /**
  * Indexes of import data in the stream
  */
 typedef struct timeshift_index_iframe
 {
-  off_t                               pos;    ///< Position in the file
+  int64_t                             pos;    ///< Position in the file
   int64_t                             time;   ///< Packet time
-  TAILQ_ENTRY(timeshift_index_iframe) link;   ///< List entry
 } timeshift_index_iframe_t;
 
-typedef TAILQ_HEAD(timeshift_index_iframe_list,timeshift_index_iframe) timeshift_index_iframe_list_t;
+/**
+ * I-frame index file (<file>.idx), written once a file is complete:
+ * this header followed by the entries exactly as held in memory
+ */
+#define TIMESHIFT_IDX_MAGIC   0x58495354 // "TSIX"
+#define TIMESHIFT_IDX_VERSION 1
+
+typedef struct timeshift_idx_hdr
+{
+  uint32_t                            magic;
+  uint16_t                            version;
+  uint16_t                            size;   ///< Size of an entry
+  uint32_t                            count;  ///< Number of entries
+} __attribute__((packed)) timeshift_idx_hdr_t;
 
 /**
  * Indexes of import data in the stream
@@ -53,16 +157,21 @@ typedef struct timeshift_file
 {
   int                           fd;       ///< Write descriptor
   char                          *path;    ///< Full path to file
+  timeshift_wrbuf_t             *wbuf;    ///< Pending writes
+  timeshift_ram_t               *ram;     ///< In memory data (not spilled)
 
   time_t                        time;     ///< Files coarse timestamp
   size_t                        size;     ///< Current file size;
   int64_t                       last;     ///< Latest timestamp
 
   uint8_t                       bad;      ///< File is broken
+  uint8_t                       expired;  ///< Past max_time, readers must leave
 
   int                           refcount; ///< Reader ref count
 
-  timeshift_index_iframe_list_t iframes;  ///< I-frame indexing
+  timeshift_index_iframe_t      *iframes; ///< I-frame index (time order)
+  int                           iframe_count;
+  int                           iframe_alloc;
   timeshift_index_data_list_t   sstart;   ///< Stream start messages
 
   TAILQ_ENTRY(timeshift_file) link;     ///< List entry
@@ -70,6 +179,68 @@ typedef struct timeshift_file
 
 typedef TAILQ_HEAD(timeshift_file_list,timeshift_file) timeshift_file_list_t;
 
+static inline int timeshift_file_writable ( timeshift_file_t *tsf )
+{
+  return tsf->ram ? !tsf->ram->eof : tsf->fd != -1;
+}
+
+/* I-frame index, NULL if there are none (rdwr_mutex is held) */
+static inline timeshift_index_iframe_t *
+timeshift_filemgr_iframes ( timeshift_file_t *tsf )
+{
+  return tsf->iframe_count ? tsf->iframes : NULL;
+}
+
+#define TIMESHIFT_FEED_RECENT 16 // packets remembered for timebase matching
+#define TIMESHIFT_FEED_MATCH 100 // packets a viewer may go without a match
+
+/**
+ * Recently stored packet, viewers find their own copy of it to learn
+ * the difference between their timebase and the buffer's
+ */
+typedef struct timeshift_feed_rec
+{
+  pktbuf_t                           *payload;  ///< Held reference
+  int64_t                             dts;      ///< Stored (buffer) DTS
+} timeshift_feed_rec_t;
+
+/**
+ * Buffer, shared by all viewers of a channel (unless on-demand or
+ * transcoded). One viewer (the feeder) writes, every viewer has its own
+ * reader cursor. Files are only removed once no cursor references them.
+ */
+typedef struct timeshift_buffer
+{
+  LIST_ENTRY(timeshift_buffer) link;      ///< Shared buffer list
+  void                        *key;       ///< Channel (NULL if private)
+  char                        *source;    ///< Service the input comes from
+  int                          refcount;  ///< Attached viewers
+
+  int                          id;        ///< Reference number
+  char                        *path;      ///< Directory containing buffer
+  time_t                       max_time;  ///< Maximum period to shift
+  uint8_t                      full;      ///< Buffer is full
+
+  streaming_queue_t            wr_queue;  ///< Writer queue
+  pthread_t                    wr_thread; ///< Writer thread
+
+  pthread_mutex_t              rdwr_mutex; ///< Buffer protection
+  timeshift_file_list_t        files;     ///< List of files
+  timeshift_file_t           **fidx;      ///< Files in time order, from fidx_first
+  int                          fidx_first;
+  int                          fidx_count;
+  int                          fidx_alloc;
+
+  int                          vididx;    ///< Index of (current) video stream
+
+  pthread_mutex_t              feed_mutex;  ///< Protects the feed state
+  struct timeshift            *feeder;      ///< Viewer whose input is stored
+  int64_t                      feed_offset; ///< Added to the feeder's timestamps
+  LIST_HEAD(,timeshift)        viewers;
+  timeshift_feed_rec_t         recent[TIMESHIFT_FEED_RECENT];
+  int                          recent_idx;
+} timeshift_buffer_t;
+
 /**
  *
  */
@@ -79,11 +250,21 @@ typedef struct timeshift {
   streaming_target_t          *output;    ///< Output dest
 
   int                         id;         ///< Reference number
-  char                        *path;      ///< Directory containing buffer
-  time_t                      max_time;   ///< Maximum period to shift
   int                         ondemand;   ///< Whether this is an on-demand timeshift
   int64_t                     pts_delta;  ///< Delta between system clock and PTS
 
+  time_t                      max_time;   ///< Requested period
+  timeshift_buffer_t         *buf;        ///< Buffer (NULL until the source is known)
+  LIST_ENTRY(timeshift)       buf_link;   ///< Buffer viewers
+  struct channel             *buf_channel; ///< Shared by channel (NULL = private)
+  char                       *buf_source; ///< Input source
+  uint8_t                     buf_change; ///< Reader to move buffer
+  int                         unmatched;  ///< Packets without a timebase match
+  int64_t                     pts_offset; ///< Own timebase minus the buffer's
+  uint8_t                     pts_known;  ///< pts_offset has been measured
+  pktbuf_t                   *last_payload; ///< Last live packet (held)
+  int64_t                     last_dts;
+
   enum {
     TS_INIT,
     TS_EXIT,
@@ -92,37 +273,35 @@ typedef struct timeshift {
     TS_PLAY,
   }                           state;       ///< Play state
   pthread_mutex_t             state_mutex; ///< Protect state changes
-  uint8_t                     full;        ///< Buffer is full
-  
-  streaming_start_t          *smt_start;   ///< Current stream makeup
 
-  streaming_queue_t           wr_queue;   ///< Writer queue
-  pthread_t                   wr_thread;  ///< Writer thread
+  streaming_start_t          *smt_start;   ///< Current stream makeup
 
   pthread_t                   rd_thread;  ///< Reader thread
   th_pipe_t                   rd_pipe;    ///< Message passing to reader
 
-  pthread_mutex_t             rdwr_mutex; ///< Buffer protection
-  timeshift_file_list_t       files;      ///< List of files
-
-  int                         vididx;     ///< Index of (current) video stream
-
 } timeshift_t;
 
 /*
  * Write functions
  */
-ssize_t timeshift_write_start   ( int fd, int64_t time, streaming_start_t *ss );
-ssize_t timeshift_write_sigstat ( int fd, int64_t time, signal_status_t *ss );
-ssize_t timeshift_write_packet  ( int fd, int64_t time, th_pkt_t *pkt );
-ssize_t timeshift_write_mpegts  ( int fd, int64_t time, void *data );
+ssize_t timeshift_write_sigstat
+  ( timeshift_file_t *tsf, int64_t time, signal_status_t *ss );
+ssize_t timeshift_write_packet  ( timeshift_file_t *tsf, int64_t time, th_pkt_t *pkt );
+ssize_t timeshift_write_mpegts  ( timeshift_file_t *tsf, int64_t time, void *data );
+ssize_t timeshift_write_msg     ( timeshift_file_t *tsf, streaming_message_t *sm );
+ssize_t timeshift_write_ram     ( timeshift_file_t *tsf, streaming_message_t *sm );
+ssize_t timeshift_write_eof     ( timeshift_file_t *tsf );
+ssize_t timeshift_write_flush   ( timeshift_file_t *tsf );
+void    timeshift_write_discard ( timeshift_file_t *tsf );
+
 ssize_t timeshift_write_skip    ( int fd, streaming_skip_t *skip );
 ssize_t timeshift_write_speed   ( int fd, int speed );
 ssize_t timeshift_write_stop    ( int fd, int code );
 ssize_t timeshift_write_exit    ( int fd );
-ssize_t timeshift_write_eof     ( int fd );
 
-void timeshift_writer_flush ( timeshift_t *ts );
+void timeshift_writer_flush ( timeshift_buffer_t *tsb );
+
+void timeshift_rebuffer ( timeshift_t *ts );
 
 /*
  * Threads
@@ -138,18 +317,33 @@ void timeshift_filemgr_term     ( void );
 int  timeshift_filemgr_makedirs ( int ts_index, char *buf, size_t len );
 
 timeshift_file_t *timeshift_filemgr_get
-  ( timeshift_t *ts, int create );
+  ( timeshift_buffer_t *tsb, int create );
 timeshift_file_t *timeshift_filemgr_oldest
-  ( timeshift_t *ts );
+  ( timeshift_buffer_t *tsb );
 timeshift_file_t *timeshift_filemgr_newest
-  ( timeshift_t *ts );
+  ( timeshift_buffer_t *tsb );
 timeshift_file_t *timeshift_filemgr_prev
   ( timeshift_file_t *ts, int *end, int keep );
 timeshift_file_t *timeshift_filemgr_next
   ( timeshift_file_t *ts, int *end, int keep );
 void timeshift_filemgr_remove
-  ( timeshift_t *ts, timeshift_file_t *tsf, int force );
-void timeshift_filemgr_flush ( timeshift_t *ts, timeshift_file_t *end );
+  ( timeshift_buffer_t *tsb, timeshift_file_t *tsf, int force );
+void timeshift_filemgr_flush ( timeshift_buffer_t *tsb, timeshift_file_t *end );
+void timeshift_filemgr_trim  ( timeshift_buffer_t *tsb, int all );
 void timeshift_filemgr_close ( timeshift_file_t *tsf );
+void timeshift_filemgr_spill ( timeshift_buffer_t *tsb );
+int  timeshift_filemgr_find  ( timeshift_buffer_t *tsb, time_t time );
+
+/*
+ * File by position in the time index (rdwr_mutex is held), NULL when
+ * out of range
+ */
+static inline timeshift_file_t *timeshift_filemgr_at
+  ( timeshift_buffer_t *tsb, int i )
+{
+  if (i < 0 || i >= tsb->fidx_count)
+    return NULL;
+  return tsb->fidx[tsb->fidx_first + i];
+}
 
 #endif /* __TVH_TIMESHIFT_PRIVATE_H__ */
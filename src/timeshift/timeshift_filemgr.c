@@ -39,6 +39,7 @@ static pthread_mutex_t       timeshift_reaper_lock;
 static pthread_cond_t        timeshift_reaper_cond;
 
 uint64_t                     timeshift_total_size;
+uint64_t                     timeshift_total_ram_size;
 
 /* **************************************************************************
  * File reaper thread
@@ -46,9 +47,8 @@ uint64_t                     timeshift_total_size;
 
 static void* timeshift_reaper_callback ( void *p )
 {
-  char *dpath;
+  char *dpath, ipath[512];
   timeshift_file_t *tsf;
-  timeshift_index_iframe_t *ti;
   timeshift_index_data_t *tid;
   streaming_message_t *sm;
   pthread_mutex_lock(&timeshift_reaper_lock);
@@ -66,6 +66,8 @@ static void* timeshift_reaper_callback ( void *p )
     tvhtrace("timeshift", "remove file %s", tsf->path);
 
     /* Remove */
+    snprintf(ipath, sizeof(ipath), "%s.idx", tsf->path);
+    unlink(ipath);
     unlink(tsf->path);
     dpath = dirname(tsf->path);
     if (rmdir(dpath) == -1)
@@ -74,10 +76,7 @@ static void* timeshift_reaper_callback ( void *p )
                dpath, strerror(errno));
 
     /* Free memory */
-    while ((ti = TAILQ_FIRST(&tsf->iframes))) {
-      TAILQ_REMOVE(&tsf->iframes, ti, link);
-      free(ti);
-    }
+    free(tsf->iframes);
     while ((tid = TAILQ_FIRST(&tsf->sstart))) {
       TAILQ_REMOVE(&tsf->sstart, tid, link);
       sm = tid->data;
@@ -133,31 +132,232 @@ int timeshift_filemgr_makedirs ( int index, char *buf, size_t len )
   return makedirs(buf, 0700);
 }
 
+/*
+ * Store the I-frame index of a complete file alongside it, so that it
+ * can be opened without scanning the records. The buffer itself keeps
+ * using the in-memory copy, a few thousand entries at most per file,
+ * so seeks never wait for the disk while holding rdwr_mutex.
+ */
+static void timeshift_filemgr_write_index ( timeshift_file_t *tsf )
+{
+  timeshift_idx_hdr_t hdr;
+  char path[512];
+  int fd;
+
+  hdr.magic   = TIMESHIFT_IDX_MAGIC;
+  hdr.version = TIMESHIFT_IDX_VERSION;
+  hdr.size    = sizeof(timeshift_index_iframe_t);
+  hdr.count   = tsf->iframe_count;
+  snprintf(path, sizeof(path), "%s.idx", tsf->path);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ||
+      tvh_write(fd, &hdr, sizeof(hdr)) ||
+      tvh_write(fd, tsf->iframes, tsf->iframe_count * sizeof(timeshift_index_iframe_t))) {
+    tvhlog(LOG_ERR, "timeshift", "failed to write %s [e=%s]",
+           path, strerror(errno));
+  }
+  if (fd >= 0)
+    close(fd);
+}
+
 /*
  * Close file
  */
 void timeshift_filemgr_close ( timeshift_file_t *tsf )
 {
-  ssize_t r = timeshift_write_eof(tsf->fd);
+  timeshift_ram_t *ram = tsf->ram;
+  timeshift_ram_rec_t *rec;
+  ssize_t r;
+
+  /* In memory, just mark the end */
+  if (ram) {
+    if (ram->eof)
+      return;
+    if (ram->count == ram->alloc) {
+      ram->alloc = MAX(256, ram->alloc * 2);
+      ram->recs  = realloc(ram->recs, ram->alloc * sizeof(*rec));
+    }
+    rec = &ram->recs[ram->count++];
+    rec->pos = tsf->size;
+    rec->len = sizeof(timeshift_rec_hdr_t);
+    rec->sm  = NULL;
+    ram->eof = 1;
+    tsf->size += rec->len;
+    atomic_add_u64(&timeshift_total_size, rec->len);
+    atomic_add_u64(&timeshift_total_ram_size, rec->len);
+    return;
+  }
+
+  r = timeshift_write_eof(tsf);
   if (r > 0)
   {
     tsf->size += r;
     atomic_add_u64(&timeshift_total_size, r);
   }
+  if (timeshift_write_flush(tsf) < 0)
+    tvhlog(LOG_ERR, "timeshift", "failed to write %s [e=%s]",
+           tsf->path, strerror(errno));
+  timeshift_write_discard(tsf);
   close(tsf->fd);
   tsf->fd = -1;
+  timeshift_filemgr_write_index(tsf);
+}
+
+/*
+ * Release in-memory data
+ */
+static void timeshift_filemgr_ram_free ( timeshift_file_t *tsf )
+{
+  int i;
+
+  for (i = 0; i < tsf->ram->count; i++)
+    if (tsf->ram->recs[i].sm)
+      streaming_msg_free(tsf->ram->recs[i].sm);
+  free(tsf->ram->recs);
+  free(tsf->ram);
+  tsf->ram = NULL;
+}
+
+/*
+ * Write an in-memory segment out to its file
+ */
+static int timeshift_filemgr_spill0 ( timeshift_buffer_t *tsb, timeshift_file_t *tsf )
+{
+  timeshift_ram_t *ram = tsf->ram;
+  timeshift_ram_rec_t *rec;
+  ssize_t r;
+  int i, fd;
+
+  tvhtrace("timeshift", "ts %d spill %s (%"PRIsize_t" bytes)",
+           tsb->id, tsf->path, tsf->size);
+  if ((fd = open(tsf->path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+    tvhlog(LOG_ERR, "timeshift", "failed to create %s [e=%s]",
+           tsf->path, strerror(errno));
+    return -1;
+  }
+
+  /* Replay the records, offsets must come out identical */
+  tsf->fd = fd;
+  for (i = 0; i < ram->count; i++) {
+    rec = &ram->recs[i];
+    r   = rec->sm ? timeshift_write_msg(tsf, rec->sm) : timeshift_write_eof(tsf);
+    if (r != rec->len)
+      break;
+  }
+  if (i < ram->count || timeshift_write_flush(tsf) < 0) {
+    tvhlog(LOG_ERR, "timeshift", "failed to write %s [e=%s]",
+           tsf->path, strerror(errno));
+    timeshift_write_discard(tsf);
+    close(fd);
+    tsf->fd = -1;
+    return -1;
+  }
+
+  /* Closed segments are complete */
+  if (ram->eof) {
+    timeshift_write_discard(tsf);
+    close(fd);
+    tsf->fd = -1;
+    timeshift_filemgr_write_index(tsf);
+  }
+  atomic_add_u64(&timeshift_total_ram_size, -tsf->size);
+  timeshift_filemgr_ram_free(tsf);
+  return 0;
+}
+
+/*
+ * Move the oldest in-memory segments to disk until the RAM budget is
+ * met (rdwr_mutex is held)
+ */
+void timeshift_filemgr_spill ( timeshift_buffer_t *tsb )
+{
+  timeshift_file_t *tsf;
+
+  TAILQ_FOREACH(tsf, &tsb->files, link) {
+    if (atomic_pre_add_u64(&timeshift_total_ram_size, 0) <= timeshift_ram_size)
+      break;
+    if (tsf->ram && timeshift_filemgr_spill0(tsb, tsf)) {
+      tsf->bad = 1;
+      tsb->full = 1; ///< Stop any more writing
+      break;
+    }
+  }
+}
+
+/*
+ * File time index, files are appended as created and normally leave
+ * from the head, which just advances fidx_first
+ */
+static void timeshift_filemgr_index
+  ( timeshift_buffer_t *tsb, timeshift_file_t *tsf )
+{
+  if (tsb->fidx_first + tsb->fidx_count == tsb->fidx_alloc) {
+    if (tsb->fidx_first > tsb->fidx_alloc / 2) {
+      memmove(tsb->fidx, tsb->fidx + tsb->fidx_first,
+              tsb->fidx_count * sizeof(*tsb->fidx));
+      tsb->fidx_first = 0;
+    } else {
+      tsb->fidx_alloc = MAX(16, tsb->fidx_alloc * 2);
+      tsb->fidx = realloc(tsb->fidx, tsb->fidx_alloc * sizeof(*tsb->fidx));
+    }
+  }
+  tsb->fidx[tsb->fidx_first + tsb->fidx_count++] = tsf;
+}
+
+static void timeshift_filemgr_unindex
+  ( timeshift_buffer_t *tsb, timeshift_file_t *tsf )
+{
+  int i;
+
+  for (i = 0; i < tsb->fidx_count; i++)
+    if (tsb->fidx[tsb->fidx_first + i] == tsf)
+      break;
+  if (i == tsb->fidx_count)
+    return;
+  if (i == 0) {
+    tsb->fidx_first++;
+  } else {
+    memmove(tsb->fidx + tsb->fidx_first + i,
+            tsb->fidx + tsb->fidx_first + i + 1,
+            (tsb->fidx_count - i - 1) * sizeof(*tsb->fidx));
+  }
+  if (--tsb->fidx_count == 0)
+    tsb->fidx_first = 0;
+}
+
+/*
+ * Position of the newest file starting at or before time (in file
+ * periods), 0 if there is none (rdwr_mutex is held)
+ */
+int timeshift_filemgr_find ( timeshift_buffer_t *tsb, time_t time )
+{
+  int lo = 0, hi = tsb->fidx_count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (timeshift_filemgr_at(tsb, mid)->time <= time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo ? lo - 1 : 0;
 }
 
 /*
  * Remove file
  */
 void timeshift_filemgr_remove
-  ( timeshift_t *ts, timeshift_file_t *tsf, int force )
+  ( timeshift_buffer_t *tsb, timeshift_file_t *tsf, int force )
 {
   if (tsf->fd != -1)
     close(tsf->fd);
-  tvhlog(LOG_DEBUG, "timeshift", "ts %d remove %s", ts->id, tsf->path);
-  TAILQ_REMOVE(&ts->files, tsf, link);
+  timeshift_write_discard(tsf);
+  if (tsf->ram) {
+    atomic_add_u64(&timeshift_total_ram_size, -tsf->size);
+    timeshift_filemgr_ram_free(tsf);
+  }
+  tvhlog(LOG_DEBUG, "timeshift", "ts %d remove %s", tsb->id, tsf->path);
+  TAILQ_REMOVE(&tsb->files, tsf, link);
+  timeshift_filemgr_unindex(tsb, tsf);
   atomic_add_u64(&timeshift_total_size, -tsf->size);
   timeshift_reaper_remove(tsf);
 }
@@ -165,19 +365,31 @@ void timeshift_filemgr_remove
 /*
  * Flush all files
  */
-void timeshift_filemgr_flush ( timeshift_t *ts, timeshift_file_t *end )
+void timeshift_filemgr_flush ( timeshift_buffer_t *tsb, timeshift_file_t *end )
 {
   timeshift_file_t *tsf;
-  while ((tsf = TAILQ_FIRST(&ts->files))) {
+  while ((tsf = TAILQ_FIRST(&tsb->files))) {
     if (tsf == end) break;
-    timeshift_filemgr_remove(ts, tsf, 1);
+    timeshift_filemgr_remove(tsb, tsf, 1);
   }
 }
 
+/*
+ * Remove unreferenced files from the head of a shared buffer, expired
+ * ones only unless all is set (rdwr_mutex is held)
+ */
+void timeshift_filemgr_trim ( timeshift_buffer_t *tsb, int all )
+{
+  timeshift_file_t *tsf;
+  while ((tsf = TAILQ_FIRST(&tsb->files)) && !tsf->refcount &&
+         (all || tsf->expired))
+    timeshift_filemgr_remove(tsb, tsf, 0);
+}
+
 /*
  * Get current / new file
  */
-timeshift_file_t *timeshift_filemgr_get ( timeshift_t *ts, int create )
+timeshift_file_t *timeshift_filemgr_get ( timeshift_buffer_t *tsb, int create )
 {
   int fd;
   struct timespec tp;
@@ -188,33 +400,44 @@ timeshift_file_t *timeshift_filemgr_get ( timeshift_t *ts, int create )
 
   /* Return last file */
   if (!create)
-    return timeshift_filemgr_newest(ts);
+    return timeshift_filemgr_newest(tsb);
 
   /* No space */
-  if (ts->full)
+  if (tsb->full)
     return NULL;
 
   /* Store to file */
   clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
   time   = tp.tv_sec / TIMESHIFT_FILE_PERIOD;
-  tsf_tl = TAILQ_LAST(&ts->files, timeshift_file_list);
+  tsf_tl = TAILQ_LAST(&tsb->files, timeshift_file_list);
   if (!tsf_tl || tsf_tl->time != time) {
-    tsf_hd = TAILQ_FIRST(&ts->files);
+    tsf_hd = TAILQ_FIRST(&tsb->files);
+    while (tsf_hd && tsf_hd->expired)
+      tsf_hd = TAILQ_NEXT(tsf_hd, link);
 
     /* Close existing */
-    if (tsf_tl && tsf_tl->fd != -1)
+    if (tsf_tl && timeshift_file_writable(tsf_tl))
       timeshift_filemgr_close(tsf_tl);
 
     /* Check period */
-    if (ts->max_time && tsf_hd && tsf_tl) {
+    if (tsb->max_time && tsf_hd && tsf_tl) {
       time_t d = (tsf_tl->time - tsf_hd->time) * TIMESHIFT_FILE_PERIOD;
-      if (d > (ts->max_time+5)) {
+      if (d > (tsb->max_time+5)) {
         if (!tsf_hd->refcount) {
-          timeshift_filemgr_remove(ts, tsf_hd, 0);
+          timeshift_filemgr_remove(tsb, tsf_hd, 0);
+          tsf_hd = NULL;
+
+        /* Shared, the readers still on the file skip ahead (and only
+           they lose data), it goes once they have */
+        } else if (tsb->key) {
+          tvhlog(LOG_DEBUG, "timeshift", "ts %d expire %s (%d readers)",
+                 tsb->id, tsf_hd->path, tsf_hd->refcount);
+          tsf_hd->expired = 1;
+          timeshift_filemgr_unindex(tsb, tsf_hd);
           tsf_hd = NULL;
         } else {
-          tvhlog(LOG_DEBUG, "timeshift", "ts %d buffer full", ts->id);
-          ts->full = 1;
+          tvhlog(LOG_DEBUG, "timeshift", "ts %d buffer full", tsb->id);
+          tsb->full = 1;
         }
       }
     }
@@ -225,44 +448,52 @@ timeshift_file_t *timeshift_filemgr_get ( timeshift_t *ts, int create )
 
       /* Remove the last file (if we can) */
       if (tsf_hd && !tsf_hd->refcount) {
-        timeshift_filemgr_remove(ts, tsf_hd, 0);
+        timeshift_filemgr_remove(tsb, tsf_hd, 0);
 
       /* Full */
       } else {
-        tvhlog(LOG_DEBUG, "timeshift", "ts %d buffer full", ts->id);
-        ts->full = 1;
+        tvhlog(LOG_DEBUG, "timeshift", "ts %d buffer full", tsb->id);
+        tsb->full = 1;
       }
     }
       
     /* Create new file */
     tsf_tmp = NULL;
-    if (!ts->full) {
+    if (!tsb->full) {
 
       /* Create directories */
-      if (!ts->path) {
-        if (timeshift_filemgr_makedirs(ts->id, path, sizeof(path)))
+      if (!tsb->path) {
+        if (timeshift_filemgr_makedirs(tsb->id, path, sizeof(path)))
           return NULL;
-        ts->path = strdup(path);
+        tsb->path = strdup(path);
       }
 
       /* Create File */
-      snprintf(path, sizeof(path), "%s/tvh-%"PRItime_t, ts->path, time);
-      tvhtrace("timeshift", "ts %d create file %s", ts->id, path);
-      if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) > 0) {
+      snprintf(path, sizeof(path), "%s/tvh-%"PRItime_t, tsb->path, time);
+      tvhtrace("timeshift", "ts %d create %s %s", tsb->id,
+               timeshift_ram_size ? "segment" : "file", path);
+      if (timeshift_ram_size)
+        fd = -1;
+      else if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) < 0)
+        tvhlog(LOG_ERR, "timeshift", "failed to create %s [e=%s]",
+               path, strerror(errno));
+      if (fd >= 0 || timeshift_ram_size) {
         tsf_tmp = calloc(1, sizeof(timeshift_file_t));
         tsf_tmp->time     = time;
         tsf_tmp->fd       = fd;
+        if (fd < 0)
+          tsf_tmp->ram    = calloc(1, sizeof(timeshift_ram_t));
         tsf_tmp->path     = strdup(path);
         tsf_tmp->refcount = 0;
         tsf_tmp->last     = getmonoclock();
-        TAILQ_INIT(&tsf_tmp->iframes);
         TAILQ_INIT(&tsf_tmp->sstart);
-        TAILQ_INSERT_TAIL(&ts->files, tsf_tmp, link);
+        TAILQ_INSERT_TAIL(&tsb->files, tsf_tmp, link);
+        timeshift_filemgr_index(tsb, tsf_tmp);
 
         /* Copy across last start message */
         if (tsf_tl && (ti = TAILQ_LAST(&tsf_tl->sstart, timeshift_index_data_list))) {
           tvhtrace("timeshift", "ts %d copy smt_start to new file",
-                   ts->id);
+                   tsb->id);
           timeshift_index_data_t *ti2 = calloc(1, sizeof(timeshift_index_data_t));
           ti2->data = streaming_msg_clone(ti->data);
           TAILQ_INSERT_TAIL(&tsf_tmp->sstart, ti2, link);
@@ -304,9 +535,9 @@ timeshift_file_t *timeshift_filemgr_prev
 /*
  * Get the oldest file
  */
-timeshift_file_t *timeshift_filemgr_oldest ( timeshift_t *ts )
+timeshift_file_t *timeshift_filemgr_oldest ( timeshift_buffer_t *tsb )
 {
-  timeshift_file_t *tsf = TAILQ_FIRST(&ts->files);
+  timeshift_file_t *tsf = TAILQ_FIRST(&tsb->files);
   if (tsf)
     tsf->refcount++;
   return tsf;
@@ -315,9 +546,9 @@ timeshift_file_t *timeshift_filemgr_oldest ( timeshift_t *ts )
 /*
  * Get the newest file
  */
-timeshift_file_t *timeshift_filemgr_newest ( timeshift_t *ts )
+timeshift_file_t *timeshift_filemgr_newest ( timeshift_buffer_t *tsb )
 {
-  timeshift_file_t *tsf = TAILQ_LAST(&ts->files, timeshift_file_list);
+  timeshift_file_t *tsf = TAILQ_LAST(&tsb->files, timeshift_file_list);
   if (tsf)
     tsf->refcount++;
   return tsf;
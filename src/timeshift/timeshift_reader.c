@@ -41,138 +41,220 @@
  * File Reading
  * *************************************************************************/
 
-static ssize_t _read_pktbuf ( int fd, pktbuf_t **pktbuf )
+static pktbuf_t *_decode_pktbuf ( const uint8_t *buf, size_t len )
 {
-  ssize_t r, cnt = 0;
-  size_t sz;
-
-  /* Size */
-  r = read(fd, &sz, sizeof(sz));
-  if (r < 0) return -1;
-  if (r != sizeof(sz)) return 0;
-  cnt += r;
-
-  /* Empty */
-  if (!sz) {
-    *pktbuf = NULL;
-    return cnt;
-  }
-
-  /* Data */
-  *pktbuf = pktbuf_alloc(NULL, sz);
-  r = read(fd, (*pktbuf)->pb_data, sz);
-  if (r != sz) {
-    free((*pktbuf)->pb_data);
-    free(*pktbuf);
-    return r < 0 ? -1 : 0;
-  }
-  cnt += r;
-
-  return cnt;
+  return len ? pktbuf_alloc(buf, len) : pktbuf_make(NULL, 0);
 }
 
-
-static ssize_t _read_msg ( int fd, streaming_message_t **sm )
+/*
+ * Decode a record body
+ */
+static int _decode_msg
+  ( const timeshift_rec_hdr_t *hdr, const uint8_t *buf,
+    streaming_message_t **sm )
 {
-  ssize_t r, cnt = 0;
-  size_t sz;
-  streaming_message_type_t type;
-  int64_t time;
+  size_t sz = hdr->len - sizeof(*hdr);
+  timeshift_rec_pkt_t rec;
+  th_pkt_t *pkt;
   void *data;
   int code;
 
-  /* Clear */
-  *sm = NULL;
-
-  /* Size */
-  r = read(fd, &sz, sizeof(sz));
-  if (r < 0) return -1;
-  if (r != sizeof(sz)) return 0;
-  cnt += r;
-
-  /* EOF */
-  if (sz == 0) return cnt;
-
-  /* Type */
-  r = read(fd, &type, sizeof(type));
-  if (r < 0) return -1;
-  if (r != sizeof(type)) return 0;
-  cnt += r;
-
-  /* Time */
-  r = read(fd, &time, sizeof(time));
-  if (r < 0) return -1;
-  if (r != sizeof(time)) return 0;
-  cnt += r;
-
-  /* Adjust size */
-  sz -= sizeof(type) + sizeof(time);
-  cnt += sz;
-
   /* Standard messages */
-  switch (type) {
-
-    /* Unhandled */
-    case SMT_START:
-    case SMT_NOSTART:
-    case SMT_SERVICE_STATUS:
-      return -1;
-      break;
+  switch (hdr->type) {
 
     /* Code */
     case SMT_STOP:
     case SMT_EXIT:
     case SMT_SPEED:
       if (sz != sizeof(code)) return -1;
-      r = read(fd, &code, sz);
-      if (r != sz) {
-        if (r < 0) return -1;
-        return 0;
-      }
-      *sm = streaming_msg_create_code(type, code);
+      memcpy(&code, buf, sz);
+      *sm = streaming_msg_create_code(hdr->type, code);
       break;
 
     /* Data */
     case SMT_SKIP:
     case SMT_SIGNAL_STATUS:
     case SMT_MPEGTS:
-    case SMT_PACKET:
       data = malloc(sz);
-      r = read(fd, data, sz);
-      if (r != sz) {
-        free(data);
-        if (r < 0) return -1;
-        return 0;
-      }
-      if (type == SMT_PACKET) {
-        th_pkt_t *pkt = data;
-        pkt->pkt_payload  = pkt->pkt_header = NULL;
-        pkt->pkt_refcount = 0;
-        *sm = streaming_msg_create_pkt(pkt);
-        r   = _read_pktbuf(fd, &pkt->pkt_header);
-        if (r < 0) {
-          streaming_msg_free(*sm);
-          return r;
-        }
-        cnt += r;
-        r   = _read_pktbuf(fd, &pkt->pkt_payload);
-        if (r < 0) {
-          streaming_msg_free(*sm);
-          return r;
-        }
-        cnt += r;
-      } else {
-        *sm = streaming_msg_create_data(type, data);
-      }
-      (*sm)->sm_time = time;
+      memcpy(data, buf, sz);
+      *sm = streaming_msg_create_data(hdr->type, data);
+      break;
+
+    /* Packet */
+    case SMT_PACKET:
+      if (sz < sizeof(rec)) return -1;
+      memcpy(&rec, buf, sizeof(rec));
+      buf += sizeof(rec);
+      sz  -= sizeof(rec);
+      if (rec.hdr_len > sz) return -1;
+      pkt = calloc(1, sizeof(th_pkt_t));
+      pkt->pkt_dts            = rec.dts;
+      pkt->pkt_pts            = rec.pts;
+      pkt->pkt_duration       = rec.duration;
+      pkt->pkt_commercial     = rec.commercial;
+      pkt->pkt_componentindex = rec.componentindex;
+      pkt->pkt_frametype      = rec.frametype;
+      pkt->pkt_field          = rec.field;
+      pkt->pkt_channels       = rec.channels;
+      pkt->pkt_sri            = rec.sri;
+      pkt->pkt_err            = rec.err;
+      pkt->pkt_aspect_num     = rec.aspect_num;
+      pkt->pkt_aspect_den     = rec.aspect_den;
+      if (rec.flags & TIMESHIFT_REC_HEADER)
+        pkt->pkt_header  = _decode_pktbuf(buf, rec.hdr_len);
+      if (rec.flags & TIMESHIFT_REC_PAYLOAD)
+        pkt->pkt_payload = _decode_pktbuf(buf + rec.hdr_len, sz - rec.hdr_len);
+      *sm = streaming_msg_create_pkt(pkt);
       break;
 
+    /* Unhandled */
     default:
       return -1;
   }
 
-  /* OK */
-  return cnt;
+  (*sm)->sm_time = hdr->time;
+  return 0;
+}
+
+/*
+ * Read control message (reader pipe)
+ */
+static ssize_t _read_msg ( int fd, streaming_message_t **sm )
+{
+  timeshift_rec_hdr_t hdr;
+  uint8_t buf[64];
+  ssize_t r;
+
+  /* Clear */
+  *sm = NULL;
+
+  /* Header */
+  r = read(fd, &hdr, sizeof(hdr));
+  if (r < 0) return -1;
+  if (r != sizeof(hdr)) return 0;
+  if (hdr.len < sizeof(hdr) || hdr.len - sizeof(hdr) > sizeof(buf))
+    return -1;
+
+  /* Body */
+  r = read(fd, buf, hdr.len - sizeof(hdr));
+  if (r != hdr.len - sizeof(hdr)) {
+    if (r < 0) return -1;
+    return 0;
+  }
+
+  if (_decode_msg(&hdr, buf, sm))
+    return -1;
+  return hdr.len;
+}
+
+/*
+ * Make sure len bytes from off are buffered, returns 1 when they are,
+ * 0 when the file is short and -1 on error
+ */
+static int _rdbuf_fill ( timeshift_rdbuf_t *rb, off_t off, size_t len )
+{
+  ssize_t r;
+  size_t keep = 0;
+
+  if (off >= rb->off && off + len <= rb->off + rb->len)
+    return 1;
+
+  /* Keep whatever overlaps */
+  if (off >= rb->off && off < rb->off + rb->len) {
+    keep = rb->off + rb->len - off;
+    memmove(rb->data, rb->data + (off - rb->off), keep);
+  }
+  rb->off = off;
+  rb->len = keep;
+  if (rb->size < MAX(len, TIMESHIFT_RD_AHEAD)) {
+    rb->size = MAX(len, TIMESHIFT_RD_AHEAD);
+    rb->data = realloc(rb->data, rb->size);
+  }
+
+  /* Read ahead */
+  while (rb->len < len) {
+    r = pread(rb->fd, rb->data + rb->len, rb->size - rb->len,
+              rb->off + rb->len);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0)
+      return 0;
+    rb->len += r;
+  }
+  return 1;
+}
+
+static void _rdbuf_close ( timeshift_rdbuf_t *rb )
+{
+  if (rb->fd != -1) {
+    close(rb->fd);
+    rb->fd = -1;
+  }
+  rb->len = 0;
+}
+
+/*
+ * Read record at off, *sm is left NULL at end of file
+ */
+static ssize_t _read_rec
+  ( timeshift_rdbuf_t *rb, off_t off, streaming_message_t **sm )
+{
+  timeshift_rec_hdr_t hdr;
+  int r;
+
+  /* Clear */
+  *sm = NULL;
+
+  /* Header */
+  if ((r = _rdbuf_fill(rb, off, sizeof(hdr))) <= 0)
+    return r;
+  memcpy(&hdr, rb->data + (off - rb->off), sizeof(hdr));
+
+  /* EOF */
+  if (hdr.len == 0) return sizeof(hdr);
+  if (hdr.len < sizeof(hdr)) return -1;
+
+  /* Body */
+  if ((r = _rdbuf_fill(rb, off, hdr.len)) <= 0)
+    return r;
+  if (_decode_msg(&hdr, rb->data + (off - rb->off) + sizeof(hdr), sm))
+    return -1;
+  return hdr.len;
+}
+
+/*
+ * Read record at off from an in-memory segment (rdwr_mutex is held),
+ * the stored message is shared rather than copied
+ */
+static ssize_t _read_ram
+  ( timeshift_file_t *tsf, off_t off, streaming_message_t **sm )
+{
+  timeshift_ram_t *ram = tsf->ram;
+  timeshift_ram_rec_t *rec;
+  int lo = 0, hi = ram->count - 1, mid;
+
+  /* Clear */
+  *sm = NULL;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    rec = &ram->recs[mid];
+    if (rec->pos == off) {
+      if (rec->sm)
+        *sm = streaming_msg_clone(rec->sm);
+      return rec->len;
+    }
+    if (rec->pos < off)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+
+  /* Not written yet */
+  return off >= tsf->size ? 0 : -1;
 }
 
 /* **************************************************************************
@@ -192,121 +274,144 @@ static streaming_message_t *_timeshift_find_sstart
   return ti ? ti->data : NULL;
 }
 
-static timeshift_index_iframe_t *_timeshift_first_frame
-  ( timeshift_t *ts )
-{ 
-  int end;
-  timeshift_index_iframe_t *tsi = NULL;
-  timeshift_file_t *tsf = timeshift_filemgr_oldest(ts);
-  while (tsf && !tsi) {
-    if (!(tsi = TAILQ_FIRST(&tsf->iframes))) {
-      tsf = timeshift_filemgr_next(tsf, &end, 0);
-    }
+/*
+ * Start messages stored by another viewer of a shared buffer describe
+ * the same streams as our own, don't resend those
+ */
+static int _timeshift_same_start
+  ( streaming_start_t *a, streaming_start_t *b )
+{
+  int i;
+
+  if (!a || !b || a->ss_num_components != b->ss_num_components)
+    return 0;
+  for (i = 0; i < a->ss_num_components; i++)
+    if (a->ss_components[i].ssc_index != b->ss_components[i].ssc_index ||
+        a->ss_components[i].ssc_type  != b->ss_components[i].ssc_type)
+      return 0;
+  return 1;
+}
+
+static void _timeshift_rebase
+  ( timeshift_t *ts, streaming_message_t *sm )
+{
+  th_pkt_t *pkt = sm->sm_data;
+  int64_t off;
+
+  pthread_mutex_lock(&ts->buf->feed_mutex);
+  off = ts->pts_offset;
+  pthread_mutex_unlock(&ts->buf->feed_mutex);
+  if (!off)
+    return;
+
+  /* Packets may be shared (RAM buffer) */
+  sm->sm_data = pkt_copy_shallow(pkt);
+  pkt_ref_dec(pkt);
+  pkt = sm->sm_data;
+  if (pkt->pkt_pts != PTS_UNSET)
+    pkt->pkt_pts += off;
+  if (pkt->pkt_dts != PTS_UNSET)
+    pkt->pkt_dts += off;
+}
+
+/*
+ * Oldest or newest file holding any I-frames (rdwr_mutex is held)
+ */
+static timeshift_file_t *_timeshift_edge_file
+  ( timeshift_buffer_t *tsb, int newest )
+{
+  timeshift_file_t *tsf;
+  int f   = newest ? tsb->fidx_count - 1 : 0;
+  int dir = newest ? -1 : 1;
+
+  while ((tsf = timeshift_filemgr_at(tsb, f)) && !timeshift_filemgr_iframes(tsf))
+    f += dir;
+  return tsf;
+}
+
+/*
+ * Time of the first and last I-frame in the buffer
+ */
+static int _timeshift_span
+  ( timeshift_t *ts, int64_t *start, int64_t *end )
+{
+  timeshift_file_t *fst, *lst;
+  int r = 0;
+
+  pthread_mutex_lock(&ts->buf->rdwr_mutex);
+  fst = _timeshift_edge_file(ts->buf, 0);
+  lst = _timeshift_edge_file(ts->buf, 1);
+  if (fst && lst) {
+    *start = fst->iframes[0].time;
+    *end   = lst->iframes[lst->iframe_count - 1].time;
+    r      = 1;
   }
-  if (tsf)
-    tsf->refcount--;
-  return tsi;
+  pthread_mutex_unlock(&ts->buf->rdwr_mutex);
+  return r;
 }
 
-static timeshift_index_iframe_t *_timeshift_last_frame
-  ( timeshift_t *ts )
+/*
+ * Number of I-frames in the file at or before time
+ */
+static int _timeshift_iframe_upper ( timeshift_file_t *tsf, int64_t time )
 {
-  int end;
-  timeshift_index_iframe_t *tsi = NULL;
-  timeshift_file_t *tsf = timeshift_filemgr_get(ts, 0);
-  while (tsf && !tsi) {
-    if (!(tsi = TAILQ_LAST(&tsf->iframes, timeshift_index_iframe_list))) {
-      tsf = timeshift_filemgr_prev(tsf, &end, 0);
-    }
+  int lo = 0, hi, mid;
+
+  if (!timeshift_filemgr_iframes(tsf))
+    return 0;
+  hi = tsf->iframe_count;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (tsf->iframes[mid].time <= time)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  if (tsf)
-    tsf->refcount--;
-  return tsi;
+  return lo;
 }
 
+/*
+ * Find the I-frame to continue from: the last one at or before req_time
+ * when going back, else the first one at or after it. Returns -1/1 if
+ * the start/end of the buffer was hit (rdwr_mutex is held).
+ */
 static int _timeshift_skip
   ( timeshift_t *ts, int64_t req_time, int64_t cur_time,
-    timeshift_file_t *cur_file, timeshift_file_t **new_file,
-    timeshift_index_iframe_t **iframe )
+    timeshift_file_t **new_file, timeshift_index_iframe_t *iframe )
 {
-  timeshift_index_iframe_t *tsi  = *iframe;
-  timeshift_file_t         *tsf  = cur_file;
-  int64_t                   sec  = req_time / (1000000 * TIMESHIFT_FILE_PERIOD);
-  int                       back = (req_time < cur_time) ? 1 : 0;
-  int                       end  = 0;
-  
-  /* Hold local ref */
-  if (cur_file)
-    cur_file->refcount++;
-
-  /* Coarse search */
-  if (!tsi) {
-    while (tsf && !end) {
-      if (back) {
-        if ((tsf->time <= sec) &&
-            (tsi = TAILQ_LAST(&tsf->iframes, timeshift_index_iframe_list)))
-          break;
-        tsf = timeshift_filemgr_prev(tsf, &end, 1);
-      } else {
-        if ((tsf->time >= sec) &&
-            (tsi = TAILQ_FIRST(&tsf->iframes)))
-          break;
-        tsf = timeshift_filemgr_next(tsf, &end, 0);
-      }
-      tsi = NULL;
-    }
-  }
-
-  /* Fine search */
+  timeshift_buffer_t *tsb  = ts->buf;
+  timeshift_file_t   *tsf;
+  time_t              sec  = req_time / (1000000 * TIMESHIFT_FILE_PERIOD);
+  int                 back = (req_time < cur_time) ? 1 : 0;
+  int                 end  = 0, f, i = 0;
+
+  /* File covering the time, then neighbours if it has no candidate */
+  f = timeshift_filemgr_find(tsb, sec);
   if (back) {
-    while (!end && tsf && tsi && (tsi->time > req_time)) {
-      tsi = TAILQ_PREV(tsi, timeshift_index_iframe_list, link);
-      while (!end && tsf && !tsi) {
-        if ((tsf = timeshift_filemgr_prev(tsf, &end, 1)))
-          tsi = TAILQ_LAST(&tsf->iframes, timeshift_index_iframe_list);
-      }
-    }
+    for (; (tsf = timeshift_filemgr_at(tsb, f)); f--)
+      if ((i = _timeshift_iframe_upper(tsf, req_time) - 1) >= 0)
+        break;
   } else {
-    while (!end && tsf && tsi && (tsi->time < req_time)) {
-      tsi = TAILQ_NEXT(tsi, link);
-      while (!end && tsf && !tsi) {
-        if ((tsf = timeshift_filemgr_next(tsf, &end, 0)))
-          tsi = TAILQ_FIRST(&tsf->iframes);
-      }
+    for (; (tsf = timeshift_filemgr_at(tsb, f)); f++) {
+      i = _timeshift_iframe_upper(tsf, req_time - 1);
+      if (i < tsf->iframe_count)
+        break;
     }
   }
 
-  /* End */
-  if (!tsf || !tsi)
-    end = 1;
-
-  /* Find start/end of buffer */
-  if (end) {
-    if (back) {
-      tsf = timeshift_filemgr_oldest(ts);
-      tsi = NULL;
-      while (tsf && !tsi) {
-        if (!(tsi = TAILQ_FIRST(&tsf->iframes)))
-          tsf = timeshift_filemgr_next(tsf, &end, 0);
-      }
-      end = -1;
-    } else {
-      tsf = timeshift_filemgr_get(ts, 0);
-      tsi = NULL;
-      while (tsf && !tsi) {
-        if (!(tsi = TAILQ_LAST(&tsf->iframes, timeshift_index_iframe_list)))
-          tsf = timeshift_filemgr_prev(tsf, &end, 0);
-      }
-      end = 1;
-    }
+  /* Start/end of buffer */
+  if (!tsf) {
+    tsf = _timeshift_edge_file(tsb, !back);
+    i   = (tsf && !back) ? tsf->iframe_count - 1 : 0;
+    end = back ? -1 : 1;
   }
 
-  if (cur_file)
-    cur_file->refcount--;
-
   /* Done */
+  if (tsf) {
+    tsf->refcount++;
+    *iframe = tsf->iframes[i];
+  }
   *new_file = tsf;
-  *iframe   = tsi;
   return end;
 }
 
@@ -314,22 +419,32 @@ static int _timeshift_skip
  * Output packet
  */
 static int _timeshift_read
-  ( timeshift_t *ts, timeshift_file_t **cur_file, off_t *cur_off, int *fd,
+  ( timeshift_t *ts, timeshift_file_t **cur_file, off_t *cur_off,
+    timeshift_rdbuf_t *rb,
     streaming_message_t **sm, int *wait )
 {
+  ssize_t r;
+
   if (*cur_file) {
+    tvhtrace("timeshift", "ts %d read at %"PRIoff_t, ts->id, *cur_off);
 
-    /* Open file */
-    if (*fd == -1) {
-      tvhtrace("timeshift", "ts %d open file %s",
-               ts->id, (*cur_file)->path);
-      *fd = open((*cur_file)->path, O_RDONLY);
-    }
-    tvhtrace("timeshift", "ts %d seek to %"PRIoff_t, ts->id, *cur_off);
-    lseek(*fd, *cur_off, SEEK_SET);
+    /* In memory (may be spilled at any time) */
+    pthread_mutex_lock(&ts->buf->rdwr_mutex);
+    if ((*cur_file)->ram) {
+      r = _read_ram(*cur_file, *cur_off, sm);
+      pthread_mutex_unlock(&ts->buf->rdwr_mutex);
 
     /* Read msg */
-    ssize_t r = _read_msg(*fd, sm);
+    } else {
+      pthread_mutex_unlock(&ts->buf->rdwr_mutex);
+      if (rb->fd == -1) {
+        tvhtrace("timeshift", "ts %d open file %s",
+                 ts->id, (*cur_file)->path);
+        rb->fd  = open((*cur_file)->path, O_RDONLY);
+        rb->len = 0;
+      }
+      r = _read_rec(rb, *cur_off, sm);
+    }
     if (r < 0) {
       streaming_message_t *e = streaming_msg_create_code(SMT_STOP, SM_CODE_UNDEFINED_ERROR);
       streaming_target_deliver2(ts->output, e);
@@ -340,21 +455,18 @@ static int _timeshift_read
              ts->id, *sm, r);
 
     /* Incomplete */
-    if (r == 0) {
-      lseek(*fd, *cur_off, SEEK_SET);
+    if (r == 0)
       return 0;
-    }
 
     /* Update */
     *cur_off += r;
 
     /* Special case - EOF */
-    if (r == sizeof(size_t) || *cur_off > (*cur_file)->size) {
-      close(*fd);
-      *fd       = -1;
-      pthread_mutex_lock(&ts->rdwr_mutex);
+    if (!*sm || *cur_off > (*cur_file)->size) {
+      _rdbuf_close(rb);
+      pthread_mutex_lock(&ts->buf->rdwr_mutex);
       *cur_file = timeshift_filemgr_next(*cur_file, NULL, 0);
-      pthread_mutex_unlock(&ts->rdwr_mutex);
+      pthread_mutex_unlock(&ts->buf->rdwr_mutex);
       *cur_off  = 0; // reset
       *wait     = 0;
 
@@ -362,12 +474,17 @@ static int _timeshift_read
     } else {
       streaming_message_t *ssm = _timeshift_find_sstart(*cur_file, (*sm)->sm_time);
       if (ssm && ssm->sm_data != ts->smt_start) {
-        streaming_target_deliver2(ts->output, streaming_msg_clone(ssm));
+        if (!_timeshift_same_start(ssm->sm_data, ts->smt_start))
+          streaming_target_deliver2(ts->output, streaming_msg_clone(ssm));
         if (ts->smt_start)
           streaming_start_unref(ts->smt_start);
         ts->smt_start = ssm->sm_data;
         atomic_add(&ts->smt_start->ss_refcount, 1);
       }
+
+      /* Shared buffer, convert to our own timebase */
+      if ((*sm)->sm_type == SMT_PACKET)
+        _timeshift_rebase(ts, *sm);
     }
   }
   return 0;
@@ -378,12 +495,13 @@ static int _timeshift_read
  * Flush all data to live
  */
 static int _timeshift_flush_to_live
-  ( timeshift_t *ts, timeshift_file_t **cur_file, off_t *cur_off, int *fd,
+  ( timeshift_t *ts, timeshift_file_t **cur_file, off_t *cur_off,
+    timeshift_rdbuf_t *rb,
     streaming_message_t **sm, int *wait )
 {
   time_t pts = 0;
   while (*cur_file) {
-    if (_timeshift_read(ts, cur_file, cur_off, fd, sm, wait) == -1)
+    if (_timeshift_read(ts, cur_file, cur_off, rb, sm, wait) == -1)
       return -1;
     if (!*sm) break;
     if ((*sm)->sm_type == SMT_PACKET) {
@@ -397,6 +515,43 @@ static int _timeshift_flush_to_live
   return 0;
 }
 
+/*
+ * The file being read went past the (shared) buffer's max_time, move
+ * on to the first I-frame still held. Returns 1 (and its time) if the
+ * position changed.
+ */
+static int _timeshift_expired
+  ( timeshift_t *ts, timeshift_file_t **cur_file, off_t *cur_off,
+    timeshift_rdbuf_t *rb, int64_t *time )
+{
+  timeshift_buffer_t *tsb = ts->buf;
+  timeshift_file_t *tsf;
+  timeshift_index_iframe_t *ti = NULL, tsi;
+
+  if (!*cur_file || !(*cur_file)->expired)
+    return 0;
+
+  /* The index may be reallocated by the writer once unlocked */
+  pthread_mutex_lock(&tsb->rdwr_mutex);
+  tsf = _timeshift_edge_file(tsb, 0);
+  (*cur_file)->refcount--;
+  if (tsf) {
+    tsf->refcount++;
+    if ((ti = timeshift_filemgr_iframes(tsf)))
+      tsi = ti[0];
+  }
+  timeshift_filemgr_trim(tsb, 0);
+  pthread_mutex_unlock(&tsb->rdwr_mutex);
+
+  tvhlog(LOG_WARNING, "timeshift", "ts %d fell out of the buffer", ts->id);
+  _rdbuf_close(rb);
+  *cur_file = tsf;
+  *cur_off  = ti ? tsi.pos : 0;
+  if (ti)
+    *time = tsi.time;
+  return 1;
+}
+
 /* **************************************************************************
  * Thread
  * *************************************************************************/
@@ -407,14 +562,15 @@ static int _timeshift_flush_to_live
 void *timeshift_reader ( void *p )
 {
   timeshift_t *ts = p;
-  int nfds, end, fd = -1, run = 1, wait = -1;
+  int nfds, end, run = 1, wait = -1;
   timeshift_file_t *cur_file = NULL;
   off_t cur_off = 0;
+  timeshift_rdbuf_t rb = { .fd = -1 };
   int cur_speed = 100, keyframe_mode = 0;
   int64_t pause_time = 0, play_time = 0, last_time = 0;
   int64_t now, deliver, skip_time = 0;
   streaming_message_t *sm = NULL, *ctrl = NULL;
-  timeshift_index_iframe_t *tsi = NULL;
+  timeshift_index_iframe_t tsi;
   streaming_skip_t *skip = NULL;
   time_t last_status = 0;
   tvhpoll_t *pd;
@@ -445,6 +601,30 @@ void *timeshift_reader ( void *p )
 
     /* Control */
     pthread_mutex_lock(&ts->state_mutex);
+
+    /* Source changed (or no timebase match), drop the position */
+    if (ts->buf_change) {
+      if (cur_file) {
+        pthread_mutex_lock(&ts->buf->rdwr_mutex);
+        cur_file->refcount--;
+        pthread_mutex_unlock(&ts->buf->rdwr_mutex);
+        cur_file = NULL;
+      }
+      _rdbuf_close(&rb);
+      if (sm)
+        streaming_msg_free(sm);
+      sm = NULL;
+      if (ts->state > TS_LIVE) {
+        tvhlog(LOG_DEBUG, "timeshift", "ts %d buffer changed, revert to live mode",
+               ts->id);
+        ts->state = TS_LIVE;
+        cur_speed = 100;
+        streaming_target_deliver2(ts->output,
+                                  streaming_msg_create_code(SMT_SPEED, cur_speed));
+      }
+      timeshift_rebuffer(ts);
+    }
+
     if (nfds == 1) {
       if (_read_msg(ts->rd_pipe.rd, &ctrl) > 0) {
 
@@ -484,14 +664,14 @@ void *timeshift_reader ( void *p )
               } else {
                 tvhlog(LOG_DEBUG, "timeshift", "ts %d enter timeshift mode",
                        ts->id);
-                timeshift_writer_flush(ts);
-                pthread_mutex_lock(&ts->rdwr_mutex);
-                if ((cur_file   = timeshift_filemgr_get(ts, 1))) {
+                timeshift_writer_flush(ts->buf);
+                pthread_mutex_lock(&ts->buf->rdwr_mutex);
+                if ((cur_file   = timeshift_filemgr_get(ts->buf, 1))) {
                   cur_off    = cur_file->size;
                   pause_time = cur_file->last;
                   last_time  = pause_time;
                 }
-                pthread_mutex_unlock(&ts->rdwr_mutex);
+                pthread_mutex_unlock(&ts->buf->rdwr_mutex);
               }
 
             /* Buffer playback */
@@ -508,9 +688,6 @@ void *timeshift_reader ( void *p )
               tvhlog(LOG_DEBUG, "timeshift", "using keyframe mode? %s",
                      keyframe ? "yes" : "no");
               keyframe_mode = keyframe;
-              if (keyframe) {
-                tsi = NULL;
-              }
             }
 
             /* Update */
@@ -534,12 +711,15 @@ void *timeshift_reader ( void *p )
             case SMT_SKIP_LIVE:
               if (ts->state != TS_LIVE) {
 
-                /* Reset */
-                if (ts->full) {
-                  pthread_mutex_lock(&ts->rdwr_mutex);
-                  timeshift_filemgr_flush(ts, NULL);
-                  ts->full = 0;
-                  pthread_mutex_unlock(&ts->rdwr_mutex);
+                /* Reset (shared, only what no other cursor is on) */
+                if (ts->buf->full) {
+                  pthread_mutex_lock(&ts->buf->rdwr_mutex);
+                  if (!ts->buf->key)
+                    timeshift_filemgr_flush(ts->buf, NULL);
+                  else
+                    timeshift_filemgr_trim(ts->buf, 1);
+                  ts->buf->full = 0;
+                  pthread_mutex_unlock(&ts->buf->rdwr_mutex);
                 }
 
                 /* Release */
@@ -567,15 +747,15 @@ void *timeshift_reader ( void *p )
 
               /* Live playback (stage1) */
               if (ts->state == TS_LIVE) {
-                pthread_mutex_lock(&ts->rdwr_mutex);
-                if ((cur_file   = timeshift_filemgr_get(ts, !ts->ondemand))) {
+                pthread_mutex_lock(&ts->buf->rdwr_mutex);
+                if ((cur_file   = timeshift_filemgr_get(ts->buf, !ts->ondemand))) {
                   cur_off    = cur_file->size;
                   last_time  = cur_file->last;
                 } else {
                   tvhlog(LOG_ERR, "timeshift", "ts %d failed to get current file", ts->id);
                   skip = NULL;
                 }
-                pthread_mutex_unlock(&ts->rdwr_mutex);
+                pthread_mutex_unlock(&ts->buf->rdwr_mutex);
               }
 
               /* May have failed */
@@ -601,7 +781,6 @@ void *timeshift_reader ( void *p )
                 /* Adjust time */
                 play_time  = now;
                 pause_time = skip_time;
-                tsi        = NULL;
 
                 /* Clear existing packet */
                 if (sm)
@@ -630,19 +809,27 @@ void *timeshift_reader ( void *p )
       }
     }
 
+    /* Oldest reader of a shared buffer, lose the expired data */
+    if (!skip && _timeshift_expired(ts, &cur_file, &cur_off, &rb, &last_time)) {
+      if (sm)
+        streaming_msg_free(sm);
+      sm         = NULL;
+      pause_time = last_time;
+      play_time  = now;
+    }
+
     /* Status message */
-    if (now >= (last_status + 1000000)) {
+    if (ts->buf && now >= (last_status + 1000000)) {
       streaming_message_t *tsm;
       timeshift_status_t *status;
-      timeshift_index_iframe_t *fst, *lst;
+      int64_t fst, lst;
       status = calloc(1, sizeof(timeshift_status_t));
-      fst    = _timeshift_first_frame(ts);
-      lst    = _timeshift_last_frame(ts);
-      status->full  = ts->full;
+      status->full  = ts->buf->full;
       status->shift = ts->state <= TS_LIVE ? 0 : ts_rescale_i(now - last_time, 1000000);
-      if (lst && fst && lst != fst && ts->pts_delta != PTS_UNSET) {
-        status->pts_start = ts_rescale_i(fst->time - ts->pts_delta, 1000000);
-        status->pts_end   = ts_rescale_i(lst->time - ts->pts_delta, 1000000);
+      if (_timeshift_span(ts, &fst, &lst) && lst != fst &&
+          ts->pts_delta != PTS_UNSET) {
+        status->pts_start = ts_rescale_i(fst - ts->pts_delta, 1000000);
+        status->pts_end   = ts_rescale_i(lst - ts->pts_delta, 1000000);
       } else {
         status->pts_start = PTS_UNSET;
         status->pts_end   = PTS_UNSET;
@@ -679,31 +866,28 @@ void *timeshift_reader ( void *p )
         tvhlog(LOG_DEBUG, "timeshift", "ts %d skip to %"PRId64" from %"PRId64, ts->id, req_time, last_time);
 
         /* Find */
-        pthread_mutex_lock(&ts->rdwr_mutex);
-        end = _timeshift_skip(ts, req_time, last_time,
-                              cur_file, &tsf, &tsi);
-        pthread_mutex_unlock(&ts->rdwr_mutex);
-        if (tsi)
-          tvhlog(LOG_DEBUG, "timeshift", "ts %d skip found pkt @ %"PRId64, ts->id, tsi->time);
+        pthread_mutex_lock(&ts->buf->rdwr_mutex);
+        end = _timeshift_skip(ts, req_time, last_time, &tsf, &tsi);
+        pthread_mutex_unlock(&ts->buf->rdwr_mutex);
+        if (tsf)
+          tvhlog(LOG_DEBUG, "timeshift", "ts %d skip found pkt @ %"PRId64, ts->id, tsi.time);
 
         /* File changed (close) */
-        if ((tsf != cur_file) && (fd != -1)) {
-          close(fd);
-          fd = -1;
-        }
+        if (tsf != cur_file)
+          _rdbuf_close(&rb);
 
         /* Position */
         if (cur_file)
           cur_file->refcount--;
         cur_file = tsf;
-        if (tsi)
-          cur_off = tsi->pos;
+        if (tsf)
+          cur_off = tsi.pos;
         else
           cur_off = 0;
       }
 
       /* Find packet */
-      if (_timeshift_read(ts, &cur_file, &cur_off, &fd, &sm, &wait) == -1) {
+      if (_timeshift_read(ts, &cur_file, &cur_off, &rb, &sm, &wait) == -1) {
         pthread_mutex_unlock(&ts->state_mutex);
         break;
       }
@@ -746,8 +930,8 @@ void *timeshift_reader ( void *p )
                  pktbuf_len(pkt->pkt_payload), sm->sm_time);
 #endif
       }
-      streaming_target_deliver2(ts->output, sm);
       last_time = sm->sm_time;
+      streaming_target_deliver2(ts->output, sm);
       sm        = NULL;
       wait      = 0;
     } else if (sm) {
@@ -766,7 +950,7 @@ void *timeshift_reader ( void *p )
         end = (cur_speed > 0) ? 1 : -1;
 
       /* Back to live (unless buffer is full) */
-      if (end == 1 && !ts->full) {
+      if (end == 1 && !ts->buf->full) {
         tvhlog(LOG_DEBUG, "timeshift", "ts %d eob revert to live mode", ts->id);
         ts->state = TS_LIVE;
         cur_speed = 100;
@@ -774,18 +958,15 @@ void *timeshift_reader ( void *p )
         streaming_target_deliver2(ts->output, ctrl);
 
         /* Flush timeshift buffer to live */
-        if (_timeshift_flush_to_live(ts, &cur_file, &cur_off, &fd, &sm, &wait) == -1)
+        if (_timeshift_flush_to_live(ts, &cur_file, &cur_off, &rb, &sm, &wait) == -1)
           break;
 
         /* Close file (if open) */
-        if (fd != -1) {
-          close(fd);
-          fd = -1;
-        }
+        _rdbuf_close(&rb);
 
         /* Flush ALL files */
         if (ts->ondemand)
-          timeshift_filemgr_flush(ts, NULL);
+          timeshift_filemgr_flush(ts->buf, NULL);
 
       /* Pause */
       } else {
@@ -805,9 +986,9 @@ void *timeshift_reader ( void *p )
 
     /* Flush unwanted */
     } else if (ts->ondemand && cur_file) {
-      pthread_mutex_lock(&ts->rdwr_mutex);
-      timeshift_filemgr_flush(ts, cur_file);
-      pthread_mutex_unlock(&ts->rdwr_mutex);
+      pthread_mutex_lock(&ts->buf->rdwr_mutex);
+      timeshift_filemgr_flush(ts->buf, cur_file);
+      pthread_mutex_unlock(&ts->buf->rdwr_mutex);
     }
 
     pthread_mutex_unlock(&ts->state_mutex);
@@ -815,7 +996,8 @@ void *timeshift_reader ( void *p )
 
   /* Cleanup */
   tvhpoll_destroy(pd);
-  if (fd != -1) close(fd);
+  _rdbuf_close(&rb);
+  free(rb.data);
   if (sm)       streaming_msg_free(sm);
   if (ctrl)     streaming_msg_free(ctrl);
   tvhtrace("timeshift", "ts %d exit reader thread", ts->id);
@@ -55,82 +55,297 @@ static ssize_t _write
 }
 
 /*
- * Write message
+ * Write control message (reader pipe)
  */
 static ssize_t _write_msg
   ( int fd, streaming_message_type_t type, int64_t time,
     const void *buf, size_t len )
 {
-  size_t len2 = len + sizeof(type) + sizeof(time);
-  ssize_t err, ret;
-  ret = err = _write(fd, &len2, sizeof(len2));
-  if (err < 0) return err;
-  err = _write(fd, &type, sizeof(type));
-  if (err < 0) return err;
-  ret += err;
-  err = _write(fd, &time, sizeof(time));
-  if (err < 0) return err;
-  ret += err;
-  if (len) {
-    err = _write(fd, buf, len);
-    if (err < 0) return err;
-    ret += err;
+  uint8_t rec[sizeof(timeshift_rec_hdr_t) + 64];
+  timeshift_rec_hdr_t hdr;
+
+  assert(len <= sizeof(rec) - sizeof(hdr));
+  hdr.len   = sizeof(hdr) + len;
+  hdr.type  = type;
+  hdr.flags = 0;
+  hdr.time  = time;
+  memcpy(rec, &hdr, sizeof(hdr));
+  memcpy(rec + sizeof(hdr), buf, len);
+  return _write(fd, rec, hdr.len);
+}
+
+/*
+ * Write pending data
+ */
+ssize_t timeshift_write_flush ( timeshift_file_t *tsf )
+{
+  timeshift_wrbuf_t *wb = tsf->wbuf;
+  struct iovec *iov;
+  ssize_t r, ret;
+  int i, cnt;
+
+  if (!wb || !wb->len)
+    return 0;
+
+  ret = wb->len;
+  iov = wb->iov;
+  cnt = wb->iovcnt;
+  while (cnt > 0) {
+    r = writev(tsf->fd, iov, cnt);
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      ret = -1;
+      break;
+    }
+    /* Partial write */
+    while (cnt > 0 && r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base += r;
+      iov->iov_len  -= r;
+    }
   }
+
+  for (i = 0; i < wb->iovcnt; i++)
+    if (wb->ref[i])
+      pktbuf_ref_dec(wb->ref[i]);
+  wb->iovcnt    = 0;
+  wb->len       = 0;
+  wb->stage_len = 0;
   return ret;
 }
 
 /*
- * Write packet buffer
+ * Drop pending data
+ */
+void timeshift_write_discard ( timeshift_file_t *tsf )
+{
+  timeshift_wrbuf_t *wb = tsf->wbuf;
+  int i;
+
+  if (!wb)
+    return;
+  for (i = 0; i < wb->iovcnt; i++)
+    if (wb->ref[i])
+      pktbuf_ref_dec(wb->ref[i]);
+  free(wb);
+  tsf->wbuf = NULL;
+}
+
+/*
+ * Make room for iovcnt vectors and len bytes of staged data
+ */
+static int _wbuf_reserve ( timeshift_file_t *tsf, int iovcnt, size_t len )
+{
+  timeshift_wrbuf_t *wb = tsf->wbuf;
+
+  if (!wb)
+    wb = tsf->wbuf = calloc(1, sizeof(timeshift_wrbuf_t));
+  if (wb->iovcnt + iovcnt > TIMESHIFT_WR_IOV ||
+      wb->stage_len + len > TIMESHIFT_WR_STAGE ||
+      wb->len >= TIMESHIFT_WR_BATCH)
+    return timeshift_write_flush(tsf) < 0 ? -1 : 0;
+  return 0;
+}
+
+/*
+ * Copy data into the staging area (merged with the previous vector
+ * when they are contiguous)
+ */
+static void _wbuf_stage ( timeshift_wrbuf_t *wb, const void *buf, size_t len )
+{
+  uint8_t *dst = wb->stage + wb->stage_len;
+  struct iovec *iov;
+
+  memcpy(dst, buf, len);
+  wb->stage_len += len;
+  wb->len       += len;
+  if (wb->iovcnt && !wb->ref[wb->iovcnt-1]) {
+    iov = &wb->iov[wb->iovcnt-1];
+    if (iov->iov_base + iov->iov_len == dst) {
+      iov->iov_len += len;
+      return;
+    }
+  }
+  iov = &wb->iov[wb->iovcnt];
+  iov->iov_base = dst;
+  iov->iov_len  = len;
+  wb->ref[wb->iovcnt++] = NULL;
+}
+
+/*
+ * Add packet data, small buffers are copied, the rest is referenced
  */
-static int _write_pktbuf ( int fd, pktbuf_t *pktbuf )
+static void _wbuf_pktbuf ( timeshift_wrbuf_t *wb, pktbuf_t *pb )
 {
-  ssize_t ret, err;
-  if (pktbuf) {
-    ret = err = _write(fd, &pktbuf->pb_size, sizeof(pktbuf->pb_size));
-    if (err < 0) return err;
-    err = _write(fd, pktbuf->pb_data, pktbuf->pb_size);
-    if (err < 0) return err;
-    ret += err;
+  if (pb->pb_size <= TIMESHIFT_WR_COPY) {
+    _wbuf_stage(wb, pb->pb_data, pb->pb_size);
   } else {
-    size_t sz = 0;
-    ret = _write(fd, &sz, sizeof(sz));
+    pktbuf_ref_inc(pb);
+    wb->iov[wb->iovcnt].iov_base = pb->pb_data;
+    wb->iov[wb->iovcnt].iov_len  = pb->pb_size;
+    wb->ref[wb->iovcnt++] = pb;
+    wb->len += pb->pb_size;
   }
-  return ret;
+}
+
+/*
+ * Write message (file)
+ */
+static ssize_t _write_rec
+  ( timeshift_file_t *tsf, streaming_message_type_t type, int64_t time,
+    const void *buf, size_t len )
+{
+  timeshift_rec_hdr_t hdr;
+
+  if (_wbuf_reserve(tsf, 1, sizeof(hdr) + len))
+    return -1;
+  hdr.len   = sizeof(hdr) + len;
+  hdr.type  = type;
+  hdr.flags = 0;
+  hdr.time  = time;
+  _wbuf_stage(tsf->wbuf, &hdr, sizeof(hdr));
+  if (len)
+    _wbuf_stage(tsf->wbuf, buf, len);
+  return hdr.len;
 }
 
 /*
  * Write signal status
  */
 ssize_t timeshift_write_sigstat
-  ( int fd, int64_t time, signal_status_t *sigstat )
+  ( timeshift_file_t *tsf, int64_t time, signal_status_t *sigstat )
 {
-  return _write_msg(fd, SMT_SIGNAL_STATUS, time, sigstat,
+  return _write_rec(tsf, SMT_SIGNAL_STATUS, time, sigstat,
                     sizeof(signal_status_t));
 }
 
 /*
  * Write packet
  */
-ssize_t timeshift_write_packet ( int fd, int64_t time, th_pkt_t *pkt )
+ssize_t timeshift_write_packet
+  ( timeshift_file_t *tsf, int64_t time, th_pkt_t *pkt )
 {
-  ssize_t ret = 0, err;
-  ret = err = _write_msg(fd, SMT_PACKET, time, pkt, sizeof(th_pkt_t));
-  if (err <= 0) return err;
-  err = _write_pktbuf(fd, pkt->pkt_header);
-  if (err <= 0) return err;
-  ret += err;
-  err = _write_pktbuf(fd, pkt->pkt_payload);
-  if (err <= 0) return err;
-  ret += err;
-  return ret;
+  timeshift_rec_hdr_t hdr;
+  timeshift_rec_pkt_t rec;
+  size_t hlen = pkt->pkt_header  ? pktbuf_len(pkt->pkt_header)  : 0;
+  size_t plen = pkt->pkt_payload ? pktbuf_len(pkt->pkt_payload) : 0;
+
+  if (_wbuf_reserve(tsf, 3, sizeof(hdr) + sizeof(rec) + 2 * TIMESHIFT_WR_COPY))
+    return -1;
+
+  hdr.len            = sizeof(hdr) + sizeof(rec) + hlen + plen;
+  hdr.type           = SMT_PACKET;
+  hdr.flags          = 0;
+  hdr.time           = time;
+  rec.dts            = pkt->pkt_dts;
+  rec.pts            = pkt->pkt_pts;
+  rec.duration       = pkt->pkt_duration;
+  rec.hdr_len        = hlen;
+  rec.flags          = (pkt->pkt_header  ? TIMESHIFT_REC_HEADER  : 0) |
+                       (pkt->pkt_payload ? TIMESHIFT_REC_PAYLOAD : 0);
+  rec.commercial     = pkt->pkt_commercial;
+  rec.componentindex = pkt->pkt_componentindex;
+  rec.frametype      = pkt->pkt_frametype;
+  rec.field          = pkt->pkt_field;
+  rec.channels       = pkt->pkt_channels;
+  rec.sri            = pkt->pkt_sri;
+  rec.err            = pkt->pkt_err;
+  rec.aspect_num     = pkt->pkt_aspect_num;
+  rec.aspect_den     = pkt->pkt_aspect_den;
+
+  _wbuf_stage(tsf->wbuf, &hdr, sizeof(hdr));
+  _wbuf_stage(tsf->wbuf, &rec, sizeof(rec));
+  if (hlen)
+    _wbuf_pktbuf(tsf->wbuf, pkt->pkt_header);
+  if (plen)
+    _wbuf_pktbuf(tsf->wbuf, pkt->pkt_payload);
+  return hdr.len;
 }
 
 /*
  * Write MPEGTS data
  */
-ssize_t timeshift_write_mpegts ( int fd, int64_t time, void *data )
+ssize_t timeshift_write_mpegts ( timeshift_file_t *tsf, int64_t time, void *data )
+{
+  return _write_rec(tsf, SMT_MPEGTS, time, data, 188);
+}
+
+/*
+ * Write any stored message type
+ */
+ssize_t timeshift_write_msg ( timeshift_file_t *tsf, streaming_message_t *sm )
+{
+  switch (sm->sm_type) {
+    case SMT_SIGNAL_STATUS:
+      return timeshift_write_sigstat(tsf, sm->sm_time, sm->sm_data);
+    case SMT_PACKET:
+      return timeshift_write_packet(tsf, sm->sm_time, sm->sm_data);
+    case SMT_MPEGTS:
+      return timeshift_write_mpegts(tsf, sm->sm_time, sm->sm_data);
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Keep message in memory (takes ownership), the returned length is
+ * what timeshift_write_msg() will produce when the segment is spilled
+ */
+ssize_t timeshift_write_ram ( timeshift_file_t *tsf, streaming_message_t *sm )
+{
+  timeshift_ram_t *ram = tsf->ram;
+  timeshift_ram_rec_t *rec;
+  th_pkt_t *pkt;
+  size_t len = sizeof(timeshift_rec_hdr_t);
+
+  switch (sm->sm_type) {
+    case SMT_SIGNAL_STATUS:
+      len += sizeof(signal_status_t);
+      break;
+    case SMT_PACKET:
+      pkt  = sm->sm_data;
+      len += sizeof(timeshift_rec_pkt_t);
+      if (pkt->pkt_header)
+        len += pktbuf_len(pkt->pkt_header);
+      if (pkt->pkt_payload)
+        len += pktbuf_len(pkt->pkt_payload);
+      break;
+    case SMT_MPEGTS:
+      len += 188;
+      break;
+    default:
+      return 0;
+  }
+
+  if (ram->count == ram->alloc) {
+    ram->alloc = MAX(256, ram->alloc * 2);
+    ram->recs  = realloc(ram->recs, ram->alloc * sizeof(*rec));
+  }
+  rec = &ram->recs[ram->count++];
+  rec->pos = tsf->size;
+  rec->len = len;
+  rec->sm  = sm;
+  atomic_add_u64(&timeshift_total_ram_size, len);
+  return len;
+}
+
+/*
+ * Write end of file (special internal message)
+ */
+ssize_t timeshift_write_eof ( timeshift_file_t *tsf )
 {
-  return _write_msg(fd, SMT_MPEGTS, time, data, 188);
+  timeshift_rec_hdr_t hdr;
+
+  if (_wbuf_reserve(tsf, 1, sizeof(hdr)))
+    return -1;
+  memset(&hdr, 0, sizeof(hdr));
+  _wbuf_stage(tsf->wbuf, &hdr, sizeof(hdr));
+  return sizeof(hdr);
 }
 
 /*
@@ -166,21 +381,12 @@ ssize_t timeshift_write_exit ( int fd )
   return _write_msg(fd, SMT_EXIT, 0, &code, sizeof(code));
 }
 
-/*
- * Write end of file (special internal message)
- */
-ssize_t timeshift_write_eof ( int fd )
-{
-  size_t sz = 0;
-  return _write(fd, &sz, sizeof(sz));
-}
-
 /* **************************************************************************
  * Thread
  * *************************************************************************/
 
 static inline ssize_t _process_msg0
-  ( timeshift_t *ts, timeshift_file_t *tsf, streaming_message_t **smp )
+  ( timeshift_buffer_t *tsb, timeshift_file_t *tsf, streaming_message_t **smp )
 {
   int i;
   ssize_t err;
@@ -198,27 +404,29 @@ static inline ssize_t _process_msg0
     ss = sm->sm_data;
     for (i = 0; i < ss->ss_num_components; i++)
       if (SCT_ISVIDEO(ss->ss_components[i].ssc_type))
-        ts->vididx = ss->ss_components[i].ssc_index;
-  } else if (sm->sm_type == SMT_SIGNAL_STATUS)
-    err = timeshift_write_sigstat(tsf->fd, sm->sm_time, sm->sm_data);
-  else if (sm->sm_type == SMT_PACKET) {
-    err = timeshift_write_packet(tsf->fd, sm->sm_time, sm->sm_data);
-    if (err > 0) {
-      th_pkt_t *pkt = sm->sm_data;
-
-      /* Index video iframes */
-      if (pkt->pkt_componentindex == ts->vididx &&
-          pkt->pkt_frametype      == PKT_I_FRAME) {
-        timeshift_index_iframe_t *ti = calloc(1, sizeof(timeshift_index_iframe_t));
-        ti->pos  = tsf->size;
-        ti->time = sm->sm_time;
-        TAILQ_INSERT_TAIL(&tsf->iframes, ti, link);
+        tsb->vididx = ss->ss_components[i].ssc_index;
+  } else if (tsf->ram) {
+    if ((err = timeshift_write_ram(tsf, sm)) > 0)
+      *smp = NULL;
+  } else
+    err = timeshift_write_msg(tsf, sm);
+
+  /* Index video iframes */
+  if (err > 0 && sm->sm_type == SMT_PACKET) {
+    th_pkt_t *pkt = sm->sm_data;
+    if (pkt->pkt_componentindex == tsb->vididx &&
+        pkt->pkt_frametype      == PKT_I_FRAME) {
+      timeshift_index_iframe_t *ti;
+      if (tsf->iframe_count == tsf->iframe_alloc) {
+        tsf->iframe_alloc = MAX(64, tsf->iframe_alloc * 2);
+        tsf->iframes = realloc(tsf->iframes,
+                               tsf->iframe_alloc * sizeof(*tsf->iframes));
       }
+      ti = &tsf->iframes[tsf->iframe_count++];
+      ti->pos  = tsf->size;
+      ti->time = sm->sm_time;
     }
-  } else if (sm->sm_type == SMT_MPEGTS)
-    err = timeshift_write_mpegts(tsf->fd, sm->sm_time, sm->sm_data);
-  else
-    err = 0;
+  }
 
   /* OK */
   if (err > 0) {
@@ -230,7 +438,7 @@ static inline ssize_t _process_msg0
 }
 
 static void _process_msg
-  ( timeshift_t *ts, streaming_message_t *sm, int *run )
+  ( timeshift_buffer_t *tsb, streaming_message_t *sm, int *run )
 {
   int err;
   timeshift_file_t *tsf;
@@ -263,16 +471,19 @@ static void _process_msg
     case SMT_START:
     case SMT_MPEGTS:
     case SMT_PACKET:
-      pthread_mutex_lock(&ts->rdwr_mutex);
-      if ((tsf = timeshift_filemgr_get(ts, 1)) && (tsf->fd != -1)) {
-        if ((err = _process_msg0(ts, tsf, &sm)) < 0) {
+      pthread_mutex_lock(&tsb->rdwr_mutex);
+      if ((tsf = timeshift_filemgr_get(tsb, 1)) && timeshift_file_writable(tsf)) {
+        if ((err = _process_msg0(tsb, tsf, &sm)) < 0) {
           timeshift_filemgr_close(tsf);
           tsf->bad = 1;
-          ts->full = 1; ///< Stop any more writing
+          tsb->full = 1; ///< Stop any more writing
         }
         tsf->refcount--;
+        if (err > 0 && timeshift_ram_size &&
+            atomic_pre_add_u64(&timeshift_total_ram_size, 0) > timeshift_ram_size)
+          timeshift_filemgr_spill(tsb);
       }
-      pthread_mutex_unlock(&ts->rdwr_mutex);
+      pthread_mutex_unlock(&tsb->rdwr_mutex);
       break;
   }
 
@@ -281,11 +492,30 @@ static void _process_msg
     streaming_msg_free(sm);
 }
 
+/*
+ * Write out anything pending on the current file
+ */
+static void _flush ( timeshift_buffer_t *tsb )
+{
+  timeshift_file_t *tsf;
+
+  pthread_mutex_lock(&tsb->rdwr_mutex);
+  if ((tsf = timeshift_filemgr_newest(tsb))) {
+    if (tsf->fd != -1 && timeshift_write_flush(tsf) < 0) {
+      timeshift_filemgr_close(tsf);
+      tsf->bad = 1;
+      tsb->full = 1; ///< Stop any more writing
+    }
+    tsf->refcount--;
+  }
+  pthread_mutex_unlock(&tsb->rdwr_mutex);
+}
+
 void *timeshift_writer ( void *aux )
 {
-  int run = 1;
-  timeshift_t *ts = aux;
-  streaming_queue_t *sq = &ts->wr_queue;
+  int run = 1, pending = 0;
+  timeshift_buffer_t *tsb = aux;
+  streaming_queue_t *sq = &tsb->wr_queue;
   streaming_message_t *sm;
 
   pthread_mutex_lock(&sq->sq_mutex);
@@ -295,18 +525,29 @@ void *timeshift_writer ( void *aux )
     /* Get message */
     sm = TAILQ_FIRST(&sq->sq_queue);
     if (sm == NULL) {
+
+      /* Queue drained, write the batch */
+      if (pending) {
+        pending = 0;
+        pthread_mutex_unlock(&sq->sq_mutex);
+        _flush(tsb);
+        pthread_mutex_lock(&sq->sq_mutex);
+        continue;
+      }
       pthread_cond_wait(&sq->sq_cond, &sq->sq_mutex);
       continue;
     }
     TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
     pthread_mutex_unlock(&sq->sq_mutex);
 
-    _process_msg(ts, sm, &run);
+    _process_msg(tsb, sm, &run);
+    pending = 1;
 
     pthread_mutex_lock(&sq->sq_mutex);
   }
 
   pthread_mutex_unlock(&sq->sq_mutex);
+  _flush(tsb);
   return NULL;
 }
 
@@ -314,17 +555,18 @@ void *timeshift_writer ( void *aux )
  * Utilities
  * *************************************************************************/
 
-void timeshift_writer_flush ( timeshift_t *ts )
+void timeshift_writer_flush ( timeshift_buffer_t *tsb )
 
 {
   streaming_message_t *sm;
-  streaming_queue_t *sq = &ts->wr_queue;
+  streaming_queue_t *sq = &tsb->wr_queue;
 
   pthread_mutex_lock(&sq->sq_mutex);
   while ((sm = TAILQ_FIRST(&sq->sq_queue))) {
     TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
-    _process_msg(ts, sm, NULL);
+    _process_msg(tsb, sm, NULL);
   }
+  _flush(tsb);
   pthread_mutex_unlock(&sq->sq_mutex);
 }
 
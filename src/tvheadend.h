@@ -456,6 +456,9 @@ typedef struct streaming_queue {
   pthread_cond_t  sq_cond;     /* Condvar for signalling new packets */
 
   size_t          sq_maxsize;  /* Max queue size (bytes) */
+  size_t          sq_size;     /* Queued payload (bytes) */
+
+  struct congestion *sq_cc;    /* Trimmed when the consumer lags */
   
   struct streaming_message_queue sq_queue;
 
@@ -571,7 +574,9 @@ int tvh_write(int fd, const void *buf, size_t len);
 
 void hexdump(const char *pfx, const uint8_t *data, int len);
 
-uint32_t tvh_crc32(const uint8_t *data, size_t datalen, uint32_t crc);
+void tvh_crc32_init(void);
+
+extern uint32_t (*tvh_crc32)(const uint8_t *data, size_t datalen, uint32_t crc);
 
 int base64_decode(uint8_t *out, const char *in, int out_size);
 
@@ -92,10 +92,21 @@ tvheadend.cwceditor = function() {
 			return value;
 		},
 		editor : new fm.TextField()
+	}, {
+		header : "ECM Cache Hits",
+		dataIndex : 'ecmhits',
+		width : 120,
+		renderer : function(value, metadata, record, row, col, store) {
+			var total = value + record.get('ecmrequests');
+			if (!total) return '';
+			return value + ' / ' + total + ' (' +
+				Math.round(100 * value / total) + '%)';
+		}
 	} ]});
 
 	var rec = Ext.data.Record.create([ 'enabled', 'connected', 'hostname',
-		'port', 'username', 'password', 'deskey', 'emm', 'emmex', 'comment' ]);
+		'port', 'username', 'password', 'deskey', 'emm', 'emmex', 'comment',
+		'ecmhits', 'ecmrequests' ]);
 
 	var store = new Ext.data.JsonStore({
 		root : 'entries',
@@ -120,6 +131,8 @@ tvheadend.cwceditor = function() {
 		var rec = store.getById(msg.id);
 		if (rec) {
 			rec.set('connected', msg.connected);
+			rec.set('ecmhits', msg.ecmhits);
+			rec.set('ecmrequests', msg.ecmrequests);
 			grid.getView().refresh();
 		}
 	});
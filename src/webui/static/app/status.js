@@ -180,6 +180,26 @@ tvheadend.status_streams = function() {
 			name : 'cc'
 		}, {
 			name : 'te'
+		}, {
+			name : 'fill'
+		}, {
+			name : 'overrun'
+		}, {
+			name : 'backlog'
+		}, {
+			name : 'drop'
+		}, {
+			name : 'loss'
+		}, {
+			name : 'dup'
+		}, {
+			name : 'reorder'
+		}, {
+			name : 'fec_rec'
+		}, {
+			name : 'fec_unrec'
+		}, {
+			name : 'fec_pkts'
 		},
 		],
 		url : 'api/status/inputs',
@@ -201,6 +221,16 @@ tvheadend.status_streams = function() {
         r.data.bps     = m.bps;
         r.data.cc      = m.cc;
         r.data.te      = m.te;
+        r.data.fill    = m.fill;
+        r.data.overrun = m.overrun;
+        r.data.backlog = m.backlog;
+        r.data.drop    = m.drop;
+        r.data.loss    = m.loss;
+        r.data.dup     = m.dup;
+        r.data.reorder = m.reorder;
+        r.data.fec_rec   = m.fec_rec;
+        r.data.fec_unrec = m.fec_unrec;
+        r.data.fec_pkts  = m.fec_pkts;
 
         tvheadend.streamStatusStore.afterEdit(r);
         tvheadend.streamStatusStore.fireEvent('updated',
@@ -264,6 +294,46 @@ tvheadend.status_streams = function() {
 		width : 50,
 		header : "Continuity Error",
 		dataIndex : 'cc'
+        },{
+		width : 50,
+		header : "Queue Fill (%)",
+		dataIndex : 'fill'
+        },{
+		width : 50,
+		header : "Queue Overruns",
+		dataIndex : 'overrun'
+        },{
+		width : 50,
+		header : "Table Backlog",
+		dataIndex : 'backlog'
+        },{
+		width : 50,
+		header : "Input Drops",
+		dataIndex : 'drop'
+        },{
+		width : 50,
+		header : "Lost Packets",
+		dataIndex : 'loss'
+        },{
+		width : 50,
+		header : "Duplicates",
+		dataIndex : 'dup'
+        },{
+		width : 50,
+		header : "Reordered",
+		dataIndex : 'reorder'
+        },{
+		width : 50,
+		header : "FEC Recovered",
+		dataIndex : 'fec_rec'
+        },{
+		width : 50,
+		header : "FEC Unrecoverable",
+		dataIndex : 'fec_unrec'
+        },{
+		width : 50,
+		header : "FEC Packets",
+		dataIndex : 'fec_pkts'
         },{
 		width : 50,
 		header : "SNR",
@@ -12,7 +12,8 @@ tvheadend.timeshift = function() {
       'timeshift_enabled', 'timeshift_ondemand',
       'timeshift_path',
       'timeshift_unlimited_period', 'timeshift_max_period',
-      'timeshift_unlimited_size', 'timeshift_max_size'
+      'timeshift_unlimited_size', 'timeshift_max_size',
+      'timeshift_ram_size'
     ]
   );
   
@@ -65,6 +66,13 @@ tvheadend.timeshift = function() {
     Width: 300
   });
 
+  var timeshiftRamSize = new Ext.form.NumberField({
+    fieldLabel: 'Max. RAM Size (MB)',
+    name: 'timeshift_ram_size',
+    allowBlank: false,
+    width: 300
+  });
+
   /* ****************************************************************
    * Events
    * ***************************************************************/
@@ -110,7 +118,8 @@ tvheadend.timeshift = function() {
       timeshiftEnabled, timeshiftOndemand,
       timeshiftPath,
       timeshiftMaxPeriod, timeshiftUnlPeriod,
-      timeshiftMaxSize, timeshiftUnlSize
+      timeshiftMaxSize, timeshiftUnlSize,
+      timeshiftRamSize
     ],
     tbar : [ saveButton, '->', helpButton ]
   });
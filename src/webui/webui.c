@@ -40,12 +40,14 @@
 #include "plumbing/tsfix.h"
 #include "plumbing/globalheaders.h"
 #include "plumbing/transcoding.h"
+#include "plumbing/liveout.h"
 #include "epg.h"
 #include "muxer.h"
 #include "imagecache.h"
 #include "tcp.h"
 #include "config.h"
 #include "atomic.h"
+#include "congestion.h"
 
 #if defined(PLATFORM_LINUX)
 #include <sys/sendfile.h>
@@ -267,7 +269,7 @@ http_stream_run(http_connection_t *hc, streaming_queue_t *sq,
     }
 
     timeouts = 0; //Reset timeout counter
-    TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
+    streaming_queue_remove(sq, sm);
     pthread_mutex_unlock(&sq->sq_mutex);
 
     switch(sm->sm_type) {
@@ -346,6 +348,90 @@ http_stream_run(http_connection_t *hc, streaming_queue_t *sq,
     muxer_close(mux);
 
   muxer_destroy(mux);
+
+  pthread_mutex_lock(&sq->sq_mutex);
+  if(sq->sq_cc && sq->sq_cc->cc_gops)
+    tvhlog(LOG_DEBUG, "webui",  "Stream %s lagged, queue trimmed %d times",
+           hc->hc_url_orig, sq->sq_cc->cc_gops);
+  pthread_mutex_unlock(&sq->sq_mutex);
+}
+
+
+/**
+ * HTTP stream loop for a viewer of a shared live output
+ */
+static void
+http_stream_live(http_connection_t *hc, liveout_viewer_t *lv)
+{
+  liveout_event_t le;
+  int run = 1;
+  int timeouts = 0;
+  struct timeval tp;
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  /* reduce timeout on write() for streaming */
+  tp.tv_sec  = 5;
+  tp.tv_usec = 0;
+  setsockopt(hc->hc_fd, SOL_SOCKET, SO_SNDTIMEO, &tp, sizeof(tp));
+
+  while(run && tvheadend_running) {
+    switch(liveout_next(lv, 1000, &le)) {
+    case LIVEOUT_TIMEOUT:
+      timeouts++;
+
+      //Check socket status
+      getsockopt(hc->hc_fd, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen);
+      if(err) {
+        tvhlog(LOG_DEBUG, "webui",  "Stop streaming %s, client hung up", hc->hc_url_orig);
+        run = 0;
+      } else if(timeouts >= 20) {
+        tvhlog(LOG_WARNING, "webui",  "Stop streaming %s, timeout waiting for packets", hc->hc_url_orig);
+        run = 0;
+      }
+      break;
+
+    case LIVEOUT_START:
+      tvhlog(LOG_DEBUG, "webui",  "Start streaming %s (shared)", hc->hc_url_orig);
+      http_output_content(hc, le.le_mime);
+      break;
+
+    case LIVEOUT_DATA:
+      timeouts = 0;
+      if(tvh_write(hc->hc_fd, le.le_data, le.le_len)) {
+        tvhlog(LOG_DEBUG, "webui",  "Stop streaming %s, write failed -- %s",
+               hc->hc_url_orig, strerror(errno));
+        run = 0;
+      }
+      break;
+
+    case LIVEOUT_STOP:
+      tvhlog(LOG_WARNING, "webui",  "Stop streaming %s, %s", hc->hc_url_orig,
+             streaming_code2txt(le.le_code));
+      run = 0;
+      break;
+    }
+  }
+
+  if(liveout_skips(lv))
+    tvhlog(LOG_DEBUG, "webui",  "Stream %s lagged, skipped to a keyframe %d times",
+           hc->hc_url_orig, liveout_skips(lv));
+}
+
+
+/**
+ * Plain remuxing without per-client queue settings shares the muxer
+ */
+static int
+http_stream_shareable(http_connection_t *hc)
+{
+#if ENABLE_LIBAV
+  transcoder_props_t props;
+  if(http_get_transcoder_properties(&hc->hc_req_args, &props))
+    return 0;
+#endif
+  return !http_arg_get(&hc->hc_req_args, "qsize") &&
+         !http_arg_get(&hc->hc_req_args, "qlatency");
 }
 
 
@@ -663,6 +749,8 @@ http_stream_service(http_connection_t *hc, service_t *service, int weight)
   int flags;
   const char *str;
   size_t qsize;
+  int64_t qlatency = 0;
+  congestion_t cc;
   const char *name;
   char addrbuf[50];
 
@@ -679,20 +767,27 @@ http_stream_service(http_connection_t *hc, service_t *service, int weight)
   else
     qsize = 1500000;
 
+  /* Bounded latency mode, the time to catch up in ms */
+  if ((str = http_arg_get(&hc->hc_req_args, "qlatency")))
+    qlatency = atoll(str) * 1000;
+
   if(mc == MC_PASS || mc == MC_RAW) {
-    streaming_queue_init2(&sq, SMT_PACKET, qsize);
+    streaming_queue_init(&sq, SMT_PACKET);
     gh = NULL;
     tsfix = NULL;
     st = &sq.sq_st;
     flags = SUBSCRIPTION_RAW_MPEGTS;
   } else {
-    streaming_queue_init2(&sq, 0, qsize);
+    streaming_queue_init(&sq, 0);
     gh = globalheaders_create(&sq.sq_st);
     tsfix = tsfix_create(gh);
     st = tsfix;
     flags = 0;
   }
 
+  congestion_init(&cc, qsize, qlatency);
+  streaming_queue_congestion(&sq, &cc);
+
   tcp_get_ip_str((struct sockaddr*)hc->hc_peer, addrbuf, 50);
 
   s = subscription_create_from_service(service, weight ?: 100, "HTTP", st, flags,
@@ -775,8 +870,11 @@ http_stream_channel(http_connection_t *hc, channel_t *ch, int weight)
   muxer_container_type_t mc;
   char *str;
   size_t qsize;
+  int64_t qlatency = 0;
+  congestion_t cc;
   const char *name;
   char addrbuf[50];
+  liveout_viewer_t *lv;
 
   cfg = dvr_config_find_by_name_default("");
 
@@ -786,19 +884,40 @@ http_stream_channel(http_connection_t *hc, channel_t *ch, int weight)
     mc = cfg->dvr_mc;
   }
 
+  tcp_get_ip_str((struct sockaddr*)hc->hc_peer, addrbuf, 50);
+
+  /* Falls back to a private muxer when the container can't be shared */
+  if(http_stream_shareable(hc)) {
+    lv = liveout_join(ch, mc, &cfg->dvr_muxcnf, weight ?: 100,
+                      addrbuf,
+                      hc->hc_username,
+                      http_arg_get(&hc->hc_args, "User-Agent"));
+    if(lv) {
+      pthread_mutex_unlock(&global_lock);
+      http_stream_live(hc, lv);
+      pthread_mutex_lock(&global_lock);
+      liveout_leave(lv);
+      return 0;
+    }
+  }
+
   if ((str = http_arg_get(&hc->hc_req_args, "qsize")))
     qsize = atoll(str);
   else
     qsize = 1500000;
 
+  /* Bounded latency mode, the time to catch up in ms */
+  if ((str = http_arg_get(&hc->hc_req_args, "qlatency")))
+    qlatency = atoll(str) * 1000;
+
   if(mc == MC_PASS || mc == MC_RAW) {
-    streaming_queue_init2(&sq, SMT_PACKET, qsize);
+    streaming_queue_init(&sq, SMT_PACKET);
     gh = NULL;
     tsfix = NULL;
     st = &sq.sq_st;
     flags = SUBSCRIPTION_RAW_MPEGTS;
   } else {
-    streaming_queue_init2(&sq, 0, qsize);
+    streaming_queue_init(&sq, 0);
     gh = globalheaders_create(&sq.sq_st);
 #if ENABLE_LIBAV
     transcoder_props_t props;
@@ -813,7 +932,9 @@ http_stream_channel(http_connection_t *hc, channel_t *ch, int weight)
     flags = 0;
   }
 
-  tcp_get_ip_str((struct sockaddr*)hc->hc_peer, addrbuf, 50);
+  congestion_init(&cc, qsize, qlatency);
+  streaming_queue_congestion(&sq, &cc);
+
   s = subscription_create_from_channel(ch, weight ?: 100, "HTTP", st, flags,
                addrbuf,
                hc->hc_username,
@@ -827,14 +948,14 @@ http_stream_channel(http_connection_t *hc, channel_t *ch, int weight)
     subscription_unsubscribe(s);
   }
 
-  if(gh)
-    globalheaders_destroy(gh);
-
 #if ENABLE_LIBAV
   if(tr)
     transcoder_destroy(tr);
 #endif
 
+  if(gh)
+    globalheaders_destroy(gh);
+
   if(tsfix)
     tsfix_destroy(tsfix);
 
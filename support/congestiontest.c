@@ -0,0 +1,141 @@
+/*
+ *  tvheadend, congestion control check
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Built and run with "make congestiontest". The queue below is trimmed
+ * the way htsp_queue_trim() does it, and a subscription with its video
+ * stream filtered out has to keep getting audio across the trims.
+ */
+
+#include "tvheadend.h"
+#include "congestion.h"
+
+#include <stdio.h>
+
+#define PKT_AUDIO  0        // audio packets carry no frame type
+#define PKT_LEN    188
+#define QUEUE_MAX  (8 * PKT_LEN)
+
+static struct {
+  int      types[256];
+  int      head, tail;
+} q;
+
+static void
+queue_trim ( congestion_t *cc )
+{
+  int n;
+
+  while (congestion_trim(cc)) {
+    for (n = 0; q.head != q.tail; n++, q.head++) {
+      int type = q.types[q.head % ARRAY_SIZE(q.types)];
+      if (n && congestion_sync(cc, type))
+        break;
+      congestion_drop(cc, type, PKT_LEN);
+    }
+    if (n == 0) {
+      congestion_flush(cc);
+      break;
+    }
+  }
+}
+
+/* number of the packets admitted */
+static int
+queue_feed ( congestion_t *cc, int type, int count )
+{
+  int i, r = 0;
+
+  for (i = 0; i < count; i++) {
+    if (!congestion_admit(cc, type, PKT_LEN))
+      continue;
+    q.types[q.tail++ % ARRAY_SIZE(q.types)] = type;
+    queue_trim(cc);
+    r++;
+  }
+  return r;
+}
+
+/* what the owner does when the stream filters change */
+static void
+queue_filter ( congestion_t *cc, int video )
+{
+  int i;
+
+  congestion_video(cc, video);
+  for (i = q.head; i != q.tail; i++)
+    congestion_count(cc, q.types[i % ARRAY_SIZE(q.types)]);
+}
+
+static void
+queue_reset ( congestion_t *cc, const streaming_start_t *ss )
+{
+  memset(&q, 0, sizeof(q));
+  congestion_init(cc, QUEUE_MAX, 0);
+  congestion_start(cc, ss);
+}
+
+static int
+check ( const char *name, int ok )
+{
+  printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+  return !ok;
+}
+
+int
+main ( int argc, char **argv )
+{
+  streaming_start_t *ss;
+  congestion_t cc;
+  int r = 0, n;
+
+  ss = calloc(1, sizeof(*ss) + 2 * sizeof(streaming_start_component_t));
+  ss->ss_num_components = 2;
+  ss->ss_components[0].ssc_index = 1;
+  ss->ss_components[0].ssc_type  = SCT_H264;
+  ss->ss_components[1].ssc_index = 2;
+  ss->ss_components[1].ssc_type  = SCT_MPEG2AUDIO;
+
+  /* Video filtered before the first trim */
+  queue_reset(&cc, ss);
+  queue_filter(&cc, 0);
+  n = queue_feed(&cc, PKT_AUDIO, 100);
+  r |= check("video filtered, audio through trims",
+             n == 100 && cc.cc_gops > 0 && !cc.cc_resync);
+
+  /* Filtered once the queue already waits for an I-frame */
+  queue_reset(&cc, ss);
+  queue_feed(&cc, PKT_AUDIO, 100);
+  n = cc.cc_resync;
+  queue_filter(&cc, 0);
+  r |= check("video filtered while resyncing, recovers",
+             n && queue_feed(&cc, PKT_AUDIO, 10) == 10);
+
+  /* Video back on, the queue resumes on the next I-frame */
+  queue_feed(&cc, PKT_AUDIO, 4);
+  queue_filter(&cc, 1);
+  n = queue_feed(&cc, PKT_AUDIO, 100);
+  r |= check("video enabled again, waits for an I-frame",
+             cc.cc_resync && n < 100 &&
+             queue_feed(&cc, PKT_P_FRAME, 1) == 0 &&
+             queue_feed(&cc, PKT_I_FRAME, 1) == 1 &&
+             queue_feed(&cc, PKT_AUDIO, 1) == 1);
+
+  free(ss);
+  return r;
+}
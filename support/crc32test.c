@@ -0,0 +1,144 @@
+/*
+ *  tvheadend, MPEG-2 CRC32 kernel check and benchmark
+ *  Copyright (C) 2014 Tvheadend
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Built with "make crc32test", which also runs it. Every kernel is
+ * checked against a known value and against the byte-wise table code
+ * for all lengths and alignments up to a few blocks, then timed on
+ * section sized and large buffers. "crc32test -n" skips the timing.
+ */
+
+#include "tvheadend.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+
+uint32_t tvh_crc32_c      ( const uint8_t *data, size_t datalen, uint32_t crc );
+uint32_t tvh_crc32_sb8    ( const uint8_t *data, size_t datalen, uint32_t crc );
+#if ENABLE_PCLMUL
+uint32_t tvh_crc32_pclmul ( const uint8_t *data, size_t datalen, uint32_t crc );
+#endif
+
+typedef uint32_t (*crc32_fn_t)(const uint8_t *data, size_t datalen, uint32_t crc);
+
+static struct {
+  const char *name;
+  crc32_fn_t  fn;
+} kernels[] = {
+  { "generic",      tvh_crc32_c },
+  { "slicing-by-8", tvh_crc32_sb8 },
+#if ENABLE_PCLMUL
+  { "PCLMUL",       tvh_crc32_pclmul },
+#endif
+};
+
+#define CHECK_LEN    1024
+#define CHECK_ALIGN  16
+#define BENCH_BYTES  (256 * 1024 * 1024)
+
+/* crc32.c logs through this, no log subsystem here */
+void
+_tvhlog ( const char *file, int line, int notify, int severity,
+          const char *subsys, const char *fmt, ... )
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  fprintf(stderr, "%s: ", subsys);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+}
+
+static int
+crc32_check ( int k, const uint8_t *buf )
+{
+  crc32_fn_t fn = kernels[k].fn;
+  uint32_t init, ref, crc;
+  int off, len;
+
+  crc = fn((const uint8_t *)"123456789", 9, 0xffffffff);
+  if (crc != 0x0376e6e7) {
+    printf("%-14s FAIL \"123456789\" = 0x%08x, expected 0x0376e6e7\n",
+           kernels[k].name, crc);
+    return 1;
+  }
+
+  for (off = 0; off < CHECK_ALIGN; off++)
+    for (len = 0; len <= CHECK_LEN; len++) {
+      init = 0xffffffff ^ (off * 0x9e3779b9) ^ len;
+      ref  = tvh_crc32_c(buf + off, len, init);
+      crc  = fn(buf + off, len, init);
+      if (crc != ref) {
+        printf("%-14s FAIL offset %d length %d: 0x%08x, expected 0x%08x\n",
+               kernels[k].name, off, len, crc, ref);
+        return 1;
+      }
+    }
+
+  printf("%-14s ok\n", kernels[k].name);
+  return 0;
+}
+
+static void
+crc32_bench ( int k, const uint8_t *buf, int len )
+{
+  crc32_fn_t fn = kernels[k].fn;
+  volatile uint32_t sink = 0;
+  int64_t t0, t1;
+  int i, n = BENCH_BYTES / len;
+
+  /* The generic code is an order of magnitude slower */
+  if (fn == tvh_crc32_c)
+    n /= 8;
+
+  t0 = getmonoclock();
+  for (i = 0; i < n; i++)
+    sink ^= fn(buf, len, 0xffffffff);
+  t1 = getmonoclock();
+
+  printf("%-14s %7d bytes %8.1f MB/s\n", kernels[k].name, len,
+         (double)n * len / MAX(t1 - t0, 1));
+  (void)sink;
+}
+
+int
+main ( int argc, char **argv )
+{
+  static const int sizes[] = { 188, 1024, 65536 };
+  uint8_t *buf;
+  int i, k, r = 0, bench = !(argc > 1 && !strcmp(argv[1], "-n"));
+
+  tvh_crc32_init();
+
+  buf = malloc(MAX(CHECK_LEN + CHECK_ALIGN, 65536));
+  srand(1);
+  for (i = 0; i < MAX(CHECK_LEN + CHECK_ALIGN, 65536); i++)
+    buf[i] = rand();
+
+  for (k = 0; k < ARRAY_SIZE(kernels); k++)
+    r |= crc32_check(k, buf);
+
+  if (bench && !r)
+    for (i = 0; i < ARRAY_SIZE(sizes); i++)
+      for (k = 0; k < ARRAY_SIZE(kernels); k++)
+        crc32_bench(k, buf, sizes[i]);
+
+  free(buf);
+  return r;
+}